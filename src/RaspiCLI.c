@@ -153,3 +153,352 @@ const char *raspicli_unmap_xref(const int en, XREF_T *map, int num_refs)
    }
    return NULL;
 }
+
+/// Largest displacement tried for a bucket before growing the table
+#define REGISTRY_MAX_DISPLACEMENT   4096
+
+/// Largest number of names sharing a bucket before growing the table
+#define REGISTRY_MAX_BUCKET         16
+
+/// A name waiting to be placed in the registry
+typedef struct
+{
+   const char *name;
+   const COMMAND_LIST *command;
+   int table;
+   unsigned int hash;
+} REGISTRY_KEY;
+
+/**
+ * FNV-1a hash of a string
+ *
+ * @param str String to hash
+ * @return 32 bit hash
+ */
+static unsigned int registry_hash(const char *str)
+{
+   unsigned int hash = 2166136261U;
+
+   while (*str)
+   {
+      hash ^= (unsigned char)*str++;
+      hash *= 16777619U;
+   }
+
+   return hash;
+}
+
+/**
+ * Mix a name hash with a bucket displacement to give a slot hash
+ *
+ * @param hash Hash of the name
+ * @param displacement Displacement of the bucket the name falls in
+ * @return Well mixed 32 bit value, the low bits are used as slot index
+ */
+static unsigned int registry_mix(unsigned int hash, unsigned int displacement)
+{
+   hash ^= displacement * 0x9e3779b9U;
+   hash ^= hash >> 16;
+   hash *= 0x7feb352dU;
+   hash ^= hash >> 15;
+   hash *= 0x846ca68bU;
+   hash ^= hash >> 16;
+
+   return hash;
+}
+
+/**
+ * Gather all distinct names from the tables
+ *
+ * @param tables Array of option tables
+ * @param num_tables Number of tables
+ * @param keys Array to fill, must hold 2 entries per command
+ * @return Number of distinct names found
+ */
+static int registry_collect(const RASPICLI_TABLE *tables, int num_tables, REGISTRY_KEY *keys)
+{
+   int num_keys = 0;
+   int t, j, n, k;
+
+   for (t = 0; t < num_tables; t++)
+   {
+      for (j = 0; j < tables[t].num_commands; j++)
+      {
+         const COMMAND_LIST *command = &tables[t].commands[j];
+         const char *names[2] = {command->command, command->abbrev};
+
+         for (n = 0; n < 2; n++)
+         {
+            if (!names[n])
+               continue;
+
+            // Same name in an earlier table takes precedence, as it did when
+            // each module's parser was tried in turn
+            for (k = 0; k < num_keys; k++)
+            {
+               if (!strcmp(keys[k].name, names[n]))
+                  break;
+            }
+
+            if (k < num_keys)
+               continue;
+
+            keys[num_keys].name = names[n];
+            keys[num_keys].command = command;
+            keys[num_keys].table = t;
+            keys[num_keys].hash = registry_hash(names[n]);
+            num_keys++;
+         }
+      }
+   }
+
+   return num_keys;
+}
+
+/**
+ * Try to place every name with the current table size
+ *
+ * Names are grouped into buckets by hash, then largest bucket first, each
+ * bucket is given the smallest displacement that lands all of its names in
+ * free slots.
+ *
+ * @param registry Registry whose slots and displacements are to be filled
+ * @param keys Names to place
+ * @param num_keys Number of names
+ * @return 0 if every name landed in its own slot, -1 otherwise
+ */
+static int registry_fill(RASPICLI_REGISTRY *registry, const REGISTRY_KEY *keys, int num_keys)
+{
+   unsigned int num_buckets = registry->bucket_mask + 1;
+   int largest = 0;
+   int size, b, k, m;
+
+   memset(registry->slots, 0, (registry->mask + 1) * sizeof(RASPICLI_SLOT));
+   memset(registry->displacements, 0, num_buckets * sizeof(unsigned int));
+
+   for (k = 0; k < num_keys; k++)
+   {
+      int count = 0;
+
+      for (m = 0; m < num_keys; m++)
+      {
+         if ((keys[m].hash & registry->bucket_mask) == (keys[k].hash & registry->bucket_mask))
+            count++;
+      }
+
+      if (count > largest)
+         largest = count;
+   }
+
+   if (largest > REGISTRY_MAX_BUCKET)
+      return -1;
+
+   for (size = largest; size > 0; size--)
+   {
+      for (b = 0; b < (int)num_buckets; b++)
+      {
+         const REGISTRY_KEY *members[REGISTRY_MAX_BUCKET];
+         unsigned int displacement;
+         int count = 0;
+
+         for (k = 0; k < num_keys; k++)
+         {
+            if ((keys[k].hash & registry->bucket_mask) == (unsigned int)b)
+               members[count++] = &keys[k];
+         }
+
+         if (count != size)
+            continue;
+
+         for (displacement = 0; displacement < REGISTRY_MAX_DISPLACEMENT; displacement++)
+         {
+            for (k = 0; k < count; k++)
+            {
+               unsigned int slot = registry_mix(members[k]->hash, displacement) & registry->mask;
+
+               if (registry->slots[slot].name)
+                  break;
+
+               // Claim now so later members of this bucket see it as taken
+               registry->slots[slot].name = members[k]->name;
+            }
+
+            if (k == count)
+               break;
+
+            // Roll back the partial placement and try the next displacement
+            for (m = 0; m < k; m++)
+               registry->slots[registry_mix(members[m]->hash, displacement) & registry->mask].name = NULL;
+         }
+
+         if (displacement == REGISTRY_MAX_DISPLACEMENT)
+            return -1;
+
+         registry->displacements[b] = displacement;
+
+         for (k = 0; k < count; k++)
+         {
+            RASPICLI_SLOT *slot = &registry->slots[registry_mix(members[k]->hash, displacement) & registry->mask];
+
+            slot->command = members[k]->command;
+            slot->table = members[k]->table;
+         }
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Build a merged registry over a set of option tables
+ *
+ * Builds a perfect hash (hash and displace) over every long and short name,
+ * so a lookup is a single hash of the argument and a single string compare.
+ * This is done once at startup, the option tables being fixed.
+ *
+ * @param registry Registry to initialise
+ * @param tables Array of option tables, earlier tables win on duplicate names
+ * @param num_tables Number of tables
+ * @return 0 if successful, non-zero otherwise
+ */
+int raspicli_registry_create(RASPICLI_REGISTRY *registry, const RASPICLI_TABLE *tables, int num_tables)
+{
+   REGISTRY_KEY *keys;
+   unsigned int size = 16;
+   int num_names = 0;
+   int num_keys;
+   int t;
+
+   vcos_assert(registry);
+   vcos_assert(tables);
+
+   if (!registry || !tables)
+      return 1;
+
+   memset(registry, 0, sizeof(*registry));
+
+   for (t = 0; t < num_tables; t++)
+      num_names += 2 * tables[t].num_commands;
+
+   keys = malloc((num_names + 1) * sizeof(REGISTRY_KEY));
+
+   if (!keys)
+      return 1;
+
+   num_keys = registry_collect(tables, num_tables, keys);
+
+   while (size < 2 * (unsigned int)num_keys)
+      size <<= 1;
+
+   for (; size <= 65536; size <<= 1)
+   {
+      registry->slots = malloc(size * sizeof(RASPICLI_SLOT));
+      registry->displacements = malloc(size / 4 * sizeof(unsigned int));
+      registry->mask = size - 1;
+      registry->bucket_mask = size / 4 - 1;
+
+      if (!registry->slots || !registry->displacements)
+         break;
+
+      if (registry_fill(registry, keys, num_keys) == 0)
+      {
+         free(keys);
+         return 0;
+      }
+
+      free(registry->slots);
+      free(registry->displacements);
+      registry->slots = NULL;
+      registry->displacements = NULL;
+   }
+
+   free(keys);
+   raspicli_registry_destroy(registry);
+
+   vcos_log_error("Unable to build command line registry");
+
+   return 1;
+}
+
+/**
+ * Release the memory held by a registry
+ *
+ * @param registry Registry to destroy
+ */
+void raspicli_registry_destroy(RASPICLI_REGISTRY *registry)
+{
+   if (!registry)
+      return;
+
+   free(registry->slots);
+   free(registry->displacements);
+
+   registry->slots = NULL;
+   registry->displacements = NULL;
+   registry->mask = 0;
+   registry->bucket_mask = 0;
+}
+
+/**
+ * Look up a command line argument in a merged registry
+ *
+ * @param registry Registry built with raspicli_registry_create
+ * @param arg String to search for
+ * @param table Returns the index of the table the command belongs to
+ * @return Pointer to the matching command, NULL if not found
+ */
+const COMMAND_LIST *raspicli_registry_lookup(const RASPICLI_REGISTRY *registry, const char *arg, int *table)
+{
+   const RASPICLI_SLOT *slot;
+   unsigned int hash;
+
+   if (!registry || !registry->slots || !arg)
+      return NULL;
+
+   hash = registry_hash(arg);
+   slot = &registry->slots[registry_mix(hash, registry->displacements[hash & registry->bucket_mask]) & registry->mask];
+
+   if (!slot->name || strcmp(slot->name, arg))
+      return NULL;
+
+   if (table)
+      *table = slot->table;
+
+   return slot->command;
+}
+
+/// Longest setting name raspicli_registry_lookup_setting tries as a long name
+#define REGISTRY_MAX_SETTING_NAME   64
+
+/**
+ * Look up a setting given by name, as in name=value, rather than as an argument
+ *
+ * Long names are registered with their leading '-' left over from "--name",
+ * so the name is tried with one added first, then as a short name.
+ *
+ * @param registry Registry built with raspicli_registry_create
+ * @param name Long or short name, without any leading '-'
+ * @param table Returns the index of the table the command belongs to
+ * @return Pointer to the matching command, NULL if not found
+ */
+const COMMAND_LIST *raspicli_registry_lookup_setting(const RASPICLI_REGISTRY *registry, const char *name, int *table)
+{
+   char long_name[REGISTRY_MAX_SETTING_NAME + 2];
+   const COMMAND_LIST *command = NULL;
+
+   if (!name)
+      return NULL;
+
+   if (strlen(name) <= REGISTRY_MAX_SETTING_NAME)
+   {
+      long_name[0] = '-';
+      strcpy(&long_name[1], name);
+
+      command = raspicli_registry_lookup(registry, long_name, table);
+   }
+
+   if (!command)
+      command = raspicli_registry_lookup(registry, name, table);
+
+   return command;
+}
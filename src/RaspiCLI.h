@@ -45,6 +45,30 @@ typedef struct xref_t
    int mmal_mode;
 } XREF_T;
 
+/// One option table contributed to a merged registry
+typedef struct
+{
+   const COMMAND_LIST *commands;
+   int num_commands;
+} RASPICLI_TABLE;
+
+/// Slot in the registry hash table. Each long and short name gets its own slot.
+typedef struct
+{
+   const char *name;             /// Name hashed into this slot, NULL if empty
+   const COMMAND_LIST *command;  /// Command the name resolves to
+   int table;                    /// Index of the table the command came from
+} RASPICLI_SLOT;
+
+/// Merged option registry, a collision free hash over all names of all tables
+typedef struct
+{
+   RASPICLI_SLOT *slots;
+   unsigned int mask;            /// Number of slots - 1, slot count is a power of 2
+   unsigned int *displacements;  /// Per bucket displacement giving no collisions for this name set
+   unsigned int bucket_mask;     /// Number of buckets - 1, bucket count is a power of 2
+} RASPICLI_REGISTRY;
+
 
 void raspicli_display_help(const COMMAND_LIST *commands, const int num_commands);
 int raspicli_get_command_id(const COMMAND_LIST *commands, const int num_commands, const char *arg, int *num_parameters);
@@ -52,5 +76,10 @@ int raspicli_get_command_id(const COMMAND_LIST *commands, const int num_commands
 int raspicli_map_xref(const char *str, const XREF_T *map, int num_refs);
 const char *raspicli_unmap_xref(const int en, XREF_T *map, int num_refs);
 
+int raspicli_registry_create(RASPICLI_REGISTRY *registry, const RASPICLI_TABLE *tables, int num_tables);
+void raspicli_registry_destroy(RASPICLI_REGISTRY *registry);
+const COMMAND_LIST *raspicli_registry_lookup(const RASPICLI_REGISTRY *registry, const char *arg, int *table);
+const COMMAND_LIST *raspicli_registry_lookup_setting(const RASPICLI_REGISTRY *registry, const char *name, int *table);
+
 
 #endif
@@ -29,6 +29,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <memory.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "interface/vcos/vcos.h"
 
@@ -559,6 +560,17 @@ static MMAL_STEREOSCOPIC_MODE_T stereo_mode_from_string(const char *str)
    return MMAL_STEREOSCOPIC_MODE_NONE;
 }
 
+/**
+ * Get the command line options handled by this module
+ * @param num_commands Returns the number of entries in the table
+ * @return Pointer to the command table
+ */
+const COMMAND_LIST *raspicamcontrol_get_commands(int *num_commands)
+{
+   *num_commands = cmdline_commands_size;
+   return cmdline_commands;
+}
+
 /**
  * Parse a possible command pair - command and parameter
  * @param arg1 Command
@@ -567,7 +579,7 @@ static MMAL_STEREOSCOPIC_MODE_T stereo_mode_from_string(const char *str)
  */
 int raspicamcontrol_parse_cmdline(RASPICAM_CAMERA_PARAMETERS *params, const char *arg1, const char *arg2)
 {
-   int command_id, used = 0, num_parameters;
+   int command_id, num_parameters;
 
    if (!arg1)
       return 0;
@@ -578,6 +590,19 @@ int raspicamcontrol_parse_cmdline(RASPICAM_CAMERA_PARAMETERS *params, const char
    if (command_id==-1 || (command_id != -1 && num_parameters > 0 && arg2 == NULL))
       return 0;
 
+   return raspicamcontrol_parse_command(params, command_id, arg2);
+}
+
+/**
+ * Apply an already identified command to the parameter block
+ * @param command_id ID of the command from this module's table
+ * @param arg2 Parameter (could be NULL if the command takes none)
+ * @return How many parameters were used, 0,1,2
+ */
+int raspicamcontrol_parse_command(RASPICAM_CAMERA_PARAMETERS *params, int command_id, const char *arg2)
+{
+   int used = 0;
+
    switch (command_id)
    {
    case CommandSharpness : // sharpness - needs single number parameter
@@ -919,6 +944,45 @@ void raspicamcontrol_display_help()
 }
 
 
+/**
+ * Name of an exposure mode, as given to -ex
+ *
+ * @param mode Exposure mode
+ * @return The name, or "unknown"
+ */
+const char *raspicamcontrol_get_exposure_mode_name(int mode)
+{
+   const char *name = raspicli_unmap_xref(mode, exposure_map, exposure_map_size);
+
+   return name ? name : "unknown";
+}
+
+/**
+ * Name of a metering mode, as given to -mm
+ *
+ * @param mode Metering mode
+ * @return The name, or "unknown"
+ */
+const char *raspicamcontrol_get_metering_mode_name(int mode)
+{
+   const char *name = raspicli_unmap_xref(mode, metering_mode_map, metering_mode_map_size);
+
+   return name ? name : "unknown";
+}
+
+/**
+ * Name of an AWB mode, as given to -awb
+ *
+ * @param mode AWB mode
+ * @return The name, or "unknown"
+ */
+const char *raspicamcontrol_get_awb_mode_name(int mode)
+{
+   const char *name = raspicli_unmap_xref(mode, awb_map, awb_map_size);
+
+   return name ? name : "unknown";
+}
+
 /**
  * Dump contents of camera parameter structure to stderr for debugging/verbose logging
  *
@@ -985,36 +1049,595 @@ void raspicamcontrol_set_defaults(RASPICAM_CAMERA_PARAMETERS *params)
    params->stereo_mode.swap_eyes = MMAL_FALSE;
 }
 
+/**
+ * Read a rational camera parameter scaled to an integer percentage
+ * @param camera Pointer to camera component
+ * @param id Parameter ID
+ * @param value Returns the value * 100
+ * @return MMAL status of the read
+ */
+static MMAL_STATUS_T get_rational_percent(MMAL_COMPONENT_T *camera, uint32_t id, int *value)
+{
+   MMAL_RATIONAL_T rational = {0, 1};
+   MMAL_STATUS_T status = mmal_port_parameter_get_rational(camera->control, id, &rational);
+
+   if (status == MMAL_SUCCESS && rational.den)
+      *value = (rational.num * 100 + (rational.num < 0 ? -rational.den : rational.den) / 2) / rational.den;
+
+   return status;
+}
+
+/**
+ * Read a rational camera parameter as a float
+ * @param port Port to read from
+ * @param id Parameter ID
+ * @param value Returns the value
+ * @return MMAL status of the read
+ */
+static MMAL_STATUS_T get_rational_float(MMAL_PORT_T *port, uint32_t id, float *value)
+{
+   MMAL_RATIONAL_T rational = {0, 1};
+   MMAL_STATUS_T status = mmal_port_parameter_get_rational(port, id, &rational);
+
+   if (status == MMAL_SUCCESS && rational.den)
+      *value = (float)rational.num / rational.den;
+
+   return status;
+}
+
+/**
+ * Read an enumerated camera parameter held in a single value after the header
+ * @param camera Pointer to camera component
+ * @param id Parameter ID
+ * @param value Returns the value
+ * @return MMAL status of the read
+ */
+static MMAL_STATUS_T get_enum(MMAL_COMPONENT_T *camera, uint32_t id, int *value)
+{
+   MMAL_PARAMETER_UINT32_T param = {{id, sizeof(param)}, 0};
+   MMAL_STATUS_T status = mmal_port_parameter_get(camera->control, &param.hdr);
+
+   if (status == MMAL_SUCCESS)
+      *value = param.value;
+
+   return status;
+}
+
+/**
+ * Get the current saturation, -100 to 100
+ * @param camera Pointer to camera component
+ * @return Saturation, 0 if it could not be read
+ */
+int raspicamcontrol_get_saturation(MMAL_COMPONENT_T *camera)
+{
+   int value = 0;
+   get_rational_percent(camera, MMAL_PARAMETER_SATURATION, &value);
+   return value;
+}
+
+/**
+ * Get the current sharpness, -100 to 100
+ * @param camera Pointer to camera component
+ * @return Sharpness, 0 if it could not be read
+ */
+int raspicamcontrol_get_sharpness(MMAL_COMPONENT_T *camera)
+{
+   int value = 0;
+   get_rational_percent(camera, MMAL_PARAMETER_SHARPNESS, &value);
+   return value;
+}
+
+/**
+ * Get the current contrast, -100 to 100
+ * @param camera Pointer to camera component
+ * @return Contrast, 0 if it could not be read
+ */
+int raspicamcontrol_get_contrast(MMAL_COMPONENT_T *camera)
+{
+   int value = 0;
+   get_rational_percent(camera, MMAL_PARAMETER_CONTRAST, &value);
+   return value;
+}
+
+/**
+ * Get the current brightness, 0 to 100
+ * @param camera Pointer to camera component
+ * @return Brightness, 50 if it could not be read
+ */
+int raspicamcontrol_get_brightness(MMAL_COMPONENT_T *camera)
+{
+   int value = 50;
+   get_rational_percent(camera, MMAL_PARAMETER_BRIGHTNESS, &value);
+   return value;
+}
+
+/**
+ * Get the current ISO
+ * @param camera Pointer to camera component
+ * @return ISO, 0 (auto) if it could not be read
+ */
+int raspicamcontrol_get_ISO(MMAL_COMPONENT_T *camera)
+{
+   uint32_t value = 0;
+   mmal_port_parameter_get_uint32(camera->control, MMAL_PARAMETER_ISO, &value);
+   return value;
+}
+
+/**
+ * Get the current metering mode
+ * @param camera Pointer to camera component
+ * @return Metering mode, average if it could not be read
+ */
+MMAL_PARAM_EXPOSUREMETERINGMODE_T raspicamcontrol_get_metering_mode(MMAL_COMPONENT_T *camera)
+{
+   int value = MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE;
+   get_enum(camera, MMAL_PARAMETER_EXP_METERING_MODE, &value);
+   return (MMAL_PARAM_EXPOSUREMETERINGMODE_T)value;
+}
+
+/**
+ * Get the video stabilisation flag
+ * @param camera Pointer to camera component
+ * @return 1 if on, 0 if off or it could not be read
+ */
+int raspicamcontrol_get_video_stabilisation(MMAL_COMPONENT_T *camera)
+{
+   MMAL_BOOL_T value = MMAL_FALSE;
+   mmal_port_parameter_get_boolean(camera->control, MMAL_PARAMETER_VIDEO_STABILISATION, &value);
+   return value ? 1 : 0;
+}
+
+/**
+ * Get the current exposure compensation (EV)
+ * @param camera Pointer to camera component
+ * @return Exposure compensation, 0 if it could not be read
+ */
+int raspicamcontrol_get_exposure_compensation(MMAL_COMPONENT_T *camera)
+{
+   int32_t value = 0;
+   mmal_port_parameter_get_int32(camera->control, MMAL_PARAMETER_EXPOSURE_COMP, &value);
+   return value;
+}
+
+/**
+ * Get the thumbnail configuration. This lives on the encoder, so pass the
+ * encoder component rather than the camera.
+ * @param camera Pointer to the component holding the thumbnail configuration
+ * @return Thumbnail configuration, disabled if it could not be read
+ */
+MMAL_PARAM_THUMBNAIL_CONFIG_T raspicamcontrol_get_thumbnail_parameters(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_THUMBNAIL_CONFIG_T param = {{MMAL_PARAMETER_THUMBNAIL_CONFIGURATION, sizeof(param)}, 0, 0, 0, 0};
+   MMAL_PARAM_THUMBNAIL_CONFIG_T config = {0, 0, 0, 0};
+
+   if (mmal_port_parameter_get(camera->control, &param.hdr) == MMAL_SUCCESS)
+   {
+      config.enable = param.enable;
+      config.width = param.width;
+      config.height = param.height;
+      config.quality = param.quality;
+   }
+
+   return config;
+}
+
+/**
+ * Get the current exposure mode
+ * @param camera Pointer to camera component
+ * @return Exposure mode, auto if it could not be read
+ */
+MMAL_PARAM_EXPOSUREMODE_T raspicamcontrol_get_exposure_mode(MMAL_COMPONENT_T *camera)
+{
+   int value = MMAL_PARAM_EXPOSUREMODE_AUTO;
+   get_enum(camera, MMAL_PARAMETER_EXPOSURE_MODE, &value);
+   return (MMAL_PARAM_EXPOSUREMODE_T)value;
+}
+
+/**
+ * Get the current flicker avoid mode
+ * @param camera Pointer to camera component
+ * @return Flicker avoid mode, off if it could not be read
+ */
+MMAL_PARAM_FLICKERAVOID_T raspicamcontrol_get_flicker_avoid_mode(MMAL_COMPONENT_T *camera)
+{
+   int value = MMAL_PARAM_FLICKERAVOID_OFF;
+   get_enum(camera, MMAL_PARAMETER_FLICKER_AVOID, &value);
+   return (MMAL_PARAM_FLICKERAVOID_T)value;
+}
+
+/**
+ * Get the current AWB mode
+ * @param camera Pointer to camera component
+ * @return AWB mode, auto if it could not be read
+ */
+MMAL_PARAM_AWBMODE_T raspicamcontrol_get_awb_mode(MMAL_COMPONENT_T *camera)
+{
+   int value = MMAL_PARAM_AWBMODE_AUTO;
+   get_enum(camera, MMAL_PARAMETER_AWB_MODE, &value);
+   return (MMAL_PARAM_AWBMODE_T)value;
+}
+
+/**
+ * Get the current image effect
+ * @param camera Pointer to camera component
+ * @return Image effect, none if it could not be read
+ */
+MMAL_PARAM_IMAGEFX_T raspicamcontrol_get_imageFX(MMAL_COMPONENT_T *camera)
+{
+   int value = MMAL_PARAM_IMAGEFX_NONE;
+   get_enum(camera, MMAL_PARAMETER_IMAGE_EFFECT, &value);
+   return (MMAL_PARAM_IMAGEFX_T)value;
+}
+
+/**
+ * Get the current colour effect
+ * @param camera Pointer to camera component
+ * @return Colour effect, disabled if it could not be read
+ */
+MMAL_PARAM_COLOURFX_T raspicamcontrol_get_colourFX(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_COLOURFX_T param = {{MMAL_PARAMETER_COLOUR_EFFECT, sizeof(param)}, 0, 0, 0};
+   MMAL_PARAM_COLOURFX_T colfx = {0, 128, 128};
+
+   if (mmal_port_parameter_get(camera->control, &param.hdr) == MMAL_SUCCESS)
+   {
+      colfx.enable = param.enable;
+      colfx.u = param.u;
+      colfx.v = param.v;
+   }
+
+   return colfx;
+}
+
+/**
+ * Get the custom AWB gains
+ * @param camera Pointer to camera component
+ * @param r_gain Returns the red gain
+ * @param b_gain Returns the blue gain
+ * @return 0 if successful, non-zero otherwise
+ */
+int raspicamcontrol_get_awb_gains(MMAL_COMPONENT_T *camera, float *r_gain, float *b_gain)
+{
+   MMAL_PARAMETER_AWB_GAINS_T param = {{MMAL_PARAMETER_CUSTOM_AWB_GAINS, sizeof(param)}, {0,0}, {0,0}};
+   MMAL_STATUS_T status = mmal_port_parameter_get(camera->control, &param.hdr);
+
+   if (status == MMAL_SUCCESS)
+   {
+      *r_gain = param.r_gain.den ? (float)param.r_gain.num / param.r_gain.den : 0;
+      *b_gain = param.b_gain.den ? (float)param.b_gain.num / param.b_gain.den : 0;
+   }
+
+   return status == MMAL_SUCCESS ? 0 : 1;
+}
+
+/**
+ * Get the rotation of the image
+ * @param camera Pointer to camera component
+ * @return Rotation in degrees, 0 if it could not be read
+ */
+int raspicamcontrol_get_rotation(MMAL_COMPONENT_T *camera)
+{
+   int32_t value = 0;
+   mmal_port_parameter_get_int32(camera->output[0], MMAL_PARAMETER_ROTATION, &value);
+   return value;
+}
+
+/**
+ * Get the flips state of the image
+ * @param camera Pointer to camera component
+ * @param hflip Returns non-zero if horizontally flipped
+ * @param vflip Returns non-zero if vertically flipped
+ * @return 0 if successful, non-zero otherwise
+ */
+int raspicamcontrol_get_flips(MMAL_COMPONENT_T *camera, int *hflip, int *vflip)
+{
+   MMAL_PARAMETER_MIRROR_T mirror = {{MMAL_PARAMETER_MIRROR, sizeof(MMAL_PARAMETER_MIRROR_T)}, MMAL_PARAM_MIRROR_NONE};
+   MMAL_STATUS_T status = mmal_port_parameter_get(camera->output[0], &mirror.hdr);
+
+   if (status == MMAL_SUCCESS)
+   {
+      *hflip = (mirror.value == MMAL_PARAM_MIRROR_HORIZONTAL || mirror.value == MMAL_PARAM_MIRROR_BOTH);
+      *vflip = (mirror.value == MMAL_PARAM_MIRROR_VERTICAL || mirror.value == MMAL_PARAM_MIRROR_BOTH);
+   }
+
+   return status == MMAL_SUCCESS ? 0 : 1;
+}
+
+/**
+ * Get the ROI of the sensor
+ * @param camera Pointer to camera component
+ * @return Normalised ROI rectangle, full sensor if it could not be read
+ */
+PARAM_FLOAT_RECT_T raspicamcontrol_get_ROI(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_INPUT_CROP_T crop = {{MMAL_PARAMETER_INPUT_CROP, sizeof(MMAL_PARAMETER_INPUT_CROP_T)}};
+   PARAM_FLOAT_RECT_T rect = {0.0, 0.0, 1.0, 1.0};
+
+   if (mmal_port_parameter_get(camera->control, &crop.hdr) == MMAL_SUCCESS)
+   {
+      rect.x = (double)crop.rect.x / 65536;
+      rect.y = (double)crop.rect.y / 65536;
+      rect.w = (double)crop.rect.width / 65536;
+      rect.h = (double)crop.rect.height / 65536;
+   }
+
+   return rect;
+}
+
+/**
+ * Get the requested shutter speed
+ * @param camera Pointer to camera component
+ * @return Shutter speed in microseconds, 0 (auto) if it could not be read
+ */
+int raspicamcontrol_get_shutter_speed(MMAL_COMPONENT_T *camera)
+{
+   uint32_t value = 0;
+   mmal_port_parameter_get_uint32(camera->control, MMAL_PARAMETER_SHUTTER_SPEED, &value);
+   return value;
+}
+
+/**
+ * Get the dynamic range compression level
+ * @param camera Pointer to camera component
+ * @return DRC strength, off if it could not be read
+ */
+MMAL_PARAMETER_DRC_STRENGTH_T raspicamcontrol_get_DRC(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_DRC_T drc = {{MMAL_PARAMETER_DYNAMIC_RANGE_COMPRESSION, sizeof(MMAL_PARAMETER_DRC_T)}, MMAL_PARAMETER_DRC_STRENGTH_OFF};
+
+   mmal_port_parameter_get(camera->control, &drc.hdr);
+
+   return drc.strength;
+}
+
+/**
+ * Get the stills capture statistics pass flag
+ * @param camera Pointer to camera component
+ * @return 1 if on, 0 if off or it could not be read
+ */
+int raspicamcontrol_get_stats_pass(MMAL_COMPONENT_T *camera)
+{
+   MMAL_BOOL_T value = MMAL_FALSE;
+   mmal_port_parameter_get_boolean(camera->control, MMAL_PARAMETER_CAPTURE_STATS_PASS, &value);
+   return value ? 1 : 0;
+}
+
+/**
+ * Get the requested analog and digital gains
+ * @param camera Pointer to camera component
+ * @param analog Returns the analog gain
+ * @param digital Returns the digital gain
+ * @return 0 if successful, non-zero otherwise
+ */
+int raspicamcontrol_get_gains(MMAL_COMPONENT_T *camera, float *analog, float *digital)
+{
+   int result;
+
+   result  = get_rational_float(camera->control, MMAL_PARAMETER_ANALOG_GAIN, analog) != MMAL_SUCCESS;
+   result += get_rational_float(camera->control, MMAL_PARAMETER_DIGITAL_GAIN, digital) != MMAL_SUCCESS;
+
+   return result;
+}
+
+/**
+ * Get the focus window flag
+ * @param camera Pointer to camera component
+ * @return 1 if on, 0 if off or it could not be read
+ */
+int raspicamcontrol_get_focus_window(MMAL_COMPONENT_T *camera)
+{
+   MMAL_BOOL_T value = MMAL_FALSE;
+   mmal_port_parameter_get_boolean(camera->control, MMAL_PARAMETER_DRAW_BOX_FACES_AND_FOCUS, &value);
+   return value ? 1 : 0;
+}
+
+/**
+ * Read back the annotation settings into the parameter block
+ * @param camera Pointer to camera component
+ * @param params Pointer to parameter block to accept settings
+ * @return MMAL status of the read
+ */
+static MMAL_STATUS_T get_annotate(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA_PARAMETERS *params)
+{
+   MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T annotate =
+   {{MMAL_PARAMETER_ANNOTATE, sizeof(MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T)}};
+   MMAL_STATUS_T status = mmal_port_parameter_get(camera->control, &annotate.hdr);
+   int settings = 0;
+
+   if (status != MMAL_SUCCESS)
+      return status;
+
+   if (annotate.enable)
+   {
+      if (annotate.text[0])
+         settings |= ANNOTATE_USER_TEXT;
+      if (annotate.show_shutter)
+         settings |= ANNOTATE_SHUTTER_SETTINGS;
+      if (annotate.show_analog_gain)
+         settings |= ANNOTATE_GAIN_SETTINGS;
+      if (annotate.show_lens)
+         settings |= ANNOTATE_LENS_SETTINGS;
+      if (annotate.show_caf)
+         settings |= ANNOTATE_CAF_SETTINGS;
+      if (annotate.show_motion)
+         settings |= ANNOTATE_MOTION_SETTINGS;
+      if (annotate.show_frame_num)
+         settings |= ANNOTATE_FRAME_NUMBER;
+      if (annotate.enable_text_background)
+         settings |= ANNOTATE_BLACK_BACKGROUND;
+   }
+
+   params->enable_annotate = settings;
+   strncpy(params->annotate_string, annotate.text, sizeof(params->annotate_string));
+   params->annotate_string[sizeof(params->annotate_string) - 1] = '\0';
+   params->annotate_text_size = annotate.text_size;
+   params->annotate_text_colour = annotate.custom_text_colour ?
+                                  (annotate.custom_text_V << 16 | annotate.custom_text_U << 8 | annotate.custom_text_Y) : -1;
+   params->annotate_bg_colour = annotate.custom_background_colour ?
+                                (annotate.custom_background_V << 16 | annotate.custom_background_U << 8 | annotate.custom_background_Y) : -1;
+   params->annotate_justify = annotate.justify;
+   params->annotate_x = annotate.x_offset;
+   params->annotate_y = annotate.y_offset;
+
+   return status;
+}
+
 /**
  * Get all the current camera parameters from specified camera component
+ *
+ * Every parameter is queried from the firmware, each query being a round
+ * trip to the VideoCore, so long running code should prefer
+ * raspicamcontrol_get_cached_parameters. Fields that cannot be read back
+ * (the settings event flag) are left as they were.
+ *
  * @param camera Pointer to camera component
  * @param params Pointer to parameter block to accept settings
- * @return 0 if successful, non-zero if unsuccessful
+ * @return 0 if successful, otherwise the number of parameters that could not be read
  */
 int raspicamcontrol_get_all_parameters(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA_PARAMETERS *params)
 {
+   MMAL_PARAMETER_STEREOSCOPIC_MODE_T stereo = { {MMAL_PARAMETER_STEREOSCOPIC_MODE, sizeof(stereo)},
+      MMAL_STEREOSCOPIC_MODE_NONE, MMAL_FALSE, MMAL_FALSE
+   };
+   MMAL_BOOL_T flag;
+   uint32_t value;
+   int32_t value32;
+   int mode;
+   int result = 0;
+
    vcos_assert(camera);
    vcos_assert(params);
 
    if (!camera || !params)
       return 1;
 
-   /* TODO : Write these get functions
-      params->sharpness = raspicamcontrol_get_sharpness(camera);
-      params->contrast = raspicamcontrol_get_contrast(camera);
-      params->brightness = raspicamcontrol_get_brightness(camera);
-      params->saturation = raspicamcontrol_get_saturation(camera);
-      params->ISO = raspicamcontrol_get_ISO(camera);
-      params->videoStabilisation = raspicamcontrol_get_video_stabilisation(camera);
-      params->exposureCompensation = raspicamcontrol_get_exposure_compensation(camera);
-      params->exposureMode = raspicamcontrol_get_exposure_mode(camera);
-      params->flickerAvoidMode = raspicamcontrol_get_flicker_avoid_mode(camera);
-      params->awbMode = raspicamcontrol_get_awb_mode(camera);
-      params->imageEffect = raspicamcontrol_get_image_effect(camera);
-      params->colourEffects = raspicamcontrol_get_colour_effect(camera);
-      params->thumbnailConfig = raspicamcontrol_get_thumbnail_config(camera);
-   */
-   return 0;
+   result += get_rational_percent(camera, MMAL_PARAMETER_SHARPNESS, &params->sharpness) != MMAL_SUCCESS;
+   result += get_rational_percent(camera, MMAL_PARAMETER_CONTRAST, &params->contrast) != MMAL_SUCCESS;
+   result += get_rational_percent(camera, MMAL_PARAMETER_BRIGHTNESS, &params->brightness) != MMAL_SUCCESS;
+   result += get_rational_percent(camera, MMAL_PARAMETER_SATURATION, &params->saturation) != MMAL_SUCCESS;
+
+   if (mmal_port_parameter_get_uint32(camera->control, MMAL_PARAMETER_ISO, &value) == MMAL_SUCCESS)
+      params->ISO = value;
+   else
+      result++;
+
+   if (mmal_port_parameter_get_boolean(camera->control, MMAL_PARAMETER_VIDEO_STABILISATION, &flag) == MMAL_SUCCESS)
+      params->videoStabilisation = flag ? 1 : 0;
+   else
+      result++;
+
+   if (mmal_port_parameter_get_int32(camera->control, MMAL_PARAMETER_EXPOSURE_COMP, &value32) == MMAL_SUCCESS)
+      params->exposureCompensation = value32;
+   else
+      result++;
+
+   if (get_enum(camera, MMAL_PARAMETER_EXPOSURE_MODE, &mode) == MMAL_SUCCESS)
+      params->exposureMode = (MMAL_PARAM_EXPOSUREMODE_T)mode;
+   else
+      result++;
+
+   if (get_enum(camera, MMAL_PARAMETER_EXP_METERING_MODE, &mode) == MMAL_SUCCESS)
+      params->exposureMeterMode = (MMAL_PARAM_EXPOSUREMETERINGMODE_T)mode;
+   else
+      result++;
+
+   if (get_enum(camera, MMAL_PARAMETER_FLICKER_AVOID, &mode) == MMAL_SUCCESS)
+      params->flickerAvoidMode = (MMAL_PARAM_FLICKERAVOID_T)mode;
+   else
+      result++;
+
+   if (get_enum(camera, MMAL_PARAMETER_AWB_MODE, &mode) == MMAL_SUCCESS)
+      params->awbMode = (MMAL_PARAM_AWBMODE_T)mode;
+   else
+      result++;
+
+   if (get_enum(camera, MMAL_PARAMETER_IMAGE_EFFECT, &mode) == MMAL_SUCCESS)
+      params->imageEffect = (MMAL_PARAM_IMAGEFX_T)mode;
+   else
+      result++;
+
+   // These report a default rather than a status, so read them directly
+   params->colourEffects = raspicamcontrol_get_colourFX(camera);
+   params->roi = raspicamcontrol_get_ROI(camera);
+   params->drc_level = raspicamcontrol_get_DRC(camera);
+
+   if (mmal_port_parameter_get_int32(camera->output[0], MMAL_PARAMETER_ROTATION, &value32) == MMAL_SUCCESS)
+      params->rotation = value32;
+   else
+      result++;
+
+   result += raspicamcontrol_get_flips(camera, &params->hflip, &params->vflip);
+   result += raspicamcontrol_get_awb_gains(camera, &params->awb_gains_r, &params->awb_gains_b);
+   result += raspicamcontrol_get_gains(camera, &params->analog_gain, &params->digital_gain);
+
+   if (mmal_port_parameter_get_uint32(camera->control, MMAL_PARAMETER_SHUTTER_SPEED, &value) == MMAL_SUCCESS)
+      params->shutter_speed = value;
+   else
+      result++;
+
+   if (mmal_port_parameter_get_boolean(camera->control, MMAL_PARAMETER_CAPTURE_STATS_PASS, &flag) == MMAL_SUCCESS)
+      params->stats_pass = flag;
+   else
+      result++;
+
+   if (mmal_port_parameter_get_boolean(camera->control, MMAL_PARAMETER_DRAW_BOX_FACES_AND_FOCUS, &flag) == MMAL_SUCCESS)
+      params->focus_window = flag ? 1 : 0;
+   else
+      result++;
+
+   result += get_annotate(camera, params) != MMAL_SUCCESS;
+
+   if (mmal_port_parameter_get(camera->output[0], &stereo.hdr) == MMAL_SUCCESS)
+   {
+      params->stereo_mode.mode = stereo.mode;
+      params->stereo_mode.decimate = stereo.decimate;
+      params->stereo_mode.swap_eyes = stereo.swap_eyes;
+   }
+   else
+      result++;
+
+   return result;
+}
+
+/**
+ * Get the current camera parameters, only querying the camera if they have
+ * been changed through the cache since the last read back
+ *
+ * Settings changed without going through raspicamcontrol_apply_parameters
+ * are not seen until the cache is invalidated.
+ *
+ * @param camera Pointer to camera component
+ * @param cache Pointer to the cache of settings for this camera
+ * @param params Pointer to parameter block to accept settings
+ * @return 0 if successful, non-zero if any parameter could not be read
+ */
+int raspicamcontrol_get_cached_parameters(MMAL_COMPONENT_T *camera, RASPICAM_PARAMETER_CACHE *cache, RASPICAM_CAMERA_PARAMETERS *params)
+{
+   int result = 0;
+
+   vcos_assert(cache);
+   vcos_assert(params);
+
+   if (!cache || !params)
+      return 1;
+
+   if (!cache->readback_valid)
+   {
+      // Start from what we last sent so fields with no read back stay meaningful
+      if (cache->valid)
+         memcpy(&cache->readback, &cache->applied, sizeof(cache->readback));
+      else
+         raspicamcontrol_set_defaults(&cache->readback);
+
+      result = raspicamcontrol_get_all_parameters(camera, &cache->readback);
+
+      // Only keep a complete read, a partial one would be retried next time anyway
+      cache->readback_valid = (result == 0);
+   }
+
+   memcpy(params, &cache->readback, sizeof(*params));
+
+   return result;
 }
 
 /**
@@ -1105,6 +1728,304 @@ int raspicamcontrol_set_all_parameters(MMAL_COMPONENT_T *camera, const RASPICAM_
    return result;
 }
 
+/**
+ * Reset a parameter cache so the next apply sends every parameter
+ * @param cache Pointer to the cache
+ */
+void raspicamcontrol_init_parameter_cache(RASPICAM_PARAMETER_CACHE *cache)
+{
+   vcos_assert(cache);
+
+   memset(cache, 0, sizeof(*cache));
+}
+
+/**
+ * Forget what the camera was last sent, e.g. after it has been recreated
+ * @param cache Pointer to the cache
+ */
+void raspicamcontrol_invalidate_parameter_cache(RASPICAM_PARAMETER_CACHE *cache)
+{
+   vcos_assert(cache);
+
+   cache->valid = 0;
+   cache->readback_valid = 0;
+}
+
+/**
+ * Compare the annotation settings of two parameter blocks
+ *
+ * Date and time text is not counted as a change, keeping it current is up
+ * to the caller.
+ *
+ * @param params Pointer to the new parameters
+ * @param old Pointer to the parameters to compare against
+ * @return Non-zero if any annotation setting differs
+ */
+int raspicamcontrol_annotate_changed(const RASPICAM_CAMERA_PARAMETERS *params, const RASPICAM_CAMERA_PARAMETERS *old)
+{
+   return params->enable_annotate != old->enable_annotate ||
+          strcmp(params->annotate_string, old->annotate_string) ||
+          params->annotate_text_size != old->annotate_text_size ||
+          params->annotate_text_colour != old->annotate_text_colour ||
+          params->annotate_bg_colour != old->annotate_bg_colour ||
+          params->annotate_justify != old->annotate_justify ||
+          params->annotate_x != old->annotate_x ||
+          params->annotate_y != old->annotate_y;
+}
+
+/// Push a parameter set if the cache is cold or the fields it covers have changed
+#define APPLY_IF_CHANGED(changed, call) \
+   do \
+   { \
+      if (!cache->valid || (changed)) \
+      { \
+         result += (call); \
+         cache->sent++; \
+         cache->readback_valid = 0; \
+      } \
+      else \
+         cache->skipped++; \
+   } while (0)
+
+/**
+ * Set the specified camera to the specified settings, only sending those that
+ * differ from the settings it was last given through the same cache
+ *
+ * Each parameter set is a round trip to the VideoCore, so in a long running
+ * process where only one or two settings change per shot this is much cheaper
+ * than raspicamcontrol_set_all_parameters.
+ *
+ * @param camera Pointer to camera component
+ * @param cache Pointer to the cache of applied settings for this camera
+ * @param params Pointer to parameter block containing parameters
+ * @return 0 if successful, non-zero if unsuccessful.
+ */
+int raspicamcontrol_apply_parameters(MMAL_COMPONENT_T *camera, RASPICAM_PARAMETER_CACHE *cache, const RASPICAM_CAMERA_PARAMETERS *params)
+{
+   const RASPICAM_CAMERA_PARAMETERS *old = &cache->applied;
+   int result = 0;
+
+   vcos_assert(camera);
+   vcos_assert(cache);
+   vcos_assert(params);
+
+   if (!camera || !cache || !params)
+      return 1;
+
+   APPLY_IF_CHANGED(params->saturation != old->saturation,
+                    raspicamcontrol_set_saturation(camera, params->saturation));
+   APPLY_IF_CHANGED(params->sharpness != old->sharpness,
+                    raspicamcontrol_set_sharpness(camera, params->sharpness));
+   APPLY_IF_CHANGED(params->contrast != old->contrast,
+                    raspicamcontrol_set_contrast(camera, params->contrast));
+   APPLY_IF_CHANGED(params->brightness != old->brightness,
+                    raspicamcontrol_set_brightness(camera, params->brightness));
+   APPLY_IF_CHANGED(params->ISO != old->ISO,
+                    raspicamcontrol_set_ISO(camera, params->ISO));
+   APPLY_IF_CHANGED(params->videoStabilisation != old->videoStabilisation,
+                    raspicamcontrol_set_video_stabilisation(camera, params->videoStabilisation));
+   APPLY_IF_CHANGED(params->exposureCompensation != old->exposureCompensation,
+                    raspicamcontrol_set_exposure_compensation(camera, params->exposureCompensation));
+   APPLY_IF_CHANGED(params->exposureMode != old->exposureMode,
+                    raspicamcontrol_set_exposure_mode(camera, params->exposureMode));
+   APPLY_IF_CHANGED(params->flickerAvoidMode != old->flickerAvoidMode,
+                    raspicamcontrol_set_flicker_avoid_mode(camera, params->flickerAvoidMode));
+   APPLY_IF_CHANGED(params->exposureMeterMode != old->exposureMeterMode,
+                    raspicamcontrol_set_metering_mode(camera, params->exposureMeterMode));
+   APPLY_IF_CHANGED(params->awbMode != old->awbMode,
+                    raspicamcontrol_set_awb_mode(camera, params->awbMode));
+   // Custom gains only stick while AWB is off, so resend them on any mode change
+   APPLY_IF_CHANGED(params->awb_gains_r != old->awb_gains_r || params->awb_gains_b != old->awb_gains_b ||
+                    params->awbMode != old->awbMode,
+                    raspicamcontrol_set_awb_gains(camera, params->awb_gains_r, params->awb_gains_b));
+   APPLY_IF_CHANGED(params->imageEffect != old->imageEffect,
+                    raspicamcontrol_set_imageFX(camera, params->imageEffect));
+   APPLY_IF_CHANGED(memcmp(&params->colourEffects, &old->colourEffects, sizeof(params->colourEffects)),
+                    raspicamcontrol_set_colourFX(camera, &params->colourEffects));
+   APPLY_IF_CHANGED(params->rotation != old->rotation,
+                    raspicamcontrol_set_rotation(camera, params->rotation));
+   APPLY_IF_CHANGED(params->hflip != old->hflip || params->vflip != old->vflip,
+                    raspicamcontrol_set_flips(camera, params->hflip, params->vflip));
+   APPLY_IF_CHANGED(memcmp(&params->roi, &old->roi, sizeof(params->roi)),
+                    raspicamcontrol_set_ROI(camera, params->roi));
+   APPLY_IF_CHANGED(params->shutter_speed != old->shutter_speed,
+                    raspicamcontrol_set_shutter_speed(camera, params->shutter_speed));
+   APPLY_IF_CHANGED(params->drc_level != old->drc_level,
+                    raspicamcontrol_set_DRC(camera, params->drc_level));
+   APPLY_IF_CHANGED(params->stats_pass != old->stats_pass,
+                    raspicamcontrol_set_stats_pass(camera, params->stats_pass));
+   // Whoever owns the annotation renders it off the capture path, with the location if it has one
+   if (!cache->annotate_owned)
+   {
+      APPLY_IF_CHANGED(raspicamcontrol_annotate_changed(params, old),
+                       raspicamcontrol_set_annotate(camera, params->enable_annotate, params->annotate_string,
+                                                    params->annotate_text_size,
+                                                    params->annotate_text_colour,
+                                                    params->annotate_bg_colour,
+                                                    params->annotate_justify,
+                                                    params->annotate_x,
+                                                    params->annotate_y));
+   }
+   // Fixed gains are dropped by the firmware when the exposure mode changes
+   APPLY_IF_CHANGED(params->analog_gain != old->analog_gain || params->digital_gain != old->digital_gain ||
+                    params->exposureMode != old->exposureMode,
+                    raspicamcontrol_set_gains(camera, params->analog_gain, params->digital_gain));
+   APPLY_IF_CHANGED(params->focus_window != old->focus_window,
+                    raspicamcontrol_set_focus_window(camera, params->focus_window));
+   APPLY_IF_CHANGED(params->settings != old->settings,
+                    raspicamcontrol_set_settings_events(camera, params->settings));
+
+   // On any failure we no longer know what the camera holds, so resend everything next time
+   if (result == 0)
+   {
+      memcpy(&cache->applied, params, sizeof(cache->applied));
+      cache->valid = 1;
+   }
+   else
+      cache->valid = 0;
+
+   return result;
+}
+
+#undef APPLY_IF_CHANGED
+
+/**
+ * Set up an empty camera settings slot
+ * @param slot Slot to initialise
+ */
+void raspicamcontrol_init_settings_slot(RASPICAM_SETTINGS_SLOT *slot)
+{
+   vcos_assert(slot);
+
+   memset(slot, 0, sizeof(*slot));
+}
+
+/**
+ * Convert a MMAL rational to a float, treating a zero denominator as zero
+ */
+static float rational_to_float(MMAL_RATIONAL_T value)
+{
+   return value.den ? (float)value.num / value.den : 0.0f;
+}
+
+/**
+ * Publish a camera settings report to the slot. Only one thread (the control
+ * port callback) may publish to a given slot.
+ * @param slot Slot to update
+ * @param settings Settings report from the camera
+ */
+void raspicamcontrol_publish_camera_settings(RASPICAM_SETTINGS_SLOT *slot, const MMAL_PARAMETER_CAMERA_SETTINGS_T *settings)
+{
+   RASPICAM_CAMERA_SETTINGS update;
+   struct timespec now;
+   uint32_t sequence;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   // Build the new value before opening the write so readers retry as little as possible
+   update.exposure = settings->exposure;
+   update.analog_gain = rational_to_float(settings->analog_gain);
+   update.digital_gain = rational_to_float(settings->digital_gain);
+   update.awb_red_gain = rational_to_float(settings->awb_red_gain);
+   update.awb_blue_gain = rational_to_float(settings->awb_blue_gain);
+   update.focus_position = settings->focus_position;
+   update.reports = slot->settings.reports + 1;
+   update.timestamp = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+   sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+
+   __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   memcpy(&slot->settings, &update, sizeof(update));
+
+   __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Read the latest camera settings report from the slot without blocking the
+ * publisher
+ * @param slot Slot to read
+ * @param settings Returns a consistent copy of the latest report
+ * @return 0 if a report has been received, non-zero if none has arrived yet
+ */
+int raspicamcontrol_get_camera_settings(const RASPICAM_SETTINGS_SLOT *slot, RASPICAM_CAMERA_SETTINGS *settings)
+{
+   uint32_t before, after;
+
+   vcos_assert(slot);
+   vcos_assert(settings);
+
+   do
+   {
+      before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+      memcpy(settings, &slot->settings, sizeof(*settings));
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+   }
+   while ((before & 1) || before != after);
+
+   return settings->reports == 0;
+}
+
+/**
+ * Set up convergence tracking
+ * @param convergence Tracker to initialise
+ * @param tolerance Largest relative change between reports still treated as stable
+ * @param required Number of consecutive stable reports needed
+ */
+void raspicamcontrol_init_convergence(RASPICAM_CONVERGENCE *convergence, float tolerance, int required)
+{
+   vcos_assert(convergence);
+
+   memset(convergence, 0, sizeof(*convergence));
+
+   convergence->tolerance = tolerance;
+   convergence->required = required;
+}
+
+/**
+ * Check whether two values are within a relative tolerance of each other
+ */
+static int within_tolerance(float a, float b, float tolerance)
+{
+   float diff = a > b ? a - b : b - a;
+   float scale = a > b ? a : b;
+
+   return diff <= tolerance * scale;
+}
+
+/**
+ * Feed the latest settings report to the tracker. Reports already seen are
+ * ignored, so this can be called as often as convenient.
+ * @param convergence Tracker to update
+ * @param settings Latest settings report
+ * @return 1 once exposure, gains and AWB have been stable for the required number of reports, 0 otherwise
+ */
+int raspicamcontrol_update_convergence(RASPICAM_CONVERGENCE *convergence, const RASPICAM_CAMERA_SETTINGS *settings)
+{
+   const RASPICAM_CAMERA_SETTINGS *last = &convergence->last;
+
+   if (settings->reports == 0 || settings->reports == last->reports)
+      return convergence->stable >= convergence->required;
+
+   if (last->reports &&
+       within_tolerance(settings->exposure, last->exposure, convergence->tolerance) &&
+       within_tolerance(settings->analog_gain, last->analog_gain, convergence->tolerance) &&
+       within_tolerance(settings->digital_gain, last->digital_gain, convergence->tolerance) &&
+       within_tolerance(settings->awb_red_gain, last->awb_red_gain, convergence->tolerance) &&
+       within_tolerance(settings->awb_blue_gain, last->awb_blue_gain, convergence->tolerance))
+      convergence->stable++;
+   else
+      convergence->stable = 0;
+
+   memcpy(&convergence->last, settings, sizeof(*settings));
+
+   return convergence->stable >= convergence->required;
+}
+
 /**
  * Adjust the saturation level for images
  * @param camera Pointer to camera component
@@ -1628,47 +2549,71 @@ int raspicamcontrol_set_focus_window(MMAL_COMPONENT_T *camera, int focus_window)
 }
 
 /**
- * Set the annotate data
+ * Turn camera settings change events on or off. When on, the control port
+ * callback receives MMAL_PARAMETER_CAMERA_SETTINGS each time AE/AWB move.
  * @param camera Pointer to camera component
+ * @param enable Non-zero to request events, zero to stop them
+ * @return 0 if successful, non-zero otherwise
+ */
+int raspicamcontrol_set_settings_events(MMAL_COMPONENT_T *camera, int enable)
+{
+   MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request =
+   {
+      {MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T)},
+      MMAL_PARAMETER_CAMERA_SETTINGS, enable ? 1 : 0
+   };
+
+   if (!camera)
+      return 1;
+
+   return mmal_status_to_int(mmal_port_parameter_set(camera->control, &change_event_request.hdr));
+}
+
+/**
+ * Build the annotate parameter for a given time without sending it, so it can
+ * be prepared ahead of when it is needed
+ * @param annotate Parameter to fill in
+ * @param time Time to render any date/time text for
  * @param Bitmask of required annotation data. 0 for off.
  * @param If set, a pointer to text string to use instead of bitmask, max length 32 characters
- *
- * @return 0 if successful, non-zero if any parameters out of range
  */
-int raspicamcontrol_set_annotate(MMAL_COMPONENT_T *camera, const int settings, const char *string,
-                                 const int text_size, const int text_colour, const int bg_colour,
-                                 const unsigned int justify, const unsigned int x, const unsigned int y)
+void raspicamcontrol_build_annotate(MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T *annotate, time_t t, const int settings, const char *string,
+                                    const int text_size, const int text_colour, const int bg_colour,
+                                    const unsigned int justify, const unsigned int x, const unsigned int y)
 {
-   MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T annotate =
-   {{MMAL_PARAMETER_ANNOTATE, sizeof(MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T)}};
+   // Zero everything so built parameters can be compared with memcmp
+   memset(annotate, 0, sizeof(*annotate));
+   annotate->hdr.id = MMAL_PARAMETER_ANNOTATE;
+   annotate->hdr.size = sizeof(MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T);
 
    if (settings)
    {
-      time_t t = time(NULL);
-      struct tm tm = *localtime(&t);
+      struct tm tm;
       char tmp[MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V4];
       int process_datetime = 1;
 
-      annotate.enable = 1;
+      localtime_r(&t, &tm);
+
+      annotate->enable = 1;
 
-      if (settings & (ANNOTATE_APP_TEXT | ANNOTATE_USER_TEXT))
+      if (settings & (ANNOTATE_APP_TEXT | ANNOTATE_USER_TEXT | ANNOTATE_GPS_TEXT))
       {
          if ((settings & (ANNOTATE_TIME_TEXT | ANNOTATE_DATE_TEXT)) && strchr(string,'%') != NULL)
          {
             //string contains strftime parameter?
-            strftime(annotate.text, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3, string, &tm );
+            strftime(annotate->text, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3, string, &tm );
             process_datetime = 0;
          }
          else
          {
-            strncpy(annotate.text, string, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3);
+            strncpy(annotate->text, string, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3);
          }
-         annotate.text[MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3-1] = '\0';
+         annotate->text[MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3-1] = '\0';
       }
 
       if (process_datetime && (settings & ANNOTATE_TIME_TEXT))
       {
-         if(strlen(annotate.text))
+         if(strlen(annotate->text))
          {
             strftime(tmp, 32, " %X", &tm );
          }
@@ -1676,12 +2621,12 @@ int raspicamcontrol_set_annotate(MMAL_COMPONENT_T *camera, const int settings, c
          {
             strftime(tmp, 32, "%X", &tm );
          }
-         strncat(annotate.text, tmp, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3 - strlen(annotate.text) - 1);
+         strncat(annotate->text, tmp, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3 - strlen(annotate->text) - 1);
       }
 
       if (process_datetime && (settings & ANNOTATE_DATE_TEXT))
       {
-         if(strlen(annotate.text))
+         if(strlen(annotate->text))
          {
             strftime(tmp, 32, " %x", &tm );
          }
@@ -1689,60 +2634,92 @@ int raspicamcontrol_set_annotate(MMAL_COMPONENT_T *camera, const int settings, c
          {
             strftime(tmp, 32, "%x", &tm );
          }
-         strncat(annotate.text, tmp, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3 - strlen(annotate.text) - 1);
+         strncat(annotate->text, tmp, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3 - strlen(annotate->text) - 1);
       }
 
       if (settings & ANNOTATE_SHUTTER_SETTINGS)
-         annotate.show_shutter = MMAL_TRUE;
+         annotate->show_shutter = MMAL_TRUE;
 
       if (settings & ANNOTATE_GAIN_SETTINGS)
-         annotate.show_analog_gain = MMAL_TRUE;
+         annotate->show_analog_gain = MMAL_TRUE;
 
       if (settings & ANNOTATE_LENS_SETTINGS)
-         annotate.show_lens = MMAL_TRUE;
+         annotate->show_lens = MMAL_TRUE;
 
       if (settings & ANNOTATE_CAF_SETTINGS)
-         annotate.show_caf = MMAL_TRUE;
+         annotate->show_caf = MMAL_TRUE;
 
       if (settings & ANNOTATE_MOTION_SETTINGS)
-         annotate.show_motion = MMAL_TRUE;
+         annotate->show_motion = MMAL_TRUE;
 
       if (settings & ANNOTATE_FRAME_NUMBER)
-         annotate.show_frame_num = MMAL_TRUE;
+         annotate->show_frame_num = MMAL_TRUE;
 
       if (settings & ANNOTATE_BLACK_BACKGROUND)
-         annotate.enable_text_background = MMAL_TRUE;
+         annotate->enable_text_background = MMAL_TRUE;
 
-      annotate.text_size = text_size;
+      annotate->text_size = text_size;
 
       if (text_colour != -1)
       {
-         annotate.custom_text_colour = MMAL_TRUE;
-         annotate.custom_text_Y = text_colour&0xff;
-         annotate.custom_text_U = (text_colour>>8)&0xff;
-         annotate.custom_text_V = (text_colour>>16)&0xff;
+         annotate->custom_text_colour = MMAL_TRUE;
+         annotate->custom_text_Y = text_colour&0xff;
+         annotate->custom_text_U = (text_colour>>8)&0xff;
+         annotate->custom_text_V = (text_colour>>16)&0xff;
       }
       else
-         annotate.custom_text_colour = MMAL_FALSE;
+         annotate->custom_text_colour = MMAL_FALSE;
 
       if (bg_colour != -1)
       {
-         annotate.custom_background_colour = MMAL_TRUE;
-         annotate.custom_background_Y = bg_colour&0xff;
-         annotate.custom_background_U = (bg_colour>>8)&0xff;
-         annotate.custom_background_V = (bg_colour>>16)&0xff;
+         annotate->custom_background_colour = MMAL_TRUE;
+         annotate->custom_background_Y = bg_colour&0xff;
+         annotate->custom_background_U = (bg_colour>>8)&0xff;
+         annotate->custom_background_V = (bg_colour>>16)&0xff;
       }
       else
-         annotate.custom_background_colour = MMAL_FALSE;
+         annotate->custom_background_colour = MMAL_FALSE;
 
-      annotate.justify = justify;
-      annotate.x_offset = x;
-      annotate.y_offset = y;
+      annotate->justify = justify;
+      annotate->x_offset = x;
+      annotate->y_offset = y;
    }
    else
-      annotate.enable = 0;
+      annotate->enable = 0;
+}
 
-   return mmal_status_to_int(mmal_port_parameter_set(camera->control, &annotate.hdr));
+/**
+ * Send a previously built annotate parameter to the camera
+ * @param camera Pointer to camera component
+ * @param annotate Parameter built by raspicamcontrol_build_annotate
+ *
+ * @return 0 if successful, non-zero otherwise
+ */
+int raspicamcontrol_push_annotate(MMAL_COMPONENT_T *camera, const MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T *annotate)
+{
+   if (!camera)
+      return 1;
+
+   return mmal_status_to_int(mmal_port_parameter_set(camera->control, &annotate->hdr));
+}
+
+/**
+ * Set the annotate data
+ * @param camera Pointer to camera component
+ * @param Bitmask of required annotation data. 0 for off.
+ * @param If set, a pointer to text string to use instead of bitmask, max length 32 characters
+ *
+ * @return 0 if successful, non-zero if any parameters out of range
+ */
+int raspicamcontrol_set_annotate(MMAL_COMPONENT_T *camera, const int settings, const char *string,
+                                 const int text_size, const int text_colour, const int bg_colour,
+                                 const unsigned int justify, const unsigned int x, const unsigned int y)
+{
+   MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T annotate;
+
+   raspicamcontrol_build_annotate(&annotate, time(NULL), settings, string, text_size, text_colour, bg_colour, justify, x, y);
+
+   return raspicamcontrol_push_annotate(camera, &annotate);
 }
 
 int raspicamcontrol_set_stereo_mode(MMAL_PORT_T *port, MMAL_PARAMETER_STEREOSCOPIC_MODE_T *stereo_mode)
@@ -1837,8 +2814,6 @@ void raspicamcontrol_check_configuration(int min_gpu_mem)
  */
 void default_camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
-   fprintf(stderr, "Camera control callback  cmd=0x%08x", buffer->cmd);
-
    if (buffer->cmd == MMAL_EVENT_PARAMETER_CHANGED)
    {
       MMAL_EVENT_PARAMETER_CHANGED_T *param = (MMAL_EVENT_PARAMETER_CHANGED_T *)buffer->data;
@@ -1847,11 +2822,15 @@ void default_camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *bu
       case MMAL_PARAMETER_CAMERA_SETTINGS:
       {
          MMAL_PARAMETER_CAMERA_SETTINGS_T *settings = (MMAL_PARAMETER_CAMERA_SETTINGS_T*)param;
-         vcos_log_error("Exposure now %u, analog gain %u/%u, digital gain %u/%u",
+
+         if (port->userdata)
+            raspicamcontrol_publish_camera_settings((RASPICAM_SETTINGS_SLOT *)port->userdata, settings);
+
+         vcos_log_trace("Exposure now %u, analog gain %u/%u, digital gain %u/%u",
                         settings->exposure,
                         settings->analog_gain.num, settings->analog_gain.den,
                         settings->digital_gain.num, settings->digital_gain.den);
-         vcos_log_error("AWB R=%u/%u, B=%u/%u",
+         vcos_log_trace("AWB R=%u/%u, B=%u/%u",
                         settings->awb_red_gain.num, settings->awb_red_gain.den,
                         settings->awb_blue_gain.num, settings->awb_blue_gain.den);
       }
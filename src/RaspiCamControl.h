@@ -29,6 +29,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef RASPICAMCONTROL_H_
 #define RASPICAMCONTROL_H_
 
+#include <time.h>
+
+#include "RaspiCLI.h"
+
 /* Various parameters
  *
  * Exposure Mode
@@ -109,6 +113,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define ANNOTATE_MOTION_SETTINGS    256
 #define ANNOTATE_FRAME_NUMBER       512
 #define ANNOTATE_BLACK_BACKGROUND   1024
+/// Location from gpsd, the app renders it into the annotate text
+#define ANNOTATE_GPS_TEXT           2048
 
 
 // There isn't actually a MMAL structure for the following, so make one
@@ -181,16 +187,74 @@ typedef enum
    ZOOM_IN, ZOOM_OUT, ZOOM_RESET
 } ZOOM_COMMAND_T;
 
+/// Record of the parameters last sent to a camera, so only changes need to be pushed
+typedef struct raspicam_parameter_cache_s
+{
+   RASPICAM_CAMERA_PARAMETERS applied; /// Parameters last successfully applied
+   int valid;                 /// Non-zero once applied matches the camera state
+   unsigned int sent;         /// Number of parameter sets pushed to the camera
+   unsigned int skipped;      /// Number of parameter sets skipped as unchanged
+   RASPICAM_CAMERA_PARAMETERS readback; /// Parameters last read back from the camera
+   int readback_valid;        /// Non-zero while readback reflects the camera state
+   int annotate_owned;        /// Non-zero while something else keeps the annotation up, it is then never sent
+} RASPICAM_PARAMETER_CACHE;
+
+/// Camera settings as last reported by a MMAL_PARAMETER_CAMERA_SETTINGS event
+typedef struct raspicam_camera_settings_s
+{
+   uint32_t exposure;         /// Exposure time in microseconds
+   float analog_gain;         /// Analog gain
+   float digital_gain;        /// Digital gain
+   float awb_red_gain;        /// AWB red gain
+   float awb_blue_gain;       /// AWB blue gain
+   uint32_t focus_position;   /// Focus position, where the sensor has a motorised lens
+   uint32_t reports;          /// Number of reports received, 0 until the first arrives
+   int64_t timestamp;         /// CLOCK_MONOTONIC time of the report in microseconds
+} RASPICAM_CAMERA_SETTINGS;
+
+/// Latest value slot for camera settings. Written only by the control port
+/// callback and read from any thread without locking (a sequence lock).
+typedef struct raspicam_settings_slot_s
+{
+   uint32_t sequence;         /// Odd while an update is in progress
+   RASPICAM_CAMERA_SETTINGS settings;
+} RASPICAM_SETTINGS_SLOT;
+
+/// Tracks successive settings reports to decide when AE/AWB have settled
+typedef struct raspicam_convergence_s
+{
+   float tolerance;           /// Largest relative change still counted as stable, e.g. 0.05
+   int required;              /// Consecutive stable reports needed to call it converged
+   int stable;                /// Consecutive stable reports seen so far
+   RASPICAM_CAMERA_SETTINGS last; /// Previous report, last.reports is 0 before the first
+} RASPICAM_CONVERGENCE;
+
 
 void raspicamcontrol_check_configuration(int min_gpu_mem);
 
 int raspicamcontrol_parse_cmdline(RASPICAM_CAMERA_PARAMETERS *params, const char *arg1, const char *arg2);
+int raspicamcontrol_parse_command(RASPICAM_CAMERA_PARAMETERS *params, int command_id, const char *arg2);
+const COMMAND_LIST *raspicamcontrol_get_commands(int *num_commands);
 void raspicamcontrol_display_help();
 int raspicamcontrol_cycle_test(MMAL_COMPONENT_T *camera);
 
 int raspicamcontrol_set_all_parameters(MMAL_COMPONENT_T *camera, const RASPICAM_CAMERA_PARAMETERS *params);
 int raspicamcontrol_get_all_parameters(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA_PARAMETERS *params);
+void raspicamcontrol_init_parameter_cache(RASPICAM_PARAMETER_CACHE *cache);
+void raspicamcontrol_invalidate_parameter_cache(RASPICAM_PARAMETER_CACHE *cache);
+int raspicamcontrol_apply_parameters(MMAL_COMPONENT_T *camera, RASPICAM_PARAMETER_CACHE *cache, const RASPICAM_CAMERA_PARAMETERS *params);
+int raspicamcontrol_annotate_changed(const RASPICAM_CAMERA_PARAMETERS *params, const RASPICAM_CAMERA_PARAMETERS *old);
+int raspicamcontrol_get_cached_parameters(MMAL_COMPONENT_T *camera, RASPICAM_PARAMETER_CACHE *cache, RASPICAM_CAMERA_PARAMETERS *params);
 void raspicamcontrol_dump_parameters(const RASPICAM_CAMERA_PARAMETERS *params);
+const char *raspicamcontrol_get_exposure_mode_name(int mode);
+const char *raspicamcontrol_get_metering_mode_name(int mode);
+const char *raspicamcontrol_get_awb_mode_name(int mode);
+
+void raspicamcontrol_init_settings_slot(RASPICAM_SETTINGS_SLOT *slot);
+void raspicamcontrol_publish_camera_settings(RASPICAM_SETTINGS_SLOT *slot, const MMAL_PARAMETER_CAMERA_SETTINGS_T *settings);
+int raspicamcontrol_get_camera_settings(const RASPICAM_SETTINGS_SLOT *slot, RASPICAM_CAMERA_SETTINGS *settings);
+void raspicamcontrol_init_convergence(RASPICAM_CONVERGENCE *convergence, float tolerance, int required);
+int raspicamcontrol_update_convergence(RASPICAM_CONVERGENCE *convergence, const RASPICAM_CAMERA_SETTINGS *settings);
 
 void raspicamcontrol_set_defaults(RASPICAM_CAMERA_PARAMETERS *params);
 
@@ -221,9 +285,14 @@ int raspicamcontrol_set_stats_pass(MMAL_COMPONENT_T *camera, int stats_pass);
 int raspicamcontrol_set_annotate(MMAL_COMPONENT_T *camera, const int bitmask, const char *string,
                                  const int text_size, const int text_colour, const int bg_colour,
                                  const unsigned int justify, const unsigned int x, const unsigned int y);
+void raspicamcontrol_build_annotate(MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T *annotate, time_t t, const int bitmask, const char *string,
+                                    const int text_size, const int text_colour, const int bg_colour,
+                                    const unsigned int justify, const unsigned int x, const unsigned int y);
+int raspicamcontrol_push_annotate(MMAL_COMPONENT_T *camera, const MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T *annotate);
 int raspicamcontrol_set_stereo_mode(MMAL_PORT_T *port, MMAL_PARAMETER_STEREOSCOPIC_MODE_T *stereo_mode);
 int raspicamcontrol_set_gains(MMAL_COMPONENT_T *camera, float analog, float digital);
 int raspicamcontrol_set_focus_window(MMAL_COMPONENT_T *camera, int focus_window);
+int raspicamcontrol_set_settings_events(MMAL_COMPONENT_T *camera, int enable);
 
 //Individual getting functions
 int raspicamcontrol_get_saturation(MMAL_COMPONENT_T *camera);
@@ -240,8 +309,18 @@ MMAL_PARAM_FLICKERAVOID_T raspicamcontrol_get_flicker_avoid_mode(MMAL_COMPONENT_
 MMAL_PARAM_AWBMODE_T raspicamcontrol_get_awb_mode(MMAL_COMPONENT_T *camera);
 MMAL_PARAM_IMAGEFX_T raspicamcontrol_get_imageFX(MMAL_COMPONENT_T *camera);
 MMAL_PARAM_COLOURFX_T raspicamcontrol_get_colourFX(MMAL_COMPONENT_T *camera);
+int raspicamcontrol_get_awb_gains(MMAL_COMPONENT_T *camera, float *r_gain, float *b_gain);
+int raspicamcontrol_get_rotation(MMAL_COMPONENT_T *camera);
+int raspicamcontrol_get_flips(MMAL_COMPONENT_T *camera, int *hflip, int *vflip);
+PARAM_FLOAT_RECT_T raspicamcontrol_get_ROI(MMAL_COMPONENT_T *camera);
+int raspicamcontrol_get_shutter_speed(MMAL_COMPONENT_T *camera);
+MMAL_PARAMETER_DRC_STRENGTH_T raspicamcontrol_get_DRC(MMAL_COMPONENT_T *camera);
+int raspicamcontrol_get_stats_pass(MMAL_COMPONENT_T *camera);
+int raspicamcontrol_get_gains(MMAL_COMPONENT_T *camera, float *analog, float *digital);
+int raspicamcontrol_get_focus_window(MMAL_COMPONENT_T *camera);
 
-/** Default camera callback function
+/** Default camera callback function. If the control port userdata is set it
+  * must point to a RASPICAM_SETTINGS_SLOT, which receives each settings report.
   */
 void default_camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 
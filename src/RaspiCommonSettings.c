@@ -123,6 +123,17 @@ void raspicommonsettings_display_help()
 }
 
 
+/**
+ * Get the command line options handled by this module
+ * @param num_commands Returns the number of entries in the table
+ * @return Pointer to the command table
+ */
+const COMMAND_LIST *raspicommonsettings_get_commands(int *num_commands)
+{
+   *num_commands = cmdline_commands_size;
+   return cmdline_commands;
+}
+
 /**
  * Parse a possible command pair - command and parameter
  * @param arg1 Command
@@ -131,7 +142,7 @@ void raspicommonsettings_display_help()
  */
 int raspicommonsettings_parse_cmdline(RASPICOMMONSETTINGS_PARAMETERS *state, const char *arg1, const char *arg2, void (*app_help)(char*))
 {
-   int command_id, used = 0, num_parameters;
+   int command_id, num_parameters;
 
    if (!arg1)
       return 0;
@@ -142,6 +153,19 @@ int raspicommonsettings_parse_cmdline(RASPICOMMONSETTINGS_PARAMETERS *state, con
    if (command_id==-1 || (command_id != -1 && num_parameters > 0 && arg2 == NULL))
       return 0;
 
+   return raspicommonsettings_parse_command(state, command_id, arg2, app_help);
+}
+
+/**
+ * Apply an already identified command to the parameter block
+ * @param command_id ID of the command from this module's table
+ * @param arg2 Parameter (could be NULL if the command takes none)
+ * @return How many parameters were used, 0,1,2
+ */
+int raspicommonsettings_parse_command(RASPICOMMONSETTINGS_PARAMETERS *state, int command_id, const char *arg2, void (*app_help)(char*))
+{
+   int used = 0;
+
    switch (command_id)
    {
    case CommandHelp:
@@ -165,7 +189,7 @@ int raspicommonsettings_parse_cmdline(RASPICOMMONSETTINGS_PARAMETERS *state, con
       int len = strlen(arg2);
       if (len)
       {
-         // Ensure that any %<char> is either %% or %d.
+         // Ensure that any %<char> is %% or a filename template field (%d, %n, %Y etc).
          const char *percent = arg2;
 
          while(*percent && (percent=strchr(percent, '%')) != NULL)
@@ -177,15 +201,16 @@ int raspicommonsettings_parse_cmdline(RASPICOMMONSETTINGS_PARAMETERS *state, con
                percent++;
                digits++;
             }
-            if(!((*percent == '%' && !digits) || *percent == 'd'))
+            if(!((*percent == '%' && !digits) || (*percent && strchr("dnYmHMScgb", *percent))))
             {
                used = 0;
-               fprintf(stderr, "Filename contains %% characters, but not %%d or %%%% - sorry, will fail\n");
+               fprintf(stderr, "Filename contains %% characters, but not a template field or %%%% - sorry, will fail\n");
                break;
             }
             percent++;
          }
 
+         free(state->filename);
          state->filename = malloc(len + 10); // leave enough space for any timelapse generated changes to filename
          vcos_assert(state->filename);
          if (state->filename)
@@ -38,6 +38,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "interface/mmal/mmal_parameters_camera.h"
 
+#include "RaspiCLI.h"
+
 typedef struct
 {
    char camera_name[MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN]; // Name of the camera sensor
@@ -54,6 +56,8 @@ typedef struct
 void raspicommonsettings_set_defaults(RASPICOMMONSETTINGS_PARAMETERS *);
 void raspicommonsettings_dump_parameters(RASPICOMMONSETTINGS_PARAMETERS *);
 void raspicommonsettings_display_help();
+const COMMAND_LIST *raspicommonsettings_get_commands(int *num_commands);
 int raspicommonsettings_parse_cmdline(RASPICOMMONSETTINGS_PARAMETERS *state, const char *arg1, const char *arg2, void (*app_help)());
+int raspicommonsettings_parse_command(RASPICOMMONSETTINGS_PARAMETERS *state, int command_id, const char *arg2, void (*app_help)(char*));
 
 #endif
@@ -133,6 +133,15 @@ void raspi_gps_shutdown(int verbose)
    pthread_mutex_destroy(&gps_reader_data.gps_cache_mutex);
 }
 
+int raspi_gps_get_reader_thread(pthread_t *thread)
+{
+   if (!gps_reader_data.gps_reader_thread_ok)
+      return -1;
+
+   *thread = gps_reader_data.gps_reader_thread;
+   return 0;
+}
+
 int raspi_gps_setup(int verbose)
 {
    memset(&gps_reader_data, 0, sizeof(gps_reader_data));
@@ -185,57 +194,115 @@ int raspi_gps_setup(int verbose)
    return 0;
 }
 
-char *raspi_gps_location_string()
+void raspi_gps_init_location_cache(RASPIGPS_LOCATION_CACHE *cache)
 {
-   char lat[24] = {"n/a"};
-   char lon[24] = {"n/a"};
-   char alt[24] = {"Altitude n/a"};
-   char speed[24] = {"Speed n/a"};
-   char track[24] = {"Track n/a"};
-   char datetime[32] = {"Time n/a"};
-   char *text;
+   memset(cache, 0, sizeof(*cache));
+}
 
+/**
+ * Re-render a field if its value has changed since it was last rendered
+ *
+ * @param field Field to update
+ * @param value New value, NAN if not available
+ * @param format printf format taking a single double
+ * @param unavailable Text to use when the value is not available
+ *
+ * @return 1 if the field was rendered again, 0 if unchanged
+ */
+static int update_field(RASPIGPS_FIELD *field, double value, const char *format, const char *unavailable)
+{
+   if (field->rendered)
+   {
+      if (isnan(value) ? isnan(field->value) : value == field->value)
+         return 0;
+   }
+
+   if (isnan(value))
+      snprintf(field->text, sizeof(field->text), "%s", unavailable);
+   else
+      snprintf(field->text, sizeof(field->text), format, value);
+
+   field->value = value;
+   field->rendered = 1;
+
+   return 1;
+}
+
+int raspi_gps_location_format(RASPIGPS_LOCATION_CACHE *cache, char *buffer, size_t buffer_len)
+{
+   double time = NAN;
+   double lat = NAN;
+   double lon = NAN;
+   double alt = NAN;
+   double speed = NAN;
+   double track = NAN;
+   int changed = 0;
+
+   // Only copy the values under the lock, all the formatting happens after
    struct gps_data_t *gpsdata = raspi_gps_lock();
 
    if (gpsdata->set & TIME_SET)
-   {
-      time_t rawtime;
-      struct tm *timeinfo;
-      rawtime = gpsdata->fix.time;
-      timeinfo = localtime(&rawtime);
-      strftime(datetime, sizeof(datetime), "%Y:%m:%d %H:%M:%S", timeinfo);
-   }
+      time = floor(gpsdata->fix.time);
 
    if (gpsdata->online && gpsdata->fix.mode >= MODE_2D)
    {
       if (gpsdata->set & LATLON_SET)
       {
-         if (!isnan(gpsdata->fix.latitude))
-            snprintf(lat, sizeof(lat), "%.6lf", gpsdata->fix.latitude);
-
-         if (!isnan(gpsdata->fix.longitude))
-            snprintf(lon, sizeof(lon), "%.6lf", gpsdata->fix.longitude);
+         lat = gpsdata->fix.latitude;
+         lon = gpsdata->fix.longitude;
       }
 
-      if ((gpsdata->set & ALTITUDE_SET) && (gpsdata->fix.mode >= MODE_3D) &&
-            (!isnan(gpsdata->fix.altitude)))
-      {
-         snprintf(alt, sizeof(alt), "Altitude=%.2fm", gpsdata->fix.altitude);
-      }
+      if ((gpsdata->set & ALTITUDE_SET) && (gpsdata->fix.mode >= MODE_3D))
+         alt = gpsdata->fix.altitude;
+
+      if (gpsdata->set & SPEED_SET)
+         speed = gpsdata->fix.speed * MPS_TO_KPH;
+
+      if (gpsdata->set & TRACK_SET)
+         track = gpsdata->fix.track;
+   }
+   raspi_gps_unlock();
 
-      if ((gpsdata->set & SPEED_SET) && !isnan(gpsdata->fix.speed))
+   if (!cache->datetime.rendered || (isnan(time) ? !isnan(cache->datetime.value) : time != cache->datetime.value))
+   {
+      if (isnan(time))
       {
-         snprintf(speed, sizeof(speed), "Speed=%.2fkph", gpsdata->fix.speed*MPS_TO_KPH);
+         snprintf(cache->datetime.text, sizeof(cache->datetime.text), "Time n/a");
       }
-
-      if ((gpsdata->set & TRACK_SET) && !isnan(gpsdata->fix.track))
+      else
       {
-         snprintf(track, sizeof(track), "Track=%.2f", gpsdata->fix.track);
+         time_t rawtime = (time_t)time;
+         struct tm timeinfo;
+
+         localtime_r(&rawtime, &timeinfo);
+         strftime(cache->datetime.text, sizeof(cache->datetime.text), "%Y:%m:%d %H:%M:%S", &timeinfo);
       }
+
+      cache->datetime.value = time;
+      cache->datetime.rendered = 1;
+      changed = 1;
    }
-   raspi_gps_unlock();
 
-   asprintf(&text,  "%s Lat %s Long %s %s %s %s", datetime, lat, lon, alt, speed, track);
+   changed |= update_field(&cache->lat, lat, "%.6lf", "n/a");
+   changed |= update_field(&cache->lon, lon, "%.6lf", "n/a");
+   changed |= update_field(&cache->alt, alt, "Altitude=%.2fm", "Altitude n/a");
+   changed |= update_field(&cache->speed, speed, "Speed=%.2fkph", "Speed n/a");
+   changed |= update_field(&cache->track, track, "Track=%.2f", "Track n/a");
+
+   snprintf(buffer, buffer_len, "%s Lat %s Long %s %s %s %s",
+            cache->datetime.text, cache->lat.text, cache->lon.text,
+            cache->alt.text, cache->speed.text, cache->track.text);
+
+   return changed;
+}
+
+char *raspi_gps_location_string()
+{
+   RASPIGPS_LOCATION_CACHE cache;
+   char text[256];
+
+   raspi_gps_init_location_cache(&cache);
+   raspi_gps_location_format(&cache, text, sizeof(text));
 
-   return text;
+   return strdup(text);
 }
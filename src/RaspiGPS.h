@@ -30,12 +30,37 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <pthread.h>
 #include <time.h>
+#include <stddef.h>
 
 #include "libgps_loader.h"
 
+/// One rendered field of the location text
+typedef struct
+{
+   int rendered;        /// Non-zero once text holds a rendering
+   double value;        /// Value text was rendered from, NAN when not available
+   char text[32];       /// Rendered field
+} RASPIGPS_FIELD;
+
+/// Location text fields kept between calls, so only the fields whose values
+/// changed need formatting again
+typedef struct
+{
+   RASPIGPS_FIELD datetime;
+   RASPIGPS_FIELD lat;
+   RASPIGPS_FIELD lon;
+   RASPIGPS_FIELD alt;
+   RASPIGPS_FIELD speed;
+   RASPIGPS_FIELD track;
+} RASPIGPS_LOCATION_CACHE;
+
 int raspi_gps_setup(int verbose);
 void raspi_gps_shutdown(int verbose);
 
+// Get the reader thread, so its scheduling can be changed.
+// Returns non-zero if the thread isn't running.
+int raspi_gps_get_reader_thread(pthread_t *thread);
+
 struct gps_data_t *raspi_gps_lock();
 void raspi_gps_unlock();
 
@@ -44,4 +69,11 @@ void raspi_gps_unlock();
 // need to be freed when finished with.
 char *raspi_gps_location_string();
 
+void raspi_gps_init_location_cache(RASPIGPS_LOCATION_CACHE *cache);
+
+// Write string representation of the current fix into
+// the supplied buffer, without allocating. Returns
+// non-zero if the text differs from the last call.
+int raspi_gps_location_format(RASPIGPS_LOCATION_CACHE *cache, char *buffer, size_t buffer_len);
+
 #endif /* RASPIGPS_H_ */
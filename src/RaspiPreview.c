@@ -218,6 +218,17 @@ void raspipreview_dump_parameters(RASPIPREVIEW_PARAMETERS *state)
            state->previewWindow.height, state->opacity);
 };
 
+/**
+ * Get the command line options handled by this module
+ * @param num_commands Returns the number of entries in the table
+ * @return Pointer to the command table
+ */
+const COMMAND_LIST *raspipreview_get_commands(int *num_commands)
+{
+   *num_commands = cmdline_commands_size;
+   return cmdline_commands;
+}
+
 /**
  * Parse a possible command pair - command and parameter
  * @param arg1 Command
@@ -226,7 +237,7 @@ void raspipreview_dump_parameters(RASPIPREVIEW_PARAMETERS *state)
  */
 int raspipreview_parse_cmdline(RASPIPREVIEW_PARAMETERS *params, const char *arg1, const char *arg2)
 {
-   int command_id, used = 0, num_parameters;
+   int command_id, num_parameters;
 
    if (!arg1)
       return 0;
@@ -237,6 +248,19 @@ int raspipreview_parse_cmdline(RASPIPREVIEW_PARAMETERS *params, const char *arg1
    if (command_id==-1 || (command_id != -1 && num_parameters > 0 && arg2 == NULL))
       return 0;
 
+   return raspipreview_parse_command(params, command_id, arg2);
+}
+
+/**
+ * Apply an already identified command to the parameter block
+ * @param command_id ID of the command from this module's table
+ * @param arg2 Parameter (could be NULL if the command takes none)
+ * @return How many parameters were used, 0,1,2
+ */
+int raspipreview_parse_command(RASPIPREVIEW_PARAMETERS *params, int command_id, const char *arg2)
+{
+   int used = 0;
+
    switch (command_id)
    {
    case CommandPreview: // Preview window
@@ -29,6 +29,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef RASPIPREVIEW_H_
 #define RASPIPREVIEW_H_
 
+#include "RaspiCLI.h"
+
 /// Layer that preview window should be displayed on
 #define PREVIEW_LAYER      2
 
@@ -63,6 +65,8 @@ void raspipreview_destroy(RASPIPREVIEW_PARAMETERS *state);
 void raspipreview_set_defaults(RASPIPREVIEW_PARAMETERS *state);
 void raspipreview_dump_parameters(RASPIPREVIEW_PARAMETERS *state);
 int raspipreview_parse_cmdline(RASPIPREVIEW_PARAMETERS *params, const char *arg1, const char *arg2);
+int raspipreview_parse_command(RASPIPREVIEW_PARAMETERS *params, int command_id, const char *arg2);
+const COMMAND_LIST *raspipreview_get_commands(int *num_commands);
 void raspipreview_display_help();
 
 #endif /* RASPIPREVIEW_H_ */
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "annotateupdater.h"
+#include "rpi_error.h"
+#include "logger.h"
+#include "threadpolicy.h"
+
+AnnotateUpdater::AnnotateUpdater()
+{
+    this->camera = NULL;
+    this->running = false;
+    this->stopRequested = false;
+    this->pushed = 0;
+    this->skipped = 0;
+    this->requested = 0;
+    this->applied = 0;
+
+    memset(&this->current, 0, sizeof(this->current));
+    memset(&this->next, 0, sizeof(this->next));
+
+    pthread_mutex_init(&this->mutex, NULL);
+    pthread_cond_init(&this->cond, NULL);
+}
+
+AnnotateUpdater::~AnnotateUpdater()
+{
+    stop();
+
+    pthread_cond_destroy(&this->cond);
+    pthread_mutex_destroy(&this->mutex);
+}
+
+/*
+** Only annotations showing the date or time go stale
+*/
+bool AnnotateUpdater::isNeeded(const RASPICAM_CAMERA_PARAMETERS * params)
+{
+    return ((params->enable_annotate & (ANNOTATE_DATE_TEXT | ANNOTATE_TIME_TEXT | ANNOTATE_GPS_TEXT)) ? true : false);
+}
+
+void AnnotateUpdater::build(MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T * annotate, time_t t)
+{
+    const char *    pszText = parameters.annotate_string;
+
+    if (parameters.enable_annotate & ANNOTATE_GPS_TEXT) {
+        size_t      len = 0;
+
+        if ((parameters.enable_annotate & ANNOTATE_USER_TEXT) && parameters.annotate_string[0]) {
+            len = snprintf(szText, sizeof(szText), "%s ", parameters.annotate_string);
+
+            if (len >= sizeof(szText)) {
+                len = sizeof(szText) - 1;
+            }
+        }
+
+        raspi_gps_location_format(&gpsCache, &szText[len], sizeof(szText) - len);
+
+        pszText = szText;
+    }
+
+    raspicamcontrol_build_annotate(
+                annotate,
+                t,
+                parameters.enable_annotate,
+                pszText,
+                parameters.annotate_text_size,
+                parameters.annotate_text_colour,
+                parameters.annotate_bg_colour,
+                parameters.annotate_justify,
+                parameters.annotate_x,
+                parameters.annotate_y);
+}
+
+void AnnotateUpdater::start(MMAL_COMPONENT_T * camera, const RASPICAM_CAMERA_PARAMETERS * params)
+{
+    Logger & log = Logger::getInstance();
+
+    if (this->running) {
+        stop();
+    }
+
+    this->camera = camera;
+    memcpy(&this->parameters, params, sizeof(this->parameters));
+    memcpy(&this->pending, params, sizeof(this->pending));
+
+    raspi_gps_init_location_cache(&this->gpsCache);
+
+    // The camera was given the annotation for now when its parameters were set
+    build(&this->current, time(NULL));
+
+    // ...but without the location, which only we know how to render
+    if (this->parameters.enable_annotate & ANNOTATE_GPS_TEXT) {
+        if (raspicamcontrol_push_annotate(this->camera, &this->current)) {
+            log.logError("Failed to set GPS annotation");
+        }
+    }
+
+    this->stopRequested = false;
+    this->pushed = 0;
+    this->skipped = 0;
+    this->requested = 0;
+    this->applied = 0;
+
+    if (pthread_create(&this->thread, NULL, threadEntry, this)) {
+        log.logError("Failed to start annotation updater");
+        throw rpi_error("Failed to start annotation updater", __FILE__, __LINE__);
+    }
+
+    this->running = true;
+
+    log.logDebug("Started annotation updater");
+}
+
+void AnnotateUpdater::stop()
+{
+    if (!this->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&this->mutex);
+    this->stopRequested = true;
+    pthread_cond_broadcast(&this->cond);
+    pthread_mutex_unlock(&this->mutex);
+
+    pthread_join(this->thread, NULL);
+
+    this->running = false;
+
+    Logger::getInstance().logDebug(
+                    "Stopped annotation updater, %u updates pushed, %u skipped as unchanged",
+                    this->pushed,
+                    this->skipped);
+}
+
+/*
+** Hand over new annotation settings, called after the camera parameters
+** have been applied. Only compares them unless they changed, then waits
+** for the thread to render and push them, so the next frame shows them.
+*/
+void AnnotateUpdater::update(const RASPICAM_CAMERA_PARAMETERS * params)
+{
+    unsigned int    target;
+
+    if (!this->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&this->mutex);
+
+    if (raspicamcontrol_annotate_changed(params, &this->pending)) {
+        memcpy(&this->pending, params, sizeof(this->pending));
+
+        target = ++this->requested;
+
+        pthread_cond_broadcast(&this->cond);
+
+        while ((int)(this->applied - target) < 0 && !this->stopRequested) {
+            pthread_cond_wait(&this->cond, &this->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&this->mutex);
+}
+
+/*
+** Send the annotation rendered into next, unless the camera already shows it
+*/
+void AnnotateUpdater::pushNext()
+{
+    if (memcmp(&this->next, &this->current, sizeof(this->next)) != 0) {
+        if (raspicamcontrol_push_annotate(this->camera, &this->next)) {
+            Logger::getInstance().logError("Failed to update annotation");
+        }
+
+        memcpy(&this->current, &this->next, sizeof(this->current));
+        this->pushed++;
+    }
+    else {
+        this->skipped++;
+    }
+}
+
+void * AnnotateUpdater::threadEntry(void * arg)
+{
+    ((AnnotateUpdater *)arg)->run();
+
+    return NULL;
+}
+
+void AnnotateUpdater::run()
+{
+    struct timespec     boundary;
+    time_t              second;
+
+    ThreadPolicy::getInstance().applyBackground("annotation");
+
+    second = time(NULL) + 1;
+
+    pthread_mutex_lock(&this->mutex);
+
+    while (!this->stopRequested) {
+        // New settings go out straight away, rendered for now
+        if (this->applied != this->requested) {
+            unsigned int target = this->requested;
+
+            memcpy(&this->parameters, &this->pending, sizeof(this->parameters));
+
+            pthread_mutex_unlock(&this->mutex);
+
+            build(&this->next, time(NULL));
+            pushNext();
+
+            pthread_mutex_lock(&this->mutex);
+
+            this->applied = target;
+            pthread_cond_broadcast(&this->cond);
+
+            second = time(NULL) + 1;
+            continue;
+        }
+
+        // Render the next second while there is time to spare
+        pthread_mutex_unlock(&this->mutex);
+        build(&this->next, second);
+        pthread_mutex_lock(&this->mutex);
+
+        boundary.tv_sec = second;
+        boundary.tv_nsec = 0;
+
+        // The condition variable waits on CLOCK_REALTIME, the clock the text shows
+        while (!this->stopRequested && this->applied == this->requested) {
+            if (pthread_cond_timedwait(&this->cond, &this->mutex, &boundary) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        if (this->stopRequested) {
+            break;
+        }
+
+        // What was rendered is for the old settings
+        if (this->applied != this->requested) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&this->mutex);
+
+        pushNext();
+
+        second++;
+
+        // If we were held up for more than a second, catch up rather than replay
+        if (second <= time(NULL)) {
+            second = time(NULL) + 1;
+        }
+
+        pthread_mutex_lock(&this->mutex);
+    }
+
+    pthread_mutex_unlock(&this->mutex);
+}
+
+unsigned int AnnotateUpdater::getPushed()
+{
+    return this->pushed;
+}
+
+unsigned int AnnotateUpdater::getSkipped()
+{
+    return this->skipped;
+}
@@ -0,0 +1,75 @@
+#include <time.h>
+#include <pthread.h>
+
+#include <interface/mmal/mmal.h>
+#include <interface/mmal/mmal_parameters_camera.h>
+
+extern "C" {
+#include "RaspiCamControl.h"
+#include "RaspiGPS.h"
+}
+
+#ifndef _INCL_ANNOTATEUPDATER
+#define _INCL_ANNOTATEUPDATER
+
+/*
+** Keeps a date/time annotation current while the camera runs.
+**
+** A background thread renders the annotation for the next second while it
+** waits, then pushes it as the second turns. If the text has not changed,
+** e.g. a date only overlay, nothing is sent at all. None of the formatting
+** happens on the capture path.
+**
+** With ANNOTATE_GPS_TEXT the location from gpsd is added after any user
+** text. It is formatted into a fixed buffer, re-rendering only the fields
+** that moved, so long runs do not churn the heap.
+**
+** While it runs the updater owns the annotation, the parameter cache
+** leaves it alone. New annotation settings are handed over with update(),
+** and rendered and pushed on the updater's thread.
+*/
+class AnnotateUpdater
+{
+private:
+    MMAL_COMPONENT_T *          camera;
+    RASPICAM_CAMERA_PARAMETERS  parameters;     // Only touched by the thread once it is running
+
+    MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T current;
+    MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T next;
+
+    pthread_t                   thread;
+    pthread_mutex_t             mutex;
+    pthread_cond_t              cond;
+    bool                        running;
+    bool                        stopRequested;
+    RASPICAM_CAMERA_PARAMETERS  pending;        // Settings handed over by update()
+    unsigned int                requested;      // Bumped by update()
+    unsigned int                applied;        // requested as of the last push
+
+    RASPIGPS_LOCATION_CACHE     gpsCache;
+    char                        szText[MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3];
+
+    unsigned int                pushed;
+    unsigned int                skipped;
+
+    static void *               threadEntry(void * arg);
+    void                        run();
+    void                        build(MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T * annotate, time_t t);
+    void                        pushNext();
+
+public:
+    AnnotateUpdater();
+    ~AnnotateUpdater();
+
+    static bool     isNeeded(const RASPICAM_CAMERA_PARAMETERS * params);
+
+    void            start(MMAL_COMPONENT_T * camera, const RASPICAM_CAMERA_PARAMETERS * params);
+    void            stop();
+
+    void            update(const RASPICAM_CAMERA_PARAMETERS * params);
+
+    unsigned int    getPushed();
+    unsigned int    getSkipped();
+};
+
+#endif
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "camerapresets.h"
+#include "rpi_error.h"
+#include "logger.h"
+
+/*
+** Strip leading and trailing whitespace in place
+*/
+static char * trim(char * str)
+{
+    char *      end;
+
+    while (isspace(*str)) {
+        str++;
+    }
+
+    end = str + strlen(str);
+
+    while (end > str && isspace(end[-1])) {
+        *--end = 0;
+    }
+
+    return str;
+}
+
+CameraPresets::CameraPresets()
+{
+}
+
+void CameraPresets::load(const char * pszFileName, const RASPICAM_CAMERA_PARAMETERS * base)
+{
+    struct stat     st;
+    void *          data;
+    int             fd;
+
+    Logger & log = Logger::getInstance();
+
+    fd = open(pszFileName, O_RDONLY);
+
+    if (fd < 0) {
+        log.logError("Failed to open preset file %s", pszFileName);
+        throw rpi_error(rpi_error::buildMsg("Failed to open preset file %s", pszFileName), __FILE__, __LINE__);
+    }
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        log.logError("Failed to stat preset file %s", pszFileName);
+        throw rpi_error(rpi_error::buildMsg("Failed to stat preset file %s", pszFileName), __FILE__, __LINE__);
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        log.logDebug("Preset file %s is empty", pszFileName);
+        return;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        log.logError("Failed to map preset file %s", pszFileName);
+        throw rpi_error(rpi_error::buildMsg("Failed to map preset file %s", pszFileName), __FILE__, __LINE__);
+    }
+
+    try {
+        parse((const char *)data, st.st_size, base);
+    }
+    catch (rpi_error & e) {
+        munmap(data, st.st_size);
+        throw;
+    }
+
+    munmap(data, st.st_size);
+
+    log.logDebug("Loaded %d presets from %s", getCount(), pszFileName);
+}
+
+void CameraPresets::parse(const char * data, size_t length, const RASPICAM_CAMERA_PARAMETERS * base)
+{
+    RASPICLI_REGISTRY   registry;
+    RASPICLI_TABLE      table;
+    const char *        pos = data;
+    const char *        end = data + length;
+    char                szLine[PRESET_MAX_LINE_LEN];
+    int                 lineNum = 0;
+    int                 current = -1;
+
+    Logger & log = Logger::getInstance();
+
+    table.commands = raspicamcontrol_get_commands(&table.num_commands);
+
+    if (raspicli_registry_create(&registry, &table, 1)) {
+        throw rpi_error("Failed to create camera option registry", __FILE__, __LINE__);
+    }
+
+    try {
+        while (pos < end) {
+            const char *    eol = (const char *)memchr(pos, '\n', end - pos);
+            size_t          len;
+            char *          pszLine;
+
+            if (eol == NULL) {
+                eol = end;
+            }
+
+            len = eol - pos;
+            lineNum++;
+
+            if (len >= sizeof(szLine)) {
+                log.logError("Preset file line %d is too long", lineNum);
+                throw rpi_error(rpi_error::buildMsg("Preset file line %d is too long", lineNum), __FILE__, __LINE__);
+            }
+
+            memcpy(szLine, pos, len);
+            szLine[len] = 0;
+
+            pos = eol + 1;
+
+            pszLine = trim(szLine);
+
+            if (*pszLine == 0 || *pszLine == '#' || *pszLine == ';') {
+                continue;
+            }
+
+            if (*pszLine == '[') {
+                char *      pszEnd = strchr(pszLine, ']');
+                Preset      preset;
+
+                if (pszEnd == NULL) {
+                    log.logError("Missing ']' on preset file line %d", lineNum);
+                    throw rpi_error(rpi_error::buildMsg("Missing ']' on preset file line %d", lineNum), __FILE__, __LINE__);
+                }
+
+                *pszEnd = 0;
+                pszLine = trim(pszLine + 1);
+
+                if (*pszLine == 0 || strlen(pszLine) >= PRESET_MAX_NAME_LEN) {
+                    log.logError("Invalid preset name on line %d", lineNum);
+                    throw rpi_error(rpi_error::buildMsg("Invalid preset name on line %d", lineNum), __FILE__, __LINE__);
+                }
+
+                if (find(pszLine) != NULL) {
+                    log.logError("Duplicate preset '%s' on line %d", pszLine, lineNum);
+                    throw rpi_error(rpi_error::buildMsg("Duplicate preset '%s' on line %d", pszLine, lineNum), __FILE__, __LINE__);
+                }
+
+                strcpy(preset.szName, pszLine);
+                memcpy(&preset.parameters, base, sizeof(preset.parameters));
+
+                presets.push_back(preset);
+                current = presets.size() - 1;
+            }
+            else if (current < 0) {
+                log.logError("Setting outside of a preset on line %d", lineNum);
+                throw rpi_error(rpi_error::buildMsg("Setting outside of a preset on line %d", lineNum), __FILE__, __LINE__);
+            }
+            else {
+                parseSetting(&registry, &presets[current], pszLine, lineNum);
+            }
+        }
+    }
+    catch (rpi_error & e) {
+        raspicli_registry_destroy(&registry);
+        throw;
+    }
+
+    raspicli_registry_destroy(&registry);
+}
+
+void CameraPresets::parseSetting(const RASPICLI_REGISTRY * registry, Preset * preset, char * pszLine, int lineNum)
+{
+    const COMMAND_LIST *    command;
+    char *                  pszKey = pszLine;
+    char *                  pszValue = NULL;
+    char *                  pszEquals;
+
+    Logger & log = Logger::getInstance();
+
+    pszEquals = strchr(pszLine, '=');
+
+    if (pszEquals != NULL) {
+        *pszEquals = 0;
+        pszValue = trim(pszEquals + 1);
+    }
+
+    pszKey = trim(pszKey);
+
+    command = raspicli_registry_lookup_setting(registry, pszKey, NULL);
+
+    if (command == NULL) {
+        log.logError("Unknown camera setting '%s' on line %d", pszKey, lineNum);
+        throw rpi_error(rpi_error::buildMsg("Unknown camera setting '%s' on line %d", pszKey, lineNum), __FILE__, __LINE__);
+    }
+
+    if (command->num_parameters > 0 && (pszValue == NULL || *pszValue == 0)) {
+        log.logError("Camera setting '%s' needs a value on line %d", pszKey, lineNum);
+        throw rpi_error(rpi_error::buildMsg("Camera setting '%s' needs a value on line %d", pszKey, lineNum), __FILE__, __LINE__);
+    }
+
+    if (raspicamcontrol_parse_command(&preset->parameters, command->id, pszValue) == 0) {
+        log.logError("Invalid value for '%s' on line %d", pszKey, lineNum);
+        throw rpi_error(rpi_error::buildMsg("Invalid value for '%s' on line %d", pszKey, lineNum), __FILE__, __LINE__);
+    }
+}
+
+const RASPICAM_CAMERA_PARAMETERS * CameraPresets::find(const char * pszName)
+{
+    for (size_t i = 0;i < presets.size();i++) {
+        if (strcmp(presets[i].szName, pszName) == 0) {
+            return &presets[i].parameters;
+        }
+    }
+
+    return NULL;
+}
+
+int CameraPresets::getCount()
+{
+    return (int)presets.size();
+}
+
+const char * CameraPresets::getName(int index)
+{
+    if (index < 0 || index >= getCount()) {
+        return NULL;
+    }
+
+    return presets[index].szName;
+}
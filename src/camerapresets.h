@@ -0,0 +1,60 @@
+#include <stddef.h>
+#include <vector>
+
+#include <interface/mmal/mmal.h>
+#include <interface/mmal/mmal_parameters_camera.h>
+
+extern "C" {
+#include "RaspiCamControl.h"
+}
+
+#ifndef _INCL_CAMERAPRESETS
+#define _INCL_CAMERAPRESETS
+
+#define PRESET_MAX_NAME_LEN             32
+#define PRESET_MAX_LINE_LEN             256
+
+/*
+** Named sets of camera parameters, loaded from a file such as:
+**
+**  # Comments start with '#' or ';'
+**  [day]
+**  exposure = auto
+**  awb = sun
+**
+**  [night]
+**  exposure = night
+**  ISO = 800
+**  vflip
+**
+** Keys are the camera option names, long or short, without the leading '-'.
+** Options that take no value are given on their own. Each section starts
+** from the base parameters passed to load(), so a preset only lists what it
+** changes. The file is parsed once, after which selecting a preset is just a
+** lookup.
+*/
+class CameraPresets
+{
+private:
+    struct Preset {
+        char                        szName[PRESET_MAX_NAME_LEN];
+        RASPICAM_CAMERA_PARAMETERS  parameters;
+    };
+
+    std::vector<Preset>     presets;
+
+    void        parse(const char * data, size_t length, const RASPICAM_CAMERA_PARAMETERS * base);
+    void        parseSetting(const RASPICLI_REGISTRY * registry, Preset * preset, char * pszLine, int lineNum);
+
+public:
+    CameraPresets();
+
+    void        load(const char * pszFileName, const RASPICAM_CAMERA_PARAMETERS * base);
+
+    const RASPICAM_CAMERA_PARAMETERS * find(const char * pszName);
+
+    int         getCount();
+    const char * getName(int index);
+};
+
+#endif
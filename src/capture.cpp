@@ -1,10 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <semaphore.h>
 #include <math.h>
 #include <pthread.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <netinet/in.h>
 
 #include <interface/mmal/mmal.h>
 #include <interface/mmal/mmal_types.h>
@@ -24,11 +30,29 @@ extern "C" {
 #include "RaspiCamControl.h"
 #include "RaspiPreview.h"
 #include "RaspiHelpers.h"
+#include "RaspiGPS.h"
 }
 
 #include "rpi_error.h"
 #include "currenttime.h"
 #include "logger.h"
+#include "framemetadata.h"
+#include "camerapresets.h"
+#include "annotateupdater.h"
+#include "filenametemplate.h"
+#include "outputmanager.h"
+#include "retentionmanager.h"
+#include "syncpolicy.h"
+#include "segmentwriter.h"
+#include "frameindex.h"
+#include "mjpegserver.h"
+#include "controlserver.h"
+#include "framering.h"
+#include "triggersource.h"
+#include "threadpolicy.h"
+#include "stereosplitter.h"
+#include "exposurebracket.h"
+#include "fusionworker.h"
 
 #define MMAL_CAMERA_PREVIEW_PORT    0
 #define MMAL_CAMERA_VIDEO_PORT      1
@@ -45,6 +69,9 @@ extern "C" {
 #define MAX_USER_EXIF_TAGS          32
 #define MAX_EXIF_PAYLOAD_LENGTH     128
 
+// How often to look at the settings reports while waiting for exposure to settle, ms
+#define SETTLE_POLL_INTERVAL        10
+
 /** Structure containing all state information for the current run
  */
 typedef struct {
@@ -64,6 +91,62 @@ typedef struct {
 
    RASPIPREVIEW_PARAMETERS preview_parameters;    /// Preview setup parameters
    RASPICAM_CAMERA_PARAMETERS camera_parameters; /// Camera setup parameters
+   RASPICAM_PARAMETER_CACHE parameter_cache;     /// Camera parameters last sent to the camera
+   RASPICAM_SETTINGS_SLOT settings_slot;         /// Latest settings reported by the camera
+   AnnotateUpdater *annotate_updater;            /// Keeps the annotation up while running, NULL if it isn't
+   int metadata_format;                          /// Format of the per frame settings sidecar
+   int settle_reports;                 /// Consecutive stable settings reports before capture, 0 to always wait for the timeout
+   int settle_tolerance;               /// Largest change between settings reports still counted as stable, in percent
+   int frames;                         /// Number of frames to capture in the series
+   int timelapse;                      /// Time between the start of each frame in the series, ms. 0 for a burst
+   int exposure_lock;                  /// Lock the settled exposure, gains and AWB for the rest of the series
+   int remeter_frames;                 /// Re-meter a locked series after this many frames, 0 for never
+   int remeter_drift;                  /// Re-meter when the frame size drifts from the first locked frame by this percentage, 0 for never
+   const char *preset_file;            /// File of named camera parameter presets
+   const char *preset_name;            /// Preset to start with
+   CameraPresets *presets;             /// Presets loaded from preset_file, NULL if none
+   FilenameTemplate *filename_template;  /// Compiled output filename
+   OutputManager *output;              /// Creates the output files, sharding directories if limits are set
+   int shard_files;                    /// Start a new output directory after this many files, 0 for no limit
+   int shard_megabytes;                /// Start a new output directory after this many MB, 0 for no limit
+   RetentionManager *retention;        /// Deletes the oldest captures when storage runs low, NULL if no limits set
+   int min_free_megabytes;             /// Free space to keep on the output filesystem, MB. 0 for no limit
+   int quota_megabytes;                /// Most the indexed captures may take up, MB. 0 for no limit
+   const char *retention_index;        /// Retention index file, NULL to keep it with the output
+   int preallocate;                    /// Preallocate output files from the average frame size
+   SyncPolicy *sync_policy;            /// Syncs finished files in groups, NULL if not syncing
+   int sync_mode;                      /// SYNC_MODE_NONE, SYNC_MODE_FS or SYNC_MODE_DATA
+   int sync_frames;                    /// Sync once this many files are waiting
+   int sync_ms;                        /// Sync once the oldest file has waited this long, ms
+   int segment_megabytes;              /// Append frames to segment files of about this many MB, 0 for a file per frame
+   SegmentWriter *segments;            /// Writes the frames into segments, NULL for a file per frame
+   int segment_num;                    /// Sequence number of the open or next segment
+   FILE *segment_file;                 /// The open segment
+   char segment_path[OUTPUT_MAX_PATH_LEN]; /// Path of the open segment
+   const char *frame_index_file;       /// Add each frame to this frame index, NULL for none
+   FrameIndexWriter *frame_index;      /// Writes to frame_index_file
+   const char *stream_spec;            /// [address:]port to serve the MJPEG stream on, NULL for no stream
+   MjpegServer *stream;                /// Serves each encoded frame to viewers, NULL if not streaming
+   const char *frame_ring_socket;      /// Unix socket consumers attach to the shared memory frame ring on, NULL for no ring
+   int frame_ring_slots;               /// Number of frames the ring holds
+   FrameRing *frame_ring;              /// Publishes each frame to local consumers, NULL if not publishing
+   const char *control_socket;         /// Take capture requests on this Unix socket, NULL to capture the series and exit
+   int signal_trigger;                 /// Capture a frame on each SIGUSR1 until SIGINT or SIGTERM
+   const char *trigger_spec;           /// Also capture on events from this trigger source, NULL for none
+   int realtime_priority;              /// SCHED_FIFO priority of the capture threads, 0 to leave it alone
+   const char *capture_cpus;           /// CPUs to pin the capture threads to, NULL for any
+   const char *background_cpus;        /// CPUs to pin the other threads to, NULL for those capture_cpus leaves
+   int second_camera;                  /// Camera to capture on alongside cameraNum, -1 for one camera
+   struct second_camera_s *second;     /// The second camera's graph, NULL for one camera
+   int split_stereo;                   /// Write each stereo frame as a file per eye
+   StereoSplitter *splitter;           /// Splits the stereo frames, NULL if not splitting
+   const char *bracket_spec;           /// Exposures to bracket each frame with, NULL for a single exposure
+   ExposureBracket *bracket;           /// Parsed from bracket_spec, NULL if not bracketing
+   int bracket_index;                  /// Exposure of the bracket being captured, 0 when not bracketing
+   int fuse;                           /// Fuse each bracket into one frame rather than writing its exposures out
+   FusionWorker *fusion;               /// Fuses the brackets, NULL if not fusing
+   char last_path[OUTPUT_MAX_PATH_LEN]; /// File the last frame went to
+   uint64_t last_offset;               /// Offset of the last frame in its segment, 0 for a file per frame
 
    MMAL_COMPONENT_T *camera_component;    /// Pointer to the camera component
    MMAL_COMPONENT_T *encoder_component;   /// Pointer to the encoder component
@@ -72,18 +155,191 @@ typedef struct {
    MMAL_CONNECTION_T *encoder_connection; /// Pointer to the connection from camera to encoder
 
    MMAL_POOL_T *encoder_pool; /// Pointer to the pool of buffers used by encoder output port
+   MMAL_PORT_T *frame_port;   /// Port the frames come out of, the encoder output or the camera's still port for raw frames
 }
 RASPISTILL_STATE;
 
+/// Command ID's and Structure defining our command line options
+enum
+{
+   CommandQuality,
+   CommandTimeout,
+   CommandRestartInterval,
+   CommandMetadata,
+   CommandSettleReports,
+   CommandSettleTolerance,
+   CommandFrames,
+   CommandTimelapse,
+   CommandExposureLock,
+   CommandRemeterFrames,
+   CommandRemeterDrift,
+   CommandPresetFile,
+   CommandPreset,
+   CommandShardFiles,
+   CommandShardSize,
+   CommandMinFree,
+   CommandQuota,
+   CommandRetentionIndex,
+   CommandPreallocate,
+   CommandSync,
+   CommandSyncFrames,
+   CommandSyncTime,
+   CommandContainer,
+   CommandFrameIndex,
+   CommandStream,
+   CommandDaemon,
+   CommandFrameRing,
+   CommandFrameRingSlots,
+   CommandSignal,
+   CommandTrigger,
+   CommandRealtimePriority,
+   CommandCaptureCpus,
+   CommandBackgroundCpus,
+   CommandDualCamera,
+   CommandEncoding,
+   CommandSplitStereo,
+   CommandBracket,
+   CommandFuse,
+};
+
+static COMMAND_LIST cmdline_commands[] =
+{
+   { CommandQuality,          "-quality",    "q",  "Set jpeg quality <0 to 100>", 1 },
+   { CommandTimeout,          "-timeout",    "t",  "Longest time (in ms) to wait for exposure to settle before taking the picture (if not specified, set to 5s)", 1 },
+   { CommandRestartInterval,  "-restart",    "rs", "Set JPEG restart marker interval (default 0)", 1 },
+   { CommandMetadata,         "-metadata",   "mt", "Write the camera settings for each frame to a sidecar file: json, binary or none", 1 },
+   { CommandSettleReports,    "-settle",     "sr", "Capture once exposure is stable for this many reports, timeout is then an upper bound (default 3, 0 to disable)", 1 },
+   { CommandSettleTolerance,  "-tolerance",  "tol","Largest exposure/gain change in percent still counted as stable (default 5)", 1 },
+   { CommandFrames,           "-frames",     "fr", "Number of frames to capture, use %n (or %d) in the filename to number them (default 1)", 1 },
+   { CommandTimelapse,        "-timelapse",  "tl", "Time (in ms) between the start of each frame, 0 captures a burst (default 0)", 1 },
+   { CommandExposureLock,     "-aelock",     "ael","Lock exposure, gains and AWB once settled for the rest of the series", 0 },
+   { CommandRemeterFrames,    "-remeter",    "rm", "Re-meter a locked series every <n> frames (default 0, never)", 1 },
+   { CommandRemeterDrift,     "-drift",      "dr", "Re-meter a locked series when the frame size drifts by <n> percent (default 0, never)", 1 },
+   { CommandPresetFile,       "-presets",    "pf", "Load named camera setting presets from <file>", 1 },
+   { CommandPreset,           "-preset",     "ps", "Use the camera settings of preset <name>", 1 },
+   { CommandShardFiles,       "-shardfiles", "sf", "Start a new numbered output subdirectory after <n> files (default 0, no limit)", 1 },
+   { CommandShardSize,        "-shardsize",  "sz", "Start a new numbered output subdirectory after <n> MB (default 0, no limit)", 1 },
+   { CommandMinFree,          "-minfree",    "mf", "Delete the oldest captures to keep <n> MB free on the output filesystem (default 0, no limit)", 1 },
+   { CommandQuota,            "-quota",      "qu", "Delete the oldest captures once they take up more than <n> MB (default 0, no limit)", 1 },
+   { CommandRetentionIndex,   "-index",      "ix", "Record captures for -minfree and -quota in <file> (default " RETENTION_INDEX_NAME " in the output directory)", 1 },
+   { CommandPreallocate,      "-prealloc",   "pa", "Preallocate each output file from the average frame size", 0 },
+   { CommandSync,             "-sync",       "sy", "Sync finished files to storage in groups: fs, data or none (default none)", 1 },
+   { CommandSyncFrames,       "-syncframes", "syf","Sync once <n> files are waiting (default 8)", 1 },
+   { CommandSyncTime,         "-synctime",   "syt","Sync once the oldest file has waited <n> ms, the most a power cut can lose (default 1000)", 1 },
+   { CommandContainer,        "-container",  "ct", "Append frames to segment files of <n> MB rather than a file each, %n in the filename numbers the segments (default 0, off)", 1 },
+   { CommandFrameIndex,       "-frameindex", "fi", "Add each frame's time, location and exposure to the frame index <file>", 1 },
+   { CommandStream,           "-stream",     "str","Serve the frames as an MJPEG stream over HTTP on [<address>:]<port> (address defaults to 127.0.0.1)", 1 },
+   { CommandFrameRing,        "-shm",        "shm","Publish each frame in shared memory to local consumers attaching on the Unix socket <path>", 1 },
+   { CommandFrameRingSlots,   "-shmslots",   "shs","Number of frames the shared memory ring holds (default 4)", 1 },
+   { CommandSignal,           "-signal",     "s",  "Stay armed and capture a frame each time SIGUSR1 arrives, until SIGINT or SIGTERM", 0 },
+   { CommandTrigger,          "-trigger",    "trg","Stay armed and capture on events from gpio:<chip>:<line>[:rising|falling|both], sysfs:<value file>, fifo:<path>, fd:<n> or timer:<ms>", 1 },
+   { CommandDualCamera,       "-dual",       "dl", "Also drive camera <n> (Compute Module), capturing on both together; use %c in the filename to tell their frames apart", 1 },
+   { CommandEncoding,         "-encoding",   "e",  "Encoding to use for output file (jpg, bmp, gif, png, or yuv for raw I420)", 1 },
+   { CommandSplitStereo,      "-split",      "spl","Write each -stereo frame as a file per eye, _left and _right before the extension (needs -encoding bmp)", 0 },
+   { CommandBracket,          "-bracket",    "brk","Capture each frame at several exposures, EV steps from the metered exposure (e.g. -2,0,+2) or shutter speeds (e.g. 1000us,8000us); use %b in the filename to number them", 1 },
+   { CommandFuse,             "-fuse",       "fu", "Fuse the exposures of each -bracket into one frame on the Pi, written as I420 (needs -encoding yuv)", 0 },
+   { CommandDaemon,           "-daemon",     "dm", "Stay running and take capture requests on the Unix socket <path> rather than capturing once", 1 },
+   { CommandRealtimePriority, "-rtprio",     "rtp","Run the capture threads at SCHED_FIFO priority <1 to 99>, needs root or an rtprio limit", 1 },
+   { CommandCaptureCpus,      "-cpus",       "cpu","Pin the capture threads to CPUs <list>, e.g. 3 or 2,3", 1 },
+   { CommandBackgroundCpus,   "-bgcpus",     "bgc","Pin the GPS reader and the file, stream and publishing threads to CPUs <list> (default the CPUs -cpus leaves)", 1 },
+};
+
+static int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
+
+static XREF_T encoding_xref[] =
+{
+   {"jpg", MMAL_ENCODING_JPEG},
+   {"bmp", MMAL_ENCODING_BMP},
+   {"gif", MMAL_ENCODING_GIF},
+   {"png", MMAL_ENCODING_PNG},
+   {"yuv", MMAL_ENCODING_I420}
+};
+
+static int encoding_xref_size = sizeof(encoding_xref) / sizeof(encoding_xref[0]);
+
+/// Order of the option tables in the merged registry, earlier tables win on duplicate names
+enum
+{
+   OptionTableApp,
+   OptionTableCommon,
+   OptionTablePreview,
+   OptionTableCamera,
+   OptionTableCount
+};
+
 /** Struct used to pass information in encoder port userdata to callback
  */
 typedef struct {
-   FILE *file_handle;                   /// File handle to write buffer data to.
+   FILE *file_handle;                   /// File handle to write buffer data to, NULL if the frame only goes to the stream or ring
+   int capturing;                       /// A capture has been triggered and its frame not yet completed
+   pthread_mutex_t output_lock;         /// Guards file_handle, splitter and the held data against the callback
+   StereoSplitter *splitter;            /// Splits the frame into a file per eye instead of writing file_handle, NULL for none
+   int holding;                         /// Keep the data until the output is ready, the capture was started on a trigger
+   uint8_t *held;                       /// Data encoded before the output was ready
+   size_t held_bytes;                   /// Bytes in held
+   size_t held_capacity;                /// Size of held
+   int started;                         /// The capture was started on a trigger, its output not yet set
+   MMAL_STATUS_T start_status;          /// Result of starting the capture early
+   size_t frame_bytes;                  /// Bytes received for the current frame
+   int64_t frame_pts;                   /// Encoder timestamp of the current frame, MMAL_TIME_UNKNOWN until its first buffer
    VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
    RASPISTILL_STATE *pstate;            /// pointer to our state in case required in callback
 }
 PORT_USERDATA;
 
+/** Exposure held fixed across a series of captures
+ */
+typedef struct {
+   int locked;                          /// Non-zero while the exposure is locked
+   int frames;                          /// Frames captured since the lock
+   size_t reference_bytes;              /// Size of the first frame after the lock, the brightness reference
+   RASPICAM_CAMERA_PARAMETERS parameters; /// Parameters holding the locked values
+}
+EXPOSURE_LOCK;
+
+/** A bracket being fused, and where the result goes once it has been
+ */
+typedef struct {
+   FUSION_JOB job;                      /// Handed to the fusion worker, its context points back here
+   char path[OUTPUT_MAX_PATH_LEN];      /// Path of job.output
+   int frame;                           /// Frame number
+   RASPICAM_SETTINGS_SLOT slot;         /// Settings at the metered exposure, for the sidecar and frame index
+}
+FUSED_FRAME;
+
+/** Running latency figures, us
+ */
+typedef struct {
+   unsigned int count;
+   long min;
+   long max;
+   long long total;
+}
+LATENCY_STATS;
+
+/** A second camera driven alongside the first, the other sensor of a stereo
+ *  pair on a Compute Module. It has a graph of its own, and its capture
+ *  requests are made from a thread of their own so the two go to the
+ *  firmware together rather than one after the other.
+ */
+typedef struct second_camera_s {
+   RASPISTILL_STATE *state;             /// Copy of the main state holding the second camera's graph
+   PORT_USERDATA callback_data;         /// Its encoder callback data
+   FILE *output_file;                   /// File for its current frame, NULL to hold the data until there is one
+   char path[OUTPUT_MAX_PATH_LEN];      /// Path of output_file
+   pthread_t thread;                    /// Makes the second camera's capture requests
+   int thread_ok;                       /// thread was started
+   pthread_barrier_t barrier;           /// Lines the two capture requests up
+   VCOS_SEMAPHORE_T requested_semaphore; /// Posted once the second capture request has been made
+   int quit;                            /// Tells the thread to finish when next released
+   MMAL_STATUS_T request_status;        /// Result of the last capture request
+   int64_t requested;                   /// CLOCK_MONOTONIC us the second camera's last request was accepted
+   int64_t first_requested;             /// CLOCK_MONOTONIC us the first camera's last request was accepted
+   LATENCY_STATS skew;                  /// Difference between the two frames' timestamps
+   LATENCY_STATS request_skew;          /// Difference between the two capture requests
+}
+SECOND_CAMERA;
+
 /**
  * Assign a default set of parameters to the state passed in
  *
@@ -114,18 +370,567 @@ static void default_status(RASPISTILL_STATE *state)
    state->preview_connection = NULL;
    state->encoder_connection = NULL;
    state->encoder_pool = NULL;
+   state->frame_port = NULL;
    state->encoding = MMAL_ENCODING_JPEG;
+   state->split_stereo = 0;
+   state->splitter = NULL;
+   state->bracket_spec = NULL;
+   state->bracket = NULL;
+   state->bracket_index = 0;
+   state->fuse = 0;
+   state->fusion = NULL;
    state->numExifTags = 0;
    state->enableExifTags = 1;
    state->datetime = 0;
    state->timestamp = 0;
    state->restart_interval = 0;
+   state->metadata_format = METADATA_FORMAT_NONE;
+   state->settle_reports = 3;
+   state->settle_tolerance = 5;
+   state->frames = 1;
+   state->timelapse = 0;
+   state->exposure_lock = 0;
+   state->remeter_frames = 0;
+   state->remeter_drift = 0;
+   state->preset_file = NULL;
+   state->preset_name = NULL;
+   state->presets = NULL;
+   state->annotate_updater = NULL;
+   state->filename_template = NULL;
+   state->output = NULL;
+   state->shard_files = 0;
+   state->shard_megabytes = 0;
+   state->retention = NULL;
+   state->min_free_megabytes = 0;
+   state->quota_megabytes = 0;
+   state->retention_index = NULL;
+   state->preallocate = 0;
+   state->sync_policy = NULL;
+   state->sync_mode = SYNC_MODE_NONE;
+   state->sync_frames = 8;
+   state->sync_ms = 1000;
+   state->segment_megabytes = 0;
+   state->segments = NULL;
+   state->segment_num = 0;
+   state->segment_file = NULL;
+   state->frame_index_file = NULL;
+   state->frame_index = NULL;
+   state->stream_spec = NULL;
+   state->stream = NULL;
+   state->frame_ring_socket = NULL;
+   state->frame_ring_slots = 4;
+   state->frame_ring = NULL;
+   state->control_socket = NULL;
+   state->signal_trigger = 0;
+   state->trigger_spec = NULL;
+   state->realtime_priority = 0;
+   state->capture_cpus = NULL;
+   state->background_cpus = NULL;
+   state->second_camera = -1;
+   state->second = NULL;
+   state->last_path[0] = 0;
+   state->last_offset = 0;
 
    // Setup preview window defaults
    raspipreview_set_defaults(&state->preview_parameters);
 
    // Set up the camera_parameters to default
    raspicamcontrol_set_defaults(&state->camera_parameters);
+   raspicamcontrol_init_parameter_cache(&state->parameter_cache);
+   raspicamcontrol_init_settings_slot(&state->settings_slot);
+}
+
+/**
+ * Display help for the application specific command line options
+ *
+ * @param app_name Name of the application as invoked
+ */
+static void application_help_message(char *app_name)
+{
+   fprintf(stdout, "Runs camera for specific time, and takes a JPG capture at end if requested\n\n");
+   fprintf(stdout, "usage: %s [options] [filename]\n\n", app_name);
+   fprintf(stdout, "Image parameter commands\n\n");
+
+   raspicli_display_help(cmdline_commands, cmdline_commands_size);
+}
+
+/**
+ * Build the merged option registry on first use
+ *
+ * All option tables are hashed together once, so each argument costs a
+ * single lookup no matter how many modules contribute options.
+ *
+ * @return Pointer to the registry, NULL if it could not be built
+ */
+static const RASPICLI_REGISTRY * get_option_registry()
+{
+   static RASPICLI_REGISTRY   registry;
+   static bool                initialised = false;
+
+   if (!initialised) {
+      RASPICLI_TABLE tables[OptionTableCount];
+
+      tables[OptionTableApp].commands = cmdline_commands;
+      tables[OptionTableApp].num_commands = cmdline_commands_size;
+      tables[OptionTableCommon].commands = raspicommonsettings_get_commands(&tables[OptionTableCommon].num_commands);
+      tables[OptionTablePreview].commands = raspipreview_get_commands(&tables[OptionTablePreview].num_commands);
+      tables[OptionTableCamera].commands = raspicamcontrol_get_commands(&tables[OptionTableCamera].num_commands);
+
+      if (raspicli_registry_create(&registry, tables, OptionTableCount)) {
+         return NULL;
+      }
+
+      initialised = true;
+   }
+
+   return &registry;
+}
+
+/**
+ * Apply a single option to the state
+ *
+ * @param state Pointer to state structure to update
+ * @param arg1 Option name without its leading '-' (i.e. "-quality" or "q")
+ * @param arg2 Option value, NULL if there is none
+ *
+ * @return How many arguments were used, 0 if the option is not recognised
+ */
+static int parse_option(RASPISTILL_STATE *state, const char *arg1, const char *arg2)
+{
+   const RASPICLI_REGISTRY *  registry = get_option_registry();
+   const COMMAND_LIST *       command;
+   int                        table;
+   int                        used = 0;
+
+   command = raspicli_registry_lookup(registry, arg1, &table);
+
+   // If invalid command, or we are missing a parameter, drop out
+   if (command == NULL || (command->num_parameters > 0 && arg2 == NULL)) {
+      return 0;
+   }
+
+   switch (table) {
+      case OptionTableCommon:
+         return raspicommonsettings_parse_command(&state->common_settings, command->id, arg2, application_help_message);
+
+      case OptionTablePreview:
+         return raspipreview_parse_command(&state->preview_parameters, command->id, arg2);
+
+      case OptionTableCamera:
+         return raspicamcontrol_parse_command(&state->camera_parameters, command->id, arg2);
+   }
+
+   switch (command->id) {
+      case CommandQuality:
+         if (sscanf(arg2, "%d", &state->quality) == 1) {
+            if (state->quality > 100) {
+               state->quality = 100;
+            }
+            used = 2;
+         }
+         break;
+
+      case CommandTimeout:
+         if (sscanf(arg2, "%d", &state->timeout) == 1) {
+            used = 2;
+         }
+         break;
+
+      case CommandRestartInterval:
+         if (sscanf(arg2, "%d", &state->restart_interval) == 1) {
+            used = 2;
+         }
+         break;
+
+      case CommandSettleReports:
+         if (sscanf(arg2, "%d", &state->settle_reports) == 1 && state->settle_reports >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandSettleTolerance:
+         if (sscanf(arg2, "%d", &state->settle_tolerance) == 1 && state->settle_tolerance >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandFrames:
+         if (sscanf(arg2, "%d", &state->frames) == 1 && state->frames > 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandTimelapse:
+         if (sscanf(arg2, "%d", &state->timelapse) == 1 && state->timelapse >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandExposureLock:
+         state->exposure_lock = 1;
+         used = 1;
+         break;
+
+      case CommandRemeterFrames:
+         if (sscanf(arg2, "%d", &state->remeter_frames) == 1 && state->remeter_frames >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandRemeterDrift:
+         if (sscanf(arg2, "%d", &state->remeter_drift) == 1 && state->remeter_drift >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandShardFiles:
+         if (sscanf(arg2, "%d", &state->shard_files) == 1 && state->shard_files >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandShardSize:
+         if (sscanf(arg2, "%d", &state->shard_megabytes) == 1 && state->shard_megabytes >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandMinFree:
+         if (sscanf(arg2, "%d", &state->min_free_megabytes) == 1 && state->min_free_megabytes >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandQuota:
+         if (sscanf(arg2, "%d", &state->quota_megabytes) == 1 && state->quota_megabytes >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandRetentionIndex:
+         state->retention_index = arg2;
+         used = 2;
+         break;
+
+      case CommandPreallocate:
+         state->preallocate = 1;
+         used = 1;
+         break;
+
+      case CommandSync:
+         state->sync_mode = SyncPolicy::parseMode(arg2);
+
+         if (state->sync_mode >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandSyncFrames:
+         if (sscanf(arg2, "%d", &state->sync_frames) == 1 && state->sync_frames > 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandSyncTime:
+         if (sscanf(arg2, "%d", &state->sync_ms) == 1 && state->sync_ms >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandContainer:
+         if (sscanf(arg2, "%d", &state->segment_megabytes) == 1 && state->segment_megabytes >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandFrameIndex:
+         state->frame_index_file = arg2;
+         used = 2;
+         break;
+
+      case CommandStream:
+         state->stream_spec = arg2;
+         used = 2;
+         break;
+
+      case CommandFrameRing:
+         state->frame_ring_socket = arg2;
+         used = 2;
+         break;
+
+      case CommandFrameRingSlots:
+         if (sscanf(arg2, "%d", &state->frame_ring_slots) == 1 && state->frame_ring_slots >= 2) {
+            used = 2;
+         }
+         break;
+
+      case CommandSignal:
+         state->signal_trigger = 1;
+         used = 1;
+         break;
+
+      case CommandTrigger:
+         state->trigger_spec = arg2;
+         used = 2;
+         break;
+
+      case CommandRealtimePriority:
+         if (sscanf(arg2, "%d", &state->realtime_priority) == 1 && state->realtime_priority >= 1 &&
+               state->realtime_priority <= THREAD_POLICY_MAX_PRIORITY) {
+            used = 2;
+         }
+         break;
+
+      case CommandCaptureCpus:
+         state->capture_cpus = arg2;
+         used = 2;
+         break;
+
+      case CommandBackgroundCpus:
+         state->background_cpus = arg2;
+         used = 2;
+         break;
+
+      case CommandDualCamera:
+         if (sscanf(arg2, "%d", &state->second_camera) == 1 && state->second_camera >= 0) {
+            used = 2;
+         }
+         break;
+
+      case CommandEncoding:
+      {
+         int encoding = raspicli_map_xref(arg2, encoding_xref, encoding_xref_size);
+
+         if (encoding != -1) {
+            state->encoding = encoding;
+            used = 2;
+         }
+         break;
+      }
+
+      case CommandSplitStereo:
+         state->split_stereo = 1;
+         used = 1;
+         break;
+
+      case CommandBracket:
+         state->bracket_spec = arg2;
+         used = 2;
+         break;
+
+      case CommandFuse:
+         state->fuse = 1;
+         used = 1;
+         break;
+
+      case CommandDaemon:
+         state->control_socket = arg2;
+         used = 2;
+         break;
+
+      case CommandPresetFile:
+         state->preset_file = arg2;
+         used = 2;
+         break;
+
+      case CommandPreset:
+         state->preset_name = arg2;
+         used = 2;
+         break;
+
+      case CommandMetadata:
+      {
+         int format = FrameMetadata::parseFormat(arg2);
+
+         if (format >= 0) {
+            state->metadata_format = format;
+            used = 2;
+         }
+         break;
+      }
+   }
+
+   return used;
+}
+
+/**
+ * Parse the incoming command line and put resulting parameters in to the state
+ *
+ * @param argc Number of arguments in command line
+ * @param argv Array of pointers to strings from command line
+ * @param state Pointer to state structure to assign any discovered parameters to
+ *
+ * @return 0 if all OK, non-zero if the command line is invalid
+ */
+static int parse_cmdline(int argc, char **argv, RASPISTILL_STATE *state)
+{
+   Logger & log = Logger::getInstance();
+
+   for (int i = 1; i < argc; i++) {
+      const char *   arg2 = (i + 1 < argc) ? argv[i + 1] : NULL;
+      int            used;
+
+      if (argv[i][0] != '-') {
+         // A bare argument is the output filename, replacing any given before
+         free(state->common_settings.filename);
+         state->common_settings.filename = strdup(argv[i]);
+         continue;
+      }
+
+      used = parse_option(state, &argv[i][1], arg2);
+
+      if (used == 0) {
+         log.logError("Invalid command line option (%s)", argv[i]);
+         return 1;
+      }
+
+      i += used - 1;
+   }
+
+   return 0;
+}
+
+/**
+ * Read back the parameters the camera holds, if any have been changed since
+ * they were last read
+ *
+ * Done as parameters are applied, so a frame's metadata only takes a copy.
+ *
+ * @param camera Pointer to the camera component
+ * @param state Pointer to state holding the cache of parameters
+ */
+static void read_back_parameters(MMAL_COMPONENT_T *camera, RASPISTILL_STATE *state)
+{
+   RASPICAM_CAMERA_PARAMETERS params;
+
+   if (raspicamcontrol_get_cached_parameters(camera, &state->parameter_cache, &params)) {
+      Logger::getInstance().logError("Failed to read back the camera parameters");
+   }
+}
+
+/**
+ * The parameters last read back from the camera
+ *
+ * @param state Pointer to state holding the cache of parameters
+ *
+ * @return The parameters, NULL if they have changed since they were read back
+ */
+static const RASPICAM_CAMERA_PARAMETERS * get_read_back_parameters(RASPISTILL_STATE *state)
+{
+   return state->parameter_cache.readback_valid ? &state->parameter_cache.readback : NULL;
+}
+
+/**
+ * Push the current camera parameters, sending only those that have changed
+ *
+ * @param camera Pointer to the camera component
+ * @param state Pointer to state holding the parameters and the cache of those already sent
+ *
+ * @return 0 if successful, non-zero otherwise
+ */
+static int apply_camera_parameters(MMAL_COMPONENT_T *camera, RASPISTILL_STATE *state)
+{
+   RASPICAM_PARAMETER_CACHE * cache = &state->parameter_cache;
+   unsigned int               sent = cache->sent;
+   unsigned int               skipped = cache->skipped;
+   int                        result;
+
+   Logger & log = Logger::getInstance();
+
+   result = raspicamcontrol_apply_parameters(camera, cache, &state->camera_parameters);
+
+   if (result) {
+      log.logError("Failed to set camera parameters");
+   }
+
+   log.logDebug(
+         "MMAL: Sent %u camera parameters, skipped %u unchanged (%u skipped in total)",
+         cache->sent - sent,
+         cache->skipped - skipped,
+         cache->skipped);
+
+   // The annotation is left out of the cache while the updater owns it
+   if (state->annotate_updater) {
+      state->annotate_updater->update(&state->camera_parameters);
+   }
+
+   read_back_parameters(camera, state);
+
+   return result;
+}
+
+/**
+ * Switch the camera to a named preset
+ *
+ * The preset replaces the camera parameters wholesale, but only the
+ * parameters that differ from what the camera already holds are sent.
+ * Used for -preset before the camera exists, and by the daemon's PRESET
+ * request on the running camera.
+ *
+ * @param state Pointer to state holding the loaded presets
+ * @param name Name of the preset
+ *
+ * @return 0 if successful, non-zero if the preset is unknown or could not be applied
+ */
+static int select_preset(RASPISTILL_STATE *state, const char *name)
+{
+   const RASPICAM_CAMERA_PARAMETERS *  params = NULL;
+   int                                 settings = state->camera_parameters.settings;
+
+   Logger & log = Logger::getInstance();
+
+   if (state->presets) {
+      params = state->presets->find(name);
+   }
+
+   if (params == NULL) {
+      log.logError("Unknown preset %s", name);
+      return 1;
+   }
+
+   memcpy(&state->camera_parameters, params, sizeof(state->camera_parameters));
+
+   // Presets were loaded before the settings reports were turned on
+   state->camera_parameters.settings = settings;
+
+   log.logDebug("Selected preset %s", name);
+
+   // Before the camera exists the parameters are simply sent when it is created
+   if (state->camera_component) {
+      return apply_camera_parameters(state->camera_component, state);
+   }
+
+   return 0;
+}
+
+/**
+ * Put the MMAL callback thread calling us under the capture thread policy,
+ * the first time it calls
+ *
+ * @param name Name of the thread for the log
+ */
+static void apply_callback_policy(const char *name)
+{
+   static __thread int applied = 0;
+
+   if (!applied) {
+      ThreadPolicy::getInstance().applyCapture(name);
+      applied = 1;
+   }
+}
+
+/**
+ * Settings reports and other camera events, handled as the default callback
+ * does once the callback thread has its policy
+ *
+ * @param port Camera control port
+ * @param buffer Event
+ */
+static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   apply_callback_policy("camera control callback");
+
+   default_camera_control_callback(port, buffer);
 }
 
 /**
@@ -174,6 +979,19 @@ static MMAL_STATUS_T create_camera_component(RASPISTILL_STATE *state)
          throw rpi_error("Camera doesn't have output ports", __FILE__, __LINE__);
       }
 
+      // Both sensors of a Compute Module pair, packed into each frame by the firmware
+      if (state->camera_parameters.stereo_mode.mode != MMAL_STEREOSCOPIC_MODE_NONE) {
+         if (raspicamcontrol_set_stereo_mode(camera->output[MMAL_CAMERA_PREVIEW_PORT], &state->camera_parameters.stereo_mode) ||
+               raspicamcontrol_set_stereo_mode(camera->output[MMAL_CAMERA_VIDEO_PORT], &state->camera_parameters.stereo_mode) ||
+               raspicamcontrol_set_stereo_mode(camera->output[MMAL_CAMERA_CAPTURE_PORT], &state->camera_parameters.stereo_mode)) {
+            status = MMAL_EINVAL;
+            log.logError("Could not set stereoscopic mode");
+            throw rpi_error("Could not set stereoscopic mode", __FILE__, __LINE__);
+         }
+
+         log.logDebug("MMAL: Set stereoscopic mode");
+      }
+
       status = mmal_port_parameter_set_uint32(camera->control, MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG, state->common_settings.sensor_mode);
 
       if (status != MMAL_SUCCESS) {
@@ -183,8 +1001,6 @@ static MMAL_STATUS_T create_camera_component(RASPISTILL_STATE *state)
 
       log.logDebug("MMAL: Set sensor mode");
 
-      preview_port = camera->output[MMAL_CAMERA_PREVIEW_PORT];
-      video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
       still_port = camera->output[MMAL_CAMERA_CAPTURE_PORT];
 
       if (still_port == NULL) {
@@ -192,8 +1008,11 @@ static MMAL_STATUS_T create_camera_component(RASPISTILL_STATE *state)
          throw rpi_error("Failed to get still capture port", __FILE__, __LINE__);
       }
 
+      // Settings reports from the camera land in our slot
+      camera->control->userdata = (struct MMAL_PORT_USERDATA_T *)&state->settings_slot;
+
       // Enable the camera, and tell it its control callback function
-      status = mmal_port_enable(camera->control, default_camera_control_callback);
+      status = mmal_port_enable(camera->control, camera_control_callback);
 
       if (status != MMAL_SUCCESS) {
          log.logError("Unable to enable control port : error %d", status);
@@ -216,7 +1035,8 @@ static MMAL_STATUS_T create_camera_component(RASPISTILL_STATE *state)
             .num_preview_video_frames = 3,
             .stills_capture_circular_buffer_height = 0,
             .fast_preview_resume = 0,
-            .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
+            // Timestamps from both cameras of a pair have to be on the same clock to compare
+            .use_stc_timestamp = (state->second_camera >= 0) ? MMAL_PARAM_TIMESTAMP_MODE_RAW_STC : MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
          };
 
          mmal_port_parameter_set(camera->control, &cam_config.hdr);
@@ -225,7 +1045,10 @@ static MMAL_STATUS_T create_camera_component(RASPISTILL_STATE *state)
       }
 
       raspicamcontrol_dump_parameters(&state->camera_parameters);
-      raspicamcontrol_set_all_parameters(camera, &state->camera_parameters);
+
+      // A new component knows none of our settings
+      raspicamcontrol_invalidate_parameter_cache(&state->parameter_cache);
+      apply_camera_parameters(camera, state);
 
       // Now set up the port formats
 
@@ -244,8 +1067,8 @@ static MMAL_STATUS_T create_camera_component(RASPISTILL_STATE *state)
          mmal_port_parameter_set(still_port, &fps_range.hdr);
       }
 
-      // Set our stills format on the stills (for encoder) port
-      format->encoding = MMAL_ENCODING_OPAQUE;
+      // Set our stills format on the stills (for encoder) port, raw frames come to us instead
+      format->encoding = (state->encoding == MMAL_ENCODING_I420) ? MMAL_ENCODING_I420 : MMAL_ENCODING_OPAQUE;
       format->es->video.width = VCOS_ALIGN_UP(state->common_settings.width, 32);
       format->es->video.height = VCOS_ALIGN_UP(state->common_settings.height, 16);
       format->es->video.crop.x = 0;
@@ -318,6 +1141,28 @@ static MMAL_STATUS_T create_encoder_component(RASPISTILL_STATE *state)
 
    Logger & log = Logger::getInstance();
 
+   // Raw frames come straight off the camera's still port, there is nothing to encode
+   if (state->encoding == MMAL_ENCODING_I420) {
+      MMAL_PORT_T *still_port = state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
+
+      still_port->buffer_size = still_port->buffer_size_recommended;
+
+      if (still_port->buffer_size < still_port->buffer_size_min)
+         still_port->buffer_size = still_port->buffer_size_min;
+
+      pool = mmal_port_pool_create(still_port, still_port->buffer_num, still_port->buffer_size);
+
+      if (!pool) {
+         log.logError("Failed to create buffer header pool for camera still port %s", still_port->name);
+         return MMAL_ENOMEM;
+      }
+
+      state->encoder_pool = pool;
+      state->frame_port = still_port;
+
+      return MMAL_SUCCESS;
+   }
+
    try {
       status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &encoder);
 
@@ -408,6 +1253,7 @@ static MMAL_STATUS_T create_encoder_component(RASPISTILL_STATE *state)
 
       state->encoder_pool = pool;
       state->encoder_component = encoder;
+      state->frame_port = encoder_output;
    }
    catch (rpi_error & e) {
       if (encoder)
@@ -427,7 +1273,8 @@ static void destroy_encoder_component(RASPISTILL_STATE *state)
 {
    // Get rid of any port buffers first
    if (state->encoder_pool) {
-      mmal_port_pool_destroy(state->encoder_component->output[0], state->encoder_pool);
+      mmal_port_pool_destroy(state->frame_port, state->encoder_pool);
+      state->encoder_pool = NULL;
    }
 
    if (state->encoder_component) {
@@ -436,6 +1283,41 @@ static void destroy_encoder_component(RASPISTILL_STATE *state)
    }
 }
 
+/**
+ * Keep data encoded before the output of a capture started early is ready
+ *
+ * @param pData Encoder callback data holding the buffer, its output lock held
+ * @param data Encoded data
+ * @param length Bytes of data
+ *
+ * @return Bytes kept, 0 if there was no memory for them
+ */
+static size_t hold_data(PORT_USERDATA *pData, const uint8_t *data, size_t length)
+{
+   if (pData->held_bytes + length > pData->held_capacity) {
+      size_t capacity = pData->held_capacity * 2;
+      uint8_t *held;
+
+      if (capacity < pData->held_bytes + length) {
+         capacity = pData->held_bytes + length;
+      }
+
+      held = (uint8_t *)realloc(pData->held, capacity);
+
+      if (held == NULL) {
+         return 0;
+      }
+
+      pData->held = held;
+      pData->held_capacity = capacity;
+   }
+
+   memcpy(&pData->held[pData->held_bytes], data, length);
+   pData->held_bytes += length;
+
+   return length;
+}
+
 /**
  *  buffer header callback function for encoder
  *
@@ -450,6 +1332,8 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 
    Logger & log = Logger::getInstance();
 
+   apply_callback_policy("encoder callback");
+
    // We pass our file handle and other stuff in via the userdata field.
 
    PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
@@ -457,14 +1341,40 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
    if (pData) {
       int bytes_written = buffer->length;
 
-      if (buffer->length && pData->file_handle) {
+      if (pData->capturing && pData->frame_pts == MMAL_TIME_UNKNOWN) {
+         pData->frame_pts = buffer->pts;
+      }
+
+      if (buffer->length && pData->capturing) {
          mmal_buffer_header_mem_lock(buffer);
 
-         bytes_written = fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+         pthread_mutex_lock(&pData->output_lock);
+
+         if (pData->splitter) {
+            bytes_written = pData->splitter->addData(buffer->data, buffer->length) ? buffer->length : 0;
+         }
+         else if (pData->file_handle) {
+            bytes_written = fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+         }
+         else if (pData->holding) {
+            bytes_written = hold_data(pData, buffer->data, buffer->length);
+         }
+
+         pthread_mutex_unlock(&pData->output_lock);
+
+         if (pData->pstate->stream) {
+            pData->pstate->stream->addData(buffer->data, buffer->length);
+         }
+
+         if (pData->pstate->frame_ring) {
+            pData->pstate->frame_ring->addData(buffer->data, buffer->length);
+         }
 
          mmal_buffer_header_mem_unlock(buffer);
       }
 
+      pData->frame_bytes += buffer->length;
+
       // We need to check we wrote what we wanted - it's possible we have run out of storage.
       if (bytes_written != buffer->length) {
          log.logError("Did not write enough bytes");
@@ -475,6 +1385,14 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
       if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)) {
          complete = 1;
       }
+
+      // Only whole frames go to the viewers
+      if (complete && pData->capturing && pData->pstate->stream) {
+         pData->pstate->stream->endFrame(
+               (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) &&
+               !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) &&
+               bytes_written == (int)buffer->length);
+      }
    }
    else {
       log.logError("Received a encoder buffer callback with no state");
@@ -504,23 +1422,2453 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
    }
 }
 
-void capture(RASPISTILL_STATE * state)
+/**
+ * Read CLOCK_MONOTONIC
+ *
+ * @return Current time, us
+ */
+static int64_t monotonic_us()
 {
+   struct timespec   ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
 
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-int main(int argc, char **argv)
+/**
+ * Sleep for the settle poll interval, or until the deadline if that is sooner
+ *
+ * @param deadline CLOCK_MONOTONIC time to wake by, us
+ */
+static void sleep_until_poll(int64_t deadline)
+{
+   int64_t remaining = (deadline - monotonic_us() + 999) / 1000;
+
+   if (remaining > 0) {
+      vcos_sleep(remaining < SETTLE_POLL_INTERVAL ? (uint32_t)remaining : SETTLE_POLL_INTERVAL);
+   }
+}
+
+/**
+ * Wait for one camera's AE/AWB to settle
+ *
+ * @param state Pointer to state holding the limits
+ * @param slot Settings reported by the camera
+ * @param timeout Longest to wait, ms
+ *
+ * @return Time waited in milliseconds
+ */
+static int wait_for_camera_settle(RASPISTILL_STATE *state, const RASPICAM_SETTINGS_SLOT *slot, int timeout)
+{
+   RASPICAM_CONVERGENCE       convergence;
+   RASPICAM_CAMERA_SETTINGS   settings;
+   int64_t                    started = monotonic_us();
+   int64_t                    deadline = started + (int64_t)timeout * 1000;
+   int                        waited;
+
+   Logger & log = Logger::getInstance();
+
+   raspicamcontrol_init_convergence(&convergence, state->settle_tolerance / 100.0f, state->settle_reports);
+
+   // Reports arrive once per preview frame, so polling faster gains nothing
+   while (monotonic_us() < deadline) {
+      if (raspicamcontrol_get_camera_settings(slot, &settings) == 0 &&
+            raspicamcontrol_update_convergence(&convergence, &settings)) {
+         waited = (int)((monotonic_us() - started) / 1000);
+
+         log.logDebug(
+               "Exposure settled after %d ms: exposure %u us, gain %.2f/%.2f",
+               waited,
+               settings.exposure,
+               settings.analog_gain,
+               settings.digital_gain);
+
+         return waited;
+      }
+
+      sleep_until_poll(deadline);
+   }
+
+   waited = (int)((monotonic_us() - started) / 1000);
+
+   log.logDebug("Exposure not settled after %d ms, capturing anyway", waited);
+
+   return waited;
+}
+
+/**
+ * Wait for the AE/AWB to settle before capturing
+ *
+ * Returns as soon as the settings reports have been stable for the required
+ * number of reports, the timeout is only an upper bound. With settling
+ * disabled this is the old fixed wait. Both cameras of a pair have to
+ * settle, within the one timeout.
+ *
+ * @param state Pointer to state holding the settings slot and limits
+ *
+ * @return Time waited in milliseconds
+ */
+static int wait_for_settle(RASPISTILL_STATE *state)
+{
+   int waited;
+
+   if (state->settle_reports == 0) {
+      vcos_sleep(state->timeout);
+      return state->timeout;
+   }
+
+   waited = wait_for_camera_settle(state, &state->settings_slot, state->timeout);
+
+   // The second camera has been metering all the while, it is usually settled already
+   if (state->second) {
+      waited += wait_for_camera_settle(state, &state->second->state->settings_slot, state->timeout - waited);
+   }
+
+   return waited;
+}
+
+/**
+ * Lock the settled exposure, gains and AWB so the rest of the series skips
+ * metering. Goes through the parameter cache, so only the values that
+ * differ from what the camera holds are sent.
+ *
+ * @param state Pointer to state holding the settings slot and the camera parameters
+ * @param lock Exposure lock to fill in
+ *
+ * @return 0 if locked, non-zero if there was nothing to lock to
+ */
+static int lock_exposure(RASPISTILL_STATE *state, EXPOSURE_LOCK *lock)
+{
+   RASPICAM_CAMERA_SETTINGS   settings;
+
+   Logger & log = Logger::getInstance();
+
+   if (raspicamcontrol_get_camera_settings(&state->settings_slot, &settings)) {
+      log.logError("No camera settings reported, cannot lock exposure");
+      return 1;
+   }
+
+   memcpy(&lock->parameters, &state->camera_parameters, sizeof(lock->parameters));
+
+   lock->parameters.shutter_speed = settings.exposure;
+   lock->parameters.analog_gain = settings.analog_gain;
+   lock->parameters.digital_gain = settings.digital_gain;
+   lock->parameters.awbMode = MMAL_PARAM_AWBMODE_OFF;
+   lock->parameters.awb_gains_r = settings.awb_red_gain;
+   lock->parameters.awb_gains_b = settings.awb_blue_gain;
+
+   if (raspicamcontrol_apply_parameters(state->camera_component, &state->parameter_cache, &lock->parameters)) {
+      log.logError("Failed to lock exposure");
+      return 1;
+   }
+
+   read_back_parameters(state->camera_component, state);
+
+   lock->locked = 1;
+   lock->frames = 0;
+   lock->reference_bytes = 0;
+
+   log.logDebug(
+         "Locked exposure %u us, gain %.2f/%.2f, AWB %.2f/%.2f",
+         settings.exposure,
+         settings.analog_gain,
+         settings.digital_gain,
+         settings.awb_red_gain,
+         settings.awb_blue_gain);
+
+   return 0;
+}
+
+/**
+ * Return the camera to automatic exposure and AWB so the next frame re-meters
+ *
+ * @param state Pointer to state holding the camera parameters
+ * @param lock Exposure lock to release
+ */
+static void unlock_exposure(RASPISTILL_STATE *state, EXPOSURE_LOCK *lock)
+{
+   lock->locked = 0;
+
+   apply_camera_parameters(state->camera_component, state);
+}
+
+/**
+ * Decide whether a locked series should re-meter after a frame
+ *
+ * With the exposure fixed, the size of the encoded frame tracks scene
+ * brightness closely enough to notice the light changing, without having to
+ * look at the image itself.
+ *
+ * @param state Pointer to state holding the re-meter limits
+ * @param lock Exposure lock to check
+ * @param bytes Size of the frame just captured
+ *
+ * @return true if the exposure should be re-metered
+ */
+static bool should_remeter(RASPISTILL_STATE *state, EXPOSURE_LOCK *lock, size_t bytes)
+{
+   lock->frames++;
+
+   if (state->remeter_frames && lock->frames >= state->remeter_frames) {
+      return true;
+   }
+
+   if (lock->reference_bytes == 0) {
+      lock->reference_bytes = bytes;
+   }
+   else if (state->remeter_drift) {
+      size_t drift = (bytes > lock->reference_bytes) ? bytes - lock->reference_bytes : lock->reference_bytes - bytes;
+
+      if (drift * 100 > lock->reference_bytes * state->remeter_drift) {
+         Logger::getInstance().logDebug(
+                     "Frame size drifted from %u to %u bytes, re-metering",
+                     (unsigned int)lock->reference_bytes,
+                     (unsigned int)bytes);
+         return true;
+      }
+   }
+
+   return false;
+}
+
+/**
+ * Build the filename for a frame of the series from the compiled template
+ *
+ * @param state Pointer to state holding the filename template
+ * @param frame Frame number
+ * @param buffer Buffer to receive the filename
+ * @param bufferLen Size of the buffer
+ *
+ * @return 0 if successful, non-zero if the name did not fit
+ */
+static int get_frame_filename(RASPISTILL_STATE *state, int frame, char *buffer, size_t bufferLen)
+{
+   FilenameTemplate *   name = state->filename_template;
+   FILENAME_FIELDS      fields;
+
+   fields.time = time(NULL);
+   fields.sequence = frame;
+   fields.camera = state->common_settings.cameraNum;
+   fields.bracket = state->bracket_index;
+   fields.latitude = NAN;
+   fields.longitude = NAN;
+
+   if (name->isGpsBased() && state->common_settings.gps) {
+      struct gps_data_t *gpsdata = raspi_gps_lock();
+
+      if (gpsdata->online && gpsdata->fix.mode >= MODE_2D && (gpsdata->set & LATLON_SET)) {
+         fields.latitude = gpsdata->fix.latitude;
+         fields.longitude = gpsdata->fix.longitude;
+      }
+
+      raspi_gps_unlock();
+   }
+
+   if (name->render(buffer, bufferLen, &fields) >= (int)bufferLen) {
+      Logger::getInstance().logError("Filename for frame %d is too long", frame);
+      return 1;
+   }
+
+   if (name->isSharded()) {
+      try {
+         name->makeDirectories(buffer);
+      }
+      catch (rpi_error & e) {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Work out where the retention index goes when not given, the fixed
+ * directory the output filename starts with
+ *
+ * @param state Pointer to state holding the output filename
+ * @param buffer Buffer to receive the index filename
+ * @param bufferLen Size of the buffer
+ */
+static void get_default_retention_index(RASPISTILL_STATE *state, char *buffer, size_t bufferLen)
+{
+   const char *filename = state->common_settings.filename;
+   size_t fixed = strcspn(filename, "%");
+   size_t dirLen = 0;
+   size_t i;
+
+   // Stop before the first component with a field in it, that may change
+   for (i = 0; i < fixed; i++) {
+      if (filename[i] == '/') {
+         dirLen = (i == 0) ? 1 : i;
+      }
+   }
+
+   if (dirLen == 0) {
+      snprintf(buffer, bufferLen, "%s", RETENTION_INDEX_NAME);
+   }
+   else if (dirLen == 1 && filename[0] == '/') {
+      snprintf(buffer, bufferLen, "/%s", RETENTION_INDEX_NAME);
+   }
+   else {
+      snprintf(buffer, bufferLen, "%.*s/%s", (int)dirLen, filename, RETENTION_INDEX_NAME);
+   }
+}
+
+/**
+ * Add a measurement to the latency figures
+ *
+ * @param stats Figures to update
+ * @param us Latency, us
+ */
+static void add_latency(LATENCY_STATS *stats, long us)
+{
+   if (stats->count == 0 || us < stats->min) {
+      stats->min = us;
+   }
+
+   if (stats->count == 0 || us > stats->max) {
+      stats->max = us;
+   }
+
+   stats->total += us;
+   stats->count++;
+}
+
+/**
+ * Log the latency figures, if there are any
+ *
+ * @param what What was measured
+ * @param stats Figures to log
+ */
+static void log_latency(const char *what, const LATENCY_STATS *stats)
+{
+   if (stats->count) {
+      Logger::getInstance().logInfo(
+            "%s: min %ld us, mean %lld us, max %ld us over %u frames",
+            what,
+            stats->min,
+            stats->total / stats->count,
+            stats->max,
+            stats->count);
+   }
+}
+
+/**
+ * Set up encoder callback data for a camera's graph
+ *
+ * @param callback_data Callback data to set up
+ * @param state State of the camera it belongs to
+ */
+static void init_callback_data(PORT_USERDATA *callback_data, RASPISTILL_STATE *state)
+{
+   VCOS_STATUS_T vcos_status;
+
+   // Null until we open our filename
+   callback_data->file_handle = NULL;
+   callback_data->splitter = NULL;
+   callback_data->capturing = 0;
+   callback_data->holding = 0;
+   callback_data->held = NULL;
+   callback_data->held_bytes = 0;
+   callback_data->held_capacity = 0;
+   callback_data->started = 0;
+   callback_data->start_status = MMAL_SUCCESS;
+   callback_data->frame_bytes = 0;
+   callback_data->frame_pts = MMAL_TIME_UNKNOWN;
+   pthread_mutex_init(&callback_data->output_lock, NULL);
+   callback_data->pstate = state;
+   vcos_status = vcos_semaphore_create(&callback_data->complete_semaphore, "RaspiStill-sem", 0);
+
+   vcos_assert(vcos_status == VCOS_SUCCESS);
+}
+
+/**
+ * Free what init_callback_data() set up
+ *
+ * @param callback_data Callback data, its port disabled
+ */
+static void free_callback_data(PORT_USERDATA *callback_data)
+{
+   vcos_semaphore_delete(&callback_data->complete_semaphore);
+   pthread_mutex_destroy(&callback_data->output_lock);
+   free(callback_data->held);
+   callback_data->held = NULL;
+}
+
+/**
+ * Enable a camera's encoder output port with our callback, and give it all
+ * the buffers in the pool. For raw frames that is the camera's still port.
+ *
+ * @param state State of the camera
+ * @param callback_data Encoder callback data for the port
+ *
+ * @return MMAL_SUCCESS if the port was enabled
+ */
+static MMAL_STATUS_T enable_encoder_output(RASPISTILL_STATE *state, PORT_USERDATA *callback_data)
+{
+   MMAL_PORT_T *     encoder_output_port = state->frame_port;
+   MMAL_STATUS_T     status;
+   int               num;
+
+   Logger & log = Logger::getInstance();
+
+   if (state->encoder_component) {
+      mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_EXIF_DISABLE, 1);
+
+      log.logDebug("Disabled exif");
+   }
+
+   // Enable the encoder output port
+   encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)callback_data;
+
+   // Enable the encoder output port and tell it its callback function
+   status = mmal_port_enable(encoder_output_port, encoder_buffer_callback);
+
+   if (status != MMAL_SUCCESS) {
+      log.logError("Failed to enable encoder output port");
+      return status;
+   }
+
+   log.logDebug("Enabled encoder output port");
+
+   // Send all the buffers to the encoder output port
+   num = mmal_queue_length(state->encoder_pool->queue);
+
+   log.logDebug("Got %d encoder queues", num);
+
+   for (int q = 0; q < num; q++) {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state->encoder_pool->queue);
+
+      if (!buffer) {
+         log.logError("Failed to get queue");
+      }
+
+      if (mmal_port_send_buffer(encoder_output_port, buffer) != MMAL_SUCCESS) {
+         log.logError("Failed to send buffer");
+      }
+   }
+
+   log.logDebug("Sent buffers to encoder output");
+
+   return MMAL_SUCCESS;
+}
+
+/**
+ * Makes the second camera's capture requests, each released by the main
+ * thread as it makes the first camera's
+ *
+ * @param arg The second camera
+ */
+static void *second_camera_thread(void *arg)
+{
+   SECOND_CAMERA *   second = (SECOND_CAMERA *)arg;
+   MMAL_PORT_T *     still_port = second->state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
+
+   ThreadPolicy::getInstance().applyCapture("second camera");
+
+   while (true) {
+      pthread_barrier_wait(&second->barrier);
+
+      if (second->quit) {
+         break;
+      }
+
+      second->request_status = mmal_port_parameter_set_boolean(still_port, MMAL_PARAMETER_CAPTURE, 1);
+      second->requested = monotonic_us();
+
+      vcos_semaphore_post(&second->requested_semaphore);
+   }
+
+   return NULL;
+}
+
+/**
+ * Take down the second camera's graph and log the skew between the two
+ *
+ * @param second Second camera, may be partly set up
+ */
+static void destroy_second_camera(SECOND_CAMERA *second)
+{
+   RASPISTILL_STATE *copy = second->state;
+
+   if (second->thread_ok) {
+      second->quit = 1;
+      pthread_barrier_wait(&second->barrier);
+      pthread_join(second->thread, NULL);
+
+      pthread_barrier_destroy(&second->barrier);
+      vcos_semaphore_delete(&second->requested_semaphore);
+   }
+
+   if (copy->encoder_component) {
+      check_disable_port(copy->encoder_component->output[0]);
+   }
+
+   if (copy->preview_connection) {
+      mmal_connection_destroy(copy->preview_connection);
+   }
+
+   if (copy->encoder_connection) {
+      mmal_connection_destroy(copy->encoder_connection);
+   }
+
+   if (copy->encoder_component) {
+      mmal_component_disable(copy->encoder_component);
+   }
+
+   if (copy->camera_component) {
+      mmal_component_disable(copy->camera_component);
+   }
+
+   destroy_encoder_component(copy);
+   destroy_camera_component(copy);
+   raspipreview_destroy(&copy->preview_parameters);
+
+   free_callback_data(&second->callback_data);
+
+   log_latency("Camera timestamp skew", &second->skew);
+   log_latency("Capture request skew", &second->request_skew);
+
+   delete copy;
+   delete second;
+}
+
+/**
+ * Build the second camera's graph, a copy of the first camera's with its
+ * own components, and start the thread that makes its capture requests.
+ * The outputs, retention, sync and frame index are shared, the stream and
+ * annotation only ever show the first camera.
+ *
+ * @param state Pointer to state control struct, its graph already built
+ *
+ * @return 0 if successful, non-zero otherwise
+ */
+static int create_second_camera(RASPISTILL_STATE *state)
+{
+   SECOND_CAMERA *      second = new SECOND_CAMERA;
+   RASPISTILL_STATE *   copy = new RASPISTILL_STATE;
+   MMAL_STATUS_T        status;
+
+   Logger & log = Logger::getInstance();
+
+   memset(second, 0, sizeof(*second));
+
+   *copy = *state;
+
+   copy->common_settings.cameraNum = state->second_camera;
+   copy->second = NULL;
+   copy->stream = NULL;
+   copy->frame_ring = NULL;
+   copy->camera_component = NULL;
+   copy->encoder_component = NULL;
+   copy->null_sink_component = NULL;
+   copy->preview_connection = NULL;
+   copy->encoder_connection = NULL;
+   copy->encoder_pool = NULL;
+   copy->frame_port = NULL;
+
+   // One preview window is enough, the second camera's goes to a null sink
+   copy->preview_parameters.wantPreview = 0;
+   copy->preview_parameters.preview_component = NULL;
+
+   raspicamcontrol_init_settings_slot(&copy->settings_slot);
+
+   second->state = copy;
+
+   init_callback_data(&second->callback_data, copy);
+
+   if (raspipreview_create(&copy->preview_parameters) != MMAL_SUCCESS ||
+         create_camera_component(copy) != MMAL_SUCCESS ||
+         create_encoder_component(copy) != MMAL_SUCCESS) {
+      log.logError("Failed to create the components for camera %d", state->second_camera);
+      destroy_second_camera(second);
+      return 1;
+   }
+
+   status = connect_ports(
+               copy->camera_component->output[MMAL_CAMERA_PREVIEW_PORT],
+               copy->preview_parameters.preview_component->input[0],
+               &copy->preview_connection);
+
+   if (status == MMAL_SUCCESS) {
+      status = connect_ports(
+                  copy->camera_component->output[MMAL_CAMERA_CAPTURE_PORT],
+                  copy->encoder_component->input[0],
+                  &copy->encoder_connection);
+   }
+
+   if (status == MMAL_SUCCESS) {
+      status = enable_encoder_output(copy, &second->callback_data);
+   }
+
+   if (status != MMAL_SUCCESS) {
+      log.logError("Failed to connect camera %d", state->second_camera);
+      destroy_second_camera(second);
+      return 1;
+   }
+
+   pthread_barrier_init(&second->barrier, NULL, 2);
+   vcos_semaphore_create(&second->requested_semaphore, "RaspiStill-second", 0);
+
+   if (pthread_create(&second->thread, NULL, second_camera_thread, second) != 0) {
+      log.logError("Failed to start the second camera thread");
+      pthread_barrier_destroy(&second->barrier);
+      vcos_semaphore_delete(&second->requested_semaphore);
+      destroy_second_camera(second);
+      return 1;
+   }
+
+   second->thread_ok = 1;
+
+   state->second = second;
+
+   log.logDebug("Set up camera %d alongside camera %d", state->second_camera, state->common_settings.cameraNum);
+
+   return 0;
+}
+
+/**
+ * Release the second camera's capture request, to be made as the first
+ * camera's is
+ *
+ * @param second Second camera
+ * @param holding Keep its data until it has an output, the capture was started on a trigger
+ */
+static void request_second_capture(SECOND_CAMERA *second, int holding)
+{
+   PORT_USERDATA *data = &second->callback_data;
+
+   data->frame_bytes = 0;
+   data->frame_pts = MMAL_TIME_UNKNOWN;
+   data->file_handle = holding ? NULL : second->output_file;
+   data->held_bytes = 0;
+   data->holding = holding;
+   data->capturing = 1;
+
+   pthread_barrier_wait(&second->barrier);
+}
+
+/**
+ * Wait for the second camera's frame, and add the skew between the two
+ * cameras' frames to the figures
+ *
+ * @param second Second camera
+ * @param first Encoder callback data of the first camera, its frame complete
+ * @param output_failed Writing out the held data failed
+ *
+ * @return MMAL_SUCCESS if the frame was captured
+ */
+static MMAL_STATUS_T finish_second_capture(SECOND_CAMERA *second, PORT_USERDATA *first, int output_failed)
+{
+   PORT_USERDATA *   data = &second->callback_data;
+   MMAL_STATUS_T     status;
+
+   Logger & log = Logger::getInstance();
+
+   vcos_semaphore_wait(&second->requested_semaphore);
+
+   status = second->request_status;
+
+   if (status == MMAL_SUCCESS) {
+      vcos_semaphore_wait(&data->complete_semaphore);
+
+      if (output_failed) {
+         status = MMAL_ENOSPC;
+      }
+   }
+   else {
+      log.logError("Failed to start capture on camera %d", second->state->common_settings.cameraNum);
+   }
+
+   data->file_handle = NULL;
+   data->holding = 0;
+   data->capturing = 0;
+
+   add_latency(&second->request_skew, labs((long)(second->requested - second->first_requested)));
+
+   if (status == MMAL_SUCCESS && data->frame_pts != MMAL_TIME_UNKNOWN && first->frame_pts != MMAL_TIME_UNKNOWN) {
+      long skew = (long)(data->frame_pts - first->frame_pts);
+
+      add_latency(&second->skew, labs(skew));
+
+      log.logDebug(
+            "Camera %d frame %ld us after camera %d's, requests %ld us apart",
+            second->state->common_settings.cameraNum,
+            skew,
+            first->pstate->common_settings.cameraNum,
+            (long)(second->requested - second->first_requested));
+   }
+
+   return status;
+}
+
+/**
+ * Tell the camera to capture, without waiting for the frame
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param output_file File the encoder callback writes the frame to, NULL for none
+ *
+ * @return MMAL_SUCCESS if the capture was started
+ */
+static MMAL_STATUS_T start_capture(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, FILE *output_file)
+{
+   MMAL_PORT_T *     camera_still_port = state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
+   MMAL_STATUS_T     status;
+
+   callback_data->frame_bytes = 0;
+   callback_data->frame_pts = MMAL_TIME_UNKNOWN;
+   callback_data->file_handle = output_file;
+   callback_data->held_bytes = 0;
+
+   if (state->frame_ring) {
+      state->frame_ring->beginFrame();
+   }
+
+   callback_data->capturing = 1;
+
+   // The second camera's request is made on its own thread at the same moment
+   if (state->second) {
+      request_second_capture(state->second, callback_data->holding);
+   }
+
+   status = mmal_port_parameter_set_boolean(camera_still_port, MMAL_PARAMETER_CAPTURE, 1);
+
+   if (state->second) {
+      state->second->first_requested = monotonic_us();
+   }
+
+   if (status != MMAL_SUCCESS) {
+      Logger::getInstance().logError("Failed to start capture");
+   }
+
+   return status;
+}
+
+/**
+ * Start a capture straight away on a trigger, before its output is ready
+ *
+ * Whatever is encoded before trigger_capture() is given the output is held
+ * in memory, opening the file overlaps with the exposure rather than
+ * delaying it.
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ *
+ * @return MMAL_SUCCESS if the capture was started
+ */
+static MMAL_STATUS_T start_capture_early(RASPISTILL_STATE *state, PORT_USERDATA *callback_data)
+{
+   callback_data->holding = 1;
+   callback_data->started = 1;
+   callback_data->start_status = start_capture(state, callback_data, NULL);
+
+   return callback_data->start_status;
+}
+
+/**
+ * Give a capture started early its output, writing out what was held
+ *
+ * @param callback_data Encoder callback data
+ * @param output_file File for the rest of the frame, NULL to only publish it
+ *
+ * @return 0 if successful, non-zero if the held data could not be written
+ */
+static int set_capture_output(PORT_USERDATA *callback_data, FILE *output_file)
+{
+   int result = 0;
+
+   pthread_mutex_lock(&callback_data->output_lock);
+
+   if (output_file && callback_data->held_bytes &&
+         fwrite(callback_data->held, 1, callback_data->held_bytes, output_file) != callback_data->held_bytes) {
+      Logger::getInstance().logError("Did not write enough bytes");
+      result = 1;
+   }
+
+   callback_data->file_handle = output_file;
+   callback_data->holding = 0;
+   callback_data->held_bytes = 0;
+
+   pthread_mutex_unlock(&callback_data->output_lock);
+
+   return result;
+}
+
+/**
+ * Trigger a capture into the given file and wait for the encoder to finish
+ *
+ * If the capture was already started on a trigger it is given the file
+ * and waited for. With a second camera, its frame is waited for too.
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param output_file File the encoder callback writes the frame to, NULL to only publish it
+ *
+ * @return MMAL_SUCCESS if the capture was started
+ */
+static MMAL_STATUS_T trigger_capture(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, FILE *output_file)
+{
+   MMAL_STATUS_T     status;
+   int               second_failed = 0;
+
+   Logger & log = Logger::getInstance();
+
+   if (callback_data->started) {
+      status = callback_data->start_status;
+
+      callback_data->started = 0;
+
+      if (state->second) {
+         second_failed = set_capture_output(&state->second->callback_data, state->second->output_file);
+      }
+
+      if (set_capture_output(callback_data, output_file) && status == MMAL_SUCCESS) {
+         // Still wait, the callback must be done with the frame before the next
+         vcos_semaphore_wait(&callback_data->complete_semaphore);
+         status = MMAL_ENOSPC;
+      }
+   }
+   else {
+      log.logDebug("Initiating capture");
+
+      status = start_capture(state, callback_data, output_file);
+   }
+
+   if (status == MMAL_SUCCESS) {
+      // Wait for capture to complete
+      // For some reason using vcos_semaphore_wait_timeout sometimes returns immediately with bad parameter error
+      // even though it appears to be all correct, so reverting to untimed one until figure out why its erratic
+      log.logDebug("Waiting on semaphore");
+
+      vcos_semaphore_wait(&callback_data->complete_semaphore);
+   }
+
+   if (state->second) {
+      MMAL_STATUS_T second_status = finish_second_capture(state->second, callback_data, second_failed);
+
+      if (status == MMAL_SUCCESS) {
+         status = second_status;
+      }
+   }
+
+   log.logDebug("Capture complete");
+
+   // Ensure we don't die if get callback with no open file
+   callback_data->file_handle = NULL;
+   callback_data->holding = 0;
+   callback_data->capturing = 0;
+
+   return status;
+}
+
+/**
+ * Start the next segment file
+ *
+ * @param state Pointer to state control struct
+ *
+ * @return 0 if successful, non-zero otherwise
+ */
+static int open_segment(RASPISTILL_STATE *state)
+{
+   char              filename[FILENAME_MAX];
+
+   Logger & log = Logger::getInstance();
+
+   if (get_frame_filename(state, state->segment_num, filename, sizeof(filename))) {
+      return 1;
+   }
+
+   try {
+      // Numbered on from the segments of earlier runs, rather than over them
+      while (state->filename_template->isSequenced() && state->output->exists(filename)) {
+         state->segment_num++;
+
+         if (get_frame_filename(state, state->segment_num, filename, sizeof(filename))) {
+            return 1;
+         }
+      }
+
+      state->segment_file = state->output->open(filename, state->segment_path, sizeof(state->segment_path), false);
+   }
+   catch (rpi_error & e) {
+      log.logError("Failed to open segment %s", filename);
+      return 1;
+   }
+
+   try {
+      state->segments->begin(state->segment_file, state->segment_num, state->encoding);
+   }
+   catch (rpi_error & e) {
+      state->output->close(state->segment_file, 0);
+      state->segment_file = NULL;
+      return 1;
+   }
+
+   log.logDebug("Opened segment %s", state->segment_path);
+
+   return 0;
+}
+
+/**
+ * Finish the open segment, if there is one
+ *
+ * @param state Pointer to state control struct
+ */
+static void close_segment(RASPISTILL_STATE *state)
+{
+   uint64_t          bytes;
+
+   if (!state->segments || !state->segments->isOpen()) {
+      return;
+   }
+
+   bytes = state->segments->end();
+
+   state->output->close(state->segment_file, bytes);
+   state->segment_file = NULL;
+
+   if (state->retention) {
+      state->retention->add(state->segment_path, bytes);
+   }
+
+   state->segment_num++;
+}
+
+/**
+ * Capture a single frame into the current segment, starting a new one
+ * when it is full. The camera settings go in the frame header.
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param frame Frame number
+ *
+ * @return Size of the frame in bytes, -1 on failure
+ */
+static long capture_to_segment(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, int frame)
+{
+   MMAL_STATUS_T           status;
+   FrameMetadata           metadata;
+   FRAME_METADATA_RECORD   record;
+   uint64_t                offset;
+
+   Logger & log = Logger::getInstance();
+
+   if (state->segments->isOpen() && state->segments->getSize() >= (uint64_t)state->segment_megabytes * 1024 * 1024) {
+      close_segment(state);
+   }
+
+   if (!state->segments->isOpen() && open_segment(state)) {
+      return -1;
+   }
+
+   try {
+      offset = state->segments->getSize();
+
+      state->segments->beginFrame();
+
+      status = trigger_capture(state, callback_data, state->segment_file);
+
+      metadata.capture(&state->settings_slot, get_read_back_parameters(state), frame);
+
+      if (state->metadata_format != METADATA_FORMAT_NONE && !metadata.isValid()) {
+         log.logError("No camera settings reported for frame %d", frame);
+      }
+
+      metadata.buildRecord(&record);
+
+      if (state->frame_ring) {
+         state->frame_ring->publish(&record, status == MMAL_SUCCESS);
+      }
+
+      state->segments->endFrame(callback_data->frame_bytes, &record, status == MMAL_SUCCESS);
+   }
+   catch (rpi_error & e) {
+      log.logError("Failed to write frame %d to segment %s", frame, state->segment_path);
+      return -1;
+   }
+
+   if (state->frame_index && status == MMAL_SUCCESS) {
+      state->frame_index->append(state->segment_path, offset, callback_data->frame_bytes, &record, true, metadata.isValid());
+   }
+
+   // Synced frame by frame as it fills, not only once it is closed
+   if (state->sync_policy) {
+      state->output->sync(state->segment_file);
+   }
+
+   if (status != MMAL_SUCCESS) {
+      return -1;
+   }
+
+   strcpy(state->last_path, state->segment_path);
+   state->last_offset = offset;
+
+   return (long)callback_data->frame_bytes;
+}
+
+/**
+ * Capture a single frame to the shared memory ring only, once every
+ * consumer attached has said it doesn't need the frames on disk
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param frame Frame number
+ *
+ * @return Size of the frame in bytes, -1 on failure
+ */
+static long capture_to_ring(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, int frame)
+{
+   MMAL_STATUS_T           status;
+   FrameMetadata           metadata;
+   FRAME_METADATA_RECORD   record;
+
+   status = trigger_capture(state, callback_data, NULL);
+
+   metadata.capture(&state->settings_slot, get_read_back_parameters(state), frame);
+   metadata.buildRecord(&record);
+
+   state->frame_ring->publish(&record, status == MMAL_SUCCESS);
+
+   if (status != MMAL_SUCCESS) {
+      return -1;
+   }
+
+   state->last_path[0] = 0;
+   state->last_offset = 0;
+
+   return (long)callback_data->frame_bytes;
+}
+
+/**
+ * Add a captured frame to the frame index and its sidecar, and publish its
+ * settings
+ *
+ * A frame written to more than one file is published once, with the first.
+ *
+ * @param state Pointer to state control struct
+ * @param slot Settings reported by the camera that captured the frame
+ * @param params Parameters read back from that camera, NULL if they weren't
+ * @param path File the frame was written to
+ * @param bytes Size of the frame
+ * @param frame Frame number
+ * @param publish Non-zero to publish the frame to the shared memory ring
+ */
+static void record_frame(RASPISTILL_STATE *state, const RASPICAM_SETTINGS_SLOT *slot, const RASPICAM_CAMERA_PARAMETERS *params, const char *path, size_t bytes, int frame, int publish)
+{
+   Logger & log = Logger::getInstance();
+
+   if (publish && !state->frame_ring) {
+      publish = 0;
+   }
+
+   if (state->metadata_format != METADATA_FORMAT_NONE || state->frame_index || publish) {
+      FrameMetadata metadata;
+      FRAME_METADATA_RECORD record;
+
+      metadata.capture(slot, params, frame);
+
+      if (state->metadata_format != METADATA_FORMAT_NONE && !metadata.isValid()) {
+         log.logError("No camera settings reported for frame %d", frame);
+      }
+
+      metadata.buildRecord(&record);
+
+      if (publish) {
+         state->frame_ring->publish(&record, true);
+      }
+
+      if (state->frame_index) {
+         state->frame_index->append(path, 0, bytes, &record, false, metadata.isValid());
+      }
+
+      if (state->metadata_format != METADATA_FORMAT_NONE) {
+         size_t sidecar_bytes = metadata.writeSidecar(path, state->metadata_format);
+
+         if (state->retention) {
+            char sidecar[OUTPUT_MAX_PATH_LEN + 8];
+
+            snprintf(sidecar, sizeof(sidecar), "%s%s", path, FrameMetadata::getExtension(state->metadata_format));
+            state->retention->add(sidecar, sidecar_bytes);
+         }
+      }
+   }
+}
+
+/**
+ * Open the second camera's file for a frame
+ *
+ * @param state Pointer to state control struct
+ * @param frame Frame number
+ *
+ * @return 0 if successful, non-zero otherwise
+ */
+static int open_second_output(RASPISTILL_STATE *state, int frame)
+{
+   SECOND_CAMERA *   second = state->second;
+   char              filename[FILENAME_MAX];
+
+   if (get_frame_filename(second->state, frame, filename, sizeof(filename))) {
+      return 1;
+   }
+
+   try {
+      second->output_file = state->output->open(filename, second->path, sizeof(second->path), true);
+   }
+   catch (rpi_error & e) {
+      Logger::getInstance().logError("Failed to open file %s", filename);
+      return 1;
+   }
+
+   second->callback_data.frame_bytes = 0;
+
+   return 0;
+}
+
+/**
+ * Close the second camera's file for a frame, and record the frame as the
+ * first camera's is
+ *
+ * @param state Pointer to state control struct
+ * @param frame Frame number
+ * @param captured Non-zero if both frames were captured
+ */
+static void close_second_output(RASPISTILL_STATE *state, int frame, int captured)
+{
+   SECOND_CAMERA *   second = state->second;
+   size_t            bytes = second->callback_data.frame_bytes;
+
+   state->output->close(second->output_file, bytes);
+   second->output_file = NULL;
+
+   if (state->retention) {
+      state->retention->add(second->path, bytes);
+   }
+
+   if (captured) {
+      record_frame(state, &second->state->settings_slot, get_read_back_parameters(second->state), second->path, bytes, frame, 0);
+   }
+}
+
+/**
+ * Build the file name of one eye of a stereo frame, _left or _right going
+ * before the extension
+ *
+ * @param filename File name of the frame
+ * @param eye STEREO_EYE_LEFT or STEREO_EYE_RIGHT
+ * @param eye_filename Buffer for the eye's file name
+ * @param len Size of eye_filename
+ *
+ * @return 0 if successful, non-zero if the name didn't fit
+ */
+static int get_eye_filename(const char *filename, int eye, char *eye_filename, size_t len)
+{
+   const char *   base = strrchr(filename, '/');
+   const char *   extension = strrchr(base ? base : filename, '.');
+   int            stem = extension ? (int)(extension - filename) : (int)strlen(filename);
+   int            written;
+
+   written = snprintf(eye_filename, len, "%.*s_%s%s",
+         stem, filename, eye == STEREO_EYE_LEFT ? "left" : "right", extension ? extension : "");
+
+   if (written < 0 || (size_t)written >= len) {
+      Logger::getInstance().logError("File name too long for the %s eye of %s", eye == STEREO_EYE_LEFT ? "left" : "right", filename);
+      return 1;
+   }
+
+   return 0;
+}
+
+/**
+ * Capture a single stereo frame, split into a file per eye as the encoder
+ * hands it over
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param frame Frame number
+ *
+ * @return Size of the stereo frame in bytes, -1 on failure
+ */
+static long capture_split(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, int frame)
+{
+   MMAL_STATUS_T     status;
+   FILE *            eye_files[2] = { NULL, NULL };
+   char              eye_paths[2][OUTPUT_MAX_PATH_LEN];
+   char              filename[FILENAME_MAX];
+   char              eye_filename[FILENAME_MAX];
+   int               layout;
+   int               eye;
+
+   Logger & log = Logger::getInstance();
+
+   if (get_frame_filename(state, frame, filename, sizeof(filename))) {
+      return -1;
+   }
+
+   for (eye = STEREO_EYE_LEFT; eye <= STEREO_EYE_RIGHT; eye++) {
+      if (get_eye_filename(filename, eye, eye_filename, sizeof(eye_filename))) {
+         break;
+      }
+
+      try {
+         eye_files[eye] = state->output->open(eye_filename, eye_paths[eye], sizeof(eye_paths[eye]), true);
+      }
+      catch (rpi_error & e) {
+         log.logError("Failed to open file %s", eye_filename);
+         break;
+      }
+   }
+
+   if (eye <= STEREO_EYE_RIGHT) {
+      if (eye_files[STEREO_EYE_LEFT]) {
+         state->output->close(eye_files[STEREO_EYE_LEFT], 0);
+      }
+      return -1;
+   }
+
+   log.logDebug("Opened output files %s and %s", eye_paths[STEREO_EYE_LEFT], eye_paths[STEREO_EYE_RIGHT]);
+
+   if (state->camera_parameters.stereo_mode.mode == MMAL_STEREOSCOPIC_MODE_TOP_BOTTOM) {
+      layout = STEREO_LAYOUT_TOP_BOTTOM;
+   }
+   else {
+      layout = STEREO_LAYOUT_SIDE_BY_SIDE;
+   }
+
+   state->splitter->begin(layout, eye_files[STEREO_EYE_LEFT], eye_files[STEREO_EYE_RIGHT]);
+
+   // Anything encoded since an early start goes first, the rest as it arrives
+   pthread_mutex_lock(&callback_data->output_lock);
+
+   if (callback_data->held_bytes) {
+      state->splitter->addData(callback_data->held, callback_data->held_bytes);
+      callback_data->held_bytes = 0;
+   }
+
+   callback_data->splitter = state->splitter;
+
+   pthread_mutex_unlock(&callback_data->output_lock);
+
+   status = trigger_capture(state, callback_data, NULL);
+
+   pthread_mutex_lock(&callback_data->output_lock);
+   callback_data->splitter = NULL;
+   pthread_mutex_unlock(&callback_data->output_lock);
+
+   if (!state->splitter->end() && status == MMAL_SUCCESS) {
+      log.logError("Failed to split frame %d", frame);
+      status = MMAL_EIO;
+   }
+
+   for (eye = STEREO_EYE_LEFT; eye <= STEREO_EYE_RIGHT; eye++) {
+      state->output->close(eye_files[eye], state->splitter->getBytes(eye));
+
+      if (state->retention) {
+         state->retention->add(eye_paths[eye], state->splitter->getBytes(eye));
+      }
+   }
+
+   if (state->frame_ring && status != MMAL_SUCCESS) {
+      state->frame_ring->publish(NULL, false);
+   }
+
+   if (status != MMAL_SUCCESS) {
+      return -1;
+   }
+
+   strcpy(state->last_path, eye_paths[STEREO_EYE_LEFT]);
+   state->last_offset = 0;
+
+   for (eye = STEREO_EYE_LEFT; eye <= STEREO_EYE_RIGHT; eye++) {
+      record_frame(state, &state->settings_slot, get_read_back_parameters(state), eye_paths[eye], state->splitter->getBytes(eye), frame, eye == STEREO_EYE_LEFT);
+   }
+
+   return (long)callback_data->frame_bytes;
+}
+
+/**
+ * Capture a single frame to its file, and the second camera's to its own
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param frame Frame number
+ *
+ * @return Size of the frame in bytes, -1 on failure
+ */
+static long capture(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, int frame)
+{
+   MMAL_STATUS_T     status;
+   FILE *            output_file;
+   char              filename[FILENAME_MAX];
+   char              path[OUTPUT_MAX_PATH_LEN];
+
+   Logger & log = Logger::getInstance();
+
+   if (state->frame_ring && !state->frame_ring->wantsFiles()) {
+      return capture_to_ring(state, callback_data, frame);
+   }
+
+   if (state->segments) {
+      return capture_to_segment(state, callback_data, frame);
+   }
+
+   if (state->splitter) {
+      return capture_split(state, callback_data, frame);
+   }
+
+   if (get_frame_filename(state, frame, filename, sizeof(filename))) {
+      return -1;
+   }
+
+   if (state->second && open_second_output(state, frame)) {
+      return -1;
+   }
+
+   try {
+      output_file = state->output->open(filename, path, sizeof(path), true);
+   }
+   catch (rpi_error & e) {
+      log.logError("Failed to open file %s", filename);
+
+      if (state->second) {
+         close_second_output(state, frame, 0);
+      }
+      return -1;
+   }
+
+   log.logDebug("Opened output file %s", path);
+
+   status = trigger_capture(state, callback_data, output_file);
+
+   state->output->close(output_file, callback_data->frame_bytes);
+
+   if (state->second) {
+      close_second_output(state, frame, status == MMAL_SUCCESS);
+   }
+
+   if (state->frame_ring && status != MMAL_SUCCESS) {
+      state->frame_ring->publish(NULL, false);
+   }
+
+   if (state->retention) {
+      state->retention->add(path, callback_data->frame_bytes);
+   }
+
+   if (status != MMAL_SUCCESS) {
+      return -1;
+   }
+
+   strcpy(state->last_path, path);
+   state->last_offset = 0;
+
+   record_frame(state, &state->settings_slot, get_read_back_parameters(state), path, callback_data->frame_bytes, frame, 1);
+
+   return (long)callback_data->frame_bytes;
+}
+
+/**
+ * Wait for a new shutter speed to reach the sensor
+ *
+ * The settings reports lag the request by a frame or two. Returns once a
+ * report shows the exposure within the settle tolerance of the speed asked
+ * for, or once it has stopped moving short of it, where the sensor mode
+ * can't expose that long.
+ *
+ * @param state Pointer to state holding the settings slot and limits
+ * @param shutter_speed Shutter speed asked for, us
+ *
+ * @return Time waited in milliseconds
+ */
+static int wait_for_exposure(RASPISTILL_STATE *state, uint32_t shutter_speed)
+{
+   RASPICAM_CAMERA_SETTINGS   settings;
+   uint32_t                   reports;
+   uint32_t                   last_exposure;
+   int                        required = (state->settle_reports > 2) ? state->settle_reports : 2;
+   int                        stable = 0;
+   int64_t                    started = monotonic_us();
+   int64_t                    deadline = started + (int64_t)state->timeout * 1000;
+   int                        waited = 0;
+
+   Logger & log = Logger::getInstance();
+
+   raspicamcontrol_get_camera_settings(&state->settings_slot, &settings);
+
+   reports = settings.reports;
+   last_exposure = settings.exposure;
+
+   while (monotonic_us() < deadline) {
+      uint32_t difference;
+
+      sleep_until_poll(deadline);
+      waited = (int)((monotonic_us() - started) / 1000);
+
+      if (raspicamcontrol_get_camera_settings(&state->settings_slot, &settings) || settings.reports == reports) {
+         continue;
+      }
+
+      reports = settings.reports;
+
+      difference = (settings.exposure > shutter_speed) ? settings.exposure - shutter_speed : shutter_speed - settings.exposure;
+
+      if ((uint64_t)difference * 100 <= (uint64_t)shutter_speed * state->settle_tolerance) {
+         log.logDebug("Exposure %u us after %d ms", settings.exposure, waited);
+         return waited;
+      }
+
+      if (settings.exposure == last_exposure) {
+         if (++stable >= required) {
+            log.logDebug("Exposure held at %u us short of %u us after %d ms", settings.exposure, shutter_speed, waited);
+            return waited;
+         }
+      }
+      else {
+         stable = 0;
+      }
+
+      last_exposure = settings.exposure;
+   }
+
+   waited = (int)((monotonic_us() - started) / 1000);
+
+   log.logDebug("Shutter speed %u us not reached after %d ms, capturing anyway", shutter_speed, waited);
+
+   return waited;
+}
+
+/**
+ * Capture a raw frame into memory, to be fused
+ *
+ * The frame goes into the callback's held buffer, sized up front so the
+ * callback never has to grow it, and is then handed over to the caller.
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param format Layout of the frame
+ * @param frame_data Set to the frame, malloc()ed, if successful
+ *
+ * @return Size of the frame in bytes, -1 on failure
+ */
+static long capture_to_memory(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, const FUSION_FORMAT *format, uint8_t **frame_data)
+{
+   size_t            frame_size = ExposureFusion::getFrameSize(format);
+   MMAL_STATUS_T     status;
+
+   Logger & log = Logger::getInstance();
+
+   if (callback_data->held_capacity < frame_size) {
+      free(callback_data->held);
+
+      callback_data->held = (uint8_t *)malloc(frame_size);
+      callback_data->held_capacity = callback_data->held ? frame_size : 0;
+
+      if (callback_data->held == NULL) {
+         log.logError("No memory for a frame of %u bytes", (unsigned int)frame_size);
+         return -1;
+      }
+   }
+
+   callback_data->holding = 1;
+
+   status = trigger_capture(state, callback_data, NULL);
+
+   if (status != MMAL_SUCCESS) {
+      return -1;
+   }
+
+   if (callback_data->held_bytes != frame_size) {
+      log.logError("Raw frame is %u bytes, expected %u", (unsigned int)callback_data->held_bytes, (unsigned int)frame_size);
+      return -1;
+   }
+
+   *frame_data = callback_data->held;
+
+   callback_data->held = NULL;
+   callback_data->held_bytes = 0;
+   callback_data->held_capacity = 0;
+
+   return (long)frame_size;
+}
+
+/**
+ * Open the output for a bracket and hand it to the fusion worker
+ *
+ * @param state Pointer to state control struct
+ * @param fused The bracket, its frames captured. Freed here on failure
+ *
+ * @return 0 if successful, non-zero otherwise
+ */
+static int submit_fused_frame(RASPISTILL_STATE *state, FUSED_FRAME *fused)
+{
+   char              filename[FILENAME_MAX];
+
+   Logger & log = Logger::getInstance();
+
+   if (get_frame_filename(state, fused->frame, filename, sizeof(filename))) {
+      fused->job.output = NULL;
+   }
+   else {
+      // Raw frames, kept out of the size estimate of the encoded ones
+      try {
+         fused->job.output = state->output->open(filename, fused->path, sizeof(fused->path), false);
+      }
+      catch (rpi_error & e) {
+         log.logError("Failed to open file %s", filename);
+         fused->job.output = NULL;
+      }
+   }
+
+   if (fused->job.output == NULL) {
+      for (int i = 0; i < fused->job.count; i++) {
+         free(fused->job.frames[i]);
+      }
+
+      free(fused);
+      return -1;
+   }
+
+   log.logDebug("Opened output file %s", fused->path);
+
+   fused->job.context = fused;
+
+   state->fusion->submit(&fused->job);
+
+   return 0;
+}
+
+/**
+ * Close the output of a fused bracket, and account for it. The output of
+ * a bracket that failed to fuse is deleted
+ *
+ * @param state Pointer to state control struct
+ * @param job The job, collected from the fusion worker. Freed here
+ */
+static void finish_fused_frame(RASPISTILL_STATE *state, FUSION_JOB *job)
+{
+   FUSED_FRAME *     fused = (FUSED_FRAME *)job->context;
+
+   if (job->bytes) {
+      state->output->close(job->output, job->bytes);
+
+      if (state->retention) {
+         state->retention->add(fused->path, job->bytes);
+      }
+
+      strcpy(state->last_path, fused->path);
+      state->last_offset = 0;
+
+      // Fused from several exposures, there is no one set of parameters to report
+      record_frame(state, &fused->slot, NULL, fused->path, job->bytes, fused->frame, 1);
+   }
+   else {
+      state->output->discard(job->output, fused->path);
+
+      Logger::getInstance().logError("Failed to fuse frame %d", fused->frame);
+   }
+
+   free(fused);
+}
+
+/**
+ * Capture a frame at each exposure of the bracket, back to back
+ *
+ * The gains and AWB are fixed where they metered, or where they were
+ * locked, and only the shutter speed changes between captures. The graph
+ * stays up throughout, so the frames are as close together as the sensor
+ * allows. The exposure each frame actually got is logged from the settings
+ * reports, and goes in its sidecar and frame index entry.
+ *
+ * When fusing, the raw frames are kept in memory and the bracket handed
+ * to the fusion worker, to be fused while the next one is captured. Its
+ * sidecar and frame index entry have the metered exposure.
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param lock Exposure lock of the series
+ * @param frame Frame number
+ *
+ * @return Total size of the bracket's frames in bytes, -1 on failure
+ */
+static long capture_bracket(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, EXPOSURE_LOCK *lock, int frame)
+{
+   RASPICAM_CAMERA_PARAMETERS parameters;
+   RASPICAM_CAMERA_SETTINGS   settings;
+   ExposureBracket *          bracket = state->bracket;
+   FUSED_FRAME *              fused = NULL;
+   FUSION_JOB *               done;
+   char                       description[32];
+   long                       total = 0;
+
+   Logger & log = Logger::getInstance();
+
+   if (raspicamcontrol_get_camera_settings(&state->settings_slot, &settings)) {
+      log.logError("No camera settings reported, cannot bracket frame %d", frame);
+      return -1;
+   }
+
+   if (state->fusion) {
+      fused = (FUSED_FRAME *)calloc(1, sizeof(FUSED_FRAME));
+
+      if (fused == NULL) {
+         log.logError("No memory to fuse frame %d", frame);
+         return -1;
+      }
+
+      fused->frame = frame;
+      fused->slot.settings = settings;
+      fused->job.count = bracket->getCount();
+      fused->job.format.width = state->common_settings.width;
+      fused->job.format.height = state->common_settings.height;
+      fused->job.format.stride = state->frame_port->format->es->video.width;
+      fused->job.format.sliceHeight = state->frame_port->format->es->video.height;
+   }
+
+   if (lock->locked) {
+      memcpy(&parameters, &lock->parameters, sizeof(parameters));
+   }
+   else {
+      memcpy(&parameters, &state->camera_parameters, sizeof(parameters));
+
+      parameters.analog_gain = settings.analog_gain;
+      parameters.digital_gain = settings.digital_gain;
+      parameters.awbMode = MMAL_PARAM_AWBMODE_OFF;
+      parameters.awb_gains_r = settings.awb_red_gain;
+      parameters.awb_gains_b = settings.awb_blue_gain;
+   }
+
+   bracket->setReference(lock->locked ? (uint32_t)lock->parameters.shutter_speed : settings.exposure);
+
+   for (int i = 0; i < bracket->getCount(); i++) {
+      long bytes;
+
+      parameters.shutter_speed = bracket->getShutterSpeed(i);
+
+      // Through the cache, so only the shutter speed is sent after the first
+      if (raspicamcontrol_apply_parameters(state->camera_component, &state->parameter_cache, &parameters)) {
+         log.logError("Failed to set shutter speed %d us", parameters.shutter_speed);
+         total = -1;
+         break;
+      }
+
+      read_back_parameters(state->camera_component, state);
+
+      wait_for_exposure(state, (uint32_t)parameters.shutter_speed);
+
+      state->bracket_index = i;
+
+      if (fused) {
+         bytes = capture_to_memory(state, callback_data, &fused->job.format, &fused->job.frames[i]);
+      }
+      else {
+         bytes = capture(state, callback_data, frame);
+      }
+
+      if (bytes < 0) {
+         total = -1;
+         break;
+      }
+
+      total += bytes;
+
+      raspicamcontrol_get_camera_settings(&state->settings_slot, &settings);
+      bracket->describe(i, description, sizeof(description));
+
+      log.logInfo(
+            "Frame %d at %s: shutter speed %d us, exposed %u us at gain %.2f/%.2f",
+            frame,
+            description,
+            parameters.shutter_speed,
+            settings.exposure,
+            settings.analog_gain,
+            settings.digital_gain);
+   }
+
+   state->bracket_index = 0;
+
+   if (fused) {
+      if (total >= 0) {
+         if (submit_fused_frame(state, fused)) {
+            total = -1;
+         }
+      }
+      else {
+         for (int i = 0; i < fused->job.count; i++) {
+            free(fused->job.frames[i]);
+         }
+
+         free(fused);
+      }
+
+      // Whatever finished fusing meanwhile
+      while ((done = state->fusion->collect(false)) != NULL) {
+         finish_fused_frame(state, done);
+      }
+   }
+
+   // Back to the locked exposure, or to metering for the next frame
+   if (lock->locked) {
+      raspicamcontrol_apply_parameters(state->camera_component, &state->parameter_cache, &lock->parameters);
+      read_back_parameters(state->camera_component, state);
+   }
+   else {
+      apply_camera_parameters(state->camera_component, state);
+   }
+
+   return total;
+}
+
+/**
+ * Sleep until the given CLOCK_MONOTONIC time
+ *
+ * @param start Start of the series
+ * @param offset Time after the start to wake, ms
+ */
+static void sleep_until(const struct timespec *start, long offset)
+{
+   struct timespec   wake;
+
+   wake.tv_sec = start->tv_sec + offset / 1000;
+   wake.tv_nsec = start->tv_nsec + (offset % 1000) * 1000000L;
+
+   if (wake.tv_nsec >= 1000000000L) {
+      wake.tv_sec++;
+      wake.tv_nsec -= 1000000000L;
+   }
+
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+      ;
+}
+
+/**
+ * Capture the whole series of frames
+ *
+ * The first frame, and every frame after a re-meter, waits for the AE/AWB to
+ * settle. With the exposure lock on, the settled values are then fixed and
+ * later frames are captured straight away. With a bracket, each frame is
+ * captured once for each of its exposures.
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ *
+ * @return Number of frames captured
+ */
+static int capture_series(RASPISTILL_STATE *state, PORT_USERDATA *callback_data)
+{
+   EXPOSURE_LOCK     lock;
+   struct timespec   start;
+   int               captured = 0;
+
+   Logger & log = Logger::getInstance();
+
+   memset(&lock, 0, sizeof(lock));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   for (int n = 0; n < state->frames; n++) {
+      int   frame = state->frameStart + n;
+      long  bytes;
+
+      // Timelapse frames start on a fixed schedule, however long each capture took
+      if (n > 0 && state->timelapse) {
+         sleep_until(&start, (long)n * state->timelapse);
+      }
+
+      if (!lock.locked) {
+         wait_for_settle(state);
+
+         if (state->exposure_lock && state->frames > 1) {
+            lock_exposure(state, &lock);
+         }
+      }
+
+      if (state->bracket) {
+         bytes = capture_bracket(state, callback_data, &lock, frame);
+      }
+      else {
+         bytes = capture(state, callback_data, frame);
+      }
+
+      if (bytes < 0) {
+         log.logError("Failed to capture frame %d", frame);
+         break;
+      }
+
+      captured++;
+
+      if (lock.locked && should_remeter(state, &lock, (size_t)bytes)) {
+         unlock_exposure(state, &lock);
+      }
+   }
+
+   if (lock.locked) {
+      unlock_exposure(state, &lock);
+   }
+
+   if (state->fusion) {
+      FUSION_JOB *done;
+
+      while ((done = state->fusion->collect(true)) != NULL) {
+         finish_fused_frame(state, done);
+      }
+   }
+
+   return captured;
+}
+
+/**
+ * Throw away the SIGUSR1 triggers that arrived while a capture was in progress
+ *
+ * @param signal_fd signalfd for SIGUSR1, SIGINT and SIGTERM
+ * @param skipped Incremented for each trigger thrown away
+ *
+ * @return true if SIGINT or SIGTERM was among them
+ */
+static bool drain_signals(int signal_fd, unsigned int *skipped)
+{
+   struct pollfd              pfd;
+   struct signalfd_siginfo    info;
+
+   pfd.fd = signal_fd;
+   pfd.events = POLLIN;
+
+   while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+      if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+         break;
+      }
+
+      if (info.ssi_signo != SIGUSR1) {
+         Logger::getInstance().logDebug("Stopping on signal %u", info.ssi_signo);
+         return true;
+      }
+
+      (*skipped)++;
+   }
+
+   return false;
+}
+
+/**
+ * Capture a frame on each trigger, until SIGINT or SIGTERM
+ *
+ * Triggers are SIGUSR1, and events from the trigger source if there is
+ * one. The camera keeps running between triggers, so the exposure tracks
+ * the scene and nothing has to settle once a trigger arrives. The capture
+ * is started as soon as the trigger is read, and the output opened while
+ * the frame is exposed and encoded. Triggers that arrive during a capture
+ * are drained and dropped rather than fired late.
+ *
+ * Latency is measured from the trigger: the edge itself for GPIO lines,
+ * which the kernel timestamps, otherwise when the wait returned. A sender
+ * that passes its CLOCK_MONOTONIC time in us (the low 32 bits) with
+ * sigqueue() gets the signal delivery time measured too.
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param signal_fd signalfd for SIGUSR1, SIGINT and SIGTERM, all blocked
+ * @param source Trigger source to wait on as well, NULL for signals only
+ *
+ * @return Number of frames captured
+ */
+static int capture_on_trigger(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, int signal_fd, TriggerSource *source)
+{
+   struct pollfd              fds[2];
+   int                        nfds = 1;
+   LATENCY_STATS              delivery;
+   LATENCY_STATS              trigger;
+   LATENCY_STATS              complete;
+   unsigned int               skipped = 0;
+   int                        frame = state->frameStart;
+   int                        captured = 0;
+
+   Logger & log = Logger::getInstance();
+
+   memset(&delivery, 0, sizeof(delivery));
+   memset(&trigger, 0, sizeof(trigger));
+   memset(&complete, 0, sizeof(complete));
+
+   fds[0].fd = signal_fd;
+   fds[0].events = POLLIN;
+
+   if (source) {
+      fds[1].fd = source->getFd();
+      fds[1].events = source->getEvents();
+      nfds = 2;
+   }
+
+   wait_for_settle(state);
+
+   if (source) {
+      // Anything that happened while the camera started up is long gone
+      source->drain();
+
+      log.logInfo("Armed, waiting for triggers from %s", source->getDescription());
+   }
+   else {
+      log.logInfo("Armed, send SIGUSR1 to capture");
+   }
+
+   while (true) {
+      TRIGGER_EVENT  event;
+      int64_t        woken;
+      int64_t        started;
+      int64_t        finished;
+      long           bytes;
+      bool           stopping;
+
+      if (poll(fds, nfds, -1) < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+
+         log.logError("Failed waiting for a trigger: %s", strerror(errno));
+         break;
+      }
+
+      woken = monotonic_us();
+
+      if (fds[0].revents & POLLIN) {
+         struct signalfd_siginfo info;
+
+         if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+            continue;
+         }
+
+         if (info.ssi_signo != SIGUSR1) {
+            log.logDebug("Stopping on signal %u", info.ssi_signo);
+            break;
+         }
+
+         if (info.ssi_code == SI_QUEUE) {
+            add_latency(&delivery, (int32_t)((uint32_t)woken - (uint32_t)info.ssi_int));
+         }
+
+         event.time = woken;
+         event.exact = false;
+         event.count = 1;
+      }
+      else if (nfds > 1 && fds[1].revents) {
+         errno = 0;
+
+         if (!source->read(&event)) {
+            if (errno == EAGAIN || errno == EINTR) {
+               continue;
+            }
+
+            // End of file or a hang up, poll() would keep waking for it
+            log.logError(
+                  "Trigger source %s has closed (%s), waiting for signals only",
+                  source->getDescription(),
+                  errno ? strerror(errno) : "end of file");
+
+            nfds = 1;
+            continue;
+         }
+
+         if (event.exact) {
+            add_latency(&delivery, (long)(woken - event.time));
+         }
+      }
+      else {
+         continue;
+      }
+
+      start_capture_early(state, callback_data);
+
+      started = monotonic_us();
+
+      bytes = capture(state, callback_data, frame);
+
+      if (callback_data->started) {
+         // The output never got as far as the capture, let the frame finish so it can't complete the next
+         trigger_capture(state, callback_data, NULL);
+      }
+
+      finished = monotonic_us();
+
+      add_latency(&trigger, (long)(started - event.time));
+      add_latency(&complete, (long)(finished - event.time));
+
+      skipped += event.count - 1;
+
+      if (source) {
+         skipped += source->drain();
+      }
+
+      stopping = drain_signals(signal_fd, &skipped);
+
+      if (bytes < 0) {
+         log.logError("Failed to capture frame %d", frame);
+      }
+      else {
+         log.logDebug(
+               "Frame %d: capture started %ld us after the trigger, complete after %ld us",
+               frame,
+               (long)(started - event.time),
+               (long)(finished - event.time));
+
+         captured++;
+         frame++;
+      }
+
+      if (stopping) {
+         break;
+      }
+   }
+
+   log_latency("Trigger delivery", &delivery);
+   log_latency("Trigger to capture started", &trigger);
+   log_latency("Trigger to frame complete", &complete);
+
+   if (skipped) {
+      log.logInfo("Skipped %u triggers that arrived during a capture", skipped);
+   }
+
+   return captured;
+}
+
+/// Most whitespace separated words in a control request
+#define CONTROL_MAX_TOKENS          32
+
+/** Running totals for the STATUS request
+ */
+typedef struct {
+   struct timespec started;            /// When the daemon started taking requests
+   unsigned int requests;              /// Requests carried out
+   unsigned int frames;                /// Frames captured on request
+   unsigned int failed;                /// Requests that failed to capture
+   int next_frame;                     /// Number of the next frame captured
+}
+CONTROL_STATS;
+
+/**
+ * Build the registry of camera options for control requests on first use
+ *
+ * @return Pointer to the registry, NULL if it could not be built
+ */
+static const RASPICLI_REGISTRY * get_camera_option_registry()
+{
+   static RASPICLI_REGISTRY   registry;
+   static bool                initialised = false;
+
+   if (!initialised) {
+      RASPICLI_TABLE table;
+
+      table.commands = raspicamcontrol_get_commands(&table.num_commands);
+
+      if (raspicli_registry_create(&registry, &table, 1)) {
+         return NULL;
+      }
+
+      initialised = true;
+   }
+
+   return &registry;
+}
+
+/**
+ * Milliseconds between two CLOCK_MONOTONIC times
+ *
+ * @param from Earlier time
+ * @param to Later time
+ *
+ * @return Elapsed time, ms
+ */
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+   return (to->tv_sec - from->tv_sec) * 1000L + (to->tv_nsec - from->tv_nsec) / 1000000L;
+}
+
+/**
+ * Apply the name=value overrides of a control request
+ *
+ * Camera settings are named as in a preset file and go straight into the
+ * camera parameters, the caller puts the saved ones back afterwards.
+ * preset=<name> starts from a loaded preset, path=<filename> compiles a
+ * filename template to use instead of the command line's.
+ *
+ * @param state Pointer to state control struct
+ * @param tokens Overrides, each name=value
+ * @param count Number of overrides
+ * @param name Set to the compiled path= template, NULL if none. The caller deletes it, even on failure
+ * @param interval Set to the interval= value for a burst, NULL if interval= isn't allowed
+ * @param error Buffer to receive a description of a bad override
+ * @param errorLen Size of the error buffer
+ *
+ * @return 0 if all OK, non-zero if an override is invalid
+ */
+static int parse_control_overrides(RASPISTILL_STATE *state, char **tokens, int count, FilenameTemplate **name, int *interval, char *error, size_t errorLen)
+{
+   const RASPICLI_REGISTRY *  registry = get_camera_option_registry();
+
+   *name = NULL;
+
+   for (int i = 0; i < count; i++) {
+      char *               key = tokens[i];
+      char *               value = strchr(key, '=');
+      const COMMAND_LIST * command;
+
+      if (value) {
+         *value++ = 0;
+      }
+
+      if (strcmp(key, "path") == 0 && value && *value) {
+         if (state->segments) {
+            snprintf(error, errorLen, "path can't be changed when writing segments");
+            return 1;
+         }
+
+         delete *name;
+         *name = new FilenameTemplate();
+
+         try {
+            (*name)->compile(value);
+         }
+         catch (rpi_error & e) {
+            snprintf(error, errorLen, "invalid path %s", value);
+            return 1;
+         }
+
+         continue;
+      }
+
+      if (strcmp(key, "interval") == 0 && interval && value) {
+         if (sscanf(value, "%d", interval) != 1 || *interval < 0) {
+            snprintf(error, errorLen, "invalid interval %s", value);
+            return 1;
+         }
+
+         continue;
+      }
+
+      if (strcmp(key, "preset") == 0 && value) {
+         const RASPICAM_CAMERA_PARAMETERS *params = state->presets ? state->presets->find(value) : NULL;
+         int settings = state->camera_parameters.settings;
+
+         if (params == NULL) {
+            snprintf(error, errorLen, "unknown preset %s", value);
+            return 1;
+         }
+
+         memcpy(&state->camera_parameters, params, sizeof(state->camera_parameters));
+
+         // Presets were loaded before the settings reports were turned on
+         state->camera_parameters.settings = settings;
+         continue;
+      }
+
+      command = raspicli_registry_lookup_setting(registry, key, NULL);
+
+      if (command == NULL) {
+         snprintf(error, errorLen, "unknown setting %s", key);
+         return 1;
+      }
+
+      if (command->num_parameters > 0 && (value == NULL || *value == 0)) {
+         snprintf(error, errorLen, "%s needs a value", key);
+         return 1;
+      }
+
+      if (raspicamcontrol_parse_command(&state->camera_parameters, command->id, value) == 0) {
+         snprintf(error, errorLen, "invalid value for %s", key);
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Carry out one control request and send its response
+ *
+ * CAPTURE [name=value ...] takes one frame, waiting for the exposure to
+ * settle first. BURST <n> [interval=<ms>] [name=value ...] captures a series
+ * as the command line would. The overrides only last for the request.
+ * PRESET <name> switches the camera to a preset until the next PRESET.
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ * @param server Control server the request came from
+ * @param request The request, its line is tokenised in place
+ * @param stats Running totals to update
+ *
+ * @return 0 to keep taking requests, non-zero to shut down
+ */
+static int handle_control_request(RASPISTILL_STATE *state, PORT_USERDATA *callback_data, ControlServer *server, CONTROL_REQUEST *request, CONTROL_STATS *stats)
+{
+   char *                        tokens[CONTROL_MAX_TOKENS];
+   char *                        token;
+   char *                        save;
+   int                           count = 0;
+   int                           first;
+   int                           frames = 1;
+   int                           interval = 0;
+   int                           burst;
+   int                           captured;
+   int                           settle_ms = 0;
+   long                          bytes = 0;
+   char                          error[CONTROL_MAX_LINE];
+   struct timespec               start;
+   struct timespec               settled;
+   struct timespec               end;
+   RASPICAM_CAMERA_PARAMETERS    saved_parameters;
+   FilenameTemplate *            saved_name = state->filename_template;
+   FilenameTemplate *            name = NULL;
+
+   Logger & log = Logger::getInstance();
+
+   for (token = strtok_r(request->szLine, " \t", &save); token; token = strtok_r(NULL, " \t", &save)) {
+      if (count == CONTROL_MAX_TOKENS) {
+         server->respond(request->client, "ERR too many arguments");
+         return 0;
+      }
+
+      tokens[count++] = token;
+   }
+
+   if (count == 0) {
+      return 0;
+   }
+
+   log.logDebug("Control request from client %d: %s", request->client, tokens[0]);
+
+   if (strcasecmp(tokens[0], "STATUS") == 0) {
+      RASPICAM_CAMERA_PARAMETERS    held;
+      char                          parameters[160];
+      char                          sync[64];
+
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      // What the camera holds, read back rather than what we think we sent it
+      if (raspicamcontrol_get_cached_parameters(state->camera_component, &state->parameter_cache, &held) == 0) {
+         snprintf(
+               parameters,
+               sizeof(parameters),
+               "shutter_us=%d iso=%d ev=%d exposure=%s metering=%s awb=%s",
+               held.shutter_speed,
+               held.ISO,
+               held.exposureCompensation,
+               raspicamcontrol_get_exposure_mode_name(held.exposureMode),
+               raspicamcontrol_get_metering_mode_name(held.exposureMeterMode),
+               raspicamcontrol_get_awb_mode_name(held.awbMode));
+      }
+      else {
+         strcpy(parameters, "parameters=-");
+      }
+
+      // How long a power cut could lose frames for, last group and worst so far
+      if (state->sync_policy && state->sync_policy->isEnabled()) {
+         snprintf(
+               sync,
+               sizeof(sync),
+               " sync_last_ms=%lld sync_max_ms=%lld",
+               (long long)(state->sync_policy->getLastLag() / 1000),
+               (long long)(state->sync_policy->getMaxLag() / 1000));
+      }
+      else {
+         sync[0] = 0;
+      }
+
+      server->respond(
+            request->client,
+            "OK uptime_ms=%ld requests=%u frames=%u failed=%u next_frame=%d last=%s %s%s",
+            elapsed_ms(&stats->started, &end),
+            stats->requests,
+            stats->frames,
+            stats->failed,
+            stats->next_frame,
+            state->last_path[0] ? state->last_path : "-",
+            parameters,
+            sync);
+      return 0;
+   }
+   else if (strcasecmp(tokens[0], "QUIT") == 0) {
+      server->respond(request->client, "OK");
+      server->disconnect(request->client);
+      return 0;
+   }
+   else if (strcasecmp(tokens[0], "SHUTDOWN") == 0) {
+      server->respond(request->client, "OK");
+      return 1;
+   }
+   else if (strcasecmp(tokens[0], "PRESET") == 0) {
+      unsigned int sent = state->parameter_cache.sent;
+
+      if (count != 2) {
+         server->respond(request->client, "ERR usage: PRESET <name>");
+         return 0;
+      }
+
+      if (select_preset(state, tokens[1])) {
+         server->respond(request->client, "ERR failed to select preset %s", tokens[1]);
+         return 0;
+      }
+
+      server->respond(request->client, "OK preset=%s sent=%u", tokens[1], state->parameter_cache.sent - sent);
+      return 0;
+   }
+   else if (strcasecmp(tokens[0], "CAPTURE") == 0) {
+      burst = 0;
+      first = 1;
+   }
+   else if (strcasecmp(tokens[0], "BURST") == 0) {
+      if (count < 2 || sscanf(tokens[1], "%d", &frames) != 1 || frames < 1) {
+         server->respond(request->client, "ERR usage: BURST <frames> [interval=<ms>] [name=value ...]");
+         return 0;
+      }
+
+      burst = 1;
+      first = 2;
+   }
+   else {
+      server->respond(request->client, "ERR unknown request %s", tokens[0]);
+      return 0;
+   }
+
+   memcpy(&saved_parameters, &state->camera_parameters, sizeof(saved_parameters));
+
+   if (parse_control_overrides(state, &tokens[first], count - first, &name, burst ? &interval : NULL, error, sizeof(error))) {
+      memcpy(&state->camera_parameters, &saved_parameters, sizeof(saved_parameters));
+      delete name;
+
+      server->respond(request->client, "ERR %s", error);
+      return 0;
+   }
+
+   // Only the overridden parameters are sent, and only those are sent back after
+   apply_camera_parameters(state->camera_component, state);
+
+   if (name) {
+      state->filename_template = name;
+   }
+
+   stats->requests++;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   if (burst) {
+      int saved_frames = state->frames;
+      int saved_timelapse = state->timelapse;
+      int saved_start = state->frameStart;
+
+      state->frames = frames;
+      state->timelapse = interval;
+      state->frameStart = stats->next_frame;
+
+      captured = capture_series(state, callback_data);
+
+      state->frames = saved_frames;
+      state->timelapse = saved_timelapse;
+      state->frameStart = saved_start;
+
+      settled = start;
+   }
+   else {
+      settle_ms = wait_for_settle(state);
+
+      clock_gettime(CLOCK_MONOTONIC, &settled);
+
+      bytes = capture(state, callback_data, stats->next_frame);
+      captured = (bytes < 0) ? 0 : 1;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   state->filename_template = saved_name;
+   delete name;
+
+   memcpy(&state->camera_parameters, &saved_parameters, sizeof(saved_parameters));
+   apply_camera_parameters(state->camera_component, state);
+
+   stats->frames += captured;
+
+   if (captured < frames) {
+      stats->failed++;
+      stats->next_frame += captured;
+
+      server->respond(request->client, "ERR captured %d of %d frames", captured, frames);
+      return 0;
+   }
+
+   if (burst) {
+      server->respond(
+            request->client,
+            "OK frames=%d first_frame=%d last=%s total_ms=%ld",
+            captured,
+            stats->next_frame,
+            state->last_path[0] ? state->last_path : "-",
+            elapsed_ms(&start, &end));
+   }
+   else {
+      server->respond(
+            request->client,
+            "OK frame=%d path=%s offset=%llu bytes=%ld settle_ms=%d capture_ms=%ld",
+            stats->next_frame,
+            state->last_path[0] ? state->last_path : "-",
+            (unsigned long long)state->last_offset,
+            bytes,
+            settle_ms,
+            elapsed_ms(&settled, &end));
+   }
+
+   stats->next_frame += captured;
+
+   return 0;
+}
+
+/**
+ * Take capture requests on the control socket until told to shut down
+ *
+ * Requests are carried out one at a time on this thread, the one that owns
+ * the camera, so a burst holds up any requests behind it until it is done.
+ *
+ * @param state Pointer to state holding the control socket path
+ * @param callback_data Encoder callback data, the output port must already be enabled
+ *
+ * @return Number of frames captured
+ */
+static int run_daemon(RASPISTILL_STATE *state, PORT_USERDATA *callback_data)
+{
+   ControlServer     server;
+   CONTROL_REQUEST   request;
+   CONTROL_STATS     stats;
+
+   Logger & log = Logger::getInstance();
+
+   memset(&stats, 0, sizeof(stats));
+
+   stats.next_frame = state->frameStart;
+   clock_gettime(CLOCK_MONOTONIC, &stats.started);
+
+   try {
+      server.start(state->control_socket);
+   }
+   catch (rpi_error & e) {
+      log.logError("%s", e.what());
+      return 0;
+   }
+
+   while (true) {
+      if (server.nextRequest(&request, -1) && handle_control_request(state, callback_data, &server, &request, &stats)) {
+         break;
+      }
+   }
+
+   server.stop();
+
+   log.logDebug("Carried out %u control requests, %u failed", stats.requests, stats.failed);
+
+   return stats.frames;
+}
+
+int main(int argc, char **argv)
 {
    // Our main data storage vessel..
    RASPISTILL_STATE     state;
    PORT_USERDATA        callback_data;
-   VCOS_STATUS_T        vcos_status;
    int                  frame; 
-   int                  num;
-   int                  q;
 	int				      defaultLoggingLevel = LOG_LEVEL_DEBUG | LOG_LEVEL_INFO | LOG_LEVEL_ERROR | LOG_LEVEL_FATAL;
    bool                 keep_looping = true;
-   FILE *               output_file = NULL;
    MMAL_STATUS_T        status = MMAL_SUCCESS;
    MMAL_PORT_T *        camera_preview_port = NULL;
    MMAL_PORT_T *        camera_video_port = NULL;
@@ -528,33 +3876,366 @@ int main(int argc, char **argv)
    MMAL_PORT_T *        preview_input_port = NULL;
    MMAL_PORT_T *        encoder_input_port = NULL;
    MMAL_PORT_T *        encoder_output_port = NULL;
+   int                  signal_fd = -1;
+   TriggerSource *      trigger_source = NULL;
 
    Logger & log = Logger::getInstance();
 
 	log.initLogger(defaultLoggingLevel);
 
+   default_status(&state);
+
+   set_app_name(argv[0]);
+
+   if (parse_cmdline(argc, argv, &state)) {
+      display_valid_parameters(basename(argv[0]), application_help_message);
+      return -1;
+   }
+
+   // A trigger source still takes SIGUSR1 too, and stops on SIGINT or SIGTERM
+   if (state.trigger_spec) {
+      state.signal_trigger = 1;
+   }
+
+   if (state.signal_trigger && state.control_socket) {
+      log.logError("-signal and -trigger can't be used with -daemon");
+      return -1;
+   }
+
+   if (state.second_camera == state.common_settings.cameraNum) {
+      log.logError("-dual needs a different camera to -camselect");
+      return -1;
+   }
+
+   // The second camera's frames only ever go to files of their own
+   if (state.second_camera >= 0 && (state.segment_megabytes || state.frame_ring_socket)) {
+      log.logError("-dual can't be used with -container or -shm");
+      return -1;
+   }
+
+   if (state.second_camera >= 0 && state.camera_parameters.stereo_mode.mode != MMAL_STEREOSCOPIC_MODE_NONE) {
+      log.logError("-dual can't be used with -stereo, the firmware drives both cameras itself");
+      return -1;
+   }
+
+   if (state.split_stereo) {
+      if (state.camera_parameters.stereo_mode.mode == MMAL_STEREOSCOPIC_MODE_NONE) {
+         log.logError("-split needs -stereo sbs or tb");
+         return -1;
+      }
+
+      // A JPEG can't be split without decoding it, the rows of a BMP can be split as they arrive
+      if (state.encoding != MMAL_ENCODING_BMP) {
+         log.logError("-split needs -encoding bmp");
+         return -1;
+      }
+
+      if (state.segment_megabytes) {
+         log.logError("-split can't be used with -container");
+         return -1;
+      }
+   }
+
+   if (state.stream_spec && state.encoding != MMAL_ENCODING_JPEG) {
+      log.logError("-stream needs -encoding jpg");
+      return -1;
+   }
+
+   // Raw frames skip the encoder, which the second camera's graph is built around
+   if (state.second_camera >= 0 && state.encoding == MMAL_ENCODING_I420) {
+      log.logError("-dual can't be used with -encoding yuv");
+      return -1;
+   }
+
+   if (state.fuse) {
+      if (!state.bracket_spec || state.encoding != MMAL_ENCODING_I420) {
+         log.logError("-fuse needs -bracket and -encoding yuv");
+         return -1;
+      }
+
+      // Fused frames are written from the fusion worker, one file each
+      if (state.segment_megabytes || state.frame_ring_socket) {
+         log.logError("-fuse can't be used with -container or -shm");
+         return -1;
+      }
+   }
+
+   // Brackets are captured as a series, the second camera would keep metering on its own
+   if (state.bracket_spec && (state.signal_trigger || state.trigger_spec || state.control_socket || state.second_camera >= 0)) {
+      log.logError("-bracket can't be used with -signal, -trigger, -daemon or -dual");
+      return -1;
+   }
+
+   // Blocked before bcm_host_init() or anything else starts a thread, so every
+   // thread inherits the mask and the signals only ever arrive through the signalfd
+   if (state.signal_trigger) {
+      sigset_t mask;
+
+      sigemptyset(&mask);
+      sigaddset(&mask, SIGUSR1);
+      sigaddset(&mask, SIGINT);
+      sigaddset(&mask, SIGTERM);
+
+      pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+      signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+      if (signal_fd < 0) {
+         log.logError("Failed to create signalfd: %s", strerror(errno));
+         return -1;
+      }
+   }
+
+   try {
+      ThreadPolicy & policy = ThreadPolicy::getInstance();
+
+      policy.setCapturePriority(state.realtime_priority);
+
+      if (state.capture_cpus) {
+         policy.setCaptureCpus(state.capture_cpus);
+      }
+      if (state.background_cpus) {
+         policy.setBackgroundCpus(state.background_cpus);
+      }
+   }
+   catch (rpi_error & e) {
+      log.logError("%s", e.what());
+      return -1;
+   }
+
+   if (state.trigger_spec) {
+      trigger_source = new TriggerSource();
+
+      try {
+         trigger_source->open(state.trigger_spec);
+      }
+      catch (rpi_error & e) {
+         log.logError("%s", e.what());
+         return -1;
+      }
+   }
+
    bcm_host_init();
 
    log.logDebug("Initialised bcm host");
 
-   mmal_port_parameter_set_rational(camera->control, MMAL_PARAMETER_SATURATION, value);
+   if (state.common_settings.filename == NULL) {
+      state.common_settings.filename = strdup("out.jpg");
+   }
 
-   default_status(&state);
+   if (state.timeout == -1) {
+      state.timeout = 5000;
+   }
+
+   if (state.preset_file) {
+      state.presets = new CameraPresets();
+
+      try {
+         // Settings given on the command line are the base for every preset
+         state.presets->load(state.preset_file, &state.camera_parameters);
+      }
+      catch (rpi_error & e) {
+         log.logError("%s", e.what());
+         return -1;
+      }
+   }
 
-   if (argc > 1) {
-      state.common_settings.filename = strdup(&argv[1][0]);
+   if (state.preset_name && select_preset(&state, state.preset_name)) {
+      return -1;
    }
-   else {
-      state.common_settings.filename = "out.jpg";
+
+   state.filename_template = new FilenameTemplate();
+
+   try {
+      state.filename_template->compile(state.common_settings.filename);
+   }
+   catch (rpi_error & e) {
+      log.logError("%s", e.what());
+      return -1;
+   }
+
+   if (state.second_camera >= 0 && !state.filename_template->isCameraBased()) {
+      log.logError("Both cameras will write to %s, use %%c in the filename to tell them apart", state.common_settings.filename);
+      return -1;
+   }
+
+   if (state.bracket_spec) {
+      state.bracket = new ExposureBracket();
+
+      try {
+         state.bracket->parse(state.bracket_spec);
+      }
+      catch (rpi_error & e) {
+         log.logError("%s", e.what());
+         return -1;
+      }
+
+      // The exposures would all carry the bracket's frame number in a segment, and -fuse can't write to one
+      if (state.bracket->getCount() > 1 && state.segment_megabytes) {
+         log.logError("-bracket of more than one exposure can't be used with -container");
+         return -1;
+      }
+
+      // A fused bracket is one frame
+      if (state.bracket->getCount() > 1 && !state.fuse && !state.filename_template->isBracketBased()) {
+         log.logError("The exposures of a bracket will write to %s, use %%b in the filename to tell them apart", state.common_settings.filename);
+         return -1;
+      }
+
+      if (state.fuse && state.bracket->getCount() < 2) {
+         log.logError("-fuse needs a -bracket of at least 2 exposures");
+         return -1;
+      }
+   }
+
+   state.output = new OutputManager();
+   state.output->setLimits(state.shard_files, (uint64_t)state.shard_megabytes * 1024 * 1024);
+   state.output->setPreallocate(state.preallocate ? true : false);
+
+   if (state.sync_mode != SYNC_MODE_NONE) {
+      state.sync_policy = new SyncPolicy();
+      state.sync_policy->start(state.sync_mode, state.sync_frames, state.sync_ms);
+      state.output->setSyncPolicy(state.sync_policy);
+   }
+
+   if (state.min_free_megabytes || state.quota_megabytes) {
+      char index[RETENTION_MAX_PATH_LEN];
+
+      if (state.retention_index) {
+         snprintf(index, sizeof(index), "%s", state.retention_index);
+      }
+      else {
+         get_default_retention_index(&state, index, sizeof(index));
+      }
+
+      state.retention = new RetentionManager();
+
+      try {
+         state.retention->start(
+                  index,
+                  (uint64_t)state.min_free_megabytes * 1024 * 1024,
+                  (uint64_t)state.quota_megabytes * 1024 * 1024);
+      }
+      catch (rpi_error & e) {
+         log.logError("%s", e.what());
+         return -1;
+      }
+   }
+
+   if (state.stream_spec) {
+      char address[INET_ADDRSTRLEN] = "127.0.0.1";
+      const char *colon = strrchr(state.stream_spec, ':');
+      int port;
+
+      if (colon && (size_t)(colon - state.stream_spec) < sizeof(address)) {
+         memcpy(address, state.stream_spec, colon - state.stream_spec);
+         address[colon - state.stream_spec] = 0;
+      }
+
+      if (sscanf(colon ? colon + 1 : state.stream_spec, "%d", &port) != 1 || port <= 0 || port > 65535) {
+         log.logError("Invalid stream port %s", state.stream_spec);
+         return -1;
+      }
+
+      state.stream = new MjpegServer();
+
+      try {
+         state.stream->start(address, port);
+      }
+      catch (rpi_error & e) {
+         log.logError("%s", e.what());
+         return -1;
+      }
+   }
+
+   if (state.frame_index_file) {
+      state.frame_index = new FrameIndexWriter();
+
+      try {
+         state.frame_index->open(state.frame_index_file);
+      }
+      catch (rpi_error & e) {
+         log.logError("%s", e.what());
+         return -1;
+      }
+   }
+
+   if (state.split_stereo) {
+      state.splitter = new StereoSplitter();
+   }
+
+   if (state.fuse) {
+      state.fusion = new FusionWorker();
+
+      try {
+         state.fusion->start();
+      }
+      catch (rpi_error & e) {
+         log.logError("%s", e.what());
+         return -1;
+      }
+   }
+
+   if (state.segment_megabytes) {
+      state.segments = new SegmentWriter();
+
+      if (!state.filename_template->isSequenced() && !state.filename_template->isTimeBased()) {
+         log.logError("Segments of %s will overwrite each other, use %%n in the filename to number them", state.common_settings.filename);
+      }
    }
 
-   log.logDebug("Got file name %s", state.linkname);
+   if (state.frames > 1 && !state.segments && !state.filename_template->isSequenced() && !state.filename_template->isTimeBased()) {
+      log.logError("Capturing %d frames to %s, each frame will overwrite the last", state.frames, state.common_settings.filename);
+   }
+
+   // A location overlay or GPS cell in the filename needs gpsd, the same as -gpsdexif
+   if ((state.camera_parameters.enable_annotate & ANNOTATE_GPS_TEXT) || state.filename_template->isGpsBased()) {
+      state.common_settings.gps = 1;
+   }
+
+   if (state.common_settings.gps && raspi_gps_setup(0)) {
+      log.logError("Failed to start GPS, is gpsd running?");
+      state.common_settings.gps = 0;
+      state.camera_parameters.enable_annotate &= ~ANNOTATE_GPS_TEXT;
+   }
+
+   if (state.common_settings.gps) {
+      pthread_t gps_thread;
+
+      // The reader is C and can't apply the policy itself
+      if (raspi_gps_get_reader_thread(&gps_thread) == 0) {
+         ThreadPolicy::getInstance().applyBackground(gps_thread, "GPS reader");
+      }
+   }
+
+   // The sidecar, segment frame headers, frame index, frame ring and settle detection are all fed by the camera's settings reports
+   if (state.metadata_format != METADATA_FORMAT_NONE || state.segment_megabytes || state.frame_index_file || state.frame_ring_socket ||
+         state.settle_reports > 0) {
+      state.camera_parameters.settings = 1;
+   }
+
+   log.logDebug("Got file name %s", state.common_settings.filename);
 
    // Setup for sensor specific parameters
    get_sensor_defaults(state.common_settings.cameraNum, state.common_settings.camera_name,
                        &state.common_settings.width, &state.common_settings.height);
 
    log.logDebug("Got sensor defaults");
+
+   if (state.frame_ring_socket) {
+      // Room for an uncompressed RGB frame, only the pages a frame uses take any memory
+      size_t slot_size = (size_t)state.common_settings.width * state.common_settings.height * 3 + 65536;
+
+      state.frame_ring = new FrameRing();
+
+      try {
+         state.frame_ring->start(state.frame_ring_socket, state.frame_ring_slots, slot_size);
+      }
+      catch (rpi_error & e) {
+         log.logError("%s", e.what());
+         return -1;
+      }
+   }
    
    status = create_camera_component(&state);
 
@@ -580,8 +4261,8 @@ int main(int argc, char **argv)
    camera_preview_port = state.camera_component->output[MMAL_CAMERA_PREVIEW_PORT];
    camera_video_port   = state.camera_component->output[MMAL_CAMERA_VIDEO_PORT];
    camera_still_port   = state.camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
-   encoder_input_port  = state.encoder_component->input[0];
-   encoder_output_port = state.encoder_component->output[0];
+   encoder_input_port  = state.encoder_component ? state.encoder_component->input[0] : NULL;
+   encoder_output_port = state.frame_port;
 
    log.logDebug("Set up ports");
 
@@ -620,8 +4301,10 @@ int main(int argc, char **argv)
 
    log.logDebug("Connected camera to preview");
 
-   // Now connect the camera to the encoder
-   status = connect_ports(camera_still_port, encoder_input_port, &state.encoder_connection);
+   // Now connect the camera to the encoder, raw frames are taken from the camera's still port
+   if (encoder_input_port) {
+      status = connect_ports(camera_still_port, encoder_input_port, &state.encoder_connection);
+   }
 
    if (status != MMAL_SUCCESS) {
       check_disable_port(encoder_output_port);
@@ -647,130 +4330,145 @@ int main(int argc, char **argv)
       throw rpi_error("Failed to connect camera to encoder", __FILE__, __LINE__);
    }
 
-   log.logDebug("Connected camera to encoder");
+   if (encoder_input_port) {
+      log.logDebug("Connected camera to encoder");
+   }
 
    // Set up our userdata - this is passed though to the callback where we need the information.
-   // Null until we open our filename
-   callback_data.file_handle = NULL;
-   callback_data.pstate = &state;
-   vcos_status = vcos_semaphore_create(&callback_data.complete_semaphore, "RaspiStill-sem", 0);
-
-   vcos_assert(vcos_status == VCOS_SUCCESS);
+   init_callback_data(&callback_data, &state);
 
    log.logDebug("Created semaphore");
 
-   // Open the file
    if (state.common_settings.filename) {
-      output_file = fopen(state.common_settings.filename, "wb");
+      status = enable_encoder_output(&state, &callback_data);
 
-      if (!output_file) {
-         check_disable_port(encoder_output_port);
+      if (state.second_camera >= 0 && create_second_camera(&state)) {
+         throw rpi_error("Failed to set up the second camera", __FILE__, __LINE__);
+      }
 
-         if (state.encoder_connection) {
-            mmal_connection_destroy(state.encoder_connection);
-         }
+      // A series outlives the second the date/time annotation was rendered for,
+      // and the location overlay is only ever rendered by the updater
+      AnnotateUpdater annotate_updater;
 
-         /* Disable components */
-         if (state.encoder_component) {
-            mmal_component_disable(state.encoder_component);
-         }
+      if ((state.frames > 1 || state.control_socket || state.signal_trigger || (state.camera_parameters.enable_annotate & ANNOTATE_GPS_TEXT)) &&
+            AnnotateUpdater::isNeeded(&state.camera_parameters)) {
+         annotate_updater.start(state.camera_component, &state.camera_parameters);
 
-         if (state.camera_component) {
-            mmal_component_disable(state.camera_component);
-         }
+         state.annotate_updater = &annotate_updater;
+         state.parameter_cache.annotate_owned = 1;
+      }
 
-         destroy_encoder_component(&state);
-         destroy_camera_component(&state);
+      // Only now, so nothing started from here picks up the capture policy as it starts
+      ThreadPolicy::getInstance().applyCapture("main");
 
-         log.logError("Failed to open file %s", state.common_settings.filename);
+      if (state.control_socket) {
+         frame = run_daemon(&state, &callback_data);
 
-         throw rpi_error(rpi_error::buildMsg("Faied to open file %s", state.common_settings.filename), __FILE__, __LINE__);
+         log.logDebug("Captured %d frames on request", frame);
       }
+      else if (state.signal_trigger) {
+         frame = capture_on_trigger(&state, &callback_data, signal_fd, trigger_source);
 
-      log.logDebug("Opened output file %s", state.common_settings.filename);
+         log.logDebug("Captured %d frames on trigger", frame);
+      }
+      else {
+         frame = capture_series(&state, &callback_data);
 
-      callback_data.file_handle = output_file;
-   }
-   
-   if (output_file) {
-      mmal_port_parameter_set_boolean(
-         state.encoder_component->output[0], MMAL_PARAMETER_EXIF_DISABLE, 1);
+         log.logDebug("Captured %d of %d frames", frame, state.frames);
+      }
 
-      log.logDebug("Disabled exif");
+      close_segment(&state);
+
+      if (state.second) {
+         destroy_second_camera(state.second);
+         state.second = NULL;
+      }
+
+      annotate_updater.stop();
+
+      state.annotate_updater = NULL;
+      state.parameter_cache.annotate_owned = 0;
+
+      // Disable encoder output port
+      status = mmal_port_disable(encoder_output_port);
 
-      // There is a possibility that shutter needs to be set each loop.
-      status = mmal_port_parameter_set_uint32(
-                     state.camera_component->control, 
-                     MMAL_PARAMETER_SHUTTER_SPEED, 
-                     state.camera_parameters.shutter_speed);
+      log.logDebug("Disabled port");
 
       if (status != MMAL_SUCCESS) {
-         log.logError("Failed to set shutter speed");
+         throw rpi_error("Failed to disable port", __FILE__, __LINE__);
       }
+   }
 
-      log.logDebug("Set shutter speed");
+   free_callback_data(&callback_data);
 
-      // Enable the encoder output port
-      encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
+   delete trigger_source;
 
-      // Enable the encoder output port and tell it its callback function
-      status = mmal_port_enable(encoder_output_port, encoder_buffer_callback);
+   if (signal_fd >= 0) {
+      close(signal_fd);
+   }
 
-      log.logDebug("Enabled encoder output port");
+   delete state.presets;
+   delete state.filename_template;
+   delete state.segments;
+   delete state.splitter;
+   delete state.bracket;
+   delete state.frame_index;
 
-      // Send all the buffers to the encoder output port
-      num = mmal_queue_length(state.encoder_pool->queue);
+   if (state.stream) {
+      state.stream->stop();
 
-      log.logDebug("Got %d encoder queues", num);
+      log.logDebug("Streamed %u frames, %u dropped with no free slot", state.stream->getPublished(), state.stream->getDropped());
 
-      for (q = 0;q < num;q++) {
-         MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state.encoder_pool->queue);
+      delete state.stream;
+   }
+   if (state.frame_ring) {
+      state.frame_ring->stop();
 
-         if (!buffer) {
-            log.logError("Failed to get queue");
-         }
+      log.logDebug("Published %u frames to the frame ring, %u dropped", state.frame_ring->getPublished(), state.frame_ring->getDropped());
 
-         status = mmal_port_send_buffer(encoder_output_port, buffer);
+      delete state.frame_ring;
+   }
 
-         if (status != MMAL_SUCCESS) {
-            log.logError("Failed to send buffer");
-         }
-      }
+   if (state.fusion) {
+      state.fusion->stop();
 
-      log.logDebug("Sent buffers to encoder output");
+      log.logDebug("Fused %u frames with the %s kernels, %u failed", state.fusion->getFused(), state.fusion->getKernelName(), state.fusion->getFailed());
 
-      log.logDebug("Initiating capture");
+      delete state.fusion;
+   }
 
-      status = mmal_port_parameter_set_boolean(camera_still_port, MMAL_PARAMETER_CAPTURE, 1);
+   delete state.output;
 
-      if (status != MMAL_SUCCESS) {
-         log.logError("Failed to start capture");
-      }
-      else {
-         // Wait for capture to complete
-         // For some reason using vcos_semaphore_wait_timeout sometimes returns immediately with bad parameter error
-         // even though it appears to be all correct, so reverting to untimed one until figure out why its erratic
-         log.logDebug("Waiting on semaphore");
+   // After the output, the last group is synced as the policy stops
+   if (state.sync_policy) {
+      state.sync_policy->stop();
 
-         vcos_semaphore_wait(&callback_data.complete_semaphore);
-      }
+      log.logInfo(
+         "Synced %u files in %u groups, last lag %lld ms, worst case lag %lld ms",
+         state.sync_policy->getFrames(),
+         state.sync_policy->getSyncs(),
+         (long long)(state.sync_policy->getLastLag() / 1000),
+         (long long)(state.sync_policy->getMaxLag() / 1000));
 
-      log.logDebug("Capture complete");
+      delete state.sync_policy;
+   }
 
-      // Ensure we don't die if get callback with no open file
-      callback_data.file_handle = NULL;
+   if (state.retention) {
+      state.retention->stop();
 
-      // Disable encoder output port
-      status = mmal_port_disable(encoder_output_port);
+      log.logDebug(
+         "Retention deleted %u files, %llu bytes indexed",
+         state.retention->getEvicted(),
+         (unsigned long long)state.retention->getIndexedBytes());
 
-      log.logDebug("Disabled port");
+      delete state.retention;
+   }
 
-      if (status != MMAL_SUCCESS) {
-         throw rpi_error("Failed to disable port", __FILE__, __LINE__);
-      }
+   if (state.common_settings.gps) {
+      raspi_gps_shutdown(0);
    }
 
-   vcos_semaphore_delete(&callback_data.complete_semaphore);
+   free(state.common_settings.filename);
 
    log.logDebug("Finished!");
 }
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "controlserver.h"
+#include "rpi_error.h"
+#include "logger.h"
+
+ControlServer::ControlServer()
+{
+    this->szPath[0] = 0;
+    this->listenFd = -1;
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        this->clients[i].fd = -1;
+        this->clients[i].length = 0;
+    }
+}
+
+ControlServer::~ControlServer()
+{
+    stop();
+}
+
+void ControlServer::start(const char * pszPath)
+{
+    struct sockaddr_un      addr;
+
+    Logger & log = Logger::getInstance();
+
+    stop();
+
+    if (strlen(pszPath) >= sizeof(addr.sun_path)) {
+        throw rpi_error(rpi_error::buildMsg("Control socket path %s is too long", pszPath), __FILE__, __LINE__);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, pszPath);
+
+    this->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (this->listenFd < 0) {
+        throw rpi_error("Failed to create control socket", __FILE__, __LINE__);
+    }
+
+    // A socket left behind by a previous run would stop the bind
+    unlink(pszPath);
+
+    if (bind(this->listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(this->listenFd, CONTROL_MAX_CLIENTS) != 0) {
+        ::close(this->listenFd);
+        this->listenFd = -1;
+
+        log.logError("Failed to listen on %s: %s", pszPath, strerror(errno));
+        throw rpi_error(rpi_error::buildMsg("Failed to listen on %s", pszPath), __FILE__, __LINE__);
+    }
+
+    // Owner and group only, anyone who can connect can drive the camera
+    chmod(pszPath, 0660);
+
+    strcpy(this->szPath, pszPath);
+
+    log.logInfo("Listening for control requests on %s", pszPath);
+}
+
+void ControlServer::stop()
+{
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        disconnect(i);
+    }
+
+    if (this->listenFd >= 0) {
+        ::close(this->listenFd);
+        this->listenFd = -1;
+
+        unlink(this->szPath);
+    }
+
+    this->szPath[0] = 0;
+}
+
+void ControlServer::disconnect(int client)
+{
+    if (client < 0 || client >= CONTROL_MAX_CLIENTS || this->clients[client].fd < 0) {
+        return;
+    }
+
+    ::close(this->clients[client].fd);
+
+    this->clients[client].fd = -1;
+    this->clients[client].length = 0;
+}
+
+void ControlServer::acceptClients()
+{
+    int         fd;
+
+    Logger & log = Logger::getInstance();
+
+    while ((fd = accept4(this->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int     i;
+
+        for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+            if (this->clients[i].fd < 0) {
+                break;
+            }
+        }
+
+        if (i == CONTROL_MAX_CLIENTS) {
+            log.logError("Too many control clients, turning one away");
+            ::close(fd);
+            continue;
+        }
+
+        this->clients[i].fd = fd;
+        this->clients[i].length = 0;
+
+        log.logDebug("Control client %d connected", i);
+    }
+}
+
+/*
+** Move the first complete line out of the client's buffer
+*/
+bool ControlServer::takeLine(Client * client, CONTROL_REQUEST * request)
+{
+    char *      eol = (char *)memchr(client->szBuffer, '\n', client->length);
+    size_t      len;
+
+    if (eol == NULL) {
+        return false;
+    }
+
+    len = eol - client->szBuffer;
+
+    memcpy(request->szLine, client->szBuffer, len);
+    request->szLine[len] = 0;
+
+    if (len > 0 && request->szLine[len - 1] == '\r') {
+        request->szLine[len - 1] = 0;
+    }
+
+    request->client = client - this->clients;
+
+    client->length -= len + 1;
+    memmove(client->szBuffer, eol + 1, client->length);
+
+    return true;
+}
+
+bool ControlServer::readClient(Client * client, CONTROL_REQUEST * request)
+{
+    ssize_t     n;
+
+    n = recv(client->fd, &client->szBuffer[client->length], sizeof(client->szBuffer) - client->length, 0);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return false;
+    }
+
+    if (n <= 0) {
+        Logger::getInstance().logDebug("Control client %d disconnected", (int)(client - this->clients));
+        disconnect(client - this->clients);
+        return false;
+    }
+
+    client->length += n;
+
+    if (takeLine(client, request)) {
+        return true;
+    }
+
+    if (client->length == sizeof(client->szBuffer)) {
+        respond(client - this->clients, "ERR request too long");
+        disconnect(client - this->clients);
+    }
+
+    return false;
+}
+
+/*
+** Wait up to timeoutMs for a request, -1 to wait for ever. Returns true
+** with the request filled in, false on timeout.
+*/
+bool ControlServer::nextRequest(CONTROL_REQUEST * request, int timeoutMs)
+{
+    struct pollfd       fds[CONTROL_MAX_CLIENTS + 1];
+    int                 map[CONTROL_MAX_CLIENTS + 1];
+    int                 count;
+    int                 n;
+
+    if (this->listenFd < 0) {
+        return false;
+    }
+
+    // Requests pipelined by a client are already buffered
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (this->clients[i].fd >= 0 && takeLine(&this->clients[i], request)) {
+            return true;
+        }
+    }
+
+    fds[0].fd = this->listenFd;
+    fds[0].events = POLLIN;
+    count = 1;
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (this->clients[i].fd >= 0) {
+            fds[count].fd = this->clients[i].fd;
+            fds[count].events = POLLIN;
+            map[count] = i;
+            count++;
+        }
+    }
+
+    n = poll(fds, count, timeoutMs);
+
+    if (n <= 0) {
+        return false;
+    }
+
+    for (int i = 1; i < count; i++) {
+        if (fds[i].revents && readClient(&this->clients[map[i]], request)) {
+            return true;
+        }
+    }
+
+    if (fds[0].revents & POLLIN) {
+        acceptClients();
+    }
+
+    return false;
+}
+
+/*
+** Send a one line response. Responses are short, so a client that can't
+** take one is treated as gone.
+*/
+void ControlServer::respond(int client, const char * fmt, ...)
+{
+    char        szResponse[CONTROL_MAX_LINE];
+    va_list     args;
+    int         len;
+
+    if (client < 0 || client >= CONTROL_MAX_CLIENTS || this->clients[client].fd < 0) {
+        return;
+    }
+
+    va_start(args, fmt);
+    len = vsnprintf(szResponse, sizeof(szResponse) - 1, fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        return;
+    }
+
+    if (len > (int)sizeof(szResponse) - 2) {
+        len = sizeof(szResponse) - 2;
+    }
+
+    szResponse[len++] = '\n';
+
+    if (send(this->clients[client].fd, szResponse, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+        Logger::getInstance().logError("Failed to respond to control client %d", client);
+        disconnect(client);
+    }
+}
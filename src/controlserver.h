@@ -0,0 +1,58 @@
+#include <stddef.h>
+
+#ifndef _INCL_CONTROLSERVER
+#define _INCL_CONTROLSERVER
+
+#define CONTROL_MAX_CLIENTS             8
+#define CONTROL_MAX_LINE                1024
+#define CONTROL_MAX_PATH_LEN            108     // sun_path
+
+/*
+** A request read from one of the control clients
+*/
+typedef struct {
+    int         client;
+    char        szLine[CONTROL_MAX_LINE];
+}
+CONTROL_REQUEST;
+
+/*
+** Line based control socket for running capture as a daemon.
+**
+** Clients connect to a Unix domain socket and send one request per line,
+** each answered with a single line starting OK or ERR. This class only
+** deals with the connections, reading requests and writing responses.
+** It is polled from the thread that owns the camera, so requests are
+** carried out one at a time in the order they arrive.
+*/
+class ControlServer
+{
+private:
+    struct Client {
+        int         fd;
+        char        szBuffer[CONTROL_MAX_LINE];
+        size_t      length;
+    };
+
+    char        szPath[CONTROL_MAX_PATH_LEN];
+    int         listenFd;
+    Client      clients[CONTROL_MAX_CLIENTS];
+
+    void        acceptClients();
+    bool        takeLine(Client * client, CONTROL_REQUEST * request);
+    bool        readClient(Client * client, CONTROL_REQUEST * request);
+
+public:
+    ControlServer();
+    ~ControlServer();
+
+    void        start(const char * pszPath);
+    void        stop();
+
+    bool        nextRequest(CONTROL_REQUEST * request, int timeoutMs);
+
+    void        respond(int client, const char * fmt, ...);
+    void        disconnect(int client);
+};
+
+#endif
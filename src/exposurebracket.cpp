@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "exposurebracket.h"
+#include "rpi_error.h"
+
+ExposureBracket::ExposureBracket()
+{
+    this->relative = true;
+    this->count = 0;
+    this->reference = 0;
+}
+
+/*
+** A list of exposures separated by ',' or '/'. Plain numbers are EV steps,
+** numbers ending in "us" are shutter speeds. The two can't be mixed.
+*/
+void ExposureBracket::parse(const char * pszSpec)
+{
+    const char *    p = pszSpec;
+    char *          end;
+    int             shutters = 0;
+
+    this->count = 0;
+
+    while (*p) {
+        double value = strtod(p, &end);
+
+        if (end == p) {
+            throw rpi_error(rpi_error::buildMsg("Invalid bracket %s", pszSpec), __FILE__, __LINE__);
+        }
+
+        if (this->count == BRACKET_MAX_EXPOSURES) {
+            throw rpi_error(rpi_error::buildMsg("Bracket %s has more than %d exposures", pszSpec, BRACKET_MAX_EXPOSURES), __FILE__, __LINE__);
+        }
+
+        p = end;
+
+        if (strncmp(p, "us", 2) == 0) {
+            if (!(value >= 1.0 && value <= (double)INT32_MAX)) {
+                throw rpi_error(rpi_error::buildMsg("Invalid shutter speed in bracket %s", pszSpec), __FILE__, __LINE__);
+            }
+
+            this->shutterSpeed[this->count] = (uint32_t)value;
+            shutters++;
+            p += 2;
+        }
+        else {
+            if (!(fabs(value) <= BRACKET_MAX_EV)) {
+                throw rpi_error(rpi_error::buildMsg("EV step in bracket %s out of range, use -%.0f to %.0f", pszSpec, BRACKET_MAX_EV, BRACKET_MAX_EV), __FILE__, __LINE__);
+            }
+
+            this->ev[this->count] = value;
+        }
+
+        this->count++;
+
+        if (*p == ',' || *p == '/') {
+            p++;
+        }
+        else if (*p) {
+            throw rpi_error(rpi_error::buildMsg("Invalid bracket %s", pszSpec), __FILE__, __LINE__);
+        }
+    }
+
+    if (this->count == 0) {
+        throw rpi_error(rpi_error::buildMsg("Invalid bracket %s", pszSpec), __FILE__, __LINE__);
+    }
+
+    if (shutters && shutters != this->count) {
+        throw rpi_error(rpi_error::buildMsg("Bracket %s mixes EV steps and shutter speeds", pszSpec), __FILE__, __LINE__);
+    }
+
+    this->relative = (shutters == 0);
+}
+
+int ExposureBracket::getCount()
+{
+    return this->count;
+}
+
+bool ExposureBracket::isRelative()
+{
+    return this->relative;
+}
+
+/*
+** The metered exposure in us that EV steps are taken from
+*/
+void ExposureBracket::setReference(uint32_t exposure)
+{
+    this->reference = exposure;
+}
+
+uint32_t ExposureBracket::getShutterSpeed(int index)
+{
+    double  speed;
+
+    if (!this->relative) {
+        return this->shutterSpeed[index];
+    }
+
+    speed = floor((double)this->reference * pow(2.0, this->ev[index]) + 0.5);
+
+    if (speed < 1.0) {
+        return 1;
+    }
+    else if (speed > (double)INT32_MAX) {
+        return INT32_MAX;
+    }
+
+    return (uint32_t)speed;
+}
+
+void ExposureBracket::describe(int index, char * pszBuffer, size_t bufferLen)
+{
+    if (this->relative) {
+        snprintf(pszBuffer, bufferLen, "%+.1f EV", this->ev[index]);
+    }
+    else {
+        snprintf(pszBuffer, bufferLen, "%u us", this->shutterSpeed[index]);
+    }
+}
@@ -0,0 +1,42 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _INCL_EXPOSUREBRACKET
+#define _INCL_EXPOSUREBRACKET
+
+#define BRACKET_MAX_EXPOSURES           16
+#define BRACKET_MAX_EV                  10.0
+
+/*
+** The exposures of a bracket, e.g. "-2,0,+2" for EV steps from the
+** metered exposure or "1000us,8000us,64000us" for fixed shutter speeds.
+**
+** EV steps are applied to the shutter speed alone, the caller fixes the
+** gains at their metered values so each step really is a doubling or
+** halving of the light. The shutter speeds are what is asked of the
+** camera, the firmware may clamp them to what the sensor mode allows.
+*/
+class ExposureBracket
+{
+private:
+    bool            relative;
+    int             count;
+    double          ev[BRACKET_MAX_EXPOSURES];
+    uint32_t        shutterSpeed[BRACKET_MAX_EXPOSURES];
+    uint32_t        reference;
+
+public:
+    ExposureBracket();
+
+    void            parse(const char * pszSpec);
+
+    int             getCount();
+    bool            isRelative();
+
+    void            setReference(uint32_t exposure);
+    uint32_t        getShutterSpeed(int index);
+
+    void            describe(int index, char * pszBuffer, size_t bufferLen);
+};
+
+#endif
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FUSION_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define FUSION_SSE2
+#endif
+
+#include "exposurefusion.h"
+#include "rpi_error.h"
+
+/*
+** Well-exposedness of a guide value, (1 - ((y - 128) / 128)^2)^2 in 8 bit
+** fixed point, from 1 at black or white to 255 at mid grey. Never 0, so
+** a pixel clipped in every frame still has weights to divide by. Every
+** kernel works it out exactly this way, and divides in single precision,
+** so they agree with each other to the bit (ARMv7 NEON, which has no
+** divide, to within 1).
+**
+** With at most 16 frames the weights sum to no more than 4080, and the
+** weighted values to no more than 1040400, exact in a float.
+*/
+static inline uint32_t weight(uint8_t y)
+{
+    int     d = (int)y - 128;
+    int     t = 256 - ((d * d) >> 6);
+
+    if (t > 255) {
+        t = 255;
+    }
+
+    return ((uint32_t)(t * t) >> 8) + 1;
+}
+
+static void fuseRowScalar(const uint8_t * const * values, const uint8_t * const * guides, int count, uint8_t * out, int width)
+{
+    for (int x = 0; x < width; x++) {
+        uint32_t    total = 0;
+        uint32_t    sum = 0;
+
+        for (int i = 0; i < count; i++) {
+            uint32_t w = weight(guides[i][x]);
+
+            total += w * values[i][x];
+            sum += w;
+        }
+
+        out[x] = (uint8_t)((float)total / (float)sum + 0.5f);
+    }
+}
+
+static void guideRowScalar(const uint8_t * row0, const uint8_t * row1, uint8_t * out, int width)
+{
+    for (int x = 0; x < width; x++) {
+        out[x] = (uint8_t)((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+    }
+}
+
+#ifdef FUSION_SSE2
+static void fuseRowSse2(const uint8_t * const * values, const uint8_t * const * guides, int count, uint8_t * out, int width)
+{
+    const __m128i   zero = _mm_setzero_si128();
+    const __m128i   mid = _mm_set1_epi16(128);
+    const __m128i   top = _mm_set1_epi16(256);
+    const __m128i   limit = _mm_set1_epi16(255);
+    const __m128i   one = _mm_set1_epi16(1);
+    const __m128    half = _mm_set1_ps(0.5f);
+    int             x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i     totalLo = zero;
+        __m128i     totalHi = zero;
+        __m128i     sum = zero;
+        __m128i     resultLo;
+        __m128i     resultHi;
+
+        for (int i = 0; i < count; i++) {
+            __m128i     g = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&guides[i][x]), zero);
+            __m128i     v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&values[i][x]), zero);
+            __m128i     d = _mm_sub_epi16(g, mid);
+            __m128i     t = _mm_min_epi16(_mm_sub_epi16(top, _mm_srli_epi16(_mm_mullo_epi16(d, d), 6)), limit);
+            __m128i     w = _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(t, t), 8), one);
+            __m128i     p = _mm_mullo_epi16(w, v);
+
+            sum = _mm_add_epi16(sum, w);
+            totalLo = _mm_add_epi32(totalLo, _mm_unpacklo_epi16(p, zero));
+            totalHi = _mm_add_epi32(totalHi, _mm_unpackhi_epi16(p, zero));
+        }
+
+        resultLo = _mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(_mm_cvtepi32_ps(totalLo), _mm_cvtepi32_ps(_mm_unpacklo_epi16(sum, zero))), half));
+        resultHi = _mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(_mm_cvtepi32_ps(totalHi), _mm_cvtepi32_ps(_mm_unpackhi_epi16(sum, zero))), half));
+
+        _mm_storel_epi64((__m128i *)&out[x], _mm_packus_epi16(_mm_packs_epi32(resultLo, resultHi), zero));
+    }
+
+    if (x < width) {
+        const uint8_t *     valueTails[FUSION_MAX_FRAMES];
+        const uint8_t *     guideTails[FUSION_MAX_FRAMES];
+
+        for (int i = 0; i < count; i++) {
+            valueTails[i] = &values[i][x];
+            guideTails[i] = &guides[i][x];
+        }
+
+        fuseRowScalar(valueTails, guideTails, count, &out[x], width - x);
+    }
+}
+
+static void guideRowSse2(const uint8_t * row0, const uint8_t * row1, uint8_t * out, int width)
+{
+    const __m128i   zero = _mm_setzero_si128();
+    const __m128i   even = _mm_set1_epi16(0x00FF);
+    const __m128i   two = _mm_set1_epi16(2);
+    int             x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i     a = _mm_loadu_si128((const __m128i *)&row0[2 * x]);
+        __m128i     b = _mm_loadu_si128((const __m128i *)&row1[2 * x]);
+        __m128i     s;
+
+        s = _mm_add_epi16(_mm_and_si128(a, even), _mm_srli_epi16(a, 8));
+        s = _mm_add_epi16(s, _mm_add_epi16(_mm_and_si128(b, even), _mm_srli_epi16(b, 8)));
+        s = _mm_srli_epi16(_mm_add_epi16(s, two), 2);
+
+        _mm_storel_epi64((__m128i *)&out[x], _mm_packus_epi16(s, zero));
+    }
+
+    if (x < width) {
+        guideRowScalar(&row0[2 * x], &row1[2 * x], &out[x], width - x);
+    }
+}
+#endif
+
+#ifdef FUSION_NEON
+static void fuseRowNeon(const uint8_t * const * values, const uint8_t * const * guides, int count, uint8_t * out, int width)
+{
+    const int16x8_t     mid = vdupq_n_s16(128);
+    const uint16x8_t    top = vdupq_n_u16(256);
+    const uint16x8_t    limit = vdupq_n_u16(255);
+    const uint16x8_t    one = vdupq_n_u16(1);
+    const float32x4_t   half = vdupq_n_f32(0.5f);
+    int                 x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint32x4_t      totalLo = vdupq_n_u32(0);
+        uint32x4_t      totalHi = vdupq_n_u32(0);
+        uint16x8_t      sum = vdupq_n_u16(0);
+        float32x4_t     sumLo;
+        float32x4_t     sumHi;
+        float32x4_t     quotientLo;
+        float32x4_t     quotientHi;
+        uint16x8_t      result;
+
+        for (int i = 0; i < count; i++) {
+            int16x8_t   d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&guides[i][x]))), mid);
+            uint16x8_t  t = vminq_u16(vsubq_u16(top, vshrq_n_u16(vreinterpretq_u16_s16(vmulq_s16(d, d)), 6)), limit);
+            uint16x8_t  w = vaddq_u16(vshrq_n_u16(vmulq_u16(t, t), 8), one);
+            uint16x8_t  v = vmovl_u8(vld1_u8(&values[i][x]));
+
+            sum = vaddq_u16(sum, w);
+            totalLo = vmlal_u16(totalLo, vget_low_u16(w), vget_low_u16(v));
+            totalHi = vmlal_u16(totalHi, vget_high_u16(w), vget_high_u16(v));
+        }
+
+        sumLo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(sum)));
+        sumHi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(sum)));
+
+#ifdef __aarch64__
+        quotientLo = vdivq_f32(vcvtq_f32_u32(totalLo), sumLo);
+        quotientHi = vdivq_f32(vcvtq_f32_u32(totalHi), sumHi);
+#else
+        {
+            // No divide on ARMv7, two Newton-Raphson steps on the reciprocal estimate
+            float32x4_t reciprocalLo = vrecpeq_f32(sumLo);
+            float32x4_t reciprocalHi = vrecpeq_f32(sumHi);
+
+            reciprocalLo = vmulq_f32(vrecpsq_f32(sumLo, reciprocalLo), reciprocalLo);
+            reciprocalHi = vmulq_f32(vrecpsq_f32(sumHi, reciprocalHi), reciprocalHi);
+            reciprocalLo = vmulq_f32(vrecpsq_f32(sumLo, reciprocalLo), reciprocalLo);
+            reciprocalHi = vmulq_f32(vrecpsq_f32(sumHi, reciprocalHi), reciprocalHi);
+
+            quotientLo = vmulq_f32(vcvtq_f32_u32(totalLo), reciprocalLo);
+            quotientHi = vmulq_f32(vcvtq_f32_u32(totalHi), reciprocalHi);
+        }
+#endif
+
+        result = vcombine_u16(
+                    vmovn_u32(vcvtq_u32_f32(vaddq_f32(quotientLo, half))),
+                    vmovn_u32(vcvtq_u32_f32(vaddq_f32(quotientHi, half))));
+
+        vst1_u8(&out[x], vqmovn_u16(result));
+    }
+
+    if (x < width) {
+        const uint8_t *     valueTails[FUSION_MAX_FRAMES];
+        const uint8_t *     guideTails[FUSION_MAX_FRAMES];
+
+        for (int i = 0; i < count; i++) {
+            valueTails[i] = &values[i][x];
+            guideTails[i] = &guides[i][x];
+        }
+
+        fuseRowScalar(valueTails, guideTails, count, &out[x], width - x);
+    }
+}
+
+static void guideRowNeon(const uint8_t * row0, const uint8_t * row1, uint8_t * out, int width)
+{
+    int     x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint16x8_t  s = vaddq_u16(vpaddlq_u8(vld1q_u8(&row0[2 * x])), vpaddlq_u8(vld1q_u8(&row1[2 * x])));
+
+        vst1_u8(&out[x], vmovn_u16(vrshrq_n_u16(s, 2)));
+    }
+
+    if (x < width) {
+        guideRowScalar(&row0[2 * x], &row1[2 * x], &out[x], width - x);
+    }
+}
+#endif
+
+// Plain C first, the best last
+static const FUSION_KERNELS kernelTable[] = {
+    { "scalar", fuseRowScalar, guideRowScalar },
+#ifdef FUSION_SSE2
+    { "sse2", fuseRowSse2, guideRowSse2 },
+#endif
+#ifdef FUSION_NEON
+    { "neon", fuseRowNeon, guideRowNeon },
+#endif
+};
+
+ExposureFusion::ExposureFusion()
+{
+    this->kernels = getBestKernels();
+    this->guides = NULL;
+    this->guideCapacity = 0;
+}
+
+ExposureFusion::~ExposureFusion()
+{
+    free(this->guides);
+}
+
+int ExposureFusion::getKernelCount()
+{
+    return (int)(sizeof(kernelTable) / sizeof(kernelTable[0]));
+}
+
+const FUSION_KERNELS * ExposureFusion::getKernels(int index)
+{
+    return &kernelTable[index];
+}
+
+const FUSION_KERNELS * ExposureFusion::getBestKernels()
+{
+    return &kernelTable[getKernelCount() - 1];
+}
+
+size_t ExposureFusion::getFrameSize(const FUSION_FORMAT * format)
+{
+    return (size_t)format->stride * format->sliceHeight * 3 / 2;
+}
+
+void ExposureFusion::setKernels(const FUSION_KERNELS * kernels)
+{
+    this->kernels = kernels;
+}
+
+const char * ExposureFusion::getKernelName()
+{
+    return this->kernels->name;
+}
+
+/*
+** Fuse count frames into out, all of the given format. The padding to the
+** right of and below the image is left as it was in out.
+*/
+void ExposureFusion::merge(const uint8_t * const * frames, int count, uint8_t * out, const FUSION_FORMAT * format)
+{
+    const uint8_t *     values[FUSION_MAX_FRAMES];
+    uint8_t *           guideRows[FUSION_MAX_FRAMES];
+    int                 chromaWidth = (format->width + 1) / 2;
+    int                 chromaHeight = (format->height + 1) / 2;
+    int                 chromaStride = format->stride / 2;
+    size_t              lumaSize = (size_t)format->stride * format->sliceHeight;
+    size_t              chromaSize = (size_t)chromaStride * (format->sliceHeight / 2);
+
+    if (count < 1 || count > FUSION_MAX_FRAMES) {
+        throw rpi_error(rpi_error::buildMsg("Can't fuse %d frames, at most %d", count, FUSION_MAX_FRAMES), __FILE__, __LINE__);
+    }
+
+    // Each chroma sample is guided by a whole 2x2 block of luma
+    if (format->width < 2 || format->height < 2 ||
+        format->stride < chromaWidth * 2 || format->sliceHeight < chromaHeight * 2)
+    {
+        throw rpi_error(rpi_error::buildMsg("Can't fuse %d x %d frames of stride %d and slice height %d",
+                    format->width, format->height, format->stride, format->sliceHeight), __FILE__, __LINE__);
+    }
+
+    if (this->guideCapacity < (size_t)count * (FUSION_TILE_WIDTH / 2)) {
+        uint8_t * guides = (uint8_t *)realloc(this->guides, (size_t)count * (FUSION_TILE_WIDTH / 2));
+
+        if (guides == NULL) {
+            throw rpi_error("Failed to allocate the fusion guides", __FILE__, __LINE__);
+        }
+
+        this->guides = guides;
+        this->guideCapacity = (size_t)count * (FUSION_TILE_WIDTH / 2);
+    }
+
+    for (int i = 0; i < count; i++) {
+        guideRows[i] = &this->guides[i * (FUSION_TILE_WIDTH / 2)];
+    }
+
+    for (int tileRow = 0; tileRow < chromaHeight; tileRow += FUSION_TILE_ROWS / 2) {
+        int     lastRow = tileRow + FUSION_TILE_ROWS / 2;
+
+        if (lastRow > chromaHeight) {
+            lastRow = chromaHeight;
+        }
+
+        for (int x = 0; x < format->width; x += FUSION_TILE_WIDTH) {
+            int     tileWidth = format->width - x;
+            int     chromaX = x / 2;
+            int     chromaTileWidth = chromaWidth - chromaX;
+
+            if (tileWidth > FUSION_TILE_WIDTH) {
+                tileWidth = FUSION_TILE_WIDTH;
+            }
+
+            if (chromaTileWidth > FUSION_TILE_WIDTH / 2) {
+                chromaTileWidth = FUSION_TILE_WIDTH / 2;
+            }
+
+            for (int chromaY = tileRow; chromaY < lastRow; chromaY++) {
+                size_t  row0 = (size_t)(2 * chromaY) * format->stride + x;
+                size_t  row1 = row0 + format->stride;
+                size_t  chromaOffset = (size_t)chromaY * chromaStride + chromaX;
+
+                // The luma rows of the block, which each weight their own pixels
+                for (int i = 0; i < count; i++) {
+                    values[i] = &frames[i][row0];
+                }
+
+                this->kernels->fuseRow(values, values, count, &out[row0], tileWidth);
+
+                if (2 * chromaY + 1 < format->height) {
+                    for (int i = 0; i < count; i++) {
+                        values[i] = &frames[i][row1];
+                    }
+
+                    this->kernels->fuseRow(values, values, count, &out[row1], tileWidth);
+                }
+                else {
+                    // An odd last row pairs with itself
+                    row1 = row0;
+                }
+
+                // Then the chroma, guided by the luma just read
+                for (int i = 0; i < count; i++) {
+                    this->kernels->guideRow(&frames[i][row0], &frames[i][row1], guideRows[i], chromaTileWidth);
+                }
+
+                for (int i = 0; i < count; i++) {
+                    values[i] = &frames[i][lumaSize + chromaOffset];
+                }
+
+                this->kernels->fuseRow(values, guideRows, count, &out[lumaSize + chromaOffset], chromaTileWidth);
+
+                for (int i = 0; i < count; i++) {
+                    values[i] = &frames[i][lumaSize + chromaSize + chromaOffset];
+                }
+
+                this->kernels->fuseRow(values, guideRows, count, &out[lumaSize + chromaSize + chromaOffset], chromaTileWidth);
+            }
+        }
+    }
+}
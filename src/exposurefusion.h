@@ -0,0 +1,79 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _INCL_EXPOSUREFUSION
+#define _INCL_EXPOSUREFUSION
+
+#define FUSION_MAX_FRAMES               16
+
+// Tiles are this many luma columns and rows, their rows of every frame fit in L1
+#define FUSION_TILE_WIDTH               512
+#define FUSION_TILE_ROWS                16
+
+/*
+** Layout of an I420 frame as the camera's still port hands it over: the
+** luma plane of sliceHeight rows of stride bytes, then the U and V planes
+** at half the stride and half the rows.
+*/
+typedef struct {
+    int             width;
+    int             height;
+    int             stride;
+    int             sliceHeight;
+}
+FUSION_FORMAT;
+
+/*
+** The kernels for one instruction set. fuseRow() blends a row from each
+** frame, weighting each pixel by how well exposed its guide is. guideRow()
+** averages each 2x2 block of two luma rows, the guide for the chroma.
+*/
+typedef struct {
+    const char *    name;
+    void            (* fuseRow)(const uint8_t * const * values, const uint8_t * const * guides, int count, uint8_t * out, int width);
+    void            (* guideRow)(const uint8_t * row0, const uint8_t * row1, uint8_t * out, int width);
+}
+FUSION_KERNELS;
+
+/*
+** Fuses a bracket of I420 frames into one, exposure fusion style.
+**
+** Each pixel of the result is the average of that pixel in every frame,
+** weighted by how well exposed it is: weights peak at mid grey and fall
+** away towards black and white, so the shadows come from the long
+** exposures and the highlights from the short ones. Chroma is weighted by
+** the luma of its 2x2 block.
+**
+** The weights are per pixel, at a single scale. Mertens' Laplacian pyramid
+** blend needs whole frames at every level, where this works through the
+** frames a tile at a time: the luma rows of a tile are fused, then reused
+** for the chroma guide while still in the cache.
+**
+** The kernels are in NEON on ARM, SSE2 on x86 and plain C otherwise. The
+** plain C kernels are always there too, to check the others against.
+*/
+class ExposureFusion
+{
+private:
+    const FUSION_KERNELS *  kernels;
+
+    uint8_t *               guides;
+    size_t                  guideCapacity;
+
+public:
+    ExposureFusion();
+    ~ExposureFusion();
+
+    static int                      getKernelCount();
+    static const FUSION_KERNELS *   getKernels(int index);
+    static const FUSION_KERNELS *   getBestKernels();
+
+    static size_t   getFrameSize(const FUSION_FORMAT * format);
+
+    void            setKernels(const FUSION_KERNELS * kernels);
+    const char *    getKernelName();
+
+    void            merge(const uint8_t * const * frames, int count, uint8_t * out, const FUSION_FORMAT * format);
+};
+
+#endif
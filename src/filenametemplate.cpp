@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "filenametemplate.h"
+#include "rpi_error.h"
+#include "logger.h"
+
+/*
+** Append a number to the buffer, padded to width with the pad character.
+** Returns the new position, which may pass the end of the buffer (like
+** snprintf) so the caller can tell the name was truncated.
+*/
+static size_t appendNumber(char * buffer, size_t pos, size_t bufferLen, long value, int width, char pad)
+{
+    char            digits[24];
+    int             numDigits = 0;
+    bool            negative = (value < 0);
+    unsigned long   v = negative ? -(unsigned long)value : (unsigned long)value;
+
+    do {
+        digits[numDigits++] = '0' + (v % 10);
+        v /= 10;
+    }
+    while (v);
+
+    if (negative) {
+        width--;
+    }
+
+    // Zero padding goes after the sign, space padding before it
+    if (negative && pad == '0') {
+        if (pos < bufferLen) {
+            buffer[pos] = '-';
+        }
+        pos++;
+    }
+
+    for (int i = numDigits;i < width;i++) {
+        if (pos < bufferLen) {
+            buffer[pos] = pad;
+        }
+        pos++;
+    }
+
+    if (negative && pad != '0') {
+        if (pos < bufferLen) {
+            buffer[pos] = '-';
+        }
+        pos++;
+    }
+
+    while (numDigits--) {
+        if (pos < bufferLen) {
+            buffer[pos] = digits[numDigits];
+        }
+        pos++;
+    }
+
+    return pos;
+}
+
+static size_t appendString(char * buffer, size_t pos, size_t bufferLen, const char * str, size_t len)
+{
+    if (pos < bufferLen) {
+        size_t      n = (len < bufferLen - pos) ? len : bufferLen - pos;
+
+        memcpy(&buffer[pos], str, n);
+    }
+
+    return pos + len;
+}
+
+FilenameTemplate::FilenameTemplate()
+{
+    this->numOps = 0;
+    this->szLiterals[0] = 0;
+    this->usesTime = false;
+    this->usesSequence = false;
+    this->usesGps = false;
+    this->usesCamera = false;
+    this->usesBracket = false;
+    this->hasDirectory = false;
+    this->cachedSecond = (time_t)-1;
+    this->szLastDirectory[0] = 0;
+
+    memset(&this->cachedTime, 0, sizeof(this->cachedTime));
+}
+
+void FilenameTemplate::addOp(OpType type, int width, char pad)
+{
+    if (numOps == TEMPLATE_MAX_OPS) {
+        throw rpi_error("Filename template has too many fields", __FILE__, __LINE__);
+    }
+
+    ops[numOps].type = type;
+    ops[numOps].width = width;
+    ops[numOps].pad = pad;
+    ops[numOps].literal = NULL;
+    ops[numOps].literalLen = 0;
+
+    numOps++;
+}
+
+void FilenameTemplate::compile(const char * pszPattern)
+{
+    const char *    p;
+    size_t          literalPos = 0;
+    bool            hasDateFields = false;
+
+    Logger & log = Logger::getInstance();
+
+    if (strlen(pszPattern) >= sizeof(szLiterals)) {
+        log.logError("Filename template is too long");
+        throw rpi_error("Filename template is too long", __FILE__, __LINE__);
+    }
+
+    numOps = 0;
+    usesTime = false;
+    usesSequence = false;
+    usesGps = false;
+    usesCamera = false;
+    usesBracket = false;
+    hasDirectory = (strchr(pszPattern, '/') != NULL);
+    cachedSecond = (time_t)-1;
+    szLastDirectory[0] = 0;
+
+    // A bare %d is the day only alongside other date fields
+    for (p = pszPattern;(p = strchr(p, '%')) != NULL;p++) {
+        if (p[1] == '%') {
+            p++;
+        }
+        else if (p[1] && strchr("YmHMS", p[1])) {
+            hasDateFields = true;
+        }
+    }
+
+    p = pszPattern;
+
+    while (*p) {
+        if (*p != '%' || p[1] == '%') {
+            // Extend the current literal, or start a new one
+            if (numOps == 0 || ops[numOps - 1].type != OpLiteral) {
+                addOp(OpLiteral, 0, 0);
+                ops[numOps - 1].literal = &szLiterals[literalPos];
+            }
+
+            szLiterals[literalPos++] = *p;
+            ops[numOps - 1].literalLen++;
+
+            p += (*p == '%') ? 2 : 1;
+        }
+        else {
+            int         width = 0;
+            char        pad = ' ';
+            bool        hasWidth = false;
+
+            p++;
+
+            if (*p == '0') {
+                pad = '0';
+            }
+
+            while (isdigit(*p)) {
+                width = width * 10 + (*p - '0');
+                hasWidth = true;
+                p++;
+            }
+
+            switch (*p) {
+                case 'Y':
+                    addOp(OpYear, 4, '0');
+                    usesTime = true;
+                    break;
+
+                case 'm':
+                    addOp(OpMonth, 2, '0');
+                    usesTime = true;
+                    break;
+
+                case 'd':
+                    if (hasWidth || !hasDateFields) {
+                        addOp(OpSequence, width, pad);
+                        usesSequence = true;
+                    }
+                    else {
+                        addOp(OpDay, 2, '0');
+                        usesTime = true;
+                    }
+                    break;
+
+                case 'H':
+                    addOp(OpHour, 2, '0');
+                    usesTime = true;
+                    break;
+
+                case 'M':
+                    addOp(OpMinute, 2, '0');
+                    usesTime = true;
+                    break;
+
+                case 'S':
+                    addOp(OpSecond, 2, '0');
+                    usesTime = true;
+                    break;
+
+                case 'n':
+                    addOp(OpSequence, width, pad);
+                    usesSequence = true;
+                    break;
+
+                case 'c':
+                    addOp(OpCamera, width, pad);
+                    usesCamera = true;
+                    break;
+
+                case 'b':
+                    addOp(OpBracket, width, pad);
+                    usesBracket = true;
+                    break;
+
+                case 'g':
+                    addOp(OpGpsCell, 0, 0);
+                    usesGps = true;
+                    break;
+
+                default:
+                    log.logError("Unknown field '%%%c' in filename template %s", *p ? *p : ' ', pszPattern);
+                    throw rpi_error(rpi_error::buildMsg("Unknown field in filename template %s", pszPattern), __FILE__, __LINE__);
+            }
+
+            p++;
+        }
+    }
+
+    szLiterals[literalPos] = 0;
+
+    log.logDebug("Compiled filename template %s into %d ops", pszPattern, numOps);
+}
+
+/*
+** Render the filename for a frame. Returns the length of the full name,
+** which is >= bufferLen if it did not fit (the buffer is always terminated).
+*/
+int FilenameTemplate::render(char * buffer, size_t bufferLen, const FILENAME_FIELDS * fields)
+{
+    size_t      pos = 0;
+
+    if (usesTime && fields->time != cachedSecond) {
+        localtime_r(&fields->time, &cachedTime);
+        cachedSecond = fields->time;
+    }
+
+    for (int i = 0;i < numOps;i++) {
+        const Op *  op = &ops[i];
+
+        switch (op->type) {
+            case OpLiteral:
+                pos = appendString(buffer, pos, bufferLen, op->literal, op->literalLen);
+                break;
+
+            case OpYear:
+                pos = appendNumber(buffer, pos, bufferLen, cachedTime.tm_year + 1900, op->width, op->pad);
+                break;
+
+            case OpMonth:
+                pos = appendNumber(buffer, pos, bufferLen, cachedTime.tm_mon + 1, op->width, op->pad);
+                break;
+
+            case OpDay:
+                pos = appendNumber(buffer, pos, bufferLen, cachedTime.tm_mday, op->width, op->pad);
+                break;
+
+            case OpHour:
+                pos = appendNumber(buffer, pos, bufferLen, cachedTime.tm_hour, op->width, op->pad);
+                break;
+
+            case OpMinute:
+                pos = appendNumber(buffer, pos, bufferLen, cachedTime.tm_min, op->width, op->pad);
+                break;
+
+            case OpSecond:
+                pos = appendNumber(buffer, pos, bufferLen, cachedTime.tm_sec, op->width, op->pad);
+                break;
+
+            case OpSequence:
+                pos = appendNumber(buffer, pos, bufferLen, fields->sequence, op->width, op->pad);
+                break;
+
+            case OpCamera:
+                pos = appendNumber(buffer, pos, bufferLen, fields->camera, op->width, op->pad);
+                break;
+
+            case OpBracket:
+                pos = appendNumber(buffer, pos, bufferLen, fields->bracket, op->width, op->pad);
+                break;
+
+            case OpGpsCell:
+                if (isnan(fields->latitude) || isnan(fields->longitude)) {
+                    pos = appendString(buffer, pos, bufferLen, "nogps", 5);
+                }
+                else {
+                    pos = appendNumber(buffer, pos, bufferLen, (long)floor(fields->latitude * 10), 0, ' ');
+                    pos = appendString(buffer, pos, bufferLen, "_", 1);
+                    pos = appendNumber(buffer, pos, bufferLen, (long)floor(fields->longitude * 10), 0, ' ');
+                }
+                break;
+        }
+    }
+
+    if (bufferLen) {
+        buffer[pos < bufferLen ? pos : bufferLen - 1] = 0;
+    }
+
+    return (int)pos;
+}
+
+/*
+** Create the directories leading to a rendered filename. Consecutive frames
+** nearly always share a directory, so nothing is done unless it changed.
+*/
+void FilenameTemplate::makeDirectories(const char * pszPath)
+{
+    const char *    pszEnd = strrchr(pszPath, '/');
+    char            szDirectory[FILENAME_MAX];
+    size_t          len;
+
+    if (pszEnd == NULL || pszEnd == pszPath) {
+        return;
+    }
+
+    len = pszEnd - pszPath;
+
+    if (len >= sizeof(szDirectory)) {
+        throw rpi_error("Output directory name is too long", __FILE__, __LINE__);
+    }
+
+    if (strncmp(szLastDirectory, pszPath, len) == 0 && szLastDirectory[len] == 0) {
+        return;
+    }
+
+    memcpy(szDirectory, pszPath, len);
+    szDirectory[len] = 0;
+
+    // Create each level in turn, existing ones are fine
+    for (size_t i = 1;i <= len;i++) {
+        if (szDirectory[i] == '/' || szDirectory[i] == 0) {
+            char        c = szDirectory[i];
+
+            szDirectory[i] = 0;
+
+            if (mkdir(szDirectory, 0755) != 0 && errno != EEXIST) {
+                Logger::getInstance().logError("Failed to create directory %s", szDirectory);
+                throw rpi_error(rpi_error::buildMsg("Failed to create directory %s", szDirectory), __FILE__, __LINE__);
+            }
+
+            szDirectory[i] = c;
+        }
+    }
+
+    strcpy(szLastDirectory, szDirectory);
+
+    Logger::getInstance().logDebug("Created output directory %s", szDirectory);
+}
+
+bool FilenameTemplate::isTimeBased()
+{
+    return usesTime;
+}
+
+bool FilenameTemplate::isSequenced()
+{
+    return usesSequence;
+}
+
+bool FilenameTemplate::isGpsBased()
+{
+    return usesGps;
+}
+
+bool FilenameTemplate::isCameraBased()
+{
+    return usesCamera;
+}
+
+bool FilenameTemplate::isBracketBased()
+{
+    return usesBracket;
+}
+
+bool FilenameTemplate::isSharded()
+{
+    return hasDirectory;
+}
@@ -0,0 +1,101 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef _INCL_FILENAMETEMPLATE
+#define _INCL_FILENAMETEMPLATE
+
+#define TEMPLATE_MAX_OPS                64
+
+/*
+** Values a filename can be built from
+*/
+typedef struct {
+    time_t          time;
+    int             sequence;
+    int             camera;
+    int             bracket;            // Exposure within a bracket, 0 when not bracketing
+    double          latitude;           // NAN when there is no fix
+    double          longitude;
+}
+FILENAME_FIELDS;
+
+/*
+** Output filename template, e.g. "%Y%m%d/%H/frame_%06n.jpg"
+**
+**  %Y %m %d %H %M %S   Year, month, day, hour, minute, second (local time)
+**  %n                  Frame sequence number, %0Nn pads it to N digits
+**  %Nd                 Frame sequence number, as raspistill's -o name%04d.jpg
+**  %c                  Camera number
+**  %b                  Exposure number within a bracket, from 0
+**  %g                  GPS grid cell, latitude and longitude in 0.1 degree steps
+**  %%                  A literal '%'
+**
+** %d on its own is the sequence number when the pattern holds no other time
+** fields, so old style names keep working; with other time fields it is the
+** day of the month.
+**
+** The pattern is compiled once into a list of ops. Rendering walks the ops
+** straight into the caller's buffer without touching the heap, and only
+** converts the time when the second changes.
+*/
+class FilenameTemplate
+{
+private:
+    enum OpType {
+        OpLiteral,
+        OpYear,
+        OpMonth,
+        OpDay,
+        OpHour,
+        OpMinute,
+        OpSecond,
+        OpSequence,
+        OpCamera,
+        OpBracket,
+        OpGpsCell
+    };
+
+    struct Op {
+        OpType          type;
+        int             width;
+        char            pad;
+        const char *    literal;
+        size_t          literalLen;
+    };
+
+    Op              ops[TEMPLATE_MAX_OPS];
+    int             numOps;
+    char            szLiterals[FILENAME_MAX];
+
+    bool            usesTime;
+    bool            usesSequence;
+    bool            usesGps;
+    bool            usesCamera;
+    bool            usesBracket;
+    bool            hasDirectory;
+
+    time_t          cachedSecond;
+    struct tm       cachedTime;
+
+    char            szLastDirectory[FILENAME_MAX];
+
+    void            addOp(OpType type, int width, char pad);
+
+public:
+    FilenameTemplate();
+
+    void            compile(const char * pszPattern);
+
+    int             render(char * buffer, size_t bufferLen, const FILENAME_FIELDS * fields);
+    void            makeDirectories(const char * pszPath);
+
+    bool            isTimeBased();
+    bool            isSequenced();
+    bool            isGpsBased();
+    bool            isCameraBased();
+    bool            isBracketBased();
+    bool            isSharded();
+};
+
+#endif
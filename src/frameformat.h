@@ -0,0 +1,208 @@
+#include <stdint.h>
+
+#ifndef _INCL_FRAMEFORMAT
+#define _INCL_FRAMEFORMAT
+
+/*
+** On-disk formats written by capture. Everything is in the byte order of
+** the host (little endian on the Pi), and each structure carries its own
+** size so later versions can append fields. This header has no other
+** dependencies, so tools can read the files without the camera libraries.
+*/
+
+#define METADATA_RECORD_MAGIC           "RCMD"
+#define METADATA_RECORD_VERSION         2
+
+// The requested settings below were read back from the camera (version 2 on)
+#define METADATA_PARAMETERS_READ_BACK   0x0001
+
+/*
+** Camera settings for one frame, as the binary sidecar and within a
+** segment frame header. The first group is what the camera reported for
+** the frame, the second what it had been asked for, as read back from it.
+** The modes are the MMAL enum values.
+*/
+typedef struct __attribute__((packed)) {
+    char            magic[4];
+    uint16_t        version;
+    uint16_t        size;
+    uint32_t        frame;
+    uint32_t        reports;
+    int64_t         captureTime;        // Wall clock time the frame completed, us since the epoch
+    int64_t         settingsAge;        // Age of the settings report when the frame completed, us
+    uint32_t        exposure;           // us
+    float           analogGain;
+    float           digitalGain;
+    float           awbRedGain;
+    float           awbBlueGain;
+    uint32_t        focusPosition;
+    uint32_t        flags;
+    uint32_t        shutterSpeed;       // us, 0 for auto
+    uint32_t        iso;                // 0 for auto
+    int32_t         exposureCompensation;
+    uint32_t        exposureMode;
+    uint32_t        meteringMode;
+    uint32_t        awbMode;
+}
+FRAME_METADATA_RECORD;
+
+/*
+** Segment files hold a run of frames back to back:
+**
+**  SEGMENT_HEADER
+**  SEGMENT_FRAME_HEADER, frame data    (repeated)
+**  SEGMENT_INDEX_ENTRY                 (one per frame)
+**  SEGMENT_FOOTER
+**
+** The index and footer are only written when the segment is closed. A
+** segment cut short has none, but can still be read by walking the frame
+** headers from the start.
+*/
+#define SEGMENT_MAGIC                   "RCSG"
+#define SEGMENT_FRAME_MAGIC             "RCFR"
+#define SEGMENT_FOOTER_MAGIC            "RCSF"
+#define SEGMENT_VERSION                 2
+
+// The frame stopped early, dataSize is what was received
+#define SEGMENT_FRAME_INCOMPLETE        0x0001
+
+typedef struct __attribute__((packed)) {
+    char            magic[4];
+    uint16_t        version;
+    uint16_t        size;
+    uint32_t        segment;            // Sequence number of the segment in the run
+    uint32_t        encoding;           // MMAL FourCC of the frame data, 0 (JPEG) before version 2
+    int64_t         created;            // Wall clock time, us since the epoch
+}
+SEGMENT_HEADER;
+
+typedef struct __attribute__((packed)) {
+    char                    magic[4];
+    uint16_t                size;
+    uint16_t                flags;
+    uint32_t                dataSize;   // Bytes of frame data following this header
+    FRAME_METADATA_RECORD   metadata;
+}
+SEGMENT_FRAME_HEADER;
+
+typedef struct __attribute__((packed)) {
+    uint64_t        offset;             // Of the frame header, from the start of the segment
+    uint32_t        frame;
+    uint32_t        dataSize;
+    int64_t         captureTime;
+}
+SEGMENT_INDEX_ENTRY;
+
+typedef struct __attribute__((packed)) {
+    char            magic[4];
+    uint16_t        version;
+    uint16_t        size;
+    uint32_t        frames;
+    uint32_t        reserved;
+    uint64_t        indexOffset;        // Of the first index entry, from the start of the segment
+}
+SEGMENT_FOOTER;
+
+/*
+** Frame index files list every frame of a run, or of several runs one
+** after another, as fixed width entries after a short header:
+**
+**  FRAME_INDEX_HEADER
+**  FRAME_INDEX_ENTRY                   (one per frame, in capture order)
+**
+** Entries are only ever appended, the count comes from the file size so
+** there is no header to rewrite. The file is meant to be mmap()ed and
+** binary searched on wallTime, which is in order unless the clock was
+** stepped back between frames.
+*/
+#define FRAME_INDEX_MAGIC               "RCIX"
+#define FRAME_INDEX_VERSION             1
+#define FRAME_INDEX_NAME_LEN            88
+
+// The frame is in a segment file, offset is where its header starts
+#define FRAME_INDEX_IN_SEGMENT          0x0001
+// The file name did not fit, name is empty
+#define FRAME_INDEX_NAME_TOO_LONG       0x0002
+// There was no settings report for the frame, exposure is 0
+#define FRAME_INDEX_NO_SETTINGS         0x0004
+
+typedef struct __attribute__((packed)) {
+    char            magic[4];
+    uint16_t        version;
+    uint16_t        size;
+    uint16_t        entrySize;
+    uint16_t        reserved;
+    uint32_t        reserved2;
+}
+FRAME_INDEX_HEADER;
+
+typedef struct __attribute__((packed)) {
+    uint32_t        frame;
+    uint32_t        flags;
+    int64_t         monotonicTime;      // CLOCK_MONOTONIC us, only comparable within a run
+    int64_t         wallTime;           // us since the epoch
+    uint64_t        offset;             // Of the frame within its file
+    uint32_t        size;               // Bytes of frame data
+    uint32_t        exposure;           // us
+    char            name[FRAME_INDEX_NAME_LEN]; // File holding the frame, relative to the index
+}
+FRAME_INDEX_ENTRY;
+
+/*
+** Shared memory frame ring, a memfd handed to local consumers over a Unix
+** socket. Unlike the files above it is never stored, and its structures
+** are naturally aligned so the fields shared between processes can be
+** used atomically:
+**
+**  FRAME_RING_HEADER
+**  FRAME_RING_SLOT                     (slotCount of them)
+**  frame data                          (slotSize bytes per slot, each page aligned)
+**
+** The producer fills a slot no consumer is holding, bumps its generation
+** to even once the frame is complete, then stores the slot in latest and
+** bumps sequence. Consumers block on sequence with FUTEX_WAIT, setting
+** waiting first so the producer only makes the wake call when someone
+** needs it. To read a frame a consumer stores the slot in holding, then
+** checks the generation is even; the producer checks holding after making
+** a generation odd, and backs off the slot if it is held, so a held slot
+** is never written.
+*/
+#define FRAME_RING_MAGIC                "RCRG"
+#define FRAME_RING_VERSION              2
+#define FRAME_RING_MAX_CONSUMERS        8
+#define FRAME_RING_NO_SLOT              0xFFFFFFFF
+
+// The consumer doesn't need the frames written to disk as well
+#define FRAME_RING_CONSUMER_NO_FILES    0x0001
+
+typedef struct {
+    uint32_t        attached;           // Non-zero while a consumer is connected, written by the producer
+    uint32_t        flags;              // Sent by the consumer when it connects
+    uint32_t        holding;            // Slot being read, FRAME_RING_NO_SLOT for none
+    uint32_t        waiting;            // Non-zero while the consumer may be in FUTEX_WAIT
+}
+FRAME_RING_CONSUMER;
+
+typedef struct {
+    char                    magic[4];
+    uint16_t                version;
+    uint16_t                size;
+    uint32_t                slotCount;
+    uint32_t                slotSize;   // Most frame data a slot can hold
+    uint32_t                sequence;   // Of the newest frame, the futex word
+    uint32_t                latest;     // Slot holding the newest frame, FRAME_RING_NO_SLOT for none
+    FRAME_RING_CONSUMER     consumers[FRAME_RING_MAX_CONSUMERS];
+}
+FRAME_RING_HEADER;
+
+typedef struct {
+    uint32_t                generation; // Odd while the slot is being filled
+    uint32_t                sequence;   // Of the frame in the slot, 0 for none
+    uint32_t                length;     // Bytes of frame data
+    uint32_t                reserved;
+    uint64_t                dataOffset; // Of the frame data, from the start of the ring
+    FRAME_METADATA_RECORD   metadata;
+}
+FRAME_RING_SLOT;
+
+#endif
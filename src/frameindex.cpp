@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "frameindex.h"
+#include "rpi_error.h"
+#include "logger.h"
+
+FrameIndexWriter::FrameIndexWriter()
+{
+    this->fd = -1;
+    this->szDirectory[0] = 0;
+    this->reportedLongName = false;
+}
+
+FrameIndexWriter::~FrameIndexWriter()
+{
+    close();
+}
+
+/*
+** Open the index for appending, creating it if need be
+*/
+void FrameIndexWriter::open(const char * pszIndexFile)
+{
+    FRAME_INDEX_HEADER      header;
+    struct stat             st;
+    const char *            pszSlash;
+    off_t                   entries;
+
+    Logger & log = Logger::getInstance();
+
+    close();
+
+    if (strlen(pszIndexFile) >= sizeof(this->szDirectory)) {
+        throw rpi_error("Frame index file name is too long", __FILE__, __LINE__);
+    }
+
+    pszSlash = strrchr(pszIndexFile, '/');
+
+    if (pszSlash == NULL) {
+        this->szDirectory[0] = 0;
+    }
+    else {
+        // Keep the slash, names are matched against this as a prefix
+        memcpy(this->szDirectory, pszIndexFile, pszSlash - pszIndexFile + 1);
+        this->szDirectory[pszSlash - pszIndexFile + 1] = 0;
+    }
+
+    this->fd = ::open(pszIndexFile, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (this->fd < 0 || fstat(this->fd, &st) != 0) {
+        log.logError("Failed to open frame index %s", pszIndexFile);
+        throw rpi_error(rpi_error::buildMsg("Failed to open frame index %s", pszIndexFile), __FILE__, __LINE__);
+    }
+
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+
+        memcpy(header.magic, FRAME_INDEX_MAGIC, sizeof(header.magic));
+        header.version = FRAME_INDEX_VERSION;
+        header.size = sizeof(header);
+        header.entrySize = sizeof(FRAME_INDEX_ENTRY);
+
+        if (write(this->fd, &header, sizeof(header)) != sizeof(header)) {
+            close();
+            throw rpi_error(rpi_error::buildMsg("Failed to write frame index %s", pszIndexFile), __FILE__, __LINE__);
+        }
+
+        return;
+    }
+
+    if (pread(this->fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, FRAME_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+            header.entrySize != sizeof(FRAME_INDEX_ENTRY))
+    {
+        close();
+
+        log.logError("%s is not a frame index this version can add to", pszIndexFile);
+        throw rpi_error(rpi_error::buildMsg("%s is not a frame index this version can add to", pszIndexFile), __FILE__, __LINE__);
+    }
+
+    entries = (st.st_size - header.size) / header.entrySize;
+
+    // Drop any part entry from a crash, or every later entry would be misaligned
+    if (header.size + entries * header.entrySize != st.st_size) {
+        log.logError("Frame index %s ends in a partial entry, removing it", pszIndexFile);
+
+        if (ftruncate(this->fd, header.size + entries * header.entrySize) != 0) {
+            close();
+            throw rpi_error(rpi_error::buildMsg("Failed to repair frame index %s", pszIndexFile), __FILE__, __LINE__);
+        }
+    }
+
+    log.logDebug("Frame index %s holds %lld frames", pszIndexFile, (long long)entries);
+}
+
+void FrameIndexWriter::close()
+{
+    if (this->fd >= 0) {
+        ::close(this->fd);
+        this->fd = -1;
+    }
+}
+
+/*
+** Names are stored relative to the index where they can be, so the
+** index and captures can be moved together
+*/
+const char * FrameIndexWriter::getRelativeName(const char * pszPath)
+{
+    size_t      dirLen = strlen(this->szDirectory);
+
+    if (dirLen && strncmp(pszPath, this->szDirectory, dirLen) == 0) {
+        return &pszPath[dirLen];
+    }
+
+    if (dirLen == 0 && strncmp(pszPath, "./", 2) == 0) {
+        return &pszPath[2];
+    }
+
+    return pszPath;
+}
+
+void FrameIndexWriter::append(
+            const char * pszPath,
+            uint64_t offset,
+            uint32_t size,
+            const FRAME_METADATA_RECORD * metadata,
+            bool inSegment,
+            bool hasSettings)
+{
+    FRAME_INDEX_ENTRY       entry;
+    struct timespec         now;
+    const char *            pszName;
+
+    Logger & log = Logger::getInstance();
+
+    if (this->fd < 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    memset(&entry, 0, sizeof(entry));
+
+    entry.frame = metadata->frame;
+    entry.monotonicTime = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    entry.wallTime = metadata->captureTime;
+    entry.offset = offset;
+    entry.size = size;
+    entry.exposure = metadata->exposure;
+
+    if (inSegment) {
+        entry.flags |= FRAME_INDEX_IN_SEGMENT;
+    }
+
+    if (!hasSettings) {
+        entry.flags |= FRAME_INDEX_NO_SETTINGS;
+    }
+
+    pszName = getRelativeName(pszPath);
+
+    if (strlen(pszName) < sizeof(entry.name)) {
+        strcpy(entry.name, pszName);
+    }
+    else {
+        entry.flags |= FRAME_INDEX_NAME_TOO_LONG;
+
+        if (!this->reportedLongName) {
+            log.logError("%s is too long for the frame index, the frame is listed without its name", pszName);
+            this->reportedLongName = true;
+        }
+    }
+
+    if (write(this->fd, &entry, sizeof(entry)) != sizeof(entry)) {
+        log.logError("Failed to add frame %u to the frame index: %s", entry.frame, strerror(errno));
+    }
+}
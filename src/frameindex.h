@@ -0,0 +1,41 @@
+#include <stdint.h>
+
+#include "frameformat.h"
+
+#ifndef _INCL_FRAMEINDEX
+#define _INCL_FRAMEINDEX
+
+#define FRAME_INDEX_MAX_PATH_LEN        512
+
+/*
+** Appends an entry for each captured frame to a frame index file, see
+** frameformat.h for the layout. Each append is a single write() of one
+** fixed width entry, a torn entry left by a crash is cut off the next time
+** the index is opened.
+*/
+class FrameIndexWriter
+{
+private:
+    int             fd;
+    char            szDirectory[FRAME_INDEX_MAX_PATH_LEN];
+    bool            reportedLongName;
+
+    const char *    getRelativeName(const char * pszPath);
+
+public:
+    FrameIndexWriter();
+    ~FrameIndexWriter();
+
+    void        open(const char * pszIndexFile);
+    void        close();
+
+    void        append(
+                    const char * pszPath,
+                    uint64_t offset,
+                    uint32_t size,
+                    const FRAME_METADATA_RECORD * metadata,
+                    bool inSegment,
+                    bool hasSettings);
+};
+
+#endif
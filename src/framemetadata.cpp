@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "framemetadata.h"
+#include "rpi_error.h"
+#include "logger.h"
+
+static int64_t clockMicroseconds(clockid_t clock)
+{
+    struct timespec     ts;
+
+    clock_gettime(clock, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+FrameMetadata::FrameMetadata()
+{
+    memset(&this->settings, 0, sizeof(this->settings));
+    memset(&this->parameters, 0, sizeof(this->parameters));
+
+    this->valid = false;
+    this->parametersValid = false;
+    this->frame = 0;
+    this->captureTime = 0;
+    this->settingsAge = 0;
+}
+
+int FrameMetadata::parseFormat(const char * pszFormat)
+{
+    if (strcmp(pszFormat, "json") == 0) {
+        return METADATA_FORMAT_JSON;
+    }
+    else if (strcmp(pszFormat, "binary") == 0 || strcmp(pszFormat, "bin") == 0) {
+        return METADATA_FORMAT_BINARY;
+    }
+    else if (strcmp(pszFormat, "none") == 0) {
+        return METADATA_FORMAT_NONE;
+    }
+
+    return -1;
+}
+
+const char * FrameMetadata::getExtension(int format)
+{
+    return (format == METADATA_FORMAT_BINARY ? ".meta" : ".json");
+}
+
+/*
+** Take a snapshot of the latest settings report. This never blocks the
+** MMAL callback thread that publishes to the slot. params are the settings
+** the camera was asked for, as read back from it, NULL if they weren't.
+*/
+void FrameMetadata::capture(const RASPICAM_SETTINGS_SLOT * slot, const RASPICAM_CAMERA_PARAMETERS * params, uint32_t frameNum)
+{
+    this->frame = frameNum;
+
+    this->parametersValid = (params != NULL);
+
+    if (params) {
+        memcpy(&this->parameters, params, sizeof(this->parameters));
+    }
+    this->captureTime = clockMicroseconds(CLOCK_REALTIME);
+
+    this->valid = (raspicamcontrol_get_camera_settings(slot, &this->settings) == 0);
+
+    if (this->valid) {
+        this->settingsAge = clockMicroseconds(CLOCK_MONOTONIC) - this->settings.timestamp;
+    }
+    else {
+        this->settingsAge = 0;
+    }
+}
+
+bool FrameMetadata::isValid()
+{
+    return this->valid;
+}
+
+const RASPICAM_CAMERA_SETTINGS & FrameMetadata::getSettings()
+{
+    return this->settings;
+}
+
+int FrameMetadata::formatJSON(char * buffer, size_t bufferLen)
+{
+    char        szSettings[256];
+    char        szParameters[256];
+
+    if (this->valid) {
+        snprintf(
+            szSettings,
+            sizeof(szSettings),
+            "{\"exposure_us\":%u,\"analog_gain\":%.4f,\"digital_gain\":%.4f,"
+            "\"awb_red_gain\":%.4f,\"awb_blue_gain\":%.4f,\"focus_position\":%u,"
+            "\"reports\":%u,\"age_us\":%lld}",
+            this->settings.exposure,
+            this->settings.analog_gain,
+            this->settings.digital_gain,
+            this->settings.awb_red_gain,
+            this->settings.awb_blue_gain,
+            this->settings.focus_position,
+            this->settings.reports,
+            (long long)this->settingsAge);
+    }
+    else {
+        strcpy(szSettings, "null");
+    }
+
+    if (this->parametersValid) {
+        snprintf(
+            szParameters,
+            sizeof(szParameters),
+            "{\"shutter_speed_us\":%d,\"iso\":%d,\"exposure_compensation\":%d,"
+            "\"exposure_mode\":\"%s\",\"metering_mode\":\"%s\",\"awb_mode\":\"%s\"}",
+            this->parameters.shutter_speed,
+            this->parameters.ISO,
+            this->parameters.exposureCompensation,
+            raspicamcontrol_get_exposure_mode_name(this->parameters.exposureMode),
+            raspicamcontrol_get_metering_mode_name(this->parameters.exposureMeterMode),
+            raspicamcontrol_get_awb_mode_name(this->parameters.awbMode));
+    }
+    else {
+        strcpy(szParameters, "null");
+    }
+
+    return snprintf(
+            buffer,
+            bufferLen,
+            "{\"frame\":%u,\"capture_time_us\":%lld,\"settings\":%s,\"parameters\":%s}\n",
+            this->frame,
+            (long long)this->captureTime,
+            szSettings,
+            szParameters);
+}
+
+void FrameMetadata::buildRecord(FRAME_METADATA_RECORD * record)
+{
+    memset(record, 0, sizeof(FRAME_METADATA_RECORD));
+
+    memcpy(record->magic, METADATA_RECORD_MAGIC, sizeof(record->magic));
+    record->version = METADATA_RECORD_VERSION;
+    record->size = sizeof(FRAME_METADATA_RECORD);
+    record->frame = this->frame;
+    record->captureTime = this->captureTime;
+
+    if (this->valid) {
+        record->reports = this->settings.reports;
+        record->settingsAge = this->settingsAge;
+        record->exposure = this->settings.exposure;
+        record->analogGain = this->settings.analog_gain;
+        record->digitalGain = this->settings.digital_gain;
+        record->awbRedGain = this->settings.awb_red_gain;
+        record->awbBlueGain = this->settings.awb_blue_gain;
+        record->focusPosition = this->settings.focus_position;
+    }
+
+    if (this->parametersValid) {
+        record->flags |= METADATA_PARAMETERS_READ_BACK;
+        record->shutterSpeed = this->parameters.shutter_speed;
+        record->iso = this->parameters.ISO;
+        record->exposureCompensation = this->parameters.exposureCompensation;
+        record->exposureMode = this->parameters.exposureMode;
+        record->meteringMode = this->parameters.exposureMeterMode;
+        record->awbMode = this->parameters.awbMode;
+    }
+}
+
+/*
+** Write the sidecar next to the image, e.g. out.jpg -> out.jpg.json,
+** returns the number of bytes written
+*/
+size_t FrameMetadata::writeSidecar(const char * pszImageFile, int format)
+{
+    FILE *                  fp;
+    char                    szFileName[512];
+    char                    szJSON[640];
+    FRAME_METADATA_RECORD   record;
+    const void *            data;
+    size_t                  dataLen;
+
+    Logger & log = Logger::getInstance();
+
+    if (format == METADATA_FORMAT_NONE) {
+        return 0;
+    }
+
+    if (format == METADATA_FORMAT_BINARY) {
+        buildRecord(&record);
+
+        data = &record;
+        dataLen = sizeof(record);
+    }
+    else {
+        int len = formatJSON(szJSON, sizeof(szJSON));
+
+        data = szJSON;
+        dataLen = (len < (int)sizeof(szJSON) ? len : sizeof(szJSON) - 1);
+    }
+
+    snprintf(szFileName, sizeof(szFileName), "%s%s", pszImageFile, getExtension(format));
+
+    fp = fopen(szFileName, "wb");
+
+    if (fp == NULL) {
+        log.logError("Failed to open metadata file %s", szFileName);
+        throw rpi_error(rpi_error::buildMsg("Failed to open metadata file %s", szFileName), __FILE__, __LINE__);
+    }
+
+    if (fwrite(data, 1, dataLen, fp) != dataLen) {
+        fclose(fp);
+
+        log.logError("Failed to write metadata file %s", szFileName);
+        throw rpi_error(rpi_error::buildMsg("Failed to write metadata file %s", szFileName), __FILE__, __LINE__);
+    }
+
+    fclose(fp);
+
+    log.logDebug("Wrote metadata file %s", szFileName);
+
+    return dataLen;
+}
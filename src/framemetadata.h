@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "frameformat.h"
+
+#include <interface/mmal/mmal.h>
+#include <interface/mmal/mmal_parameters_camera.h>
+
+extern "C" {
+#include "RaspiCamControl.h"
+}
+
+#ifndef _INCL_FRAMEMETADATA
+#define _INCL_FRAMEMETADATA
+
+/*
+** Sidecar formats...
+*/
+#define METADATA_FORMAT_NONE            0
+#define METADATA_FORMAT_JSON            1
+#define METADATA_FORMAT_BINARY          2
+
+class FrameMetadata
+{
+private:
+    RASPICAM_CAMERA_SETTINGS    settings;
+    bool                        valid;
+    RASPICAM_CAMERA_PARAMETERS  parameters;
+    bool                        parametersValid;
+    uint32_t                    frame;
+    int64_t                     captureTime;
+    int64_t                     settingsAge;
+
+public:
+    FrameMetadata();
+
+    static int  parseFormat(const char * pszFormat);
+    static const char * getExtension(int format);
+
+    void        capture(const RASPICAM_SETTINGS_SLOT * slot, const RASPICAM_CAMERA_PARAMETERS * params, uint32_t frameNum);
+
+    bool        isValid();
+    const RASPICAM_CAMERA_SETTINGS & getSettings();
+
+    void        buildRecord(FRAME_METADATA_RECORD * record);
+    int         formatJSON(char * buffer, size_t bufferLen);
+    size_t      writeSidecar(const char * pszImageFile, int format);
+};
+
+#endif
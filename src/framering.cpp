@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "framering.h"
+#include "rpi_error.h"
+#include "logger.h"
+#include "threadpolicy.h"
+
+static size_t roundToPage(size_t size)
+{
+    size_t      page = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) / page * page;
+}
+
+FrameRing::FrameRing()
+{
+    this->szPath[0] = 0;
+
+    this->memFd = -1;
+    this->map = NULL;
+    this->mapSize = 0;
+    this->header = NULL;
+    this->slots = NULL;
+
+    this->listenFd = -1;
+    this->eventFd = -1;
+
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        this->clientFds[i] = -1;
+    }
+
+    this->running = false;
+    this->stopRequested = false;
+
+    this->filling = -1;
+    this->lastFilled = -1;
+    this->fillLength = 0;
+    this->fillOverflow = false;
+
+    this->sequence = 0;
+    this->published = 0;
+    this->dropped = 0;
+
+    pthread_mutex_init(&this->mutex, NULL);
+}
+
+FrameRing::~FrameRing()
+{
+    stop();
+
+    pthread_mutex_destroy(&this->mutex);
+}
+
+/*
+** Create the ring of slotCount slots of slotSize bytes and listen for
+** consumers on the Unix socket pszPath. The memfd only takes memory for
+** the pages frames are written to, so slotSize can be a generous bound.
+*/
+void FrameRing::start(const char * pszPath, int slotCount, size_t slotSize)
+{
+    struct sockaddr_un      addr;
+    size_t                  dataStart;
+    size_t                  slotStride;
+
+    Logger & log = Logger::getInstance();
+
+    stop();
+
+    if (strlen(pszPath) >= sizeof(addr.sun_path)) {
+        throw rpi_error(rpi_error::buildMsg("Frame ring socket path %s is too long", pszPath), __FILE__, __LINE__);
+    }
+
+    if (slotCount < 2 || slotSize == 0 || slotSize > UINT32_MAX) {
+        throw rpi_error("Invalid frame ring size", __FILE__, __LINE__);
+    }
+
+    dataStart = roundToPage(sizeof(FRAME_RING_HEADER) + slotCount * sizeof(FRAME_RING_SLOT));
+    slotStride = roundToPage(slotSize);
+
+    this->mapSize = dataStart + slotCount * slotStride;
+
+    this->memFd = memfd_create("rpicapture-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (this->memFd < 0 || ftruncate(this->memFd, this->mapSize) != 0) {
+        log.logError("Failed to create the frame ring: %s", strerror(errno));
+        stop();
+        throw rpi_error("Failed to create the frame ring", __FILE__, __LINE__);
+    }
+
+    // A consumer could otherwise shrink the ring under everyone else's mappings
+    fcntl(this->memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    this->map = (uint8_t *)mmap(NULL, this->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, this->memFd, 0);
+
+    if (this->map == MAP_FAILED) {
+        this->map = NULL;
+        stop();
+        throw rpi_error("Failed to map the frame ring", __FILE__, __LINE__);
+    }
+
+    this->header = (FRAME_RING_HEADER *)this->map;
+    this->slots = (FRAME_RING_SLOT *)(this->map + sizeof(FRAME_RING_HEADER));
+
+    memcpy(this->header->magic, FRAME_RING_MAGIC, sizeof(this->header->magic));
+    this->header->version = FRAME_RING_VERSION;
+    this->header->size = sizeof(FRAME_RING_HEADER);
+    this->header->slotCount = slotCount;
+    this->header->slotSize = slotSize;
+    this->header->sequence = 0;
+    this->header->latest = FRAME_RING_NO_SLOT;
+
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        this->header->consumers[i].holding = FRAME_RING_NO_SLOT;
+    }
+
+    for (int i = 0; i < slotCount; i++) {
+        this->slots[i].dataOffset = dataStart + i * slotStride;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, pszPath);
+
+    this->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    this->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (this->listenFd < 0 || this->eventFd < 0) {
+        stop();
+        throw rpi_error("Failed to create the frame ring socket", __FILE__, __LINE__);
+    }
+
+    // A socket left behind by a previous run would stop the bind
+    unlink(pszPath);
+
+    if (bind(this->listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(this->listenFd, FRAME_RING_MAX_CONSUMERS) != 0) {
+        log.logError("Failed to listen on %s: %s", pszPath, strerror(errno));
+        stop();
+        throw rpi_error(rpi_error::buildMsg("Failed to listen on %s", pszPath), __FILE__, __LINE__);
+    }
+
+    chmod(pszPath, 0660);
+
+    strcpy(this->szPath, pszPath);
+
+    this->stopRequested = false;
+
+    if (pthread_create(&this->thread, NULL, threadEntry, this)) {
+        stop();
+        throw rpi_error("Failed to start frame ring thread", __FILE__, __LINE__);
+    }
+
+    this->running = true;
+
+    log.logInfo("Publishing frames to %d slots of %u KB, consumers connect on %s", slotCount, (unsigned int)(slotSize / 1024), pszPath);
+}
+
+void FrameRing::stop()
+{
+    uint64_t        one = 1;
+
+    if (this->running) {
+        pthread_mutex_lock(&this->mutex);
+        this->stopRequested = true;
+        pthread_mutex_unlock(&this->mutex);
+
+        if (write(this->eventFd, &one, sizeof(one)) != sizeof(one)) {
+            Logger::getInstance().logError("Failed to wake frame ring thread");
+        }
+
+        pthread_join(this->thread, NULL);
+
+        this->running = false;
+    }
+
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        detachConsumer(i);
+    }
+
+    if (this->listenFd >= 0) {
+        ::close(this->listenFd);
+        this->listenFd = -1;
+    }
+
+    if (this->szPath[0]) {
+        unlink(this->szPath);
+        this->szPath[0] = 0;
+    }
+
+    if (this->eventFd >= 0) {
+        ::close(this->eventFd);
+        this->eventFd = -1;
+    }
+
+    // Consumers keep their own mappings, the memory goes once they let go
+    if (this->map != NULL) {
+        munmap(this->map, this->mapSize);
+        this->map = NULL;
+    }
+
+    this->header = NULL;
+    this->slots = NULL;
+
+    if (this->memFd >= 0) {
+        ::close(this->memFd);
+        this->memFd = -1;
+    }
+
+    this->filling = -1;
+}
+
+/*
+** Whether frames still need writing to disk. Only once every consumer
+** connected has said it doesn't need them, with no consumers the files
+** are the only place the frames go.
+*/
+bool FrameRing::wantsFiles()
+{
+    int     attached = 0;
+
+    if (!this->running) {
+        return true;
+    }
+
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        FRAME_RING_CONSUMER * consumer = &this->header->consumers[i];
+
+        if (__atomic_load_n(&consumer->attached, __ATOMIC_ACQUIRE)) {
+            if (!(consumer->flags & FRAME_RING_CONSUMER_NO_FILES)) {
+                return true;
+            }
+
+            attached++;
+        }
+    }
+
+    return (attached == 0);
+}
+
+bool FrameRing::isHeld(int slot)
+{
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        if (__atomic_load_n(&this->header->consumers[i].holding, __ATOMIC_SEQ_CST) == (uint32_t)slot) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+** Give up on the slot being filled, leaving it empty
+*/
+void FrameRing::abandonFrame()
+{
+    FRAME_RING_SLOT *   slot = &this->slots[this->filling];
+
+    slot->sequence = 0;
+    slot->length = 0;
+
+    __atomic_store_n(&slot->generation, slot->generation + 1, __ATOMIC_RELEASE);
+
+    this->filling = -1;
+}
+
+/*
+** Pick the slot for the next frame, before the capture is triggered.
+** The newest frame and any slot a consumer is reading are left alone.
+*/
+void FrameRing::beginFrame()
+{
+    int     count;
+
+    if (!this->running) {
+        return;
+    }
+
+    if (this->filling >= 0) {
+        abandonFrame();
+    }
+
+    this->fillLength = 0;
+    this->fillOverflow = false;
+
+    count = this->header->slotCount;
+
+    for (int n = 1; n <= count; n++) {
+        int                 i = (this->lastFilled + n + count) % count;
+        FRAME_RING_SLOT *   slot = &this->slots[i];
+        uint32_t            generation = slot->generation;
+
+        if ((uint32_t)i == this->header->latest || isHeld(i)) {
+            continue;
+        }
+
+        // Claim the slot, then check again in case a consumer took hold of it meanwhile
+        __atomic_store_n(&slot->generation, generation + 1, __ATOMIC_SEQ_CST);
+
+        if (isHeld(i)) {
+            __atomic_store_n(&slot->generation, generation, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        this->filling = i;
+        break;
+    }
+}
+
+/*
+** Copy the next piece of the frame the encoder is producing, straight
+** into the shared memory. Called on the encoder callback thread.
+*/
+void FrameRing::addData(const uint8_t * data, size_t length)
+{
+    FRAME_RING_SLOT *   slot;
+
+    if (this->filling < 0 || this->fillOverflow) {
+        return;
+    }
+
+    if (this->fillLength + length > this->header->slotSize) {
+        this->fillOverflow = true;
+        return;
+    }
+
+    slot = &this->slots[this->filling];
+
+    memcpy(this->map + slot->dataOffset + this->fillLength, data, length);
+    this->fillLength += length;
+}
+
+/*
+** The capture has finished, make the frame the newest and wake any
+** consumers waiting for it. Incomplete frames and frames that found no
+** free slot are dropped.
+*/
+void FrameRing::publish(const FRAME_METADATA_RECORD * record, bool complete)
+{
+    FRAME_RING_SLOT *   slot;
+    bool                wake = false;
+
+    if (!this->running) {
+        return;
+    }
+
+    if (this->filling < 0 || this->fillOverflow || !complete) {
+        if (this->filling >= 0) {
+            abandonFrame();
+        }
+
+        if (this->fillOverflow) {
+            Logger::getInstance().logError("Frame too big for the frame ring, %u byte slots", this->header->slotSize);
+        }
+
+        this->dropped++;
+        return;
+    }
+
+    slot = &this->slots[this->filling];
+
+    slot->length = this->fillLength;
+    slot->sequence = ++this->sequence;
+    memcpy(&slot->metadata, record, sizeof(slot->metadata));
+
+    __atomic_store_n(&slot->generation, slot->generation + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&this->header->latest, (uint32_t)this->filling, __ATOMIC_RELEASE);
+    __atomic_store_n(&this->header->sequence, this->sequence, __ATOMIC_SEQ_CST);
+
+    // Consumers that aren't waiting will see the new sequence without the syscall
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        if (__atomic_load_n(&this->header->consumers[i].waiting, __ATOMIC_SEQ_CST)) {
+            wake = true;
+            break;
+        }
+    }
+
+    if (wake) {
+        syscall(SYS_futex, &this->header->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+
+    this->lastFilled = this->filling;
+    this->filling = -1;
+    this->published++;
+}
+
+int FrameRing::getConsumers()
+{
+    int     count = 0;
+
+    if (!this->running) {
+        return 0;
+    }
+
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        if (__atomic_load_n(&this->header->consumers[i].attached, __ATOMIC_ACQUIRE)) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+unsigned int FrameRing::getPublished()
+{
+    return this->published;
+}
+
+unsigned int FrameRing::getDropped()
+{
+    return this->dropped;
+}
+
+void FrameRing::acceptConsumers()
+{
+    int         fd;
+
+    Logger & log = Logger::getInstance();
+
+    while ((fd = accept4(this->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int     i;
+
+        for (i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+            if (this->clientFds[i] < 0) {
+                break;
+            }
+        }
+
+        if (i == FRAME_RING_MAX_CONSUMERS) {
+            log.logError("Too many frame ring consumers, turning one away");
+            ::close(fd);
+            continue;
+        }
+
+        this->clientFds[i] = fd;
+    }
+}
+
+/*
+** The consumer has sent its flags, give it the ring
+*/
+void FrameRing::attachConsumer(int consumer)
+{
+    FRAME_RING_CONSUMER *   entry = &this->header->consumers[consumer];
+    uint32_t                flags;
+    uint32_t                index = consumer;
+    struct msghdr           msg;
+    struct iovec            iov;
+    struct cmsghdr *        cmsg;
+    char                    control[CMSG_SPACE(sizeof(int))];
+
+    Logger & log = Logger::getInstance();
+
+    if (recv(this->clientFds[consumer], &flags, sizeof(flags), 0) != sizeof(flags)) {
+        detachConsumer(consumer);
+        return;
+    }
+
+    entry->flags = flags;
+    entry->holding = FRAME_RING_NO_SLOT;
+    entry->waiting = 0;
+
+    __atomic_store_n(&entry->attached, 1, __ATOMIC_RELEASE);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+
+    iov.iov_base = &index;
+    iov.iov_len = sizeof(index);
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &this->memFd, sizeof(int));
+
+    if (sendmsg(this->clientFds[consumer], &msg, MSG_NOSIGNAL) != sizeof(index)) {
+        log.logError("Failed to send the frame ring to consumer %d", consumer);
+        detachConsumer(consumer);
+        return;
+    }
+
+    log.logDebug("Frame ring consumer %d attached%s", consumer, (flags & FRAME_RING_CONSUMER_NO_FILES) ? ", no files needed" : "");
+}
+
+/*
+** The consumer has gone, whether it said so or not, so whatever slot it
+** was holding is free again
+*/
+void FrameRing::detachConsumer(int consumer)
+{
+    if (this->clientFds[consumer] < 0) {
+        return;
+    }
+
+    ::close(this->clientFds[consumer]);
+    this->clientFds[consumer] = -1;
+
+    if (this->header != NULL) {
+        FRAME_RING_CONSUMER * entry = &this->header->consumers[consumer];
+
+        if (__atomic_load_n(&entry->attached, __ATOMIC_ACQUIRE)) {
+            Logger::getInstance().logDebug("Frame ring consumer %d detached", consumer);
+        }
+
+        __atomic_store_n(&entry->attached, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&entry->waiting, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&entry->holding, FRAME_RING_NO_SLOT, __ATOMIC_SEQ_CST);
+        entry->flags = 0;
+    }
+}
+
+void * FrameRing::threadEntry(void * arg)
+{
+    ((FrameRing *)arg)->run();
+
+    return NULL;
+}
+
+void FrameRing::run()
+{
+    struct pollfd       fds[FRAME_RING_MAX_CONSUMERS + 2];
+    int                 owner[FRAME_RING_MAX_CONSUMERS + 2];
+    bool                done = false;
+
+    ThreadPolicy::getInstance().applyBackground("frame ring");
+
+    while (!done) {
+        int     count = 2;
+
+        fds[0].fd = this->eventFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = this->listenFd;
+        fds[1].events = POLLIN;
+
+        for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+            if (this->clientFds[i] >= 0) {
+                fds[count].fd = this->clientFds[i];
+                fds[count].events = POLLIN;
+                owner[count] = i;
+                count++;
+            }
+        }
+
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            Logger::getInstance().logError("Frame ring poll failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 2; i < count; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+
+            // Consumers only ever send their flags, anything after is the socket closing
+            if ((fds[i].revents & POLLIN) && !this->header->consumers[owner[i]].attached) {
+                attachConsumer(owner[i]);
+            }
+            else {
+                detachConsumer(owner[i]);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            acceptConsumers();
+        }
+
+        pthread_mutex_lock(&this->mutex);
+        done = this->stopRequested;
+        pthread_mutex_unlock(&this->mutex);
+    }
+}
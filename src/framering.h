@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "frameformat.h"
+
+#ifndef _INCL_FRAMERING
+#define _INCL_FRAMERING
+
+#define FRAME_RING_MAX_PATH_LEN         108     // sun_path
+
+/*
+** Publishes each encoded frame, with its camera settings, in a shared
+** memory ring that local consumers map and read in place.
+**
+** The ring is a memfd, so it never touches the filesystem. Consumers
+** connect to a Unix socket, say whether they still need the frames on
+** disk, and are sent the memfd over the socket. From then on everything
+** goes through the shared memory, with a futex to wake consumers waiting
+** for the next frame. See FRAME_RING_HEADER for the protocol.
+**
+** The encoder callback copies each frame straight into a free slot, the
+** only copy made. A slot a consumer is reading is never refilled, so a
+** slow consumer just misses frames. The socket is watched by a thread
+** that hands out the memfd and frees the slot of a consumer that goes away.
+*/
+class FrameRing
+{
+private:
+    char                    szPath[FRAME_RING_MAX_PATH_LEN];
+
+    int                     memFd;
+    uint8_t *               map;
+    size_t                  mapSize;
+    FRAME_RING_HEADER *     header;
+    FRAME_RING_SLOT *       slots;
+
+    int                     listenFd;
+    int                     eventFd;
+    int                     clientFds[FRAME_RING_MAX_CONSUMERS];
+
+    pthread_t               thread;
+    pthread_mutex_t         mutex;
+    bool                    running;
+    bool                    stopRequested;
+
+    int                     filling;            // Slot being filled, -1 for none
+    int                     lastFilled;
+    uint32_t                fillLength;
+    bool                    fillOverflow;       // The frame is bigger than a slot
+
+    uint32_t                sequence;
+    unsigned int            published;
+    unsigned int            dropped;
+
+    bool                    isHeld(int slot);
+    void                    abandonFrame();
+
+    void                    acceptConsumers();
+    void                    attachConsumer(int consumer);
+    void                    detachConsumer(int consumer);
+
+    static void *           threadEntry(void * arg);
+    void                    run();
+
+public:
+    FrameRing();
+    ~FrameRing();
+
+    void            start(const char * pszPath, int slotCount, size_t slotSize);
+    void            stop();
+
+    bool            wantsFiles();
+
+    void            beginFrame();
+    void            addData(const uint8_t * data, size_t length);
+    void            publish(const FRAME_METADATA_RECORD * record, bool complete);
+
+    int             getConsumers();
+    unsigned int    getPublished();
+    unsigned int    getDropped();
+};
+
+#endif
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fusionworker.h"
+#include "rpi_error.h"
+#include "logger.h"
+#include "threadpolicy.h"
+
+static int64_t monotonicMicroseconds()
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+FusionWorker::FusionWorker()
+{
+    this->running = false;
+    this->stopRequested = false;
+    this->busy = false;
+
+    this->fused = 0;
+    this->failed = 0;
+    this->totalFuseUs = 0;
+    this->maxFuseUs = 0;
+
+    pthread_mutex_init(&this->mutex, NULL);
+    pthread_cond_init(&this->cond, NULL);
+}
+
+FusionWorker::~FusionWorker()
+{
+    stop();
+
+    pthread_cond_destroy(&this->cond);
+    pthread_mutex_destroy(&this->mutex);
+}
+
+void * FusionWorker::threadEntry(void * arg)
+{
+    ((FusionWorker *)arg)->run();
+
+    return NULL;
+}
+
+/*
+** Fuse one bracket and write it out. The frames are freed either way.
+*/
+void FusionWorker::process(FUSION_JOB * job)
+{
+    size_t      frameSize = ExposureFusion::getFrameSize(&job->format);
+    uint8_t *   out;
+    int64_t     start;
+
+    Logger & log = Logger::getInstance();
+
+    job->bytes = 0;
+    job->fuseUs = 0;
+
+    // Zeroed, the padding isn't fused
+    out = (uint8_t *)calloc(1, frameSize);
+
+    if (out == NULL) {
+        log.logError("No memory to fuse %d frames", job->count);
+    }
+    else {
+        try {
+            start = monotonicMicroseconds();
+
+            this->fusion.merge(job->frames, job->count, out, &job->format);
+
+            job->fuseUs = monotonicMicroseconds() - start;
+
+            if (fwrite(out, 1, frameSize, job->output) == frameSize) {
+                job->bytes = frameSize;
+            }
+            else {
+                log.logError("Failed to write fused frame");
+            }
+        }
+        catch (rpi_error & e) {
+            log.logError("%s", e.what());
+        }
+
+        free(out);
+    }
+
+    for (int i = 0; i < job->count; i++) {
+        free(job->frames[i]);
+        job->frames[i] = NULL;
+    }
+
+    log.logDebug(
+        "Fused %d frames in %lld ms, %lld ms after they were captured",
+        job->count,
+        (long long)(job->fuseUs / 1000),
+        (long long)((monotonicMicroseconds() - job->queued) / 1000));
+}
+
+void FusionWorker::run()
+{
+    ThreadPolicy::getInstance().applyBackground("fusion");
+
+    pthread_mutex_lock(&this->mutex);
+
+    while (true) {
+        FUSION_JOB *    job;
+
+        if (this->pending.empty()) {
+            if (this->stopRequested) {
+                break;
+            }
+
+            pthread_cond_wait(&this->cond, &this->mutex);
+            continue;
+        }
+
+        job = this->pending.front();
+        this->pending.pop_front();
+        this->busy = true;
+
+        // Room for the next bracket
+        pthread_cond_broadcast(&this->cond);
+
+        pthread_mutex_unlock(&this->mutex);
+
+        process(job);
+
+        pthread_mutex_lock(&this->mutex);
+
+        if (job->bytes) {
+            this->fused++;
+            this->totalFuseUs += job->fuseUs;
+
+            if (job->fuseUs > this->maxFuseUs) {
+                this->maxFuseUs = job->fuseUs;
+            }
+        }
+        else {
+            this->failed++;
+        }
+
+        this->finished.push_back(job);
+        this->busy = false;
+
+        pthread_cond_broadcast(&this->cond);
+    }
+
+    pthread_mutex_unlock(&this->mutex);
+}
+
+void FusionWorker::start()
+{
+    Logger & log = Logger::getInstance();
+
+    stop();
+
+    this->stopRequested = false;
+
+    if (pthread_create(&this->thread, NULL, threadEntry, this)) {
+        log.logError("Failed to start fusion thread");
+        throw rpi_error("Failed to start fusion thread", __FILE__, __LINE__);
+    }
+
+    this->running = true;
+
+    log.logDebug("Fusing brackets with the %s kernels", getKernelName());
+}
+
+/*
+** Brackets still waiting are fused before the thread exits, and left to
+** be collected
+*/
+void FusionWorker::stop()
+{
+    if (!this->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&this->mutex);
+    this->stopRequested = true;
+    pthread_cond_broadcast(&this->cond);
+    pthread_mutex_unlock(&this->mutex);
+
+    pthread_join(this->thread, NULL);
+
+    this->running = false;
+
+    Logger::getInstance().logDebug(
+        "Fusion took a mean of %lld ms, worst %lld ms",
+        (long long)(this->fused ? this->totalFuseUs / this->fused / 1000 : 0),
+        (long long)(this->maxFuseUs / 1000));
+}
+
+void FusionWorker::submit(FUSION_JOB * job)
+{
+    job->queued = monotonicMicroseconds();
+
+    pthread_mutex_lock(&this->mutex);
+
+    while (this->pending.size() >= FUSION_MAX_PENDING) {
+        pthread_cond_wait(&this->cond, &this->mutex);
+    }
+
+    this->pending.push_back(job);
+
+    pthread_cond_broadcast(&this->cond);
+    pthread_mutex_unlock(&this->mutex);
+}
+
+/*
+** The next job written, NULL if there is none yet. With wait set, waits
+** for one unless none are outstanding.
+*/
+FUSION_JOB * FusionWorker::collect(bool wait)
+{
+    FUSION_JOB *    job = NULL;
+
+    pthread_mutex_lock(&this->mutex);
+
+    while (wait && this->finished.empty() && (!this->pending.empty() || this->busy)) {
+        pthread_cond_wait(&this->cond, &this->mutex);
+    }
+
+    if (!this->finished.empty()) {
+        job = this->finished.front();
+        this->finished.pop_front();
+    }
+
+    pthread_mutex_unlock(&this->mutex);
+
+    return job;
+}
+
+const char * FusionWorker::getKernelName()
+{
+    return this->fusion.getKernelName();
+}
+
+unsigned int FusionWorker::getFused()
+{
+    return this->fused;
+}
+
+unsigned int FusionWorker::getFailed()
+{
+    return this->failed;
+}
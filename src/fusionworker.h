@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+
+#include "exposurefusion.h"
+
+#ifndef _INCL_FUSIONWORKER
+#define _INCL_FUSIONWORKER
+
+// Brackets waiting to be fused before submit() holds the capture up, each is a few frames in memory
+#define FUSION_MAX_PENDING              2
+
+/*
+** A bracket to fuse, and where the result goes
+*/
+typedef struct {
+    uint8_t *       frames[FUSION_MAX_FRAMES];  // malloc()ed, freed by the worker once fused
+    int             count;
+    FUSION_FORMAT   format;
+    FILE *          output;                     // Written by the worker, closed by the caller
+    void *          context;                    // The caller's, untouched
+    size_t          bytes;                      // Bytes written to output, 0 if the fusion failed
+    int64_t         queued;                     // CLOCK_MONOTONIC us
+    int64_t         fuseUs;                     // Time to fuse the frames
+}
+FUSION_JOB;
+
+/*
+** Fuses brackets on a thread of its own, so the next bracket can be
+** captured meanwhile.
+**
+** Jobs go in with submit() and come back with collect() once written,
+** for the caller to close the file and account for it. Only the worker
+** touches a job in between. submit() waits while FUSION_MAX_PENDING jobs
+** are queued, rather than letting the frames pile up in memory. Every
+** job submitted should be collected before the worker is deleted.
+*/
+class FusionWorker
+{
+private:
+    ExposureFusion              fusion;
+
+    pthread_t                   thread;
+    pthread_mutex_t             mutex;
+    pthread_cond_t              cond;
+    bool                        running;
+    bool                        stopRequested;
+    bool                        busy;
+
+    std::deque<FUSION_JOB *>    pending;
+    std::deque<FUSION_JOB *>    finished;
+
+    unsigned int                fused;
+    unsigned int                failed;
+    int64_t                     totalFuseUs;
+    int64_t                     maxFuseUs;
+
+    static void *   threadEntry(void * arg);
+    void            run();
+    void            process(FUSION_JOB * job);
+
+public:
+    FusionWorker();
+    ~FusionWorker();
+
+    void            start();
+    void            stop();
+
+    void            submit(FUSION_JOB * job);
+    FUSION_JOB *    collect(bool wait);
+
+    const char *    getKernelName();
+    unsigned int    getFused();
+    unsigned int    getFailed();
+};
+
+#endif
@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mjpegserver.h"
+#include "rpi_error.h"
+#include "logger.h"
+#include "threadpolicy.h"
+
+#define MJPEG_BOUNDARY                  "rpicapture"
+
+#define MJPEG_TOKEN_LISTEN              0
+#define MJPEG_TOKEN_EVENT               1
+#define MJPEG_TOKEN_CLIENT              2
+
+static const char szResponse[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Connection: close\r\n"
+    "Cache-Control: no-cache, no-store\r\n"
+    "Pragma: no-cache\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n"
+    "\r\n";
+
+MjpegServer::MjpegServer()
+{
+    for (int i = 0; i < MJPEG_RING_SLOTS; i++) {
+        this->slots[i].data = NULL;
+        this->slots[i].capacity = 0;
+        this->slots[i].length = 0;
+        this->slots[i].sequence = 0;
+        this->slots[i].refs = 0;
+    }
+
+    for (int i = 0; i < MJPEG_MAX_CLIENTS; i++) {
+        this->clients[i].fd = -1;
+    }
+
+    this->listenFd = -1;
+    this->epollFd = -1;
+    this->eventFd = -1;
+
+    this->running = false;
+    this->stopRequested = false;
+
+    this->filling = -1;
+    this->fillFailed = false;
+    this->fillSkipped = false;
+    this->latest = -1;
+    this->sequence = 0;
+
+    this->clientCount = 0;
+    this->published = 0;
+    this->dropped = 0;
+
+    pthread_mutex_init(&this->mutex, NULL);
+}
+
+MjpegServer::~MjpegServer()
+{
+    stop();
+
+    for (int i = 0; i < MJPEG_RING_SLOTS; i++) {
+        free(this->slots[i].data);
+    }
+
+    pthread_mutex_destroy(&this->mutex);
+}
+
+/*
+** Listen on pszAddress:port, NULL for every interface
+*/
+void MjpegServer::start(const char * pszAddress, int port)
+{
+    struct sockaddr_in      addr;
+    struct epoll_event      ev;
+    int                     on = 1;
+
+    Logger & log = Logger::getInstance();
+
+    stop();
+
+    memset(&addr, 0, sizeof(addr));
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (pszAddress != NULL && inet_pton(AF_INET, pszAddress, &addr.sin_addr) != 1) {
+        throw rpi_error(rpi_error::buildMsg("Invalid stream address %s", pszAddress), __FILE__, __LINE__);
+    }
+
+    this->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (this->listenFd < 0) {
+        throw rpi_error("Failed to create stream socket", __FILE__, __LINE__);
+    }
+
+    setsockopt(this->listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(this->listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(this->listenFd, MJPEG_MAX_CLIENTS) != 0) {
+        ::close(this->listenFd);
+        this->listenFd = -1;
+
+        log.logError("Failed to listen on port %d: %s", port, strerror(errno));
+        throw rpi_error(rpi_error::buildMsg("Failed to listen on port %d", port), __FILE__, __LINE__);
+    }
+
+    this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    this->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (this->epollFd < 0 || this->eventFd < 0) {
+        stop();
+        throw rpi_error("Failed to set up stream event handling", __FILE__, __LINE__);
+    }
+
+    memset(&ev, 0, sizeof(ev));
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = MJPEG_TOKEN_LISTEN;
+    epoll_ctl(this->epollFd, EPOLL_CTL_ADD, this->listenFd, &ev);
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = MJPEG_TOKEN_EVENT;
+    epoll_ctl(this->epollFd, EPOLL_CTL_ADD, this->eventFd, &ev);
+
+    this->stopRequested = false;
+
+    if (pthread_create(&this->thread, NULL, threadEntry, this)) {
+        stop();
+        throw rpi_error("Failed to start stream server thread", __FILE__, __LINE__);
+    }
+
+    this->running = true;
+
+    log.logInfo("Streaming MJPEG on port %d", port);
+}
+
+void MjpegServer::stop()
+{
+    uint64_t        one = 1;
+
+    if (this->running) {
+        pthread_mutex_lock(&this->mutex);
+        this->stopRequested = true;
+        pthread_mutex_unlock(&this->mutex);
+
+        if (write(this->eventFd, &one, sizeof(one)) != sizeof(one)) {
+            Logger::getInstance().logError("Failed to wake stream server thread");
+        }
+
+        pthread_join(this->thread, NULL);
+
+        this->running = false;
+    }
+
+    for (int i = 0; i < MJPEG_MAX_CLIENTS; i++) {
+        if (this->clients[i].fd >= 0) {
+            dropClient(&this->clients[i]);
+        }
+    }
+
+    if (this->eventFd >= 0) {
+        ::close(this->eventFd);
+        this->eventFd = -1;
+    }
+
+    if (this->epollFd >= 0) {
+        ::close(this->epollFd);
+        this->epollFd = -1;
+    }
+
+    if (this->listenFd >= 0) {
+        ::close(this->listenFd);
+        this->listenFd = -1;
+    }
+}
+
+/*
+** Copy the next piece of the frame the encoder is producing. Called on
+** the encoder callback thread.
+*/
+void MjpegServer::addData(const uint8_t * data, size_t length)
+{
+    Slot *      slot;
+
+    if (!this->running || this->fillFailed || this->fillSkipped) {
+        return;
+    }
+
+    if (this->filling < 0) {
+        pthread_mutex_lock(&this->mutex);
+
+        if (this->clientCount == 0) {
+            this->fillSkipped = true;
+        }
+        else {
+            for (int i = 0; i < MJPEG_RING_SLOTS; i++) {
+                if (i != this->latest && this->slots[i].refs == 0) {
+                    this->filling = i;
+                    break;
+                }
+            }
+
+            if (this->filling < 0) {
+                this->fillFailed = true;
+            }
+        }
+
+        pthread_mutex_unlock(&this->mutex);
+
+        if (this->filling < 0) {
+            return;
+        }
+
+        this->slots[this->filling].length = 0;
+    }
+
+    slot = &this->slots[this->filling];
+
+    // Slots keep their memory, so this only happens until they've seen the largest frame
+    if (slot->length + length > slot->capacity) {
+        size_t      capacity = slot->capacity * 2;
+        uint8_t *   newData;
+
+        if (capacity < slot->length + length) {
+            capacity = slot->length + length;
+        }
+
+        newData = (uint8_t *)realloc(slot->data, capacity);
+
+        if (newData == NULL) {
+            this->fillFailed = true;
+            return;
+        }
+
+        slot->data = newData;
+        slot->capacity = capacity;
+    }
+
+    memcpy(&slot->data[slot->length], data, length);
+    slot->length += length;
+}
+
+/*
+** The frame is complete, make it the one viewers are sent next
+*/
+void MjpegServer::endFrame(bool complete)
+{
+    uint64_t        one = 1;
+
+    if (!this->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&this->mutex);
+
+    if (this->filling >= 0 && complete && !this->fillFailed) {
+        this->slots[this->filling].sequence = ++this->sequence;
+        this->latest = this->filling;
+        this->published++;
+    }
+    else if (this->fillFailed) {
+        this->dropped++;
+    }
+
+    pthread_mutex_unlock(&this->mutex);
+
+    this->filling = -1;
+    this->fillFailed = false;
+    this->fillSkipped = false;
+
+    if (write(this->eventFd, &one, sizeof(one)) != sizeof(one)) {
+        Logger::getInstance().logError("Failed to wake stream server thread");
+    }
+}
+
+int MjpegServer::getClients()
+{
+    int     count;
+
+    pthread_mutex_lock(&this->mutex);
+    count = this->clientCount;
+    pthread_mutex_unlock(&this->mutex);
+
+    return count;
+}
+
+unsigned int MjpegServer::getPublished()
+{
+    unsigned int    count;
+
+    pthread_mutex_lock(&this->mutex);
+    count = this->published;
+    pthread_mutex_unlock(&this->mutex);
+
+    return count;
+}
+
+unsigned int MjpegServer::getDropped()
+{
+    unsigned int    count;
+
+    pthread_mutex_lock(&this->mutex);
+    count = this->dropped;
+    pthread_mutex_unlock(&this->mutex);
+
+    return count;
+}
+
+void * MjpegServer::threadEntry(void * arg)
+{
+    ((MjpegServer *)arg)->run();
+
+    return NULL;
+}
+
+void MjpegServer::setWantWrite(Client * client, bool wantWrite)
+{
+    struct epoll_event      ev;
+
+    if (client->wantWrite == wantWrite) {
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+
+    ev.events = EPOLLIN | (wantWrite ? EPOLLOUT : 0);
+    ev.data.u64 = MJPEG_TOKEN_CLIENT + (client - this->clients);
+
+    epoll_ctl(this->epollFd, EPOLL_CTL_MOD, client->fd, &ev);
+
+    client->wantWrite = wantWrite;
+}
+
+void MjpegServer::releaseSlot(Client * client)
+{
+    if (client->slot >= 0) {
+        pthread_mutex_lock(&this->mutex);
+        this->slots[client->slot].refs--;
+        pthread_mutex_unlock(&this->mutex);
+
+        client->slot = -1;
+    }
+}
+
+void MjpegServer::dropClient(Client * client)
+{
+    releaseSlot(client);
+
+    if (this->epollFd >= 0) {
+        epoll_ctl(this->epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+    }
+
+    ::close(client->fd);
+    client->fd = -1;
+
+    pthread_mutex_lock(&this->mutex);
+    this->clientCount--;
+    pthread_mutex_unlock(&this->mutex);
+
+    Logger::getInstance().logDebug("Stream viewer disconnected");
+}
+
+void MjpegServer::acceptClients()
+{
+    struct epoll_event      ev;
+    int                     fd;
+
+    Logger & log = Logger::getInstance();
+
+    while ((fd = accept4(this->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        Client *    client = NULL;
+
+        for (int i = 0; i < MJPEG_MAX_CLIENTS; i++) {
+            if (this->clients[i].fd < 0) {
+                client = &this->clients[i];
+                break;
+            }
+        }
+
+        if (client == NULL) {
+            log.logError("Too many stream viewers, turning one away");
+            ::close(fd);
+            continue;
+        }
+
+        client->fd = fd;
+        client->wantWrite = false;
+        client->responded = false;
+        client->requestLen = 0;
+        client->headLen = 0;
+        client->slot = -1;
+        client->sent = 0;
+        client->lastSequence = 0;
+
+        memset(&ev, 0, sizeof(ev));
+
+        ev.events = EPOLLIN;
+        ev.data.u64 = MJPEG_TOKEN_CLIENT + (client - this->clients);
+
+        epoll_ctl(this->epollFd, EPOLL_CTL_ADD, fd, &ev);
+
+        pthread_mutex_lock(&this->mutex);
+        this->clientCount++;
+        pthread_mutex_unlock(&this->mutex);
+
+        log.logDebug("Stream viewer connected");
+    }
+}
+
+/*
+** Any request gets the stream, once the headers have all arrived. After
+** that anything the viewer sends is ignored.
+*/
+void MjpegServer::readRequest(Client * client)
+{
+    char        buffer[256];
+    ssize_t     n;
+
+    while (true) {
+        if (!client->responded) {
+            n = recv(client->fd, &client->request[client->requestLen], sizeof(client->request) - client->requestLen - 1, 0);
+        }
+        else {
+            n = recv(client->fd, buffer, sizeof(buffer), 0);
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        else if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (n <= 0) {
+            dropClient(client);
+            return;
+        }
+
+        if (!client->responded) {
+            client->requestLen += n;
+            client->request[client->requestLen] = 0;
+
+            if (strstr(client->request, "\r\n\r\n") != NULL || strstr(client->request, "\n\n") != NULL) {
+                memcpy(client->head, szResponse, sizeof(szResponse) - 1);
+                client->headLen = sizeof(szResponse) - 1;
+                client->sent = 0;
+                client->responded = true;
+
+                pump(client);
+                return;
+            }
+
+            if (client->requestLen >= sizeof(client->request) - 1) {
+                dropClient(client);
+                return;
+            }
+        }
+    }
+}
+
+/*
+** Send as much as the socket will take, moving on to the newest frame
+** each time one is finished
+*/
+void MjpegServer::pump(Client * client)
+{
+    static const char   szTail[] = "\r\n";
+
+    while (client->fd >= 0) {
+        struct iovec        iov[3];
+        struct msghdr       msg;
+        size_t              dataLen;
+        size_t              total;
+        size_t              skip;
+        int                 iovCount = 0;
+        ssize_t             n;
+
+        if (client->headLen == 0) {
+            int     next = -1;
+
+            pthread_mutex_lock(&this->mutex);
+
+            if (this->latest >= 0 && this->slots[this->latest].sequence != client->lastSequence) {
+                next = this->latest;
+                this->slots[next].refs++;
+            }
+
+            pthread_mutex_unlock(&this->mutex);
+
+            if (next < 0) {
+                // Nothing new, wait to be told of the next frame
+                setWantWrite(client, false);
+                return;
+            }
+
+            client->slot = next;
+            client->lastSequence = this->slots[next].sequence;
+            client->sent = 0;
+            client->headLen = snprintf(
+                                client->head,
+                                sizeof(client->head),
+                                "--" MJPEG_BOUNDARY "\r\n"
+                                "Content-Type: image/jpeg\r\n"
+                                "Content-Length: %u\r\n"
+                                "\r\n",
+                                (unsigned int)this->slots[next].length);
+        }
+
+        dataLen = (client->slot >= 0 ? this->slots[client->slot].length : 0);
+        total = client->headLen + dataLen + (client->slot >= 0 ? 2 : 0);
+        skip = client->sent;
+
+        if (skip < client->headLen) {
+            iov[iovCount].iov_base = &client->head[skip];
+            iov[iovCount].iov_len = client->headLen - skip;
+            iovCount++;
+            skip = 0;
+        }
+        else {
+            skip -= client->headLen;
+        }
+
+        if (client->slot >= 0) {
+            if (skip < dataLen) {
+                iov[iovCount].iov_base = &this->slots[client->slot].data[skip];
+                iov[iovCount].iov_len = dataLen - skip;
+                iovCount++;
+                skip = 0;
+            }
+            else {
+                skip -= dataLen;
+            }
+
+            iov[iovCount].iov_base = (void *)&szTail[skip];
+            iov[iovCount].iov_len = 2 - skip;
+            iovCount++;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovCount;
+
+        n = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                setWantWrite(client, true);
+            }
+            else if (errno != EINTR) {
+                dropClient(client);
+            }
+
+            if (errno != EINTR) {
+                return;
+            }
+
+            continue;
+        }
+
+        client->sent += n;
+
+        if (client->sent == total) {
+            releaseSlot(client);
+            client->headLen = 0;
+            client->sent = 0;
+        }
+    }
+}
+
+void MjpegServer::run()
+{
+    struct epoll_event      events[MJPEG_MAX_CLIENTS + 2];
+    uint64_t                count;
+    int                     n;
+
+    Logger & log = Logger::getInstance();
+
+    ThreadPolicy::getInstance().applyBackground("stream");
+
+    while (true) {
+        bool    newFrame = false;
+
+        n = epoll_wait(this->epollFd, events, MJPEG_MAX_CLIENTS + 2, -1);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log.logError("Stream server stopped: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t    token = events[i].data.u64;
+
+            if (token == MJPEG_TOKEN_LISTEN) {
+                acceptClients();
+            }
+            else if (token == MJPEG_TOKEN_EVENT) {
+                if (read(this->eventFd, &count, sizeof(count)) == sizeof(count)) {
+                    newFrame = true;
+                }
+            }
+            else {
+                Client * client = &this->clients[token - MJPEG_TOKEN_CLIENT];
+
+                if (client->fd < 0) {
+                    continue;
+                }
+
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    dropClient(client);
+                    continue;
+                }
+
+                if (events[i].events & EPOLLIN) {
+                    readRequest(client);
+                }
+
+                if (client->fd >= 0 && (events[i].events & EPOLLOUT)) {
+                    pump(client);
+                }
+            }
+        }
+
+        pthread_mutex_lock(&this->mutex);
+
+        if (this->stopRequested) {
+            pthread_mutex_unlock(&this->mutex);
+            break;
+        }
+
+        pthread_mutex_unlock(&this->mutex);
+
+        // Viewers still busy with a frame pick up the new one when they finish
+        if (newFrame) {
+            for (int i = 0; i < MJPEG_MAX_CLIENTS; i++) {
+                Client * client = &this->clients[i];
+
+                if (client->fd >= 0 && client->responded && !client->wantWrite) {
+                    pump(client);
+                }
+            }
+        }
+    }
+}
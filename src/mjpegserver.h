@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifndef _INCL_MJPEGSERVER
+#define _INCL_MJPEGSERVER
+
+#define MJPEG_RING_SLOTS                4
+#define MJPEG_MAX_CLIENTS               8
+#define MJPEG_HEAD_LEN                  256
+#define MJPEG_REQUEST_LEN               1024
+
+/*
+** Serves the encoded frames as a multipart/x-mixed-replace MJPEG stream,
+** so the capture can be watched while it runs.
+**
+** The encoder callback copies each frame into a small ring of slots
+** shared by every viewer, one encode feeds them all. Viewers are served
+** from a single epoll thread with non-blocking sends, each always moving
+** on to the newest frame once it has finished sending the last. A slow
+** viewer just skips frames, nothing queues up behind it. A slot is only
+** refilled once no viewer is sending it, and if every slot is busy the
+** new frame is not streamed at all.
+*/
+class MjpegServer
+{
+private:
+    struct Slot {
+        uint8_t *       data;
+        size_t          capacity;
+        size_t          length;
+        uint32_t        sequence;
+        int             refs;
+    };
+
+    struct Client {
+        int             fd;
+        bool            wantWrite;
+        bool            responded;
+        char            request[MJPEG_REQUEST_LEN];
+        size_t          requestLen;
+        char            head[MJPEG_HEAD_LEN];
+        size_t          headLen;
+        int             slot;               // Being sent, -1 for none
+        size_t          sent;               // Of head, data and the closing CRLF
+        uint32_t        lastSequence;
+    };
+
+    Slot                slots[MJPEG_RING_SLOTS];
+    Client              clients[MJPEG_MAX_CLIENTS];
+
+    int                 listenFd;
+    int                 epollFd;
+    int                 eventFd;
+
+    pthread_t           thread;
+    pthread_mutex_t     mutex;              // Slot refs, sequence and latest
+    bool                running;
+    bool                stopRequested;
+
+    int                 filling;            // Written by the encoder callback, -1 for none
+    bool                fillFailed;         // No free slot or memory, the frame is dropped
+    bool                fillSkipped;        // Nobody watching, the frame isn't copied
+    int                 latest;             // Newest complete frame, -1 for none
+    uint32_t            sequence;
+
+    int                 clientCount;
+    unsigned int        published;
+    unsigned int        dropped;
+
+    void                acceptClients();
+    void                readRequest(Client * client);
+    void                pump(Client * client);
+    void                setWantWrite(Client * client, bool wantWrite);
+    void                dropClient(Client * client);
+    void                releaseSlot(Client * client);
+
+    static void *       threadEntry(void * arg);
+    void                run();
+
+public:
+    MjpegServer();
+    ~MjpegServer();
+
+    void            start(const char * pszAddress, int port);
+    void            stop();
+
+    void            addData(const uint8_t * data, size_t length);
+    void            endFrame(bool complete);
+
+    int             getClients();
+    unsigned int    getPublished();
+    unsigned int    getDropped();
+};
+
+#endif
@@ -0,0 +1,619 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "outputmanager.h"
+#include "rpi_error.h"
+#include "logger.h"
+#include "threadpolicy.h"
+
+OutputManager::OutputManager()
+{
+    this->maxFiles = 0;
+    this->maxBytes = 0;
+
+    this->szDirectory[0] = 0;
+    this->directoryFd = -1;
+
+    this->shard = 0;
+    this->shardFd = -1;
+    this->shardFiles = 0;
+    this->shardBytes = 0;
+
+    this->preallocate = false;
+    this->sizeEstimate = 0;
+    this->syncPolicy = NULL;
+
+    this->threadRunning = false;
+    this->stopRequested = false;
+    this->generation = 0;
+    this->requestedShard = -1;
+    this->nextShard = -1;
+    this->nextShardFd = -1;
+
+    pthread_mutex_init(&this->mutex, NULL);
+    pthread_cond_init(&this->cond, NULL);
+}
+
+OutputManager::~OutputManager()
+{
+    if (this->threadRunning) {
+        pthread_mutex_lock(&this->mutex);
+        this->stopRequested = true;
+        pthread_cond_signal(&this->cond);
+        pthread_mutex_unlock(&this->mutex);
+
+        pthread_join(this->thread, NULL);
+    }
+
+    // Any still open are left to their owners, only the directories go
+    for (size_t i = 0; i < this->openFiles.size(); i++) {
+        ::close(this->openFiles[i].dirFd);
+    }
+
+    closeDirectory();
+
+    pthread_cond_destroy(&this->cond);
+    pthread_mutex_destroy(&this->mutex);
+}
+
+void OutputManager::setLimits(unsigned int maxFiles, uint64_t maxBytes)
+{
+    this->maxFiles = maxFiles;
+    this->maxBytes = maxBytes;
+
+    if (isSharded() && !this->threadRunning) {
+        if (pthread_create(&this->thread, NULL, threadEntry, this)) {
+            throw rpi_error("Failed to start output directory thread", __FILE__, __LINE__);
+        }
+
+        this->threadRunning = true;
+    }
+}
+
+void OutputManager::setPreallocate(bool preallocate)
+{
+    this->preallocate = preallocate;
+}
+
+/*
+** Files are handed to the policy to be synced as they are closed
+*/
+void OutputManager::setSyncPolicy(SyncPolicy * policy)
+{
+    this->syncPolicy = policy;
+}
+
+bool OutputManager::isSharded()
+{
+    return (this->maxFiles > 0 || this->maxBytes > 0);
+}
+
+/*
+** Create (or reuse) a shard directory and return an fd for it
+*/
+int OutputManager::createShard(int dirFd, unsigned int shard)
+{
+    char        szName[16];
+    int         fd;
+
+    snprintf(szName, sizeof(szName), "%06u", shard);
+
+    if (mkdirat(dirFd, szName, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    fd = openat(dirFd, szName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    return fd;
+}
+
+/*
+** The highest numbered shard already in the directory, -1 if there are none
+*/
+int OutputManager::findLastShard(int dirFd)
+{
+    DIR *               dir;
+    struct dirent *     entry;
+    int                 fd = dup(dirFd);
+    int                 last = -1;
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    dir = fdopendir(fd);
+
+    if (dir == NULL) {
+        ::close(fd);
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        const char *    pszName = entry->d_name;
+        struct stat     st;
+        int             shard = 0;
+        int             i;
+
+        for (i = 0; i < 6 && pszName[i] >= '0' && pszName[i] <= '9'; i++) {
+            shard = shard * 10 + (pszName[i] - '0');
+        }
+
+        if (i < 6 || pszName[6] != 0 || shard <= last) {
+            continue;
+        }
+
+        if (fstatat(dirFd, pszName, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+            last = shard;
+        }
+    }
+
+    // Also closes fd
+    closedir(dir);
+
+    return last;
+}
+
+/*
+** Count the files already in a shard, and their bytes
+*/
+void OutputManager::countShard(int shardFd)
+{
+    DIR *               dir;
+    struct dirent *     entry;
+    int                 fd = dup(shardFd);
+
+    this->shardFiles = 0;
+    this->shardBytes = 0;
+
+    if (fd < 0) {
+        return;
+    }
+
+    dir = fdopendir(fd);
+
+    if (dir == NULL) {
+        ::close(fd);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat     st;
+
+        if (fstatat(shardFd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+            this->shardFiles++;
+            this->shardBytes += st.st_size;
+        }
+    }
+
+    closedir(dir);
+}
+
+void * OutputManager::threadEntry(void * arg)
+{
+    ((OutputManager *)arg)->run();
+
+    return NULL;
+}
+
+void OutputManager::run()
+{
+    ThreadPolicy::getInstance().applyBackground("output");
+
+    pthread_mutex_lock(&this->mutex);
+
+    while (!this->stopRequested) {
+        if (this->requestedShard >= 0) {
+            int             shard = this->requestedShard;
+            unsigned int    generation = this->generation;
+            int             dirFd = dup(this->directoryFd);
+            int             fd;
+
+            this->requestedShard = -1;
+
+            pthread_mutex_unlock(&this->mutex);
+
+            fd = (dirFd >= 0) ? createShard(dirFd, shard) : -1;
+
+            if (dirFd >= 0) {
+                ::close(dirFd);
+            }
+
+            pthread_mutex_lock(&this->mutex);
+
+            // The directory may have moved on while we were busy
+            if (generation != this->generation) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+            else {
+                if (this->nextShardFd >= 0) {
+                    ::close(this->nextShardFd);
+                }
+
+                this->nextShard = shard;
+                this->nextShardFd = fd;
+            }
+        }
+        else {
+            pthread_cond_wait(&this->cond, &this->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&this->mutex);
+}
+
+/*
+** Ask the background thread to have the given shard ready. The caller
+** must hold the mutex.
+*/
+void OutputManager::requestShard(unsigned int shard)
+{
+    this->requestedShard = shard;
+    pthread_cond_signal(&this->cond);
+}
+
+void OutputManager::closeDirectory()
+{
+    if (this->shardFd >= 0) {
+        ::close(this->shardFd);
+        this->shardFd = -1;
+    }
+
+    pthread_mutex_lock(&this->mutex);
+
+    if (this->nextShardFd >= 0) {
+        ::close(this->nextShardFd);
+        this->nextShardFd = -1;
+    }
+
+    this->nextShard = -1;
+    this->requestedShard = -1;
+    this->generation++;
+
+    if (this->directoryFd >= 0) {
+        ::close(this->directoryFd);
+        this->directoryFd = -1;
+    }
+
+    pthread_mutex_unlock(&this->mutex);
+
+    this->szDirectory[0] = 0;
+}
+
+void OutputManager::setDirectory(const char * pszDirectory)
+{
+    int         fd;
+
+    Logger & log = Logger::getInstance();
+
+    closeDirectory();
+
+    fd = ::open(pszDirectory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0) {
+        log.logError("Failed to open output directory %s", pszDirectory);
+        throw rpi_error(rpi_error::buildMsg("Failed to open output directory %s", pszDirectory), __FILE__, __LINE__);
+    }
+
+    pthread_mutex_lock(&this->mutex);
+    this->directoryFd = fd;
+    pthread_mutex_unlock(&this->mutex);
+
+    strcpy(this->szDirectory, pszDirectory);
+
+    if (isSharded()) {
+        int     last = findLastShard(fd);
+
+        // Carry on where the last run left off, rather than overfilling its first shard
+        this->shard = (last > 0) ? last : 0;
+        this->shardFd = createShard(fd, this->shard);
+
+        if (this->shardFd < 0) {
+            log.logError("Failed to create shard directory in %s", pszDirectory);
+            throw rpi_error(rpi_error::buildMsg("Failed to create shard directory in %s", pszDirectory), __FILE__, __LINE__);
+        }
+
+        countShard(this->shardFd);
+
+        if (last >= 0) {
+            log.logDebug(
+                "Resuming shard %06u of %s, %u files, %llu bytes",
+                this->shard,
+                pszDirectory,
+                this->shardFiles,
+                (unsigned long long)this->shardBytes);
+        }
+
+        pthread_mutex_lock(&this->mutex);
+        requestShard(this->shard + 1);
+        pthread_mutex_unlock(&this->mutex);
+    }
+}
+
+void OutputManager::rollShard()
+{
+    int         fd = -1;
+
+    Logger & log = Logger::getInstance();
+
+    ::close(this->shardFd);
+    this->shardFd = -1;
+
+    this->shard++;
+    this->shardFiles = 0;
+    this->shardBytes = 0;
+
+    pthread_mutex_lock(&this->mutex);
+
+    if (this->nextShard == (int)this->shard && this->nextShardFd >= 0) {
+        fd = this->nextShardFd;
+        this->nextShardFd = -1;
+        this->nextShard = -1;
+    }
+
+    requestShard(this->shard + 1);
+
+    pthread_mutex_unlock(&this->mutex);
+
+    // Only if the background thread has fallen behind
+    if (fd < 0) {
+        log.logDebug("Shard %06u not ready, creating it now", this->shard);
+        fd = createShard(this->directoryFd, this->shard);
+    }
+
+    if (fd < 0) {
+        log.logError("Failed to create shard directory %06u", this->shard);
+        throw rpi_error(rpi_error::buildMsg("Failed to create shard directory %06u", this->shard), __FILE__, __LINE__);
+    }
+
+    this->shardFd = fd;
+
+    log.logDebug("Rolled output to shard %06u", this->shard);
+}
+
+/*
+** Switch to the directory part of pszFileName, if it isn't the one in use,
+** and return the file's own name
+*/
+const char * OutputManager::selectDirectory(const char * pszFileName)
+{
+    const char *    pszSlash = strrchr(pszFileName, '/');
+    const char *    pszBaseName = pszSlash ? pszSlash + 1 : pszFileName;
+    char            szDirectory[OUTPUT_MAX_PATH_LEN];
+    size_t          dirLen;
+
+    if (pszSlash == NULL) {
+        strcpy(szDirectory, ".");
+    }
+    else {
+        dirLen = (pszSlash == pszFileName) ? 1 : pszSlash - pszFileName;
+
+        if (dirLen >= sizeof(szDirectory)) {
+            throw rpi_error("Output directory name is too long", __FILE__, __LINE__);
+        }
+
+        memcpy(szDirectory, pszFileName, dirLen);
+        szDirectory[dirLen] = 0;
+    }
+
+    if (this->directoryFd < 0 || strcmp(szDirectory, this->szDirectory) != 0) {
+        setDirectory(szDirectory);
+    }
+
+    return pszBaseName;
+}
+
+/*
+** Whether a file was created in the shard and directory now in use
+*/
+bool OutputManager::isCurrent(const OUTPUT_OPEN_FILE & file)
+{
+    return (file.generation == this->generation && file.shard == this->shard);
+}
+
+/*
+** Stop tracking an open file and return what was kept for it. The caller
+** closes its dirFd, which is -1 if the file wasn't opened here.
+*/
+OUTPUT_OPEN_FILE OutputManager::releaseFile(int fd)
+{
+    OUTPUT_OPEN_FILE    file;
+
+    for (size_t i = 0; i < this->openFiles.size(); i++) {
+        if (this->openFiles[i].fd == fd) {
+            file = this->openFiles[i];
+            this->openFiles.erase(this->openFiles.begin() + i);
+            return file;
+        }
+    }
+
+    Logger::getInstance().logError("Output file %d was not opened by the output manager", fd);
+
+    file.fd = fd;
+    file.dirFd = -1;
+    file.shard = 0;
+    file.generation = 0;
+    file.estimate = false;
+
+    return file;
+}
+
+/*
+** Whether a file of that name is already where open() would put it
+*/
+bool OutputManager::exists(const char * pszFileName)
+{
+    const char *    pszBaseName = selectDirectory(pszFileName);
+    struct stat     st;
+
+    return (fstatat(isSharded() ? this->shardFd : this->directoryFd, pszBaseName, &st, 0) == 0);
+}
+
+/*
+** Hand a file still being written to the sync policy, for what has been
+** written to it so far to be synced with the next group
+*/
+void OutputManager::sync(FILE * fp)
+{
+    int         fd = fileno(fp);
+
+    fflush(fp);
+
+    if (this->syncPolicy) {
+        for (size_t i = 0; i < this->openFiles.size(); i++) {
+            if (this->openFiles[i].fd == fd) {
+                this->syncPolicy->written(fd, this->openFiles[i].dirFd);
+                break;
+            }
+        }
+    }
+}
+
+/*
+** Create an output file. pszFileName may include a directory, the shard
+** goes between it and the file's own name. The path actually used is
+** returned in pszPath. Frames of the usual encoding are opened with
+** estimate set, anything else (segments, fused frames) without.
+*/
+FILE * OutputManager::open(const char * pszFileName, char * pszPath, size_t pathLen, bool estimate)
+{
+    const char *        pszBaseName = selectDirectory(pszFileName);
+    OUTPUT_OPEN_FILE    file;
+    int                 dirFd;
+    int                 fd;
+    FILE *              fp;
+
+    Logger & log = Logger::getInstance();
+
+    if (isSharded() &&
+            ((this->maxFiles && this->shardFiles >= this->maxFiles) ||
+            (this->maxBytes && this->shardBytes >= this->maxBytes))) {
+        rollShard();
+    }
+
+    dirFd = isSharded() ? this->shardFd : this->directoryFd;
+
+    fd = openat(dirFd, pszBaseName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        log.logError("Failed to create file %s", pszFileName);
+        throw rpi_error(rpi_error::buildMsg("Failed to create file %s", pszFileName), __FILE__, __LINE__);
+    }
+
+    // Allow an eighth over the average, most frames then fit. The size is
+    // left alone, so a file not closed cleanly has no zeroed tail
+    if (estimate && this->preallocate && this->sizeEstimate > 0) {
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, this->sizeEstimate + this->sizeEstimate / 8) != 0) {
+            if (errno == EOPNOTSUPP || errno == ENOSYS) {
+                log.logError("Output filesystem does not support preallocation, turning it off");
+                this->preallocate = false;
+            }
+        }
+    }
+
+    file.fd = fd;
+    file.dirFd = fcntl(dirFd, F_DUPFD_CLOEXEC, 0);
+    file.shard = this->shard;
+    file.generation = this->generation;
+    file.estimate = estimate;
+
+    fp = (file.dirFd >= 0) ? fdopen(fd, "wb") : NULL;
+
+    if (fp == NULL) {
+        if (file.dirFd >= 0) {
+            ::close(file.dirFd);
+        }
+
+        ::close(fd);
+        unlinkat(dirFd, pszBaseName, 0);
+        throw rpi_error(rpi_error::buildMsg("Failed to create file %s", pszFileName), __FILE__, __LINE__);
+    }
+
+    this->openFiles.push_back(file);
+
+    if (isSharded()) {
+        snprintf(pszPath, pathLen, "%s/%06u/%s", this->szDirectory, this->shard, pszBaseName);
+    }
+    else {
+        snprintf(pszPath, pathLen, "%s", pszFileName);
+    }
+
+    this->shardFiles++;
+
+    return fp;
+}
+
+void OutputManager::close(FILE * fp, uint64_t bytes)
+{
+    int                 fd = fileno(fp);
+    OUTPUT_OPEN_FILE    file = releaseFile(fd);
+
+    fflush(fp);
+
+    // Give back whatever of the preallocation went unused, truncating to
+    // the same size still frees the blocks kept beyond the end
+    if (this->preallocate && file.estimate) {
+        off_t   length = ftello(fp);
+
+        if (length >= 0 && ftruncate(fd, length) != 0) {
+            Logger::getInstance().logError("Failed to trim output file: %s", strerror(errno));
+        }
+    }
+
+    if (this->syncPolicy && file.dirFd >= 0) {
+        this->syncPolicy->written(fd, file.dirFd);
+    }
+
+    fclose(fp);
+
+    if (file.dirFd >= 0) {
+        ::close(file.dirFd);
+    }
+
+    // Moving average over roughly the last 8 frames
+    if (bytes > 0 && file.estimate) {
+        if (this->sizeEstimate == 0) {
+            this->sizeEstimate = bytes;
+        }
+        else {
+            this->sizeEstimate = this->sizeEstimate - this->sizeEstimate / 8 + bytes / 8;
+        }
+    }
+
+    // A shard already rolled past no longer counts
+    if (isCurrent(file)) {
+        this->shardBytes += bytes;
+    }
+}
+
+/*
+** Close and delete a file that couldn't be written after all, pszPath is
+** the path open() returned for it
+*/
+void OutputManager::discard(FILE * fp, const char * pszPath)
+{
+    OUTPUT_OPEN_FILE    file = releaseFile(fileno(fp));
+
+    fclose(fp);
+
+    if (file.dirFd >= 0) {
+        ::close(file.dirFd);
+    }
+
+    if (unlink(pszPath) != 0) {
+        Logger::getInstance().logError("Failed to delete %s: %s", pszPath, strerror(errno));
+    }
+
+    if (isCurrent(file) && this->shardFiles > 0) {
+        this->shardFiles--;
+    }
+}
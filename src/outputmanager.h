@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+#include "syncpolicy.h"
+
+#ifndef _INCL_OUTPUTMANAGER
+#define _INCL_OUTPUTMANAGER
+
+#define OUTPUT_MAX_PATH_LEN             512
+
+/*
+** Places output files, keeping directories small.
+**
+** Files are created relative to a cached directory fd with openat(), so
+** the directory path is only resolved when it changes. With limits set,
+** files go into numbered shard subdirectories (000000, 000001, ...) and a
+** new shard is started once the current one holds maxFiles files or
+** maxBytes bytes. The next shard is created in the background while the
+** current one fills, so rolling over never waits on mkdir. A directory
+** that already has shards carries on from the highest numbered one, with
+** the files already in it counted against the limits.
+**
+** With preallocation on, each file is given space for a typical frame
+** with fallocate() as it is created, from a running average of the
+** frame sizes, and trimmed to what was written when it is closed. The
+** card then doesn't have to find blocks for the file as it grows. Only
+** files opened as part of the estimate are preallocated or counted in it,
+** so files of another kind don't skew the frame sizes.
+**
+** Each open file keeps the directory and shard it was created in, so it
+** is synced and accounted there even if the output has moved on by the
+** time it is closed.
+*/
+typedef struct {
+    int                 fd;
+    int                 dirFd;              // A dup of the directory the file was created in
+    unsigned int        shard;
+    unsigned int        generation;         // Of the directory when the file was created
+    bool                estimate;           // Counts towards the size estimate
+}
+OUTPUT_OPEN_FILE;
+
+class OutputManager
+{
+private:
+    unsigned int        maxFiles;
+    uint64_t            maxBytes;
+
+    char                szDirectory[OUTPUT_MAX_PATH_LEN];
+    int                 directoryFd;
+
+    unsigned int        shard;
+    int                 shardFd;
+    unsigned int        shardFiles;
+    uint64_t            shardBytes;
+
+    bool                preallocate;
+    uint64_t            sizeEstimate;
+    SyncPolicy *        syncPolicy;
+
+    std::vector<OUTPUT_OPEN_FILE>   openFiles;
+
+    // Shared with the pre-create thread
+    pthread_t           thread;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    bool                threadRunning;
+    bool                stopRequested;
+    unsigned int        generation;         // Bumped each time the directory changes
+    int                 requestedShard;
+    int                 nextShard;
+    int                 nextShardFd;
+
+    bool                isSharded();
+    const char *        selectDirectory(const char * pszFileName);
+    void                setDirectory(const char * pszDirectory);
+    void                closeDirectory();
+    void                rollShard();
+    void                requestShard(unsigned int shard);
+    int                 createShard(int dirFd, unsigned int shard);
+    int                 findLastShard(int dirFd);
+    void                countShard(int shardFd);
+    bool                isCurrent(const OUTPUT_OPEN_FILE & file);
+    OUTPUT_OPEN_FILE    releaseFile(int fd);
+
+    static void *       threadEntry(void * arg);
+    void                run();
+
+public:
+    OutputManager();
+    ~OutputManager();
+
+    void        setLimits(unsigned int maxFiles, uint64_t maxBytes);
+    void        setPreallocate(bool preallocate);
+    void        setSyncPolicy(SyncPolicy * policy);
+
+    bool        exists(const char * pszFileName);
+
+    FILE *      open(const char * pszFileName, char * pszPath, size_t pathLen, bool estimate);
+    void        sync(FILE * fp);
+    void        close(FILE * fp, uint64_t bytes);
+    void        discard(FILE * fp, const char * pszPath);
+};
+
+#endif
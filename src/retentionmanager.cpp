@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/statvfs.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "retentionmanager.h"
+#include "rpi_error.h"
+#include "logger.h"
+#include "threadpolicy.h"
+
+/*
+** How often free space is re-checked when nothing new has been written,
+** other processes may be using the same card
+*/
+#define RETENTION_CHECK_INTERVAL        10
+
+/*
+** The index is only rewritten once it holds at least this many
+** records for deleted files
+*/
+#define RETENTION_COMPACT_MIN           256
+
+// From linux/ioprio.h, which is not always installed
+#define RETENTION_IOPRIO_WHO_PROCESS    1
+#define RETENTION_IOPRIO_CLASS_IDLE     3
+#define RETENTION_IOPRIO_CLASS_SHIFT    13
+
+RetentionManager::RetentionManager()
+{
+    this->szIndexFile[0] = 0;
+    this->szDirectory[0] = 0;
+    this->szRoot[0] = 0;
+    this->indexFd = -1;
+
+    this->minFreeBytes = 0;
+    this->maxBytes = 0;
+
+    this->totalBytes = 0;
+    this->deadRecords = 0;
+    this->reportedFull = false;
+
+    this->running = false;
+    this->stopRequested = false;
+    this->indexedBytes = 0;
+    this->evicted = 0;
+
+    pthread_mutex_init(&this->mutex, NULL);
+    pthread_cond_init(&this->cond, NULL);
+}
+
+RetentionManager::~RetentionManager()
+{
+    stop();
+
+    pthread_cond_destroy(&this->cond);
+    pthread_mutex_destroy(&this->mutex);
+}
+
+/*
+** Rebuild the list of files from the index log
+*/
+void RetentionManager::loadIndex()
+{
+    FILE *          fp;
+    char            szLine[RETENTION_MAX_PATH_LEN + 32];
+    int             lineNum = 0;
+
+    Logger & log = Logger::getInstance();
+
+    this->entries.clear();
+    this->totalBytes = 0;
+    this->deadRecords = 0;
+
+    fp = fopen(this->szIndexFile, "r");
+
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            log.logError("Failed to read retention index %s", this->szIndexFile);
+            throw rpi_error(rpi_error::buildMsg("Failed to read retention index %s", this->szIndexFile), __FILE__, __LINE__);
+        }
+
+        return;
+    }
+
+    while (fgets(szLine, sizeof(szLine), fp) != NULL) {
+        char *                  pszEnd;
+        unsigned long long      value;
+
+        lineNum++;
+
+        szLine[strcspn(szLine, "\r\n")] = 0;
+
+        if (szLine[0] == 0 || szLine[1] != ' ') {
+            continue;
+        }
+
+        value = strtoull(&szLine[2], &pszEnd, 10);
+
+        if (szLine[0] == '+' && *pszEnd == ' ' && pszEnd[1]) {
+            Entry   entry;
+
+            entry.bytes = value;
+            entry.path = &pszEnd[1];
+
+            this->entries.push_back(entry);
+            this->totalBytes += entry.bytes;
+        }
+        else if (szLine[0] == '-' && *pszEnd == 0) {
+            while (value-- && !this->entries.empty()) {
+                this->totalBytes -= this->entries.front().bytes;
+                this->entries.pop_front();
+                this->deadRecords++;
+            }
+
+            this->deadRecords++;
+        }
+        else {
+            // Most likely the tail of a write cut short by a power cut
+            log.logError("Ignoring bad record at %s:%d", this->szIndexFile, lineNum);
+        }
+    }
+
+    fclose(fp);
+}
+
+void RetentionManager::openIndex()
+{
+    Logger & log = Logger::getInstance();
+
+    this->indexFd = ::open(this->szIndexFile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (this->indexFd < 0) {
+        log.logError("Failed to open retention index %s", this->szIndexFile);
+        throw rpi_error(rpi_error::buildMsg("Failed to open retention index %s", this->szIndexFile), __FILE__, __LINE__);
+    }
+}
+
+void RetentionManager::appendIndex(const char * pszRecord, size_t len)
+{
+    if (write(this->indexFd, pszRecord, len) != (ssize_t)len) {
+        Logger::getInstance().logError("Failed to write retention index %s", this->szIndexFile);
+    }
+}
+
+/*
+** Rewrite the index with just the files still present, the old one is
+** only replaced once the new one is complete
+*/
+void RetentionManager::compactIndex()
+{
+    char        szTempFile[RETENTION_MAX_PATH_LEN + 8];
+    FILE *      fp;
+    bool        failed = false;
+
+    Logger & log = Logger::getInstance();
+
+    snprintf(szTempFile, sizeof(szTempFile), "%s.tmp", this->szIndexFile);
+
+    fp = fopen(szTempFile, "w");
+
+    if (fp == NULL) {
+        log.logError("Failed to create %s", szTempFile);
+        return;
+    }
+
+    for (std::deque<Entry>::iterator it = this->entries.begin(); it != this->entries.end(); ++it) {
+        if (fprintf(fp, "+ %llu %s\n", (unsigned long long)it->bytes, it->path.c_str()) < 0) {
+            failed = true;
+            break;
+        }
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        failed = true;
+    }
+
+    fclose(fp);
+
+    if (failed || rename(szTempFile, this->szIndexFile) != 0) {
+        log.logError("Failed to compact retention index %s", this->szIndexFile);
+        unlink(szTempFile);
+        return;
+    }
+
+    ::close(this->indexFd);
+    openIndex();
+
+    log.logDebug("Compacted retention index, dropped %u records", this->deadRecords);
+
+    this->deadRecords = 0;
+}
+
+uint64_t RetentionManager::getFreeBytes()
+{
+    struct statvfs      fs;
+
+    if (statvfs(this->szDirectory, &fs) != 0) {
+        // Can't tell, so don't delete anything on account of it
+        return UINT64_MAX;
+    }
+
+    return (uint64_t)fs.f_bavail * fs.f_frsize;
+}
+
+bool RetentionManager::isOverLimit()
+{
+    if (this->maxBytes && this->totalBytes > this->maxBytes) {
+        return true;
+    }
+
+    if (this->minFreeBytes && getFreeBytes() < this->minFreeBytes) {
+        return true;
+    }
+
+    return false;
+}
+
+/*
+** The absolute path of a file just written. Relative paths would stop
+** meaning the same file if the next run starts somewhere else.
+*/
+std::string RetentionManager::makeAbsolute(const std::string & path)
+{
+    std::string     dir;
+    std::string     name;
+    size_t          slash;
+    char            szResolved[PATH_MAX];
+
+    if (!path.empty() && path[0] == '/') {
+        return path;
+    }
+
+    slash = path.rfind('/');
+
+    if (slash == std::string::npos) {
+        dir = ".";
+        name = path;
+    }
+    else {
+        dir = path.substr(0, slash);
+        name = path.substr(slash + 1);
+    }
+
+    // Frames mostly arrive in the same directory as the last
+    if (dir != this->lastDirectory) {
+        if (realpath(dir.c_str(), szResolved) == NULL) {
+            Logger::getInstance().logError("Failed to resolve %s: %s", dir.c_str(), strerror(errno));
+            return path;
+        }
+
+        this->lastDirectory = dir;
+        this->lastResolved = szResolved;
+    }
+
+    if (this->lastResolved == "/") {
+        return "/" + name;
+    }
+
+    return this->lastResolved + "/" + name;
+}
+
+/*
+** Clear away shard and date directories as they empty, up to the
+** directory holding the index. Nothing outside it is touched.
+*/
+void RetentionManager::removeEmptyDirectories(const std::string & path)
+{
+    std::string     dir = path;
+    size_t          rootLen = strlen(this->szRoot);
+    size_t          slash;
+
+    if (rootLen == 0) {
+        return;
+    }
+
+    while ((slash = dir.rfind('/')) != std::string::npos && slash > 0) {
+        dir.erase(slash);
+
+        // Stops at the root itself as well, it is no longer than rootLen
+        if (dir.length() <= rootLen ||
+                dir.compare(0, rootLen, this->szRoot) != 0 ||
+                (dir[rootLen] != '/' && rootLen > 1))
+        {
+            break;
+        }
+
+        if (rmdir(dir.c_str()) != 0) {
+            break;
+        }
+
+        Logger::getInstance().logDebug("Removed empty directory %s", dir.c_str());
+    }
+}
+
+void RetentionManager::evictOldest()
+{
+    Entry &         entry = this->entries.front();
+
+    Logger & log = Logger::getInstance();
+
+    // A file that has already gone still counts as evicted
+    if (unlink(entry.path.c_str()) != 0 && errno != ENOENT) {
+        log.logError("Failed to delete %s: %s", entry.path.c_str(), strerror(errno));
+    }
+    else {
+        log.logDebug("Deleted %s", entry.path.c_str());
+    }
+
+    removeEmptyDirectories(entry.path);
+
+    this->totalBytes -= entry.bytes;
+    this->entries.pop_front();
+    this->deadRecords++;
+}
+
+/*
+** Keep out of the way of the capture threads, both for CPU and I/O
+*/
+void RetentionManager::lowerPriority()
+{
+    pid_t       tid = (pid_t)syscall(SYS_gettid);
+
+    Logger & log = Logger::getInstance();
+
+    if (setpriority(PRIO_PROCESS, tid, 19) != 0) {
+        log.logDebug("Failed to lower retention thread priority");
+    }
+
+#ifdef SYS_ioprio_set
+    if (syscall(
+            SYS_ioprio_set,
+            RETENTION_IOPRIO_WHO_PROCESS,
+            tid,
+            RETENTION_IOPRIO_CLASS_IDLE << RETENTION_IOPRIO_CLASS_SHIFT) != 0)
+    {
+        log.logDebug("Failed to set idle I/O priority for retention thread");
+    }
+#endif
+}
+
+void * RetentionManager::threadEntry(void * arg)
+{
+    ((RetentionManager *)arg)->run();
+
+    return NULL;
+}
+
+void RetentionManager::run()
+{
+    std::vector<Entry>  batch;
+    char                szRecord[RETENTION_MAX_PATH_LEN + 32];
+    int                 len;
+
+    Logger & log = Logger::getInstance();
+
+    ThreadPolicy::getInstance().applyBackground("retention");
+    lowerPriority();
+
+    pthread_mutex_lock(&this->mutex);
+
+    // The limits may have changed since the last run, so check straight away
+    while (true) {
+        unsigned int    count = 0;
+
+        batch.swap(this->pending);
+
+        pthread_mutex_unlock(&this->mutex);
+
+        for (std::vector<Entry>::iterator it = batch.begin(); it != batch.end(); ++it) {
+            it->path = makeAbsolute(it->path);
+
+            len = snprintf(szRecord, sizeof(szRecord), "+ %llu %s\n", (unsigned long long)it->bytes, it->path.c_str());
+
+            if (len > 0 && len < (int)sizeof(szRecord)) {
+                appendIndex(szRecord, len);
+
+                this->entries.push_back(*it);
+                this->totalBytes += it->bytes;
+            }
+            else {
+                log.logError("Path too long to index: %s", it->path.c_str());
+            }
+        }
+
+        batch.clear();
+
+        // Always keep the newest file, it is the one just captured
+        while (this->entries.size() > 1 && isOverLimit()) {
+            evictOldest();
+            count++;
+        }
+
+        if (count) {
+            len = snprintf(szRecord, sizeof(szRecord), "- %u\n", count);
+            appendIndex(szRecord, len);
+
+            this->deadRecords++;
+            this->reportedFull = false;
+
+            if (this->deadRecords >= RETENTION_COMPACT_MIN && this->deadRecords > this->entries.size()) {
+                compactIndex();
+            }
+        }
+        else if (!this->reportedFull && this->entries.size() <= 1 && isOverLimit()) {
+            log.logError("Storage limit reached with nothing left to delete");
+            this->reportedFull = true;
+        }
+
+        pthread_mutex_lock(&this->mutex);
+
+        this->indexedBytes = this->totalBytes;
+        this->evicted += count;
+
+        if (this->pending.empty()) {
+            struct timespec     deadline;
+
+            if (this->stopRequested) {
+                break;
+            }
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += RETENTION_CHECK_INTERVAL;
+
+            pthread_cond_timedwait(&this->cond, &this->mutex, &deadline);
+        }
+    }
+
+    pthread_mutex_unlock(&this->mutex);
+}
+
+/*
+** Start managing the files recorded in pszIndexFile. Free space is
+** measured on the filesystem holding the index, a limit of 0 is off.
+*/
+void RetentionManager::start(const char * pszIndexFile, uint64_t minFreeBytes, uint64_t maxBytes)
+{
+    const char *    pszSlash;
+
+    Logger & log = Logger::getInstance();
+
+    stop();
+
+    if (strlen(pszIndexFile) >= sizeof(this->szIndexFile)) {
+        throw rpi_error("Retention index file name is too long", __FILE__, __LINE__);
+    }
+
+    strcpy(this->szIndexFile, pszIndexFile);
+
+    pszSlash = strrchr(pszIndexFile, '/');
+
+    if (pszSlash == NULL) {
+        strcpy(this->szDirectory, ".");
+    }
+    else if (pszSlash == pszIndexFile) {
+        strcpy(this->szDirectory, "/");
+    }
+    else {
+        memcpy(this->szDirectory, pszIndexFile, pszSlash - pszIndexFile);
+        this->szDirectory[pszSlash - pszIndexFile] = 0;
+    }
+
+    if (realpath(this->szDirectory, this->szRoot) == NULL) {
+        this->szRoot[0] = 0;
+    }
+
+    this->lastDirectory.clear();
+    this->lastResolved.clear();
+
+    this->minFreeBytes = minFreeBytes;
+    this->maxBytes = maxBytes;
+
+    loadIndex();
+    openIndex();
+
+    log.logDebug(
+        "Retention index %s holds %u files, %llu bytes",
+        this->szIndexFile,
+        (unsigned int)this->entries.size(),
+        (unsigned long long)this->totalBytes);
+
+    this->stopRequested = false;
+    this->reportedFull = false;
+    this->indexedBytes = this->totalBytes;
+    this->evicted = 0;
+
+    if (pthread_create(&this->thread, NULL, threadEntry, this)) {
+        ::close(this->indexFd);
+        this->indexFd = -1;
+
+        log.logError("Failed to start retention thread");
+        throw rpi_error("Failed to start retention thread", __FILE__, __LINE__);
+    }
+
+    this->running = true;
+}
+
+/*
+** Stops the thread once everything queued has made it into the index
+*/
+void RetentionManager::stop()
+{
+    if (!this->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&this->mutex);
+    this->stopRequested = true;
+    pthread_cond_signal(&this->cond);
+    pthread_mutex_unlock(&this->mutex);
+
+    pthread_join(this->thread, NULL);
+
+    ::close(this->indexFd);
+    this->indexFd = -1;
+
+    this->running = false;
+}
+
+/*
+** Record a newly written file, it is indexed in the background. A
+** relative path is taken from the current directory.
+*/
+void RetentionManager::add(const char * pszPath, uint64_t bytes)
+{
+    Entry       entry;
+
+    if (!this->running) {
+        return;
+    }
+
+    entry.bytes = bytes;
+    entry.path = pszPath;
+
+    pthread_mutex_lock(&this->mutex);
+    this->pending.push_back(entry);
+    pthread_cond_signal(&this->cond);
+    pthread_mutex_unlock(&this->mutex);
+}
+
+uint64_t RetentionManager::getIndexedBytes()
+{
+    uint64_t    bytes;
+
+    pthread_mutex_lock(&this->mutex);
+    bytes = this->indexedBytes;
+    pthread_mutex_unlock(&this->mutex);
+
+    return bytes;
+}
+
+unsigned int RetentionManager::getEvicted()
+{
+    unsigned int    count;
+
+    pthread_mutex_lock(&this->mutex);
+    count = this->evicted;
+    pthread_mutex_unlock(&this->mutex);
+
+    return count;
+}
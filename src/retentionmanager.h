@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#include <string>
+
+#ifndef _INCL_RETENTIONMANAGER
+#define _INCL_RETENTIONMANAGER
+
+#define RETENTION_MAX_PATH_LEN          512
+#define RETENTION_INDEX_NAME            ".rpicapture.idx"
+
+/*
+** Keeps the captures from filling the disk.
+**
+** Every file written is appended to an index log on disk, oldest first:
+**
+**  + <bytes> <path>
+**  - <count>
+**
+** A '+' record adds a file by its absolute path, a '-' record says the
+** oldest <count> files have been deleted. The index is read back on start
+** so the totals survive restarts without walking the directory tree, and
+** is rewritten once the deleted records outnumber the live ones.
+**
+** Once free space drops below minFreeBytes, or the files in the index
+** total more than maxBytes, the oldest files are deleted. All of this
+** runs on a background thread at idle priority. add() only queues the
+** file, so the capture path never waits on the disk for it.
+*/
+class RetentionManager
+{
+private:
+    struct Entry {
+        uint64_t        bytes;
+        std::string     path;
+    };
+
+    char                szIndexFile[RETENTION_MAX_PATH_LEN];
+    char                szDirectory[RETENTION_MAX_PATH_LEN];
+    char                szRoot[PATH_MAX];       // szDirectory resolved, empty directories are removed up to here
+    int                 indexFd;
+
+    uint64_t            minFreeBytes;
+    uint64_t            maxBytes;
+
+    // Only touched by the background thread once it is running
+    std::deque<Entry>   entries;
+    uint64_t            totalBytes;
+    unsigned int        deadRecords;
+    bool                reportedFull;
+    std::string         lastDirectory;
+    std::string         lastResolved;
+
+    // Shared with the background thread
+    pthread_t           thread;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    bool                running;
+    bool                stopRequested;
+    std::vector<Entry>  pending;
+    uint64_t            indexedBytes;
+    unsigned int        evicted;
+
+    void                loadIndex();
+    void                openIndex();
+    void                appendIndex(const char * pszRecord, size_t len);
+    void                compactIndex();
+    uint64_t            getFreeBytes();
+    bool                isOverLimit();
+    std::string         makeAbsolute(const std::string & path);
+    void                removeEmptyDirectories(const std::string & path);
+    void                evictOldest();
+    void                lowerPriority();
+
+    static void *       threadEntry(void * arg);
+    void                run();
+
+public:
+    RetentionManager();
+    ~RetentionManager();
+
+    void        start(const char * pszIndexFile, uint64_t minFreeBytes, uint64_t maxBytes);
+    void        stop();
+
+    void        add(const char * pszPath, uint64_t bytes);
+
+    uint64_t    getIndexedBytes();
+    unsigned int getEvicted();
+};
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "segmentwriter.h"
+#include "rpi_error.h"
+#include "logger.h"
+
+SegmentWriter::SegmentWriter()
+{
+    this->fp = NULL;
+    this->segment = 0;
+    this->frameOffset = -1;
+
+    memset(&this->frameHeader, 0, sizeof(this->frameHeader));
+}
+
+void SegmentWriter::write(const void * data, size_t len)
+{
+    if (fwrite(data, 1, len, this->fp) != len) {
+        Logger::getInstance().logError("Failed to write to segment %u", this->segment);
+        throw rpi_error(rpi_error::buildMsg("Failed to write to segment %u", this->segment), __FILE__, __LINE__);
+    }
+}
+
+/*
+** Start a new segment in fp, which should be empty, for frames in the
+** given MMAL encoding. The caller still owns fp and closes it after end().
+*/
+void SegmentWriter::begin(FILE * fp, uint32_t segment, uint32_t encoding)
+{
+    SEGMENT_HEADER      header;
+    struct timespec     now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    this->fp = fp;
+    this->segment = segment;
+    this->frameOffset = -1;
+    this->index.clear();
+
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+    header.version = SEGMENT_VERSION;
+    header.size = sizeof(header);
+    header.segment = segment;
+    header.encoding = encoding;
+    header.created = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    write(&header, sizeof(header));
+}
+
+/*
+** Write the index and footer. Returns the size of the finished segment,
+** the writer is then free for the next one.
+*/
+uint64_t SegmentWriter::end()
+{
+    SEGMENT_FOOTER      footer;
+    uint64_t            size;
+
+    if (this->fp == NULL) {
+        return 0;
+    }
+
+    memset(&footer, 0, sizeof(footer));
+
+    memcpy(footer.magic, SEGMENT_FOOTER_MAGIC, sizeof(footer.magic));
+    footer.version = SEGMENT_VERSION;
+    footer.size = sizeof(footer);
+    footer.frames = this->index.size();
+    footer.indexOffset = getSize();
+
+    // Without the index the frames can still be found by walking them
+    try {
+        if (!this->index.empty()) {
+            write(&this->index[0], this->index.size() * sizeof(SEGMENT_INDEX_ENTRY));
+        }
+
+        write(&footer, sizeof(footer));
+    }
+    catch (rpi_error & e) {
+    }
+
+    size = getSize();
+
+    Logger::getInstance().logDebug("Closed segment %u with %u frames, %llu bytes", this->segment, footer.frames, (unsigned long long)size);
+
+    this->fp = NULL;
+    this->index.clear();
+
+    return size;
+}
+
+bool SegmentWriter::isOpen()
+{
+    return (this->fp != NULL);
+}
+
+uint64_t SegmentWriter::getSize()
+{
+    off_t       offset = (this->fp ? ftello(this->fp) : 0);
+
+    return (offset > 0 ? (uint64_t)offset : 0);
+}
+
+uint32_t SegmentWriter::getFrames()
+{
+    return this->index.size();
+}
+
+/*
+** Reserve the frame header, the frame data is then written to the
+** segment's FILE by the caller
+*/
+void SegmentWriter::beginFrame()
+{
+    this->frameOffset = ftello(this->fp);
+
+    memset(&this->frameHeader, 0, sizeof(this->frameHeader));
+
+    memcpy(this->frameHeader.magic, SEGMENT_FRAME_MAGIC, sizeof(this->frameHeader.magic));
+    this->frameHeader.size = sizeof(this->frameHeader);
+    this->frameHeader.flags = SEGMENT_FRAME_INCOMPLETE;
+
+    write(&this->frameHeader, sizeof(this->frameHeader));
+}
+
+/*
+** Fill in the frame header now the data is written. An incomplete frame
+** is kept, flagged, so what follows it can still be found.
+*/
+void SegmentWriter::endFrame(uint32_t dataSize, const FRAME_METADATA_RECORD * metadata, bool complete)
+{
+    SEGMENT_INDEX_ENTRY     entry;
+    off_t                   endOffset;
+
+    if (this->frameOffset < 0) {
+        return;
+    }
+
+    // Not SEEK_END, the file may have been preallocated past the data
+    endOffset = ftello(this->fp);
+
+    this->frameHeader.flags = (complete ? 0 : SEGMENT_FRAME_INCOMPLETE);
+    this->frameHeader.dataSize = dataSize;
+    memcpy(&this->frameHeader.metadata, metadata, sizeof(this->frameHeader.metadata));
+
+    if (fseeko(this->fp, this->frameOffset, SEEK_SET) != 0) {
+        throw rpi_error("Failed to seek to frame header", __FILE__, __LINE__);
+    }
+
+    write(&this->frameHeader, sizeof(this->frameHeader));
+
+    if (fseeko(this->fp, endOffset, SEEK_SET) != 0) {
+        throw rpi_error("Failed to seek to end of segment", __FILE__, __LINE__);
+    }
+
+    entry.offset = this->frameOffset;
+    entry.frame = metadata->frame;
+    entry.dataSize = dataSize;
+    entry.captureTime = metadata->captureTime;
+
+    this->index.push_back(entry);
+
+    this->frameOffset = -1;
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "frameformat.h"
+
+#ifndef _INCL_SEGMENTWRITER
+#define _INCL_SEGMENTWRITER
+
+/*
+** Appends frames to a segment file, see frameformat.h for the layout.
+**
+** The frame header goes out before the encoder starts writing the frame
+** data straight after it, then is rewritten in place once the size is
+** known. The whole segment is one sequential stream apart from that,
+** with no file to create or directory to update per frame.
+*/
+class SegmentWriter
+{
+private:
+    FILE *                              fp;
+    uint32_t                            segment;
+    off_t                               frameOffset;
+    SEGMENT_FRAME_HEADER                frameHeader;
+    std::vector<SEGMENT_INDEX_ENTRY>    index;
+
+    void        write(const void * data, size_t len);
+
+public:
+    SegmentWriter();
+
+    void        begin(FILE * fp, uint32_t segment, uint32_t encoding);
+    uint64_t    end();
+
+    bool        isOpen();
+    uint64_t    getSize();
+    uint32_t    getFrames();
+
+    void        beginFrame();
+    void        endFrame(uint32_t dataSize, const FRAME_METADATA_RECORD * metadata, bool complete);
+};
+
+#endif
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stereosplitter.h"
+#include "logger.h"
+
+#define BMP_FILE_HEADER_LEN             14
+#define BMP_INFO_HEADER_LEN             40
+
+#define BMP_FILE_SIZE                   2
+#define BMP_DATA_OFFSET                 10
+#define BMP_INFO_SIZE                   14
+#define BMP_WIDTH                       18
+#define BMP_HEIGHT                      22
+#define BMP_BIT_COUNT                   28
+#define BMP_COMPRESSION                 30
+#define BMP_IMAGE_SIZE                  34
+
+#define BMP_COMPRESSION_RGB             0
+#define BMP_COMPRESSION_BITFIELDS       3
+
+static uint32_t getLE32(const uint8_t * p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t getLE16(const uint8_t * p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void putLE32(uint8_t * p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+StereoSplitter::StereoSplitter()
+{
+    this->layout = STEREO_LAYOUT_SIDE_BY_SIDE;
+    this->eyes[STEREO_EYE_LEFT] = NULL;
+    this->eyes[STEREO_EYE_RIGHT] = NULL;
+    this->row = NULL;
+    this->rowCapacity = 0;
+
+    begin(STEREO_LAYOUT_SIDE_BY_SIDE, NULL, NULL);
+}
+
+StereoSplitter::~StereoSplitter()
+{
+    free(this->row);
+}
+
+/*
+** Start on the next frame. The caller still owns the files and closes
+** them after end().
+*/
+void StereoSplitter::begin(int layout, FILE * left, FILE * right)
+{
+    this->layout = layout;
+    this->eyes[STEREO_EYE_LEFT] = left;
+    this->eyes[STEREO_EYE_RIGHT] = right;
+    this->eyeBytes[STEREO_EYE_LEFT] = 0;
+    this->eyeBytes[STEREO_EYE_RIGHT] = 0;
+
+    this->headerLength = 0;
+    this->headerBytes = 0;
+    this->width = 0;
+    this->rows = 0;
+    this->bottomUp = true;
+    this->bytesPerPixel = 0;
+    this->stride = 0;
+    this->eyeWidth = 0;
+    this->eyeRowBytes = 0;
+    this->eyeStride = 0;
+    this->rowBytes = 0;
+    this->rowsDone = 0;
+    this->failed = false;
+}
+
+bool StereoSplitter::write(int eye, const void * data, size_t length)
+{
+    if (fwrite(data, 1, length, this->eyes[eye]) != length) {
+        Logger::getInstance().logError("Failed to write the %s eye", eye == STEREO_EYE_LEFT ? "left" : "right");
+        this->failed = true;
+    }
+    else {
+        this->eyeBytes[eye] += length;
+    }
+
+    return !this->failed;
+}
+
+bool StereoSplitter::parseHeader()
+{
+    Logger & log = Logger::getInstance();
+
+    int32_t     height;
+    uint32_t    compression;
+    int         bitCount;
+
+    if (getLE32(&this->header[BMP_INFO_SIZE]) < BMP_INFO_HEADER_LEN) {
+        log.logError("Can't split stereo frame, not a Windows BMP");
+        return false;
+    }
+
+    this->width = (int32_t)getLE32(&this->header[BMP_WIDTH]);
+    height = (int32_t)getLE32(&this->header[BMP_HEIGHT]);
+    bitCount = getLE16(&this->header[BMP_BIT_COUNT]);
+    compression = getLE32(&this->header[BMP_COMPRESSION]);
+
+    if (this->width < 2 || height == 0 || bitCount < 8 || (bitCount % 8) != 0 ||
+        (compression != BMP_COMPRESSION_RGB && compression != BMP_COMPRESSION_BITFIELDS))
+    {
+        log.logError("Can't split a %d x %d, %d bit stereo frame", this->width, height, bitCount);
+        return false;
+    }
+
+    // Rows are stored bottom up unless the height is negative
+    this->bottomUp = (height > 0);
+    this->rows = this->bottomUp ? height : -height;
+    this->bytesPerPixel = bitCount / 8;
+    this->stride = (((size_t)this->width * bitCount + 31) / 32) * 4;
+
+    if (this->layout == STEREO_LAYOUT_SIDE_BY_SIDE) {
+        this->eyeWidth = this->width / 2;
+        this->eyeRowBytes = (size_t)this->eyeWidth * this->bytesPerPixel;
+        this->eyeStride = (((size_t)this->eyeWidth * bitCount + 31) / 32) * 4;
+    }
+    else {
+        // An odd row out belongs to neither eye
+        this->rows &= ~1;
+        this->eyeWidth = this->width;
+        this->eyeRowBytes = this->stride;
+        this->eyeStride = this->stride;
+    }
+
+    if (this->rowCapacity < this->stride) {
+        uint8_t * row = (uint8_t *)realloc(this->row, this->stride);
+
+        if (row == NULL) {
+            log.logError("No memory for a %u byte row", (unsigned int)this->stride);
+            return false;
+        }
+
+        this->row = row;
+        this->rowCapacity = this->stride;
+    }
+
+    return true;
+}
+
+bool StereoSplitter::writeHeaders()
+{
+    uint8_t     eyeHeader[STEREO_MAX_HEADER_LEN];
+    int32_t     eyeRows = (this->layout == STEREO_LAYOUT_SIDE_BY_SIDE) ? this->rows : this->rows / 2;
+    uint32_t    imageSize = (uint32_t)(this->eyeStride * eyeRows);
+
+    memcpy(eyeHeader, this->header, this->headerLength);
+
+    putLE32(&eyeHeader[BMP_FILE_SIZE], (uint32_t)this->headerLength + imageSize);
+    putLE32(&eyeHeader[BMP_WIDTH], (uint32_t)this->eyeWidth);
+    putLE32(&eyeHeader[BMP_HEIGHT], (uint32_t)(this->bottomUp ? eyeRows : -eyeRows));
+    putLE32(&eyeHeader[BMP_IMAGE_SIZE], imageSize);
+
+    return write(STEREO_EYE_LEFT, eyeHeader, this->headerLength) && write(STEREO_EYE_RIGHT, eyeHeader, this->headerLength);
+}
+
+bool StereoSplitter::writeRow(const uint8_t * data)
+{
+    static const uint8_t    padding[4] = { 0, 0, 0, 0 };
+
+    if (this->layout == STEREO_LAYOUT_SIDE_BY_SIDE) {
+        size_t  pad = this->eyeStride - this->eyeRowBytes;
+
+        write(STEREO_EYE_LEFT, data, this->eyeRowBytes);
+        write(STEREO_EYE_RIGHT, data + this->eyeRowBytes, this->eyeRowBytes);
+
+        if (pad) {
+            write(STEREO_EYE_LEFT, padding, pad);
+            write(STEREO_EYE_RIGHT, padding, pad);
+        }
+    }
+    else {
+        // The top image is the left eye, stored last when the rows are bottom up
+        int     first = this->bottomUp ? STEREO_EYE_RIGHT : STEREO_EYE_LEFT;
+        int     eye = (this->rowsDone < this->rows / 2) ? first : 1 - first;
+
+        write(eye, data, this->stride);
+    }
+
+    this->rowsDone++;
+
+    return !this->failed;
+}
+
+/*
+** Split the next buffer from the encoder. Returns false once anything
+** has gone wrong with the frame, the rest of it is then ignored.
+*/
+bool StereoSplitter::addData(const uint8_t * data, size_t length)
+{
+    while (length > 0 && !this->failed) {
+        size_t  take;
+
+        if (this->headerLength == 0 || this->headerBytes < this->headerLength) {
+            size_t  want = (this->headerLength == 0) ? BMP_FILE_HEADER_LEN : this->headerLength;
+
+            take = want - this->headerBytes;
+
+            if (take > length) {
+                take = length;
+            }
+
+            memcpy(&this->header[this->headerBytes], data, take);
+
+            this->headerBytes += take;
+            data += take;
+            length -= take;
+
+            if (this->headerLength == 0 && this->headerBytes == BMP_FILE_HEADER_LEN) {
+                uint32_t offset = getLE32(&this->header[BMP_DATA_OFFSET]);
+
+                if (this->header[0] != 'B' || this->header[1] != 'M' ||
+                    offset < BMP_FILE_HEADER_LEN + BMP_INFO_HEADER_LEN || offset > STEREO_MAX_HEADER_LEN)
+                {
+                    Logger::getInstance().logError("Can't split stereo frame, use -encoding bmp");
+                    this->failed = true;
+                    break;
+                }
+
+                this->headerLength = offset;
+            }
+            else if (this->headerLength && this->headerBytes == this->headerLength) {
+                if (!parseHeader() || !writeHeaders()) {
+                    this->failed = true;
+                }
+            }
+
+            continue;
+        }
+
+        // Anything after the last row isn't part of the image
+        if (this->rowsDone >= this->rows) {
+            break;
+        }
+
+        // Whole rows go straight from the encoder's buffer
+        if (this->rowBytes == 0 && length >= this->stride) {
+            writeRow(data);
+
+            data += this->stride;
+            length -= this->stride;
+            continue;
+        }
+
+        take = this->stride - this->rowBytes;
+
+        if (take > length) {
+            take = length;
+        }
+
+        memcpy(&this->row[this->rowBytes], data, take);
+
+        this->rowBytes += take;
+        data += take;
+        length -= take;
+
+        if (this->rowBytes == this->stride) {
+            writeRow(this->row);
+            this->rowBytes = 0;
+        }
+    }
+
+    return !this->failed;
+}
+
+/*
+** Returns true if both eyes were written in full
+*/
+bool StereoSplitter::end()
+{
+    bool    complete = !this->failed && this->headerLength && this->rowsDone == this->rows && this->rows > 0;
+
+    if (!complete && !this->failed) {
+        Logger::getInstance().logError("Stereo frame ended after %d of %d rows", this->rowsDone, this->rows);
+    }
+
+    this->eyes[STEREO_EYE_LEFT] = NULL;
+    this->eyes[STEREO_EYE_RIGHT] = NULL;
+
+    return complete;
+}
+
+uint64_t StereoSplitter::getBytes(int eye)
+{
+    return this->eyeBytes[eye];
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef _INCL_STEREOSPLITTER
+#define _INCL_STEREOSPLITTER
+
+#define STEREO_LAYOUT_SIDE_BY_SIDE      1
+#define STEREO_LAYOUT_TOP_BOTTOM        2
+
+#define STEREO_EYE_LEFT                 0
+#define STEREO_EYE_RIGHT                1
+
+// Largest BMP header, file and info headers plus a 256 colour palette
+#define STEREO_MAX_HEADER_LEN           2048
+
+/*
+** Splits a stereoscopic BMP into a BMP for each eye as the encoder hands
+** over its buffers, so the whole frame is never held.
+**
+** Once the headers are in, each eye's header is written with the width
+** (side by side) or height (top/bottom) halved. After that every row
+** goes straight out from the encoder's buffer, a side by side row split
+** at the middle, a top/bottom image split at the middle row. Only a row
+** that spans two buffers is copied, so at most one row is ever held.
+**
+** Compressed formats like JPEG can't be split this way without decoding
+** them, so the frames have to be encoded as BMP.
+*/
+class StereoSplitter
+{
+private:
+    int             layout;
+    FILE *          eyes[2];
+    uint64_t        eyeBytes[2];
+
+    uint8_t         header[STEREO_MAX_HEADER_LEN];
+    size_t          headerLength;       // Bytes of header to come, 0 until the file header is in
+    size_t          headerBytes;
+
+    int32_t         width;
+    int32_t         rows;               // Rows to split, each eye gets half of them if top/bottom
+    bool            bottomUp;
+    int             bytesPerPixel;
+    size_t          stride;             // Bytes per source row, padded to 4
+
+    int32_t         eyeWidth;
+    size_t          eyeRowBytes;        // Pixel bytes in each eye's row
+    size_t          eyeStride;
+
+    uint8_t *       row;                // Row that spans two buffers
+    size_t          rowCapacity;
+    size_t          rowBytes;
+    int32_t         rowsDone;
+
+    bool            failed;
+
+    bool            write(int eye, const void * data, size_t length);
+    bool            parseHeader();
+    bool            writeHeaders();
+    bool            writeRow(const uint8_t * data);
+
+public:
+    StereoSplitter();
+    ~StereoSplitter();
+
+    void            begin(int layout, FILE * left, FILE * right);
+    bool            addData(const uint8_t * data, size_t length);
+    bool            end();
+
+    uint64_t        getBytes(int eye);
+};
+
+#endif
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "syncpolicy.h"
+#include "rpi_error.h"
+#include "logger.h"
+#include "threadpolicy.h"
+
+static int64_t monotonicMicroseconds()
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+SyncPolicy::SyncPolicy()
+{
+    pthread_condattr_t      attr;
+
+    this->mode = SYNC_MODE_NONE;
+    this->maxFrames = 0;
+    this->maxDelayMs = 0;
+
+    this->running = false;
+    this->stopRequested = false;
+
+    this->fsFd = -1;
+    this->pendingFrames = 0;
+    this->oldestPending = 0;
+
+    this->syncs = 0;
+    this->frames = 0;
+    this->lastLag = 0;
+    this->maxLag = 0;
+
+    // Deadlines are worked out on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&this->mutex, NULL);
+    pthread_cond_init(&this->cond, &attr);
+
+    pthread_condattr_destroy(&attr);
+}
+
+SyncPolicy::~SyncPolicy()
+{
+    stop();
+
+    pthread_cond_destroy(&this->cond);
+    pthread_mutex_destroy(&this->mutex);
+}
+
+int SyncPolicy::parseMode(const char * pszMode)
+{
+    if (strcasecmp(pszMode, "none") == 0) {
+        return SYNC_MODE_NONE;
+    }
+    else if (strcasecmp(pszMode, "fs") == 0) {
+        return SYNC_MODE_FS;
+    }
+    else if (strcasecmp(pszMode, "data") == 0) {
+        return SYNC_MODE_DATA;
+    }
+
+    return -1;
+}
+
+bool SyncPolicy::isEnabled()
+{
+    return this->running;
+}
+
+void * SyncPolicy::threadEntry(void * arg)
+{
+    ((SyncPolicy *)arg)->run();
+
+    return NULL;
+}
+
+/*
+** Whether fd is a file already in the list, adding it if not
+*/
+static bool isDuplicate(std::vector<struct stat> & seen, int fd)
+{
+    struct stat     st;
+
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+
+    for (std::vector<struct stat>::iterator it = seen.begin(); it != seen.end(); ++it) {
+        if (it->st_dev == st.st_dev && it->st_ino == st.st_ino) {
+            return true;
+        }
+    }
+
+    seen.push_back(st);
+
+    return false;
+}
+
+/*
+** Sync one group. The fds were dup()ed for us, so are ours to close. A
+** group mostly shares one or two directories, and a file still being
+** appended to may be in it several times, each is only synced once.
+*/
+void SyncPolicy::syncBatch(std::vector<int> & files, std::vector<int> & dirs, int fd)
+{
+    std::vector<struct stat>    synced;
+
+    Logger & log = Logger::getInstance();
+
+    if (this->mode == SYNC_MODE_FS) {
+        if (fd >= 0 && syncfs(fd) != 0) {
+            log.logError("syncfs() failed: %s", strerror(errno));
+        }
+    }
+    else {
+        for (std::vector<int>::iterator it = files.begin(); it != files.end(); ++it) {
+            if (!isDuplicate(synced, *it) && fdatasync(*it) != 0) {
+                log.logError("fdatasync() failed: %s", strerror(errno));
+            }
+
+            ::close(*it);
+        }
+
+        for (std::vector<int>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+            if (!isDuplicate(synced, *it) && fsync(*it) != 0) {
+                log.logError("fsync() failed: %s", strerror(errno));
+            }
+
+            ::close(*it);
+        }
+    }
+
+    files.clear();
+    dirs.clear();
+}
+
+void SyncPolicy::run()
+{
+    std::vector<int>    files;
+    std::vector<int>    dirs;
+    Logger & log = Logger::getInstance();
+
+    ThreadPolicy::getInstance().applyBackground("sync");
+
+    pthread_mutex_lock(&this->mutex);
+
+    while (true) {
+        int64_t         oldest;
+        int64_t         lag;
+        int             fsFd;
+        unsigned int    count;
+
+        if (this->pendingFrames == 0) {
+            if (this->stopRequested) {
+                break;
+            }
+
+            pthread_cond_wait(&this->cond, &this->mutex);
+            continue;
+        }
+
+        // Wait for the group to fill, but no longer than the oldest may wait
+        if (this->pendingFrames < this->maxFrames && !this->stopRequested) {
+            int64_t             deadline = this->oldestPending + (int64_t)this->maxDelayMs * 1000;
+            struct timespec     ts;
+
+            if (monotonicMicroseconds() < deadline) {
+                ts.tv_sec = deadline / 1000000;
+                ts.tv_nsec = (deadline % 1000000) * 1000;
+
+                pthread_cond_timedwait(&this->cond, &this->mutex, &ts);
+                continue;
+            }
+        }
+
+        files.swap(this->pendingFiles);
+        dirs.swap(this->pendingDirs);
+        fsFd = this->fsFd;
+        oldest = this->oldestPending;
+        count = this->pendingFrames;
+        this->pendingFrames = 0;
+
+        pthread_mutex_unlock(&this->mutex);
+
+        syncBatch(files, dirs, fsFd);
+
+        lag = monotonicMicroseconds() - oldest;
+
+        pthread_mutex_lock(&this->mutex);
+
+        this->syncs++;
+        this->frames += count;
+        this->lastLag = lag;
+
+        if (lag > this->maxLag) {
+            this->maxLag = lag;
+        }
+
+        log.logDebug("Synced %u files, lag %lld ms", count, (long long)(lag / 1000));
+    }
+
+    pthread_mutex_unlock(&this->mutex);
+}
+
+void SyncPolicy::start(int mode, unsigned int maxFrames, unsigned int maxDelayMs)
+{
+    Logger & log = Logger::getInstance();
+
+    stop();
+
+    this->mode = mode;
+    this->maxFrames = (maxFrames > 0 ? maxFrames : 1);
+    this->maxDelayMs = maxDelayMs;
+
+    if (mode == SYNC_MODE_NONE) {
+        return;
+    }
+
+    this->stopRequested = false;
+    this->pendingFrames = 0;
+    this->syncs = 0;
+    this->frames = 0;
+    this->lastLag = 0;
+    this->maxLag = 0;
+
+    if (pthread_create(&this->thread, NULL, threadEntry, this)) {
+        log.logError("Failed to start sync thread");
+        throw rpi_error("Failed to start sync thread", __FILE__, __LINE__);
+    }
+
+    this->running = true;
+}
+
+/*
+** Anything still waiting is synced before the thread exits
+*/
+void SyncPolicy::stop()
+{
+    if (!this->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&this->mutex);
+    this->stopRequested = true;
+    pthread_cond_signal(&this->cond);
+    pthread_mutex_unlock(&this->mutex);
+
+    pthread_join(this->thread, NULL);
+
+    if (this->fsFd >= 0) {
+        ::close(this->fsFd);
+        this->fsFd = -1;
+    }
+
+    this->running = false;
+}
+
+/*
+** Queue a finished file for syncing, called just before it is closed, or
+** a file still being appended to once more has been written. dirFd is the
+** directory it was created in.
+*/
+void SyncPolicy::written(int fd, int dirFd)
+{
+    int         fileCopy = -1;
+    int         dirCopy = -1;
+
+    if (!this->running) {
+        return;
+    }
+
+    if (this->mode == SYNC_MODE_DATA) {
+        fileCopy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        dirCopy = fcntl(dirFd, F_DUPFD_CLOEXEC, 0);
+    }
+
+    pthread_mutex_lock(&this->mutex);
+
+    if (this->mode == SYNC_MODE_FS) {
+        if (this->fsFd < 0) {
+            this->fsFd = fcntl(dirFd, F_DUPFD_CLOEXEC, 0);
+        }
+    }
+    else {
+        if (fileCopy >= 0) {
+            this->pendingFiles.push_back(fileCopy);
+        }
+
+        if (dirCopy >= 0) {
+            this->pendingDirs.push_back(dirCopy);
+        }
+    }
+
+    if (this->pendingFrames == 0) {
+        this->oldestPending = monotonicMicroseconds();
+    }
+
+    this->pendingFrames++;
+
+    pthread_cond_signal(&this->cond);
+    pthread_mutex_unlock(&this->mutex);
+}
+
+unsigned int SyncPolicy::getSyncs()
+{
+    unsigned int    count;
+
+    pthread_mutex_lock(&this->mutex);
+    count = this->syncs;
+    pthread_mutex_unlock(&this->mutex);
+
+    return count;
+}
+
+unsigned int SyncPolicy::getFrames()
+{
+    unsigned int    count;
+
+    pthread_mutex_lock(&this->mutex);
+    count = this->frames;
+    pthread_mutex_unlock(&this->mutex);
+
+    return count;
+}
+
+int64_t SyncPolicy::getLastLag()
+{
+    int64_t     lag;
+
+    pthread_mutex_lock(&this->mutex);
+    lag = this->lastLag;
+    pthread_mutex_unlock(&this->mutex);
+
+    return lag;
+}
+
+int64_t SyncPolicy::getMaxLag()
+{
+    int64_t     lag;
+
+    pthread_mutex_lock(&this->mutex);
+    lag = this->maxLag;
+    pthread_mutex_unlock(&this->mutex);
+
+    return lag;
+}
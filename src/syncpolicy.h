@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+#ifndef _INCL_SYNCPOLICY
+#define _INCL_SYNCPOLICY
+
+#define SYNC_MODE_NONE                  0
+#define SYNC_MODE_FS                    1
+#define SYNC_MODE_DATA                  2
+
+/*
+** Gets finished output files onto the card without syncing each one.
+**
+** Files are handed over as they are closed, segments after each frame
+** appended to them, and synced in groups, once maxFrames are waiting or
+** the oldest has waited maxDelayMs, whichever comes first. SYNC_MODE_FS
+** issues a single syncfs() for the output filesystem, SYNC_MODE_DATA an
+** fdatasync() for each file followed by an fsync() of each directory
+** they were created in, once per group.
+**
+** The lag is the time from a frame being handed over to its sync completing,
+** the largest seen is the worst case window that a power cut would have
+** lost.
+*/
+class SyncPolicy
+{
+private:
+    int                 mode;
+    unsigned int        maxFrames;
+    unsigned int        maxDelayMs;
+
+    // Shared with the sync thread
+    pthread_t           thread;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    bool                running;
+    bool                stopRequested;
+
+    std::vector<int>    pendingFiles;       // SYNC_MODE_DATA only
+    std::vector<int>    pendingDirs;        // The directories they were created in, SYNC_MODE_DATA only
+    int                 fsFd;               // Any fd on the output filesystem, for syncfs()
+    unsigned int        pendingFrames;
+    int64_t             oldestPending;      // CLOCK_MONOTONIC us
+
+    unsigned int        syncs;
+    unsigned int        frames;
+    int64_t             lastLag;
+    int64_t             maxLag;
+
+    static void *       threadEntry(void * arg);
+    void                run();
+    void                syncBatch(std::vector<int> & files, std::vector<int> & dirs, int fd);
+
+public:
+    SyncPolicy();
+    ~SyncPolicy();
+
+    static int  parseMode(const char * pszMode);
+
+    void        start(int mode, unsigned int maxFrames, unsigned int maxDelayMs);
+    void        stop();
+
+    bool        isEnabled();
+
+    void        written(int fd, int dirFd);
+
+    unsigned int getSyncs();
+    unsigned int getFrames();
+    int64_t     getLastLag();
+    int64_t     getMaxLag();
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "threadpolicy.h"
+#include "rpi_error.h"
+#include "logger.h"
+
+ThreadPolicy::ThreadPolicy()
+{
+    this->capturePriority = 0;
+    this->pinCapture = false;
+    this->pinBackground = false;
+
+    CPU_ZERO(&this->captureCpus);
+    CPU_ZERO(&this->backgroundCpus);
+}
+
+/*
+** A list of CPUs in the form the kernel uses, e.g. 3 or 2,3 or 0-1
+*/
+void ThreadPolicy::parseCpuList(const char * pszCpus, cpu_set_t * cpus)
+{
+    const char *    p = pszCpus;
+    char *          end;
+    long            first;
+    long            last;
+
+    CPU_ZERO(cpus);
+
+    while (*p) {
+        first = strtol(p, &end, 10);
+
+        if (end == p || first < 0) {
+            throw rpi_error(rpi_error::buildMsg("Invalid CPU list %s", pszCpus), __FILE__, __LINE__);
+        }
+
+        last = first;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+
+            if (end == p || last < first) {
+                throw rpi_error(rpi_error::buildMsg("Invalid CPU list %s", pszCpus), __FILE__, __LINE__);
+            }
+
+            p = end;
+        }
+
+        if (last >= CPU_SETSIZE) {
+            throw rpi_error(rpi_error::buildMsg("CPU %ld in %s out of range", last, pszCpus), __FILE__, __LINE__);
+        }
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET((int)cpu, cpus);
+        }
+
+        if (*p == ',') {
+            p++;
+        }
+        else if (*p) {
+            throw rpi_error(rpi_error::buildMsg("Invalid CPU list %s", pszCpus), __FILE__, __LINE__);
+        }
+    }
+
+    if (CPU_COUNT(cpus) == 0) {
+        throw rpi_error(rpi_error::buildMsg("Invalid CPU list %s", pszCpus), __FILE__, __LINE__);
+    }
+}
+
+void ThreadPolicy::setCapturePriority(int priority)
+{
+    if (priority < 0 || priority > THREAD_POLICY_MAX_PRIORITY) {
+        throw rpi_error(rpi_error::buildMsg("Invalid real time priority %d, use 1 to %d", priority, THREAD_POLICY_MAX_PRIORITY), __FILE__, __LINE__);
+    }
+
+    this->capturePriority = priority;
+}
+
+void ThreadPolicy::setCaptureCpus(const char * pszCpus)
+{
+    cpu_set_t   allowed;
+
+    parseCpuList(pszCpus, &this->captureCpus);
+
+    this->pinCapture = true;
+
+    // Unless told otherwise, everything else keeps off the capture CPUs
+    if (!this->pinBackground && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &this->captureCpus)) {
+                CPU_SET(cpu, &this->backgroundCpus);
+            }
+        }
+
+        if (CPU_COUNT(&this->backgroundCpus) == 0) {
+            Logger::getInstance().logError("Capture threads have every CPU, background threads can run anywhere");
+        }
+    }
+}
+
+void ThreadPolicy::setBackgroundCpus(const char * pszCpus)
+{
+    parseCpuList(pszCpus, &this->backgroundCpus);
+
+    this->pinBackground = true;
+}
+
+bool ThreadPolicy::isSet()
+{
+    return (this->capturePriority > 0 || this->pinCapture || this->pinBackground);
+}
+
+/*
+** Failures are logged and the thread carries on as it was, a capture at
+** the default priority is better than none. SCHED_FIFO needs root,
+** CAP_SYS_NICE or an rtprio limit.
+*/
+void ThreadPolicy::apply(pthread_t thread, const char * pszName, int policy, int priority, bool pin, cpu_set_t * cpus)
+{
+    struct sched_param  param;
+    int                 error;
+
+    Logger & log = Logger::getInstance();
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+
+    error = pthread_setschedparam(thread, policy, &param);
+
+    if (error) {
+        log.logError("Failed to set the scheduling of the %s thread: %s", pszName, strerror(error));
+    }
+
+    if (pin && CPU_COUNT(cpus) > 0) {
+        error = pthread_setaffinity_np(thread, sizeof(cpu_set_t), cpus);
+
+        if (error) {
+            log.logError("Failed to set the CPUs of the %s thread: %s", pszName, strerror(error));
+        }
+    }
+
+    log.logDebug("Set %s thread to %s priority %d", pszName, policy == SCHED_FIFO ? "real time" : "normal", priority);
+}
+
+/*
+** Applied by the calling thread to itself
+*/
+void ThreadPolicy::applyCapture(const char * pszName)
+{
+    if (!this->capturePriority && !this->pinCapture) {
+        return;
+    }
+
+    if (this->capturePriority) {
+        apply(pthread_self(), pszName, SCHED_FIFO, this->capturePriority, this->pinCapture, &this->captureCpus);
+    }
+    else {
+        apply(pthread_self(), pszName, SCHED_OTHER, 0, this->pinCapture, &this->captureCpus);
+    }
+}
+
+void ThreadPolicy::applyBackground(const char * pszName)
+{
+    applyBackground(pthread_self(), pszName);
+}
+
+void ThreadPolicy::applyBackground(pthread_t thread, const char * pszName)
+{
+    if (!isSet()) {
+        return;
+    }
+
+    // Also undoes a real time priority inherited from a capture thread
+    apply(thread, pszName, SCHED_OTHER, 0, true, &this->backgroundCpus);
+}
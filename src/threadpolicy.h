@@ -0,0 +1,57 @@
+#include <sched.h>
+#include <pthread.h>
+
+#ifndef _INCL_THREADPOLICY
+#define _INCL_THREADPOLICY
+
+#define THREAD_POLICY_MAX_PRIORITY      99
+
+/*
+** Where the threads run, and at what priority.
+**
+** Capture threads are the main thread and the MMAL callback threads, the
+** ones a frame waits on. They can be given a SCHED_FIFO priority, so
+** nothing else on the box can hold them off a core, and pinned to a set
+** of CPUs. Background threads are everything else: the GPS reader and
+** the threads that create, sync, delete, stream and publish files. They
+** are pinned to the background CPUs, or if none are given to whichever
+** CPUs the capture threads aren't using, and never run at a real time
+** priority.
+**
+** Threads take their policy from the thread that created them, so each
+** thread applies its own as it starts rather than relying on the order
+** they were created in.
+*/
+class ThreadPolicy
+{
+public:
+    static ThreadPolicy & getInstance() {
+        static ThreadPolicy instance;
+        return instance;
+    }
+
+private:
+    ThreadPolicy();
+
+    int             capturePriority;        // SCHED_FIFO priority, 0 to leave the scheduling alone
+    bool            pinCapture;
+    cpu_set_t       captureCpus;
+    bool            pinBackground;
+    cpu_set_t       backgroundCpus;
+
+    void            parseCpuList(const char * pszCpus, cpu_set_t * cpus);
+    void            apply(pthread_t thread, const char * pszName, int policy, int priority, bool pin, cpu_set_t * cpus);
+
+public:
+    void            setCapturePriority(int priority);
+    void            setCaptureCpus(const char * pszCpus);
+    void            setBackgroundCpus(const char * pszCpus);
+
+    bool            isSet();
+
+    void            applyCapture(const char * pszName);
+    void            applyBackground(const char * pszName);
+    void            applyBackground(pthread_t thread, const char * pszName);
+};
+
+#endif
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <linux/gpio.h>
+
+#include "triggersource.h"
+#include "rpi_error.h"
+#include "logger.h"
+
+// GPIO timestamps further than this from CLOCK_MONOTONIC must be CLOCK_REALTIME, us
+#define TRIGGER_GPIO_CLOCK_SLACK        3600000000LL
+
+static int64_t clockMicroseconds(clockid_t clock)
+{
+    struct timespec     ts;
+
+    clock_gettime(clock, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+TriggerSource::TriggerSource()
+{
+    this->type = TRIGGER_NONE;
+    this->fd = -1;
+    this->realtimeOffset = 0;
+    this->szDescription[0] = 0;
+}
+
+TriggerSource::~TriggerSource()
+{
+    close();
+}
+
+void TriggerSource::open(const char * pszSpec)
+{
+    const char *    pszArgs = strchr(pszSpec, ':');
+
+    close();
+
+    if (pszArgs == NULL) {
+        throw rpi_error(rpi_error::buildMsg("Invalid trigger %s", pszSpec), __FILE__, __LINE__);
+    }
+
+    pszArgs++;
+
+    if (strncmp(pszSpec, "gpio:", 5) == 0) {
+        openGpio(pszArgs);
+    }
+    else if (strncmp(pszSpec, "sysfs:", 6) == 0) {
+        openSysfs(pszArgs);
+    }
+    else if (strncmp(pszSpec, "fifo:", 5) == 0) {
+        openFifo(pszArgs);
+    }
+    else if (strncmp(pszSpec, "fd:", 3) == 0) {
+        openFd(pszArgs);
+    }
+    else if (strncmp(pszSpec, "timer:", 6) == 0) {
+        openTimer(pszArgs);
+    }
+    else {
+        throw rpi_error(rpi_error::buildMsg("Unknown trigger type %s", pszSpec), __FILE__, __LINE__);
+    }
+
+    Logger::getInstance().logDebug("Waiting for triggers from %s", this->szDescription);
+}
+
+void TriggerSource::close()
+{
+    // An inherited fd belongs to whoever passed it in
+    if (this->fd >= 0 && this->type != TRIGGER_FD) {
+        ::close(this->fd);
+    }
+
+    this->fd = -1;
+    this->type = TRIGGER_NONE;
+}
+
+/*
+** <chip>:<line>[:rising|falling|both], chip as a number or a device path
+*/
+void TriggerSource::openGpio(const char * pszArgs)
+{
+    struct gpioevent_request    request;
+    char                        szChip[64];
+    char                        szDevice[80];
+    char                        szEdge[16] = "rising";
+    unsigned int                line;
+    int                         chipFd;
+
+    if (sscanf(pszArgs, "%63[^:]:%u:%15s", szChip, &line, szEdge) < 2) {
+        throw rpi_error(rpi_error::buildMsg("Invalid GPIO trigger %s, use <chip>:<line>[:rising|falling|both]", pszArgs), __FILE__, __LINE__);
+    }
+
+    memset(&request, 0, sizeof(request));
+
+    request.lineoffset = line;
+    request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    strcpy(request.consumer_label, "capture trigger");
+
+    if (strcmp(szEdge, "rising") == 0) {
+        request.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+    }
+    else if (strcmp(szEdge, "falling") == 0) {
+        request.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+    }
+    else if (strcmp(szEdge, "both") == 0) {
+        request.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+    }
+    else {
+        throw rpi_error(rpi_error::buildMsg("Invalid GPIO edge %s", szEdge), __FILE__, __LINE__);
+    }
+
+    if (szChip[0] == '/') {
+        snprintf(szDevice, sizeof(szDevice), "%s", szChip);
+    }
+    else {
+        snprintf(szDevice, sizeof(szDevice), "/dev/gpiochip%s", szChip);
+    }
+
+    chipFd = ::open(szDevice, O_RDONLY | O_CLOEXEC);
+
+    if (chipFd < 0) {
+        throw rpi_error(rpi_error::buildMsg("Failed to open %s: %s", szDevice, strerror(errno)), __FILE__, __LINE__);
+    }
+
+    if (ioctl(chipFd, GPIO_GET_LINEEVENT_IOCTL, &request) < 0) {
+        int error = errno;
+
+        ::close(chipFd);
+        throw rpi_error(rpi_error::buildMsg("Failed to request events on %s line %u: %s", szDevice, line, strerror(error)), __FILE__, __LINE__);
+    }
+
+    // The line stays requested through its own fd
+    ::close(chipFd);
+
+    this->fd = request.fd;
+    this->type = TRIGGER_GPIO;
+
+    fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL) | O_NONBLOCK);
+    fcntl(this->fd, F_SETFD, FD_CLOEXEC);
+
+    snprintf(this->szDescription, sizeof(this->szDescription), "%s line %u, %s edge", szDevice, line, szEdge);
+}
+
+/*
+** An exported sysfs GPIO value file, poll() flags POLLPRI on the edges
+** set in its edge file
+*/
+void TriggerSource::openSysfs(const char * pszPath)
+{
+    char        value[8];
+
+    this->fd = ::open(pszPath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (this->fd < 0) {
+        throw rpi_error(rpi_error::buildMsg("Failed to open %s: %s", pszPath, strerror(errno)), __FILE__, __LINE__);
+    }
+
+    this->type = TRIGGER_SYSFS;
+
+    // The value has to be read once, or the first poll() returns straight away
+    if (pread(this->fd, value, sizeof(value), 0) < 0) {
+        Logger::getInstance().logError("Failed to read %s", pszPath);
+    }
+
+    snprintf(this->szDescription, sizeof(this->szDescription), "%s", pszPath);
+}
+
+/*
+** Opened read/write so the pipe never sees end of file between writers
+*/
+void TriggerSource::openFifo(const char * pszPath)
+{
+    struct stat     st;
+
+    if (stat(pszPath, &st) != 0) {
+        if (mkfifo(pszPath, 0660) != 0) {
+            throw rpi_error(rpi_error::buildMsg("Failed to create %s: %s", pszPath, strerror(errno)), __FILE__, __LINE__);
+        }
+    }
+    else if (!S_ISFIFO(st.st_mode)) {
+        throw rpi_error(rpi_error::buildMsg("%s is not a named pipe", pszPath), __FILE__, __LINE__);
+    }
+
+    this->fd = ::open(pszPath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (this->fd < 0) {
+        throw rpi_error(rpi_error::buildMsg("Failed to open %s: %s", pszPath, strerror(errno)), __FILE__, __LINE__);
+    }
+
+    this->type = TRIGGER_FIFO;
+
+    snprintf(this->szDescription, sizeof(this->szDescription), "%s", pszPath);
+}
+
+void TriggerSource::openFd(const char * pszFd)
+{
+    int     fd;
+
+    if (sscanf(pszFd, "%d", &fd) != 1 || fd < 0 || fcntl(fd, F_GETFD) < 0) {
+        throw rpi_error(rpi_error::buildMsg("Invalid trigger fd %s", pszFd), __FILE__, __LINE__);
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    this->fd = fd;
+    this->type = TRIGGER_FD;
+
+    snprintf(this->szDescription, sizeof(this->szDescription), "fd %d", fd);
+}
+
+void TriggerSource::openTimer(const char * pszInterval)
+{
+    struct itimerspec   spec;
+    int                 ms;
+
+    if (sscanf(pszInterval, "%d", &ms) != 1 || ms <= 0) {
+        throw rpi_error(rpi_error::buildMsg("Invalid trigger interval %s", pszInterval), __FILE__, __LINE__);
+    }
+
+    this->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (this->fd < 0) {
+        throw rpi_error("Failed to create trigger timer", __FILE__, __LINE__);
+    }
+
+    this->type = TRIGGER_TIMER;
+
+    spec.it_interval.tv_sec = ms / 1000;
+    spec.it_interval.tv_nsec = (ms % 1000) * 1000000L;
+    spec.it_value = spec.it_interval;
+
+    timerfd_settime(this->fd, 0, &spec, NULL);
+
+    snprintf(this->szDescription, sizeof(this->szDescription), "a timer every %d ms", ms);
+}
+
+int TriggerSource::getFd()
+{
+    return this->fd;
+}
+
+short TriggerSource::getEvents()
+{
+    return (this->type == TRIGGER_SYSFS) ? (POLLPRI | POLLERR) : POLLIN;
+}
+
+const char * TriggerSource::getDescription()
+{
+    return this->szDescription;
+}
+
+/*
+** Kernels before 5.7 stamp GPIO events with CLOCK_REALTIME, later ones
+** with CLOCK_MONOTONIC. The two are hours apart on anything but a board
+** that has just booted without a network, so the first event tells them
+** apart.
+*/
+int64_t TriggerSource::gpioTime(uint64_t timestamp)
+{
+    int64_t     us = (int64_t)(timestamp / 1000);
+    int64_t     now = clockMicroseconds(CLOCK_MONOTONIC);
+
+    if (us - now > TRIGGER_GPIO_CLOCK_SLACK || now - us > TRIGGER_GPIO_CLOCK_SLACK) {
+        this->realtimeOffset = clockMicroseconds(CLOCK_REALTIME) - now;
+    }
+    else {
+        this->realtimeOffset = 0;
+    }
+
+    return us - this->realtimeOffset;
+}
+
+/*
+** Read the event poll() reported, false if there wasn't one after all.
+** errno is EAGAIN if it was taken by someone else, anything else means
+** the source has gone, 0 for end of file on a pipe or fifo.
+*/
+bool TriggerSource::read(TRIGGER_EVENT * event)
+{
+    int64_t     woken = clockMicroseconds(CLOCK_MONOTONIC);
+
+    event->time = woken;
+    event->exact = false;
+    event->count = 1;
+
+    switch (this->type) {
+        case TRIGGER_GPIO:
+        {
+            struct gpioevent_data   data;
+
+            if (::read(this->fd, &data, sizeof(data)) != sizeof(data)) {
+                return false;
+            }
+
+            event->time = gpioTime(data.timestamp);
+            event->exact = true;
+            break;
+        }
+
+        case TRIGGER_SYSFS:
+        {
+            char    value[8];
+
+            // Reading from the start re-arms the edge
+            if (pread(this->fd, value, sizeof(value), 0) < 0) {
+                return false;
+            }
+            break;
+        }
+
+        case TRIGGER_TIMER:
+        {
+            uint64_t    expirations;
+
+            if (::read(this->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+                return false;
+            }
+
+            event->count = (uint32_t)expirations;
+            break;
+        }
+
+        case TRIGGER_FIFO:
+        case TRIGGER_FD:
+        {
+            uint8_t     buffer[8];
+            ssize_t     n;
+
+            // An eventfd gives its count as 8 bytes, a pipe whatever was written
+            n = ::read(this->fd, buffer, sizeof(buffer));
+
+            if (n <= 0) {
+                return false;
+            }
+
+            if (n == sizeof(uint64_t)) {
+                uint64_t value;
+
+                memcpy(&value, buffer, sizeof(value));
+
+                if (value > 0 && value < 0x100000000ULL) {
+                    event->count = (uint32_t)value;
+                }
+            }
+            break;
+        }
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+/*
+** Throw away any events waiting, those that arrived while a capture was
+** in progress. Returns how many there were.
+*/
+unsigned int TriggerSource::drain()
+{
+    struct pollfd   pfd;
+    TRIGGER_EVENT   event;
+    unsigned int    count = 0;
+
+    if (this->fd < 0) {
+        return 0;
+    }
+
+    pfd.fd = this->fd;
+    pfd.events = getEvents();
+
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & pfd.events) && read(&event)) {
+        count += event.count;
+    }
+
+    return count;
+}
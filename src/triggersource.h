@@ -0,0 +1,72 @@
+#include <stdint.h>
+
+#ifndef _INCL_TRIGGERSOURCE
+#define _INCL_TRIGGERSOURCE
+
+#define TRIGGER_MAX_DESCRIPTION_LEN     128
+
+/*
+** One trigger, or several that arrived together
+*/
+typedef struct {
+    int64_t         time;           // CLOCK_MONOTONIC us of the event
+    bool            exact;          // time was stamped by the kernel at the edge, not when we woke
+    uint32_t        count;          // Events this covers, timer expirations or eventfd counts
+}
+TRIGGER_EVENT;
+
+/*
+** Something to wait on for a capture trigger, any file descriptor that
+** poll() reports readable (or POLLPRI) when there's an event:
+**
+**  gpio:<chip>:<line>[:rising|falling|both]   GPIO character device line
+**  sysfs:<path>                                Exported sysfs GPIO value file, edge already set
+**  fifo:<path>                                 Named pipe, each write is a trigger
+**  fd:<n>                                      Inherited pipe or eventfd
+**  timer:<ms>                                  Periodic timerfd
+**
+** The caller polls getFd() for getEvents() along with anything else it
+** is waiting on, then calls read(). GPIO line events carry the kernel's
+** timestamp of the edge, the others are timed as the wait returns.
+*/
+class TriggerSource
+{
+private:
+    enum {
+        TRIGGER_NONE,
+        TRIGGER_GPIO,
+        TRIGGER_SYSFS,
+        TRIGGER_FIFO,
+        TRIGGER_FD,
+        TRIGGER_TIMER
+    };
+
+    int         type;
+    int         fd;
+    int64_t     realtimeOffset;     // Subtracted from GPIO timestamps on kernels that stamp with CLOCK_REALTIME
+    char        szDescription[TRIGGER_MAX_DESCRIPTION_LEN];
+
+    void        openGpio(const char * pszArgs);
+    void        openSysfs(const char * pszPath);
+    void        openFifo(const char * pszPath);
+    void        openFd(const char * pszFd);
+    void        openTimer(const char * pszInterval);
+
+    int64_t     gpioTime(uint64_t timestamp);
+
+public:
+    TriggerSource();
+    ~TriggerSource();
+
+    void            open(const char * pszSpec);
+    void            close();
+
+    int             getFd();
+    short           getEvents();
+    const char *    getDescription();
+
+    bool            read(TRIGGER_EVENT * event);
+    unsigned int    drain();
+};
+
+#endif
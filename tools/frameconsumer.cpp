@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+#include "frameformat.h"
+
+/*
+** Reads frames from the shared memory ring published by capture -shm.
+**
+** Shows how a consumer attaches to the ring and reads each newest frame
+** in place, and reports how long after capture each frame was read. With
+** -o the frames are written out, as a stand-in for real processing.
+*/
+
+static void printUsage(const char * pszAppName)
+{
+    printf("Usage: %s [-n] [-c <count>] [-o <dir>] <socket>\n", pszAppName);
+    printf("    -n          Tell capture the frames needn't be written to disk as well\n");
+    printf("    -c <count>  Stop after reading <count> frames\n");
+    printf("    -o <dir>    Write each frame read to <dir>\n");
+}
+
+static int64_t wallTimeNow()
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+** Connect and send our flags, capture answers with our consumer number
+** and the memfd
+*/
+static int attach(const char * pszSocket, uint32_t flags, uint32_t * consumer)
+{
+    struct sockaddr_un  addr;
+    struct msghdr       msg;
+    struct iovec        iov;
+    struct cmsghdr *    cmsg;
+    char                control[CMSG_SPACE(sizeof(int))];
+    int                 sock;
+    int                 fd = -1;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, pszSocket, sizeof(addr.sun_path) - 1);
+
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", pszSocket, strerror(errno));
+        return -1;
+    }
+
+    if (send(sock, &flags, sizeof(flags), MSG_NOSIGNAL) != sizeof(flags)) {
+        fprintf(stderr, "Failed to send to %s\n", pszSocket);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = consumer;
+    iov.iov_len = sizeof(*consumer);
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(*consumer)) {
+        fprintf(stderr, "No frame ring from %s, too many consumers?\n", pszSocket);
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    }
+
+    if (fd < 0 || *consumer >= FRAME_RING_MAX_CONSUMERS) {
+        fprintf(stderr, "Bad frame ring from %s\n", pszSocket);
+        return -1;
+    }
+
+    // The socket stays open for as long as we're attached, closing it frees our slot
+    return fd;
+}
+
+/*
+** Wait up to a second for a frame newer than lastSequence
+*/
+static void waitForFrame(FRAME_RING_HEADER * header, FRAME_RING_CONSUMER * self, uint32_t lastSequence)
+{
+    struct timespec     timeout = { 1, 0 };
+
+    __atomic_store_n(&self->waiting, 1, __ATOMIC_SEQ_CST);
+
+    // capture may have published between our last look and setting waiting
+    if (__atomic_load_n(&header->sequence, __ATOMIC_SEQ_CST) == lastSequence) {
+        syscall(SYS_futex, &header->sequence, FUTEX_WAIT, lastSequence, &timeout, NULL, 0);
+    }
+
+    __atomic_store_n(&self->waiting, 0, __ATOMIC_RELAXED);
+}
+
+int main(int argc, char ** argv)
+{
+    const char *            pszSocket = NULL;
+    const char *            pszDir = NULL;
+    uint32_t                flags = 0;
+    long                    count = 0;
+    long                    frames = 0;
+    uint32_t                consumer;
+    uint32_t                lastSequence = 0;
+    unsigned int            skipped = 0;
+    int                     fd;
+    off_t                   size;
+    uint8_t *               map;
+    FRAME_RING_HEADER *     header;
+    FRAME_RING_SLOT *       slots;
+    FRAME_RING_CONSUMER *   self;
+    int                     i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            flags |= FRAME_RING_CONSUMER_NO_FILES;
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            count = strtol(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            pszDir = argv[++i];
+        }
+        else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (i < argc) {
+        pszSocket = argv[i];
+    }
+
+    if (pszSocket == NULL) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    fd = attach(pszSocket, flags, &consumer);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    size = lseek(fd, 0, SEEK_END);
+    map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map the frame ring\n");
+        return -1;
+    }
+
+    header = (FRAME_RING_HEADER *)map;
+
+    if (memcmp(header->magic, FRAME_RING_MAGIC, sizeof(header->magic)) != 0 || header->version != FRAME_RING_VERSION) {
+        fprintf(stderr, "Not a frame ring this version can read\n");
+        return -1;
+    }
+
+    slots = (FRAME_RING_SLOT *)(map + header->size);
+    self = &header->consumers[consumer];
+
+    printf("Attached as consumer %u, %u slots of %u bytes\n", consumer, header->slotCount, header->slotSize);
+
+    while (count == 0 || frames < count) {
+        uint32_t            latest;
+        FRAME_RING_SLOT *   slot;
+        uint32_t            generation;
+
+        if (__atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE) == lastSequence) {
+            waitForFrame(header, self, lastSequence);
+            continue;
+        }
+
+        latest = __atomic_load_n(&header->latest, __ATOMIC_ACQUIRE);
+
+        if (latest >= header->slotCount) {
+            continue;
+        }
+
+        slot = &slots[latest];
+
+        // Hold the slot, then check capture hadn't already started refilling it
+        __atomic_store_n(&self->holding, latest, __ATOMIC_SEQ_CST);
+        generation = __atomic_load_n(&slot->generation, __ATOMIC_SEQ_CST);
+
+        if ((generation & 1) || slot->sequence <= lastSequence) {
+            __atomic_store_n(&self->holding, FRAME_RING_NO_SLOT, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        if (lastSequence != 0) {
+            skipped += slot->sequence - lastSequence - 1;
+        }
+
+        lastSequence = slot->sequence;
+
+        // The frame is ours to read in place until we let go of the slot
+        printf(
+            "Frame %u (%u): %u bytes, exposure %u us, read %.1f ms after capture\n",
+            slot->metadata.frame,
+            slot->sequence,
+            slot->length,
+            slot->metadata.exposure,
+            (wallTimeNow() - slot->metadata.captureTime) / 1000.0);
+
+        if (pszDir != NULL) {
+            char    szFile[PATH_MAX];
+            FILE *  fp;
+
+            snprintf(szFile, sizeof(szFile), "%s/frame_%06u.jpg", pszDir, slot->sequence);
+
+            fp = fopen(szFile, "wb");
+
+            if (fp == NULL || fwrite(map + slot->dataOffset, 1, slot->length, fp) != slot->length) {
+                fprintf(stderr, "Failed to write %s\n", szFile);
+            }
+
+            if (fp != NULL) {
+                fclose(fp);
+            }
+        }
+
+        __atomic_store_n(&self->holding, FRAME_RING_NO_SLOT, __ATOMIC_SEQ_CST);
+
+        frames++;
+    }
+
+    printf("Read %ld frames, skipped %u\n", frames, skipped);
+
+    munmap(map, size);
+
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frameformat.h"
+
+/*
+** Finds frames by time in a frame index written by capture -frameindex.
+**
+** The index is mmap()ed and binary searched, so finding a moment in a
+** long run only touches a handful of pages however many frames it holds.
+*/
+
+static void printUsage(const char * pszAppName)
+{
+    printf("Usage: %s [-n <count>] <index> <time>\n", pszAppName);
+    printf("       %s -l <index>\n", pszAppName);
+    printf("    -l          List every frame in the index\n");
+    printf("    -n <count>  Frames to show from the first at or after <time> (default 1)\n");
+    printf("<time> is local time as \"YYYY-MM-DD HH:MM:SS[.ffffff]\", or @<seconds since the epoch>\n");
+}
+
+/*
+** Parse a time argument to us since the epoch, -1 if it isn't one
+*/
+static int64_t parseTime(const char * pszTime)
+{
+    struct tm       tm;
+    const char *    pszRest;
+    double          fraction = 0.0;
+    time_t          t;
+
+    if (pszTime[0] == '@') {
+        char *      pszEnd;
+        double      seconds = strtod(&pszTime[1], &pszEnd);
+
+        return (*pszEnd == 0 && pszEnd != &pszTime[1]) ? (int64_t)(seconds * 1000000.0) : -1;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+
+    pszRest = strptime(pszTime, "%Y-%m-%d %H:%M:%S", &tm);
+
+    if (pszRest == NULL) {
+        return -1;
+    }
+
+    if (*pszRest == '.') {
+        fraction = strtod(pszRest, NULL);
+    }
+    else if (*pszRest != 0) {
+        return -1;
+    }
+
+    tm.tm_isdst = -1;
+    t = mktime(&tm);
+
+    return (int64_t)t * 1000000 + (int64_t)(fraction * 1000000.0);
+}
+
+static void printEntry(const FRAME_INDEX_ENTRY * entry)
+{
+    time_t          t = (time_t)(entry->wallTime / 1000000);
+    struct tm       tm;
+    char            szTime[32];
+
+    localtime_r(&t, &tm);
+    strftime(szTime, sizeof(szTime), "%Y-%m-%d %H:%M:%S", &tm);
+
+    printf(
+        "%s.%06lld frame %u: %.*s",
+        szTime,
+        (long long)(entry->wallTime % 1000000),
+        entry->frame,
+        FRAME_INDEX_NAME_LEN,
+        (entry->flags & FRAME_INDEX_NAME_TOO_LONG) ? "<name too long>" : entry->name);
+
+    if (entry->flags & FRAME_INDEX_IN_SEGMENT) {
+        printf(" @%llu", (unsigned long long)entry->offset);
+    }
+
+    printf(", %u bytes", entry->size);
+
+    if (!(entry->flags & FRAME_INDEX_NO_SETTINGS)) {
+        printf(", exposure %u us", entry->exposure);
+    }
+
+    printf("\n");
+}
+
+/*
+** Index of the first entry at or after wallTime, count if there is none
+*/
+static size_t findFirst(const FRAME_INDEX_ENTRY * entries, size_t count, int64_t wallTime)
+{
+    size_t      low = 0;
+    size_t      high = count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (entries[mid].wallTime < wallTime) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+int main(int argc, char ** argv)
+{
+    const char *                pszIndex = NULL;
+    const char *                pszTime = NULL;
+    bool                        listAll = false;
+    long                        show = 1;
+    int                         fd;
+    struct stat                 st;
+    const uint8_t *             map;
+    const FRAME_INDEX_HEADER *  header;
+    const FRAME_INDEX_ENTRY *   entries;
+    size_t                      count;
+    size_t                      first;
+    int                         i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            listAll = true;
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            show = strtol(argv[++i], NULL, 10);
+        }
+        else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (i < argc) {
+        pszIndex = argv[i++];
+    }
+
+    if (i < argc) {
+        pszTime = argv[i++];
+    }
+
+    if (pszIndex == NULL || (pszTime == NULL && !listAll) || show < 1) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    fd = open(pszIndex, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open %s\n", pszIndex);
+        return -1;
+    }
+
+    if (st.st_size < (off_t)sizeof(FRAME_INDEX_HEADER)) {
+        fprintf(stderr, "%s is not a frame index\n", pszIndex);
+        return -1;
+    }
+
+    map = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s\n", pszIndex);
+        return -1;
+    }
+
+    header = (const FRAME_INDEX_HEADER *)map;
+
+    if (memcmp(header->magic, FRAME_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+            header->entrySize != sizeof(FRAME_INDEX_ENTRY) ||
+            header->size > st.st_size)
+    {
+        fprintf(stderr, "%s is not a frame index this version can read\n", pszIndex);
+        return -1;
+    }
+
+    // The header is a multiple of 8 bytes, so the entries stay aligned
+    entries = (const FRAME_INDEX_ENTRY *)(map + header->size);
+    count = (st.st_size - header->size) / header->entrySize;
+
+    if (listAll) {
+        for (size_t n = 0; n < count; n++) {
+            printEntry(&entries[n]);
+        }
+    }
+    else {
+        int64_t wallTime = parseTime(pszTime);
+
+        if (wallTime < 0) {
+            fprintf(stderr, "Can't make sense of the time %s\n", pszTime);
+            return -1;
+        }
+
+        first = findFirst(entries, count, wallTime);
+
+        if (first == count) {
+            fprintf(stderr, "No frames at or after %s\n", pszTime);
+            return 1;
+        }
+
+        for (size_t n = first; n < count && n < first + show; n++) {
+            printEntry(&entries[n]);
+        }
+    }
+
+    munmap((void *)map, st.st_size);
+
+    return 0;
+}
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "exposurefusion.h"
+#include "rpi_error.h"
+
+/*
+** Benchmarks the exposure fusion used by capture -fuse, on synthetic
+** brackets so it runs anywhere, x86 included.
+**
+** The scene is a radiance map some 12 stops deep: a gradient, lit and
+** shadowed discs and fine texture. Each frame of the bracket is that scene
+** at its exposure, gamma encoded and clipped as the camera would. Every
+** set of kernels built in is timed, and checked against the plain C ones.
+*/
+
+static void printUsage(const char * pszAppName)
+{
+    printf("Usage: %s [-w <width>] [-h <height>] [-n <frames>] [-ev <step>] [-i <iterations>] [-o <file>]\n", pszAppName);
+    printf("    -w <width>      Frame width (default 1920)\n");
+    printf("    -h <height>     Frame height (default 1080)\n");
+    printf("    -n <frames>     Frames in the bracket, centred on 0 EV (default 3)\n");
+    printf("    -ev <step>      EV between the frames (default 2)\n");
+    printf("    -i <iterations> Merges to time for each set of kernels (default 10)\n");
+    printf("    -o <file>       Write the fused frame to <file> as I420\n");
+}
+
+static int64_t monotonicUs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+** Scene radiance at a pixel, 1.0 exposes to mid grey at 0 EV
+*/
+static double radiance(int x, int y, int width, int height, uint32_t * seed)
+{
+    double  fx = (double)x / width;
+    double  fy = (double)y / height;
+    double  stops = 12.0 * fx - 6.0;
+    double  dx;
+    double  dy;
+
+    // A bright disc top left, a deep shadow bottom right
+    dx = fx - 0.25;
+    dy = fy - 0.3;
+
+    if (dx * dx + dy * dy < 0.02) {
+        stops += 4.0;
+    }
+
+    dx = fx - 0.75;
+    dy = fy - 0.7;
+
+    if (dx * dx + dy * dy < 0.02) {
+        stops -= 4.0;
+    }
+
+    // Texture, so there is detail to lose in the clipped frames
+    *seed = *seed * 1103515245 + 12345;
+    stops += ((double)((*seed >> 16) & 0xFF) / 255.0 - 0.5) * 0.3;
+
+    return pow(2.0, stops);
+}
+
+static uint8_t encode(double value)
+{
+    double  v = 255.0 * pow(value * 0.218, 1.0 / 2.2);
+
+    return (uint8_t)(v > 255.0 ? 255.0 : v + 0.5);
+}
+
+static void buildBracket(uint8_t ** frames, int count, double step, const FUSION_FORMAT * format)
+{
+    size_t      lumaSize = (size_t)format->stride * format->sliceHeight;
+    size_t      chromaSize = lumaSize / 4;
+    int         chromaStride = format->stride / 2;
+    uint32_t    seed = 1;
+
+    for (int y = 0; y < format->height; y++) {
+        for (int x = 0; x < format->width; x++) {
+            double l = radiance(x, y, format->width, format->height, &seed);
+
+            for (int i = 0; i < count; i++) {
+                double ev = step * (i - (count - 1) / 2.0);
+
+                frames[i][(size_t)y * format->stride + x] = encode(l * pow(2.0, ev));
+            }
+        }
+    }
+
+    // Colour fades out as the frame clips, the way it does from a sensor
+    for (int y = 0; y < (format->height + 1) / 2; y++) {
+        for (int x = 0; x < (format->width + 1) / 2; x++) {
+            for (int i = 0; i < count; i++) {
+                int     luma = frames[i][(size_t)(2 * y) * format->stride + 2 * x];
+                double  saturation = 1.0 - fabs(luma - 128) / 128.0;
+                size_t  offset = (size_t)y * chromaStride + x;
+
+                frames[i][lumaSize + offset] = (uint8_t)(128 + 40.0 * saturation * ((x / 64) % 2 ? 1 : -1));
+                frames[i][lumaSize + chromaSize + offset] = (uint8_t)(128 + 30.0 * saturation * ((y / 64) % 2 ? 1 : -1));
+            }
+        }
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    FUSION_FORMAT       format;
+    uint8_t *           frames[FUSION_MAX_FRAMES];
+    uint8_t *           reference;
+    uint8_t *           out;
+    const char *        pszOutput = NULL;
+    double              step = 2.0;
+    int                 count = 3;
+    int                 iterations = 10;
+    int                 errors = 0;
+    size_t              frameSize;
+    int                 i;
+
+    format.width = 1920;
+    format.height = 1080;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            format.width = strtol(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            format.height = strtol(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = strtol(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-ev") == 0 && i + 1 < argc) {
+            step = strtod(argv[++i], NULL);
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            iterations = strtol(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            pszOutput = argv[++i];
+        }
+        else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (format.width < 2 || format.height < 2 || count < 1 || count > FUSION_MAX_FRAMES || iterations < 1) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    // Padded as the camera's still port pads them
+    format.stride = (format.width + 31) & ~31;
+    format.sliceHeight = (format.height + 15) & ~15;
+
+    frameSize = ExposureFusion::getFrameSize(&format);
+
+    for (i = 0; i < count; i++) {
+        frames[i] = (uint8_t *)calloc(1, frameSize);
+    }
+
+    reference = (uint8_t *)calloc(1, frameSize);
+    out = (uint8_t *)calloc(1, frameSize);
+
+    for (i = 0; i < count; i++) {
+        if (frames[i] == NULL) {
+            break;
+        }
+    }
+
+    if (i < count || reference == NULL || out == NULL) {
+        fprintf(stderr, "Not enough memory for %d frames of %u bytes\n", count + 2, (unsigned int)frameSize);
+        return -1;
+    }
+
+    printf("Building %d frames of %d x %d, %.1f EV apart\n", count, format.width, format.height, step);
+
+    buildBracket(frames, count, step, &format);
+
+    try {
+        for (int k = 0; k < ExposureFusion::getKernelCount(); k++) {
+            ExposureFusion      fusion;
+            const uint8_t *     inputs[FUSION_MAX_FRAMES];
+            uint8_t *           result = (k == 0) ? reference : out;
+            int64_t             best = INT64_MAX;
+            int64_t             total = 0;
+            int                 maxDiff = 0;
+            size_t              differ = 0;
+
+            for (i = 0; i < count; i++) {
+                inputs[i] = frames[i];
+            }
+
+            fusion.setKernels(ExposureFusion::getKernels(k));
+
+            for (int n = 0; n < iterations; n++) {
+                int64_t start = monotonicUs();
+
+                fusion.merge(inputs, count, result, &format);
+
+                int64_t elapsed = monotonicUs() - start;
+
+                total += elapsed;
+
+                if (elapsed < best) {
+                    best = elapsed;
+                }
+            }
+
+            if (k > 0) {
+                for (size_t b = 0; b < frameSize; b++) {
+                    int diff = abs((int)out[b] - (int)reference[b]);
+
+                    if (diff) {
+                        differ++;
+                    }
+
+                    if (diff > maxDiff) {
+                        maxDiff = diff;
+                    }
+                }
+
+                if (maxDiff > 1) {
+                    errors++;
+                }
+            }
+
+            printf(
+                "%-8s mean %8.2f ms, best %8.2f ms",
+                fusion.getKernelName(),
+                total / 1000.0 / iterations,
+                best / 1000.0);
+
+            // A tiny frame can fuse within the clock's resolution
+            if (best > 0) {
+                printf(", %7.1f Mpixel/s", (double)format.width * format.height / best);
+            }
+            else {
+                printf(", too quick to time");
+            }
+
+            if (k > 0) {
+                printf(", %u bytes differ from scalar by up to %d", (unsigned int)differ, maxDiff);
+            }
+
+            printf("\n");
+        }
+    }
+    catch (rpi_error & e) {
+        fprintf(stderr, "%s\n", e.what());
+        return -1;
+    }
+
+    if (pszOutput) {
+        FILE * fp = fopen(pszOutput, "wb");
+
+        if (fp == NULL || fwrite(reference, 1, frameSize, fp) != frameSize) {
+            fprintf(stderr, "Failed to write %s\n", pszOutput);
+            errors++;
+        }
+
+        if (fp) {
+            fclose(fp);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        free(frames[i]);
+    }
+
+    free(reference);
+    free(out);
+
+    if (errors) {
+        fprintf(stderr, "Kernels disagree with the plain C ones\n");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mjpegserver.h"
+#include "rpi_error.h"
+#include "logger.h"
+
+/*
+** Checks the MJPEG stream's fan-out ring without a camera, x86 included.
+**
+** Synthetic JPEGs are fed to the server as the encoder callback would,
+** while two viewers on the loopback read the stream, one as fast as it
+** can and one a little at a time through a small receive buffer. The
+** slow viewer should skip frames rather than hold up the ring: the fast
+** one should still get the newest frame, the server should drop none,
+** and every frame either receives should arrive whole and in order.
+*/
+
+#define READ_BUFFER_LEN             65536
+#define FEED_CHUNK_LEN              16384
+#define SLOW_READ_LEN               4096
+#define SLOW_RCVBUF_LEN             8192
+
+typedef struct {
+    int             fd;
+    int             readDelayMs;        // Between reads, 0 to read as fast as possible
+    const char *    pszName;
+
+    // Filled in by the viewer thread
+    unsigned int    frames;
+    unsigned int    bad;
+    uint32_t        lastFrame;
+    bool            outOfOrder;
+
+    uint8_t         buffer[READ_BUFFER_LEN];
+    size_t          length;
+    size_t          start;
+}
+VIEWER;
+
+static void printUsage(const char * pszAppName)
+{
+    printf("Usage: %s [-p <port>] [-n <frames>] [-s <KB>] [-i <ms>] [-d <ms>]\n", pszAppName);
+    printf("    -p <port>   Loopback port to stream on (default 8090)\n");
+    printf("    -n <frames> Frames to feed (default 100)\n");
+    printf("    -s <KB>     Size of each frame (default 200)\n");
+    printf("    -i <ms>     Interval between frames (default 10)\n");
+    printf("    -d <ms>     Delay between the slow viewer's reads (default 5)\n");
+}
+
+static void sleepMs(int ms)
+{
+    struct timespec     ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+/*
+** A stand-in JPEG: SOI, the frame number, a pattern that depends on it
+** and EOI, so a frame spliced from two others doesn't pass
+*/
+static void makeFrame(uint8_t * frame, size_t size, uint32_t frameNum)
+{
+    frame[0] = 0xFF;
+    frame[1] = 0xD8;
+
+    memcpy(&frame[2], &frameNum, sizeof(frameNum));
+
+    for (size_t i = 6; i < size - 2; i++) {
+        frame[i] = (uint8_t)(i * 7 + frameNum);
+    }
+
+    frame[size - 2] = 0xFF;
+    frame[size - 1] = 0xD9;
+}
+
+static bool checkFrame(const uint8_t * frame, size_t size, uint32_t * frameNum)
+{
+    if (size < 8 || frame[0] != 0xFF || frame[1] != 0xD8 || frame[size - 2] != 0xFF || frame[size - 1] != 0xD9) {
+        return false;
+    }
+
+    memcpy(frameNum, &frame[2], sizeof(*frameNum));
+
+    for (size_t i = 6; i < size - 2; i++) {
+        if (frame[i] != (uint8_t)(i * 7 + *frameNum)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+** Make sure at least len bytes are buffered, false once the stream ends
+*/
+static bool fill(VIEWER * viewer, size_t len)
+{
+    if (viewer->start > 0) {
+        memmove(viewer->buffer, &viewer->buffer[viewer->start], viewer->length - viewer->start);
+        viewer->length -= viewer->start;
+        viewer->start = 0;
+    }
+
+    while (viewer->length < len) {
+        size_t      want = sizeof(viewer->buffer) - viewer->length;
+        ssize_t     n;
+
+        if (viewer->readDelayMs) {
+            sleepMs(viewer->readDelayMs);
+
+            if (want > SLOW_READ_LEN) {
+                want = SLOW_READ_LEN;
+            }
+        }
+
+        n = recv(viewer->fd, &viewer->buffer[viewer->length], want, 0);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (n <= 0) {
+            return false;
+        }
+
+        viewer->length += n;
+    }
+
+    return true;
+}
+
+/*
+** The next line of the stream, without its CRLF, NULL once it ends
+*/
+static const char * readLine(VIEWER * viewer, char * pszLine, size_t lineLen)
+{
+    while (true) {
+        uint8_t *   eol = (uint8_t *)memchr(&viewer->buffer[viewer->start], '\n', viewer->length - viewer->start);
+
+        if (eol != NULL) {
+            size_t  len = eol - &viewer->buffer[viewer->start];
+
+            if (len > 0 && eol[-1] == '\r') {
+                len--;
+            }
+
+            if (len >= lineLen) {
+                len = lineLen - 1;
+            }
+
+            memcpy(pszLine, &viewer->buffer[viewer->start], len);
+            pszLine[len] = 0;
+
+            viewer->start = (eol - viewer->buffer) + 1;
+
+            return pszLine;
+        }
+
+        if (viewer->length - viewer->start >= sizeof(viewer->buffer) - 1 ||
+                !fill(viewer, viewer->length - viewer->start + 1))
+        {
+            return NULL;
+        }
+    }
+}
+
+static void * viewerThread(void * arg)
+{
+    VIEWER *    viewer = (VIEWER *)arg;
+    uint8_t *   frame = NULL;
+    size_t      frameCapacity = 0;
+    char        szLine[256];
+
+    // The HTTP response, up to the blank line
+    while (readLine(viewer, szLine, sizeof(szLine)) != NULL && szLine[0] != 0) {
+    }
+
+    while (true) {
+        size_t      contentLength = 0;
+        size_t      copied = 0;
+        uint32_t    frameNum;
+        const char * pszLine;
+
+        // The CRLF closing the last part, then the boundary
+        while ((pszLine = readLine(viewer, szLine, sizeof(szLine))) != NULL && szLine[0] == 0) {
+        }
+
+        while (pszLine != NULL && (pszLine = readLine(viewer, szLine, sizeof(szLine))) != NULL && szLine[0] != 0) {
+            if (strncmp(szLine, "Content-Length: ", 16) == 0) {
+                contentLength = strtoul(&szLine[16], NULL, 10);
+            }
+        }
+
+        // Stream closed, a part cut short by the server stopping doesn't count
+        if (contentLength == 0) {
+            break;
+        }
+
+        if (contentLength > frameCapacity) {
+            frame = (uint8_t *)realloc(frame, contentLength);
+            frameCapacity = contentLength;
+        }
+
+        while (copied < contentLength) {
+            size_t  chunk;
+
+            if (viewer->start == viewer->length && !fill(viewer, 1)) {
+                break;
+            }
+
+            chunk = viewer->length - viewer->start;
+
+            if (chunk > contentLength - copied) {
+                chunk = contentLength - copied;
+            }
+
+            memcpy(&frame[copied], &viewer->buffer[viewer->start], chunk);
+            viewer->start += chunk;
+            copied += chunk;
+        }
+
+        if (copied < contentLength) {
+            break;
+        }
+
+        if (!checkFrame(frame, contentLength, &frameNum)) {
+            viewer->bad++;
+        }
+        else {
+            if (viewer->frames && frameNum <= viewer->lastFrame) {
+                viewer->outOfOrder = true;
+            }
+
+            viewer->lastFrame = frameNum;
+            viewer->frames++;
+        }
+    }
+
+    free(frame);
+
+    return NULL;
+}
+
+static int connectViewer(int port, int rcvBuf)
+{
+    struct sockaddr_in  addr;
+    static const char   szRequest[] = "GET / HTTP/1.0\r\n\r\n";
+    int                 fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Set before connecting, so the window is small from the start
+    if (rcvBuf) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+    }
+
+    memset(&addr, 0, sizeof(addr));
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            send(fd, szRequest, sizeof(szRequest) - 1, MSG_NOSIGNAL) != (ssize_t)(sizeof(szRequest) - 1))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char ** argv)
+{
+    MjpegServer     server;
+    VIEWER *        viewers[2];
+    pthread_t       threads[2];
+    uint8_t *       frame;
+    int             port = 8090;
+    unsigned int    frameCount = 100;
+    size_t          frameSize = 200 * 1024;
+    int             intervalMs = 10;
+    int             slowDelayMs = 5;
+    unsigned int    published;
+    unsigned int    dropped;
+    int             rtn = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            frameCount = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            frameSize = strtoul(argv[++i], NULL, 10) * 1024;
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            intervalMs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            slowDelayMs = atoi(argv[++i]);
+        }
+        else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (frameCount < 2 || frameSize < 1024 || slowDelayMs < 1) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    Logger::getInstance().initLogger(LOG_LEVEL_ERROR);
+
+    try {
+        server.start("127.0.0.1", port);
+    }
+    catch (rpi_error & e) {
+        fprintf(stderr, "%s\n", e.what());
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        viewers[i] = (VIEWER *)calloc(1, sizeof(VIEWER));
+        viewers[i]->pszName = (i == 0 ? "fast" : "slow");
+        viewers[i]->readDelayMs = (i == 0 ? 0 : slowDelayMs);
+        viewers[i]->fd = connectViewer(port, i == 0 ? 0 : SLOW_RCVBUF_LEN);
+
+        if (viewers[i]->fd < 0) {
+            fprintf(stderr, "Failed to connect the %s viewer: %s\n", viewers[i]->pszName, strerror(errno));
+            return -1;
+        }
+    }
+
+    // Both accepted, or the first frames would be skipped with nobody watching
+    for (int i = 0; i < 100 && server.getClients() < 2; i++) {
+        sleepMs(10);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, viewerThread, viewers[i]);
+    }
+
+    frame = (uint8_t *)malloc(frameSize);
+
+    // Frame numbers from 1, in pieces as the encoder hands them over
+    for (unsigned int f = 1; f <= frameCount; f++) {
+        makeFrame(frame, frameSize, f);
+
+        for (size_t offset = 0; offset < frameSize; offset += FEED_CHUNK_LEN) {
+            size_t  chunk = frameSize - offset;
+
+            server.addData(&frame[offset], chunk < FEED_CHUNK_LEN ? chunk : FEED_CHUNK_LEN);
+        }
+
+        server.endFrame(true);
+
+        sleepMs(intervalMs);
+    }
+
+    free(frame);
+
+    // Time for the fast viewer to finish the last frame
+    sleepMs(200);
+
+    published = server.getPublished();
+    dropped = server.getDropped();
+
+    server.stop();
+
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        close(viewers[i]->fd);
+    }
+
+    printf("Fed %u frames of %u KB, %u published, %u dropped with no free slot\n", frameCount, (unsigned int)(frameSize / 1024), published, dropped);
+
+    for (int i = 0; i < 2; i++) {
+        printf(
+            "  %s viewer: %u frames, last %u, %u bad%s\n",
+            viewers[i]->pszName,
+            viewers[i]->frames,
+            viewers[i]->lastFrame,
+            viewers[i]->bad,
+            viewers[i]->outOfOrder ? ", out of order" : "");
+
+        if (viewers[i]->bad || viewers[i]->outOfOrder) {
+            rtn = -1;
+        }
+    }
+
+    if (dropped != 0 || published != frameCount) {
+        printf("FAIL: a slow viewer held up the ring\n");
+        rtn = -1;
+    }
+
+    if (viewers[0]->lastFrame != frameCount) {
+        printf("FAIL: the fast viewer did not get the newest frame\n");
+        rtn = -1;
+    }
+
+    if (viewers[1]->frames == 0 || viewers[1]->frames >= frameCount) {
+        printf("FAIL: the slow viewer should have skipped some frames but not all\n");
+        rtn = -1;
+    }
+
+    if (rtn == 0) {
+        printf("PASS: the slow viewer skipped %u frames\n", frameCount - viewers[1]->frames);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        free(viewers[i]);
+    }
+
+    return rtn;
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "frameformat.h"
+
+/*
+** Splits capture's segment files back into one image per frame.
+**
+** The index at the end of the segment is used when it is there, a segment
+** cut short by a power cut or crash has none and is read by walking the
+** frame headers from the start instead.
+*/
+
+#define COPY_BUFFER_LEN             65536
+
+// As MMAL_FOURCC(), without needing the MMAL headers
+#define FOURCC(a, b, c, d)          ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+/*
+** The extension for each encoding capture can write, named as for -encoding
+*/
+static const struct {
+    uint32_t        encoding;
+    const char *    pszExtension;
+}
+extensions[] = {
+    {FOURCC('J', 'P', 'E', 'G'),    "jpg"},
+    {FOURCC('B', 'M', 'P', ' '),    "bmp"},
+    {FOURCC('G', 'I', 'F', ' '),    "gif"},
+    {FOURCC('P', 'N', 'G', ' '),    "png"},
+    {FOURCC('I', '4', '2', '0'),    "yuv"}
+};
+
+static void printUsage(const char * pszAppName)
+{
+    printf("Usage: %s [-l] [-d <dir>] <segment>...\n", pszAppName);
+    printf("    -l          List the frames rather than extracting them\n");
+    printf("    -d <dir>    Directory to write the frames to (default .)\n");
+    printf("Frames are written as <dir>/frame_<frame number>.<ext>, where ext\n");
+    printf("follows the segment's encoding, jpg for segments without one\n");
+}
+
+/*
+** Version 1 segments have no encoding, they were always JPEG
+*/
+static const char * getExtension(const SEGMENT_HEADER * header)
+{
+    if (header->version < 2 || header->encoding == 0) {
+        return "jpg";
+    }
+
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (extensions[i].encoding == header->encoding) {
+            return extensions[i].pszExtension;
+        }
+    }
+
+    return "bin";
+}
+
+static bool readAt(FILE * fp, off_t offset, void * buffer, size_t len)
+{
+    if (fseeko(fp, offset, SEEK_SET) != 0) {
+        return false;
+    }
+
+    return (fread(buffer, 1, len, fp) == len);
+}
+
+/*
+** Read the index from the footer, false if there is no usable footer
+*/
+static bool readIndex(FILE * fp, std::vector<SEGMENT_INDEX_ENTRY> & index)
+{
+    SEGMENT_FOOTER      footer;
+    off_t               size;
+
+    if (fseeko(fp, 0, SEEK_END) != 0) {
+        return false;
+    }
+
+    size = ftello(fp);
+
+    if (size < (off_t)(sizeof(SEGMENT_HEADER) + sizeof(SEGMENT_FOOTER))) {
+        return false;
+    }
+
+    if (!readAt(fp, size - sizeof(footer), &footer, sizeof(footer))) {
+        return false;
+    }
+
+    if (memcmp(footer.magic, SEGMENT_FOOTER_MAGIC, sizeof(footer.magic)) != 0 ||
+            footer.indexOffset + (uint64_t)footer.frames * sizeof(SEGMENT_INDEX_ENTRY) + sizeof(footer) != (uint64_t)size)
+    {
+        return false;
+    }
+
+    index.resize(footer.frames);
+
+    if (footer.frames && !readAt(fp, footer.indexOffset, &index[0], footer.frames * sizeof(SEGMENT_INDEX_ENTRY))) {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+** Rebuild the index by following the frame headers
+*/
+static void scanIndex(FILE * fp, off_t offset, std::vector<SEGMENT_INDEX_ENTRY> & index)
+{
+    SEGMENT_FRAME_HEADER    header;
+    SEGMENT_INDEX_ENTRY     entry;
+
+    index.clear();
+
+    while (readAt(fp, offset, &header, sizeof(header))) {
+        if (memcmp(header.magic, SEGMENT_FRAME_MAGIC, sizeof(header.magic)) != 0 || header.size < sizeof(header)) {
+            break;
+        }
+
+        entry.offset = offset;
+        entry.frame = header.metadata.frame;
+        entry.dataSize = header.dataSize;
+        entry.captureTime = header.metadata.captureTime;
+
+        index.push_back(entry);
+
+        offset += header.size + header.dataSize;
+    }
+}
+
+static bool extractFrame(FILE * fp, const SEGMENT_FRAME_HEADER * header, off_t dataOffset, const char * pszFileName)
+{
+    static char     buffer[COPY_BUFFER_LEN];
+    FILE *          out;
+    uint32_t        remaining = header->dataSize;
+    bool            ok = true;
+
+    if (fseeko(fp, dataOffset, SEEK_SET) != 0) {
+        return false;
+    }
+
+    out = fopen(pszFileName, "wb");
+
+    if (out == NULL) {
+        fprintf(stderr, "Failed to create %s\n", pszFileName);
+        return false;
+    }
+
+    while (remaining > 0) {
+        size_t chunk = (remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+
+        if (fread(buffer, 1, chunk, fp) != chunk) {
+            fprintf(stderr, "%s is truncated\n", pszFileName);
+            ok = false;
+            break;
+        }
+
+        if (fwrite(buffer, 1, chunk, out) != chunk) {
+            fprintf(stderr, "Failed to write %s\n", pszFileName);
+            ok = false;
+            break;
+        }
+
+        remaining -= chunk;
+    }
+
+    fclose(out);
+
+    return ok;
+}
+
+static int processSegment(const char * pszSegment, const char * pszDirectory, bool listOnly)
+{
+    FILE *                              fp;
+    SEGMENT_HEADER                      header;
+    std::vector<SEGMENT_INDEX_ENTRY>    index;
+    const char *                        pszExtension;
+    int                                 failed = 0;
+
+    fp = fopen(pszSegment, "rb");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s\n", pszSegment);
+        return 1;
+    }
+
+    if (!readAt(fp, 0, &header, sizeof(header)) ||
+            memcmp(header.magic, SEGMENT_MAGIC, sizeof(header.magic)) != 0 ||
+            header.size < sizeof(header))
+    {
+        fprintf(stderr, "%s is not a segment file\n", pszSegment);
+        fclose(fp);
+        return 1;
+    }
+
+    pszExtension = getExtension(&header);
+
+    if (!readIndex(fp, index)) {
+        fprintf(stderr, "%s has no index, scanning frames\n", pszSegment);
+        scanIndex(fp, header.size, index);
+    }
+
+    printf("%s: segment %u, %u %s frames\n", pszSegment, header.segment, (unsigned int)index.size(), pszExtension);
+
+    for (size_t i = 0; i < index.size(); i++) {
+        SEGMENT_FRAME_HEADER    frameHeader;
+        char                    szFileName[FILENAME_MAX];
+
+        if (!readAt(fp, index[i].offset, &frameHeader, sizeof(frameHeader)) ||
+                memcmp(frameHeader.magic, SEGMENT_FRAME_MAGIC, sizeof(frameHeader.magic)) != 0)
+        {
+            fprintf(stderr, "Bad frame header at offset %llu\n", (unsigned long long)index[i].offset);
+            failed++;
+            continue;
+        }
+
+        if (listOnly) {
+            printf(
+                "  frame %u: %u bytes at %llu, exposure %u us, analog gain %.3f%s\n",
+                frameHeader.metadata.frame,
+                frameHeader.dataSize,
+                (unsigned long long)index[i].offset,
+                frameHeader.metadata.exposure,
+                frameHeader.metadata.analogGain,
+                (frameHeader.flags & SEGMENT_FRAME_INCOMPLETE) ? " (incomplete)" : "");
+
+            continue;
+        }
+
+        snprintf(szFileName, sizeof(szFileName), "%s/frame_%06u.%s", pszDirectory, frameHeader.metadata.frame, pszExtension);
+
+        if (!extractFrame(fp, &frameHeader, index[i].offset + frameHeader.size, szFileName)) {
+            failed++;
+        }
+    }
+
+    fclose(fp);
+
+    return (failed ? 1 : 0);
+}
+
+int main(int argc, char ** argv)
+{
+    const char *    pszDirectory = ".";
+    bool            listOnly = false;
+    int             rtn = 0;
+    int             i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            listOnly = true;
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            pszDirectory = argv[++i];
+        }
+        else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (i == argc) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    for (; i < argc; i++) {
+        if (processSegment(argv[i], pszDirectory, listOnly)) {
+            rtn = -1;
+        }
+    }
+
+    return rtn;
+}